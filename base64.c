@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BASE64_X86
+#endif
+
+#include <base64.h>
+
+/*
+ * The SSSE3 and AVX2 paths follow Wojciech Muła's vectorized base64
+ * algorithms. They only handle whole blocks in the middle of the data and
+ * return how much they consumed; the scalar code does the rest, including
+ * padding, whitespace and anything invalid.
+ */
+typedef size_t (*encode_fn)(const uint8_t *buf, size_t len, char *out);
+typedef size_t (*decode_fn)(const char *text, size_t len, uint8_t *out);
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Values of each character, or one of the following. */
+#define BASE64_INVALID -1
+#define BASE64_SPACE -2
+#define BASE64_PAD -3
+
+static int8_t base64_values[256];
+
+static size_t
+encode_none(const uint8_t *buf, size_t len, char *out)
+{
+    return 0;
+}
+
+static size_t
+decode_none(const char *text, size_t len, uint8_t *out)
+{
+    return 0;
+}
+
+#ifdef BASE64_X86
+
+/* Splits each group of 3 bytes into 4 6-bit indices, one per byte. */
+__attribute__((target("ssse3")))
+static inline __m128i
+encode_indices_ssse3(__m128i in)
+{
+    __m128i t0, t1, t2, t3;
+
+    in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                            7, 6, 8, 7, 10, 9, 11, 10));
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+    return _mm_or_si128(t1, t3);
+}
+
+/* Maps 6-bit indices to characters by adding a per-range offset. */
+__attribute__((target("ssse3")))
+static inline __m128i
+encode_chars_ssse3(__m128i idx)
+{
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '+' - 62,
+                                          '/' - 63, 'A', 0, 0);
+    __m128i range, less;
+
+    range = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
+
+    return _mm_add_epi8(idx, _mm_shuffle_epi8(offsets, range));
+}
+
+/* Encodes 12 bytes at a time, reading 16. */
+__attribute__((target("ssse3")))
+static size_t
+encode_ssse3(const uint8_t *buf, size_t len, char *out)
+{
+    __m128i in;
+    size_t i;
+
+    for (i = 0; len - i >= 16; i += 12) {
+        in = _mm_loadu_si128((const __m128i *)(buf + i));
+        _mm_storeu_si128((__m128i *)(out + i / 3 * 4),
+                         encode_chars_ssse3(encode_indices_ssse3(in)));
+    }
+
+    return i;
+}
+
+/*
+ * Converts 16 characters to their 6-bit values. Returns false if any is not
+ * in the base64 alphabet.
+ */
+__attribute__((target("ssse3")))
+static inline bool
+decode_values_ssse3(__m128i in, __m128i *values)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x11, 0x11, 0x13, 0x1a,
+                                         0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                         0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                         0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                           0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i hi, lo, invalid, roll;
+
+    hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    invalid = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo),
+                            _mm_shuffle_epi8(lut_hi, hi));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(invalid, _mm_setzero_si128())) !=
+            0xffff)
+        return false;
+
+    roll = _mm_shuffle_epi8(lut_roll,
+                            _mm_add_epi8(_mm_cmpeq_epi8(in, _mm_set1_epi8('/')),
+                                         hi));
+    *values = _mm_add_epi8(in, roll);
+
+    return true;
+}
+
+/* Packs 4 6-bit values into 3 bytes, leaving them in bytes 0-11. */
+__attribute__((target("ssse3")))
+static inline __m128i
+decode_pack_ssse3(__m128i values)
+{
+    values = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    values = _mm_madd_epi16(values, _mm_set1_epi32(0x00011000));
+
+    return _mm_shuffle_epi8(values, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                                  8, 14, 13, 12, -1, -1,
+                                                  -1, -1));
+}
+
+/*
+ * Decodes 16 characters at a time, writing 16 bytes of which 12 are valid.
+ * Stops short of the end so that the extra bytes stay within
+ * BASE64_DECODED_MAX(len).
+ */
+__attribute__((target("ssse3")))
+static size_t
+decode_ssse3(const char *text, size_t len, uint8_t *out)
+{
+    __m128i values;
+    size_t i;
+
+    for (i = 0; len - i >= 32; i += 16) {
+        if (!decode_values_ssse3(_mm_loadu_si128((const __m128i *)(text + i)),
+                                 &values))
+            break;
+        _mm_storeu_si128((__m128i *)(out + i / 4 * 3),
+                         decode_pack_ssse3(values));
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+encode_avx2(const uint8_t *buf, size_t len, char *out)
+{
+    const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                          7, 6, 8, 7, 10, 9, 11, 10,
+                                          1, 0, 2, 1, 4, 3, 5, 4,
+                                          7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '+' - 62,
+                                             '/' - 63, 'A', 0, 0,
+                                             'a' - 26, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '0' - 52,
+                                             '0' - 52, '0' - 52, '+' - 62,
+                                             '/' - 63, 'A', 0, 0);
+    __m256i in, t0, t1, t2, t3, range, less;
+    size_t i;
+
+    /* Each 128-bit lane takes 12 bytes, as in the SSSE3 path. */
+    for (i = 0; len - i >= 28; i += 24) {
+        in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(buf + i))),
+            _mm_loadu_si128((const __m128i *)(buf + i + 12)), 1);
+        in = _mm256_shuffle_epi8(in, shuf);
+        t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        in = _mm256_or_si256(t1, t3);
+
+        range = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+        less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), in);
+        range = _mm256_or_si256(range,
+                                _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        in = _mm256_add_epi8(in, _mm256_shuffle_epi8(offsets, range));
+
+        _mm256_storeu_si256((__m256i *)(out + i / 3 * 4), in);
+    }
+
+    return i + encode_ssse3(buf + i, len - i, out + i / 3 * 4);
+}
+
+__attribute__((target("avx2")))
+static size_t
+decode_avx2(const char *text, size_t len, uint8_t *out)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x13, 0x1a, 0x1b, 0x1b, 0x1b,
+                                            0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x13, 0x1a, 0x1b, 0x1b, 0x1b,
+                                            0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+                                            0x08, 0x04, 0x08, 0x10, 0x10,
+                                            0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04,
+                                            0x08, 0x04, 0x08, 0x10, 0x10,
+                                            0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71,
+                                              -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71,
+                                              -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                          14, 13, 12, -1, -1, -1, -1);
+    __m256i in, hi, lo, invalid, roll;
+    size_t i;
+
+    /* Writes 32 bytes of which 24 are valid; see decode_ssse3. */
+    for (i = 0; len - i >= 48; i += 32) {
+        in = _mm256_loadu_si256((const __m256i *)(text + i));
+        hi = _mm256_and_si256(_mm256_srli_epi32(in, 4),
+                              _mm256_set1_epi8(0x0f));
+        lo = _mm256_and_si256(in, _mm256_set1_epi8(0x0f));
+        invalid = _mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo),
+                                   _mm256_shuffle_epi8(lut_hi, hi));
+        if (!_mm256_testz_si256(invalid, invalid))
+            break;
+
+        roll = _mm256_shuffle_epi8(lut_roll,
+            _mm256_add_epi8(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('/')),
+                            hi));
+        in = _mm256_add_epi8(in, roll);
+        in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+        in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+        in = _mm256_shuffle_epi8(in, pack);
+        in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 1, 2, 4,
+                                                               5, 6, 3, 7));
+
+        _mm256_storeu_si256((__m256i *)(out + i / 4 * 3), in);
+    }
+
+    /* Let the SSSE3 path find exactly which 16 characters stopped us. */
+    return i + decode_ssse3(text + i, len - i, out + i / 4 * 3);
+}
+
+#endif
+
+static encode_fn encode_fast;
+static decode_fn decode_fast;
+
+static void
+select_impl(void)
+{
+    unsigned int i;
+
+    memset(base64_values, BASE64_INVALID, sizeof(base64_values));
+    for (i = 0; i < 64; i++)
+        base64_values[(uint8_t)base64_chars[i]] = i;
+    base64_values[' '] = base64_values['\t'] = BASE64_SPACE;
+    base64_values['\r'] = base64_values['\n'] = BASE64_SPACE;
+    base64_values['='] = BASE64_PAD;
+
+    encode_fast = encode_none;
+    decode_fast = decode_none;
+
+#ifdef BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        encode_fast = encode_avx2;
+        decode_fast = decode_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        encode_fast = encode_ssse3;
+        decode_fast = decode_ssse3;
+    }
+#endif
+}
+
+static void
+encode_scalar(const uint8_t *buf, size_t len, char *out)
+{
+    uint32_t v;
+    size_t i;
+
+    for (i = 0; len - i >= 3; i += 3) {
+        v = buf[i] << 16 | buf[i + 1] << 8 | buf[i + 2];
+        *out++ = base64_chars[v >> 18];
+        *out++ = base64_chars[(v >> 12) & 0x3f];
+        *out++ = base64_chars[(v >> 6) & 0x3f];
+        *out++ = base64_chars[v & 0x3f];
+    }
+
+    if (i == len)
+        return;
+
+    v = buf[i] << 16;
+    if (len - i == 2)
+        v |= buf[i + 1] << 8;
+    *out++ = base64_chars[v >> 18];
+    *out++ = base64_chars[(v >> 12) & 0x3f];
+    *out++ = len - i == 2 ? base64_chars[(v >> 6) & 0x3f] : '=';
+    *out++ = '=';
+}
+
+void
+base64_encode(const uint8_t *buf, size_t len, char *out)
+{
+    size_t done;
+
+    if (!encode_fast)
+        select_impl();
+
+    done = encode_fast(buf, len, out);
+    encode_scalar(buf + done, len - done, out + done / 3 * 4);
+}
+
+bool
+base64_decode(const char *text, size_t len, uint8_t *out, size_t *out_len)
+{
+    uint32_t acc = 0;
+    unsigned int n = 0, pad = 0;
+    size_t i = 0, total = 0, done, retry = 0;
+    int8_t v;
+
+    if (!decode_fast)
+        select_impl();
+
+    while (i < len) {
+        /*
+         * Hand whole groups to the fast path. When it stops, let the scalar
+         * loop get past the block that stopped it before trying again.
+         */
+        if (n == 0 && !pad && i >= retry) {
+            done = decode_fast(text + i, len - i, out + total);
+            i += done;
+            total += done / 4 * 3;
+            retry = i + 16;
+            if (i == len)
+                break;
+        }
+
+        v = base64_values[(uint8_t)text[i++]];
+        if (v == BASE64_SPACE)
+            continue;
+        if (v == BASE64_PAD) {
+            pad++;
+            continue;
+        }
+        if (v < 0 || pad)
+            return false;
+        acc = acc << 6 | v;
+        if (++n == 4) {
+            out[total++] = acc >> 16;
+            out[total++] = acc >> 8;
+            out[total++] = acc;
+            acc = 0;
+            n = 0;
+        }
+    }
+
+    /* A final group of 2 or 3 characters holds 1 or 2 bytes. */
+    if (n == 1 || (pad && n + pad != 4))
+        return false;
+    if (n == 2) {
+        out[total++] = acc >> 4;
+    } else if (n == 3) {
+        out[total++] = acc >> 10;
+        out[total++] = acc >> 2;
+    }
+
+    *out_len = total;
+    return true;
+}
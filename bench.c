@@ -0,0 +1,1171 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Replays representative guest workloads through dispatch_command with an
+ * in-memory backend and reports throughput and latency percentiles per
+ * command, one "key=value" line each, so that results can be compared
+ * across releases. The persistence path (serialization, save/resume and the
+ * XAPI calls against a mock server) is timed separately on stores of
+ * different sizes. Each line also gives the bytes allocated per operation and
+ * the peak RSS, since memory limits how many VMs fit on a host.
+ */
+
+/* Including this directly allows us to poke into the implementation. */
+#include "base64.c"
+#include "context.c"
+#include "handler.c"
+#include "log.c"
+#include "mor.c"
+#include "stats.c"
+#include "template.c"
+#include "xapidb-lib.c"
+#include "xapidb.c"
+
+#include <openssl/pem.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+enum log_level log_level = LOG_LVL_ERROR;
+bool opt_resume;
+
+/*
+ * Every allocation is counted by wrapping the allocator. ASan has its own
+ * allocator so nothing is counted under it.
+ */
+static uint64_t alloc_bytes;
+
+#ifndef __SANITIZE_ADDRESS__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    alloc_bytes += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+static uint8_t comm_buf[SHMEM_SIZE];
+
+/*
+ * The backend does no I/O so that only varstored itself is measured.
+ */
+static enum backend_init_status
+memdb_init(void)
+{
+    return BACKEND_INIT_FIRSTBOOT;
+}
+
+static bool
+memdb_set_variable(void)
+{
+    return true;
+}
+
+static const struct backend memdb = {
+    .init = memdb_init,
+    .set_variable = memdb_set_variable,
+    .sb_notify = memdb_set_variable,
+};
+const struct backend *db = &memdb;
+
+/* Latency samples for one operation within a workload. */
+struct series {
+    const char *workload;
+    const char *op;
+    uint64_t *ns;
+    size_t count, size;
+    uint64_t bytes; /* Allocated across all the samples. */
+    long peak_rss_kb;
+};
+
+/* The start of a timed operation. */
+struct sample {
+    uint64_t start;
+    uint64_t bytes;
+};
+
+#define MAX_SERIES 32
+
+static struct series series[MAX_SERIES];
+static unsigned int nr_series;
+
+static void __attribute__((noreturn))
+fail(const char *what, EFI_STATUS status)
+{
+    fprintf(stderr, "%s failed: 0x%lx\n", what, (unsigned long)status);
+    exit(1);
+}
+
+static void
+record(const char *workload, const char *op, uint64_t ns, uint64_t bytes)
+{
+    struct rusage usage;
+    struct series *s;
+    unsigned int i;
+
+    for (i = 0; i < nr_series; i++) {
+        if (series[i].workload == workload && series[i].op == op)
+            break;
+    }
+    if (i == nr_series) {
+        if (nr_series == MAX_SERIES)
+            fail("record", 0);
+        series[nr_series].workload = workload;
+        series[nr_series].op = op;
+        nr_series++;
+    }
+
+    s = &series[i];
+    if (s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 1024;
+        s->ns = realloc(s->ns, s->size * sizeof(*s->ns));
+        if (!s->ns)
+            fail("realloc", 0);
+    }
+    s->ns[s->count++] = ns;
+    s->bytes += bytes;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0 && usage.ru_maxrss > s->peak_rss_kb)
+        s->peak_rss_kb = usage.ru_maxrss;
+}
+
+static void
+sample_begin(struct sample *sample)
+{
+    sample->bytes = alloc_bytes;
+    sample->start = stats_now();
+}
+
+static void
+sample_end(const struct sample *sample, const char *workload, const char *op)
+{
+    uint64_t ns = stats_now() - sample->start;
+
+    record(workload, op, ns, alloc_bytes - sample->bytes);
+}
+
+/* Dispatches the command in comm_buf and records how long it took. */
+static EFI_STATUS
+timed_dispatch(const char *workload)
+{
+    uint8_t *ptr = comm_buf;
+    enum command_t command;
+    struct sample sample;
+
+    unserialize_uint32(&ptr);
+    command = unserialize_command(&ptr);
+
+    sample_begin(&sample);
+    dispatch_command(comm_buf);
+    sample_end(&sample, workload, stat_names[command]);
+
+    ptr = comm_buf;
+    return unserialize_uintn(&ptr);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t
+percentile(const struct series *s, double p)
+{
+    return s->ns[(size_t)((s->count - 1) * p)];
+}
+
+static void
+report(void)
+{
+    struct series *s;
+    uint64_t total;
+    unsigned int i;
+    size_t j;
+
+    for (i = 0; i < nr_series; i++) {
+        s = &series[i];
+        qsort(s->ns, s->count, sizeof(*s->ns), cmp_u64);
+        total = 0;
+        for (j = 0; j < s->count; j++)
+            total += s->ns[j];
+
+        printf("workload=%s op=%s count=%zu ops_per_sec=%.0f "
+               "p50_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu "
+               "alloc_bytes_per_op=%llu peak_rss_kb=%ld\n",
+               s->workload, s->op, s->count,
+               total ? s->count * 1e9 / total : 0.0,
+               (unsigned long long)percentile(s, 0.5),
+               (unsigned long long)percentile(s, 0.99),
+               (unsigned long long)percentile(s, 0.999),
+               (unsigned long long)s->ns[s->count - 1],
+               (unsigned long long)(s->bytes / s->count), s->peak_rss_kb);
+        free(s->ns);
+        memset(s, 0, sizeof(*s));
+    }
+    nr_series = 0;
+    fflush(stdout);
+}
+
+static void
+reset_vars(void)
+{
+    struct efi_variable *l;
+
+    while (var_list) {
+        l = var_list;
+        remove_variable(l);
+        free_efi_variable(l);
+    }
+    compact_variables();
+}
+
+/* Converts an ASCII string into a UCS-2 name. Returns its size in bytes. */
+static UINTN
+make_name(uint8_t *out, const char *s)
+{
+    UINTN i;
+
+    for (i = 0; s[i]; i++) {
+        out[2 * i] = s[i];
+        out[2 * i + 1] = 0;
+    }
+
+    return 2 * i;
+}
+
+static void
+put_get_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid)
+{
+    uint8_t *ptr = comm_buf;
+
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE);
+    serialize_data(&ptr, name, name_len);
+    serialize_guid(&ptr, guid);
+    serialize_uintn(&ptr, DATA_LIMIT);
+    *ptr++ = 0;
+}
+
+static void
+put_set_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+                 const uint8_t *data, UINTN data_len, UINT32 attr)
+{
+    uint8_t *ptr = comm_buf;
+
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, (UINT32)COMMAND_SET_VARIABLE);
+    serialize_data(&ptr, name, name_len);
+    serialize_guid(&ptr, guid);
+    serialize_data(&ptr, data, data_len);
+    serialize_uint32(&ptr, attr);
+    *ptr++ = 0;
+}
+
+static void
+put_get_next_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid)
+{
+    uint8_t *ptr = comm_buf;
+
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_NEXT_VARIABLE);
+    serialize_uintn(&ptr, NAME_LIMIT);
+    serialize_data(&ptr, name, name_len);
+    serialize_guid(&ptr, guid);
+    *ptr++ = 0;
+}
+
+static void
+put_query_variable_info(UINT32 attr)
+{
+    uint8_t *ptr = comm_buf;
+
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, (UINT32)COMMAND_QUERY_VARIABLE_INFO);
+    serialize_uint32(&ptr, attr);
+}
+
+static const EFI_GUID bench_guid =
+    {{0xb4, 0x91, 0x39, 0x9a, 0x5e, 0x04, 0x4f, 0x47, 0x83, 0x3c, 0x84, 0x29, 0x5e, 0x0e, 0x7d, 0x1d}};
+
+#define ENUM_VARIABLES 200
+#define ENUM_ROUNDS 50
+
+/* The store a firmware cold boot enumerates. */
+static void
+setup_enum_variables(void)
+{
+    uint8_t name[NAME_LIMIT], data[64];
+    UINTN name_len;
+    EFI_STATUS status;
+    char ascii[16];
+    int i;
+
+    reset_vars();
+    if (!setup_variables())
+        fail("setup_variables", 0);
+
+    for (i = 0; i < ENUM_VARIABLES; i++) {
+        snprintf(ascii, sizeof(ascii), i % 2 ? "Boot%04X" : "Vendor%03d", i);
+        name_len = make_name(name, ascii);
+        memset(data, i, sizeof(data));
+        status = internal_set_variable(name, name_len, &bench_guid, data,
+                                       16 + i % 48, ATTR_BRNV);
+        if (status != EFI_SUCCESS)
+            fail("internal_set_variable", status);
+    }
+}
+
+/*
+ * A firmware cold boot walks every variable with GetNextVariableName and
+ * reads each one.
+ */
+static void
+bench_cold_boot_enum(void)
+{
+    static const char workload[] = "cold_boot_enum";
+    uint8_t name[NAME_LIMIT];
+    UINTN name_len;
+    EFI_GUID guid;
+    EFI_STATUS status;
+    uint8_t *ptr, *next;
+    int round, seen;
+
+    setup_enum_variables();
+
+    for (round = 0; round < ENUM_ROUNDS; round++) {
+        name_len = 0;
+        memset(&guid, 0, sizeof(guid));
+        seen = 0;
+
+        for (;;) {
+            put_get_next_variable(name, name_len, &guid);
+            status = timed_dispatch(workload);
+            if (status == EFI_NOT_FOUND)
+                break;
+            if (status != EFI_SUCCESS)
+                fail("GetNextVariableName", status);
+
+            ptr = comm_buf;
+            unserialize_uintn(&ptr);
+            next = unserialize_data(&ptr, &name_len, NAME_LIMIT);
+            if (!next)
+                fail("unserialize_data", 0);
+            memcpy(name, next, name_len);
+            free(next);
+            unserialize_guid(&ptr, &guid);
+
+            put_get_variable(name, name_len, &guid);
+            status = timed_dispatch(workload);
+            if (status != EFI_SUCCESS)
+                fail("GetVariable", status);
+            seen++;
+        }
+
+        if (seen < ENUM_VARIABLES)
+            fail("enumeration", seen);
+    }
+}
+
+/*
+ * The same with the version 2 batched commands: enumerate in as few
+ * requests as fit, then read every variable in as few again.
+ */
+static void
+bench_cold_boot_enum_batch(void)
+{
+    static const char workload[] = "cold_boot_enum_batch";
+    static uint8_t names[SHMEM_SIZE];
+    uint8_t cursor[NAME_LIMIT], *ptr, *entry;
+    UINTN cursor_len, count, name_len, len, i, total, done_count;
+    EFI_GUID guid;
+    EFI_STATUS status;
+    BOOLEAN done;
+    int round;
+
+    setup_enum_variables();
+
+    for (round = 0; round < ENUM_ROUNDS; round++) {
+        cursor_len = 0;
+        memset(&guid, 0, sizeof(guid));
+        len = 0;
+        total = 0;
+
+        /* Gather the (name, GUID) pairs as a GetVariable batch wants them. */
+        do {
+            ptr = comm_buf;
+            serialize_uint32(&ptr, 2);
+            serialize_uint32(&ptr, (UINT32)COMMAND_GET_NEXT_VARIABLE_BATCH);
+            serialize_data(&ptr, cursor, cursor_len);
+            serialize_guid(&ptr, &guid);
+            *ptr++ = 0;
+            serialize_uintn(&ptr, 0);
+            if ((status = timed_dispatch(workload)) != EFI_SUCCESS)
+                fail("GetNextVariableName(batch)", status);
+
+            ptr = comm_buf + sizeof(UINTN);
+            count = unserialize_uintn(&ptr);
+            done = unserialize_boolean(&ptr);
+            for (i = 0; i < count; i++) {
+                entry = ptr;
+                memcpy(&name_len, ptr, sizeof(name_len));
+                ptr += sizeof(name_len) + name_len + GUID_LEN;
+                memcpy(names + len, entry, ptr - entry);
+                len += ptr - entry;
+                memcpy(cursor, entry + sizeof(name_len), name_len);
+                cursor_len = name_len;
+                memcpy(&guid, ptr - GUID_LEN, GUID_LEN);
+                ptr += sizeof(UINT32) + sizeof(UINTN);
+            }
+            total += count;
+        } while (!done);
+
+        if (total < ENUM_VARIABLES)
+            fail("enumeration", total);
+
+        /* Read them back, asking again for any that didn't fit. */
+        entry = names;
+        while (total) {
+            ptr = comm_buf;
+            serialize_uint32(&ptr, 2);
+            serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE_BATCH);
+            serialize_uintn(&ptr, total);
+            memcpy(ptr, entry, names + len - entry);
+            ptr += names + len - entry;
+            *ptr++ = 0;
+            if ((status = timed_dispatch(workload)) != EFI_SUCCESS)
+                fail("GetVariable(batch)", status);
+
+            ptr = comm_buf + sizeof(UINTN);
+            done_count = unserialize_uintn(&ptr);
+            if (done_count == 0)
+                fail("GetVariable(batch)", 0);
+            for (i = 0; i < done_count; i++) {
+                memcpy(&name_len, entry, sizeof(name_len));
+                entry += sizeof(name_len) + name_len + GUID_LEN;
+            }
+            total -= done_count;
+        }
+    }
+}
+
+#define CHURN_ROUNDS 10000
+
+/* An OS updating BootNext and BootOrder, as on every boot and upgrade. */
+static void
+bench_boot_churn(void)
+{
+    static const char workload[] = "boot_churn";
+    uint8_t boot_order[NAME_LIMIT], boot_next[NAME_LIMIT];
+    UINTN boot_order_len, boot_next_len;
+    uint16_t order[8], next;
+    EFI_STATUS status;
+    int i, round;
+
+    reset_vars();
+    if (!setup_variables())
+        fail("setup_variables", 0);
+
+    boot_order_len = make_name(boot_order, "BootOrder");
+    boot_next_len = make_name(boot_next, "BootNext");
+    for (i = 0; i < ARRAY_SIZE(order); i++)
+        order[i] = i;
+    status = internal_set_variable(boot_order, boot_order_len,
+                                   &gEfiGlobalVariableGuid,
+                                   (uint8_t *)order, sizeof(order), ATTR_BRNV);
+    if (status != EFI_SUCCESS)
+        fail("internal_set_variable", status);
+
+    for (round = 0; round < CHURN_ROUNDS; round++) {
+        next = round % ARRAY_SIZE(order);
+        put_set_variable(boot_next, boot_next_len, &gEfiGlobalVariableGuid,
+                         (uint8_t *)&next, sizeof(next), ATTR_BRNV);
+        if ((status = timed_dispatch(workload)) != EFI_SUCCESS)
+            fail("SetVariable(BootNext)", status);
+
+        put_get_variable(boot_order, boot_order_len, &gEfiGlobalVariableGuid);
+        if ((status = timed_dispatch(workload)) != EFI_SUCCESS)
+            fail("GetVariable(BootOrder)", status);
+
+        for (i = 0; i < ARRAY_SIZE(order); i++)
+            order[i] = (order[i] + 1) % ARRAY_SIZE(order);
+        put_set_variable(boot_order, boot_order_len, &gEfiGlobalVariableGuid,
+                         (uint8_t *)order, sizeof(order), ATTR_BRNV);
+        if ((status = timed_dispatch(workload)) != EFI_SUCCESS)
+            fail("SetVariable(BootOrder)", status);
+
+        put_set_variable(boot_next, boot_next_len, &gEfiGlobalVariableGuid,
+                         NULL, 0, ATTR_BRNV);
+        if ((status = timed_dispatch(workload)) != EFI_SUCCESS)
+            fail("SetVariable(BootNext delete)", status);
+    }
+}
+
+#define QUERY_ROUNDS 100000
+
+static void
+bench_query_info(void)
+{
+    static const char workload[] = "query_info";
+    EFI_STATUS status;
+    int round;
+
+    for (round = 0; round < QUERY_ROUNDS; round++) {
+        put_query_variable_info(ATTR_BRNV);
+        if ((status = timed_dispatch(workload)) != EFI_SUCCESS)
+            fail("QueryVariableInfo", status);
+    }
+}
+
+/*
+ * Authenticated variables
+ */
+
+static X509 *sign_cert;
+static EVP_PKEY *sign_key;
+static const EFI_TIME bench_time = {2020, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static void
+load_signer(const char *cert_path, const char *key_path)
+{
+    BIO *bio;
+
+    bio = BIO_new_file(cert_path, "r");
+    sign_cert = bio ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+
+    bio = BIO_new_file(key_path, "r");
+    sign_key = bio ? PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+
+    if (!sign_cert || !sign_key) {
+        fprintf(stderr, "Failed to load %s and %s\n", cert_path, key_path);
+        exit(1);
+    }
+}
+
+/* Returns an EFI_SIGNATURE_LIST holding the X509 certificate at path. */
+static uint8_t *
+cert_list(const char *path, UINTN *len)
+{
+    EFI_SIGNATURE_LIST *list;
+    EFI_SIGNATURE_DATA *data;
+    uint8_t *ptr;
+    X509 *cert;
+    BIO *bio;
+    int cert_len;
+
+    bio = BIO_new_file(path, "r");
+    cert = bio ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+    BIO_free(bio);
+    if (!cert) {
+        fprintf(stderr, "Failed to load %s\n", path);
+        exit(1);
+    }
+
+    cert_len = i2d_X509(cert, NULL);
+    *len = sizeof(*list) + offsetof(EFI_SIGNATURE_DATA, SignatureData) + cert_len;
+    list = calloc(1, *len);
+    if (!list)
+        fail("calloc", 0);
+    list->SignatureType = gEfiCertX509Guid;
+    list->SignatureListSize = *len;
+    list->SignatureSize = offsetof(EFI_SIGNATURE_DATA, SignatureData) + cert_len;
+    data = (EFI_SIGNATURE_DATA *)(list + 1);
+    ptr = data->SignatureData;
+    i2d_X509(cert, &ptr);
+    X509_free(cert);
+
+    return (uint8_t *)list;
+}
+
+/* Returns an EFI_VARIABLE_AUTHENTICATION_2 followed by data, signed. */
+static uint8_t *
+sign_auth(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+          UINT32 attr, const uint8_t *data, UINTN data_len, UINTN *out_len)
+{
+    EFI_VARIABLE_AUTHENTICATION_2 *auth;
+    uint8_t *request, *ptr, *out;
+    UINTN request_len, auth_len;
+    PKCS7 *p7;
+    BIO *bio;
+    int sig_len;
+    const int flags = PKCS7_BINARY | PKCS7_DETACHED | PKCS7_NOATTR;
+
+    request_len = name_len + GUID_LEN + sizeof(attr) + sizeof(bench_time) +
+                  data_len;
+    request = malloc(request_len);
+    if (!request)
+        fail("malloc", 0);
+    ptr = request;
+    memcpy(ptr, name, name_len);
+    ptr += name_len;
+    memcpy(ptr, guid, GUID_LEN);
+    ptr += GUID_LEN;
+    memcpy(ptr, &attr, sizeof(attr));
+    ptr += sizeof(attr);
+    memcpy(ptr, &bench_time, sizeof(bench_time));
+    ptr += sizeof(bench_time);
+    memcpy(ptr, data, data_len);
+
+    bio = BIO_new_mem_buf(request, request_len);
+    p7 = PKCS7_sign(NULL, NULL, NULL, bio, flags | PKCS7_PARTIAL);
+    if (!p7 || !PKCS7_sign_add_signer(p7, sign_cert, sign_key,
+                                      EVP_sha256(), flags) ||
+            !PKCS7_final(p7, bio, flags))
+        fail("PKCS7_sign", 0);
+    BIO_free(bio);
+    free(request);
+
+    sig_len = i2d_PKCS7(p7, NULL);
+    auth_len = offsetof(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo.CertData) +
+               sig_len;
+    out = malloc(auth_len + data_len);
+    if (!out)
+        fail("malloc", 0);
+    auth = (EFI_VARIABLE_AUTHENTICATION_2 *)out;
+    auth->TimeStamp = bench_time;
+    auth->AuthInfo.Hdr.dwLength = offsetof(WIN_CERTIFICATE_UEFI_GUID, CertData) +
+                                  sig_len;
+    auth->AuthInfo.Hdr.wRevision = 0x0200;
+    auth->AuthInfo.Hdr.wCertificateType = WIN_CERT_TYPE_EFI_GUID;
+    auth->AuthInfo.CertType = gEfiCertPkcs7Guid;
+    ptr = auth->AuthInfo.CertData;
+    i2d_PKCS7(p7, &ptr);
+    PKCS7_free(p7);
+    memcpy(out + auth_len, data, data_len);
+
+    *out_len = auth_len + data_len;
+    return out;
+}
+
+/* Fills in the auth data used by setup_keys, signed with the test PK. */
+static void
+make_auth_data(void)
+{
+    static const char *const certs[] = {
+        [1] = "testcertA.pem", /* db */
+        [2] = "testcertB.pem", /* KEK */
+        [3] = "testPK.pem",    /* PK */
+    };
+    uint8_t *list;
+    UINTN len, auth_len;
+    int i;
+
+    for (i = 1; i < ARRAY_SIZE(certs); i++) {
+        list = cert_list(certs[i], &len);
+        auth_info[i].data = sign_auth(auth_info[i].name, auth_info[i].name_len,
+                                      auth_info[i].guid, ATTR_BRNV_TIME,
+                                      list, len, &auth_len);
+        auth_info[i].data_len = auth_len;
+        free(list);
+    }
+}
+
+#define FIRST_BOOT_ROUNDS 20
+
+/* The keys every new VM gets from its auth data on first boot. */
+static void
+bench_first_boot(void)
+{
+    static const char workload[] = "first_boot";
+    struct sample sample;
+    int round;
+
+    for (round = 0; round < FIRST_BOOT_ROUNDS; round++) {
+        reset_vars();
+        if (!setup_variables())
+            fail("setup_variables", 0);
+
+        sample_begin(&sample);
+        if (!setup_keys())
+            fail("setup_keys", 0);
+        sample_end(&sample, workload, "setup_keys");
+    }
+}
+
+#define AUTH_APPENDS 250
+
+/* Guests applying db and dbx updates signed by the PK, in user mode. */
+static void
+bench_auth_append(void)
+{
+    static const char workload[] = "auth_append";
+    static const struct {
+        const uint8_t *name;
+        UINTN name_len;
+    } targets[] = {
+        {EFI_IMAGE_SECURITY_DATABASE, sizeof(EFI_IMAGE_SECURITY_DATABASE)},
+        {EFI_IMAGE_SECURITY_DATABASE1, sizeof(EFI_IMAGE_SECURITY_DATABASE1)},
+    };
+    const UINT32 attr = ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE;
+    uint8_t list[sizeof(EFI_SIGNATURE_LIST) + sizeof(EFI_GUID) + 32];
+    EFI_SIGNATURE_LIST *l = (EFI_SIGNATURE_LIST *)list;
+    uint8_t **auth;
+    UINTN *auth_len;
+    EFI_STATUS status;
+    int i, t;
+
+    reset_vars();
+    if (!setup_variables() || !setup_keys())
+        fail("setup_keys", 0);
+
+    auth = calloc(AUTH_APPENDS, sizeof(*auth));
+    auth_len = calloc(AUTH_APPENDS, sizeof(*auth_len));
+    if (!auth || !auth_len)
+        fail("calloc", 0);
+
+    /* Each append adds a different hash so that none is verified twice. */
+    memset(list, 0, sizeof(list));
+    l->SignatureType = mSupportSigItem[0].SigType; /* EFI_CERT_SHA256_GUID */
+    l->SignatureListSize = sizeof(list);
+    l->SignatureSize = sizeof(EFI_GUID) + 32;
+
+    for (t = 0; t < ARRAY_SIZE(targets); t++) {
+        for (i = 0; i < AUTH_APPENDS; i++) {
+            memcpy(list + sizeof(*l) + sizeof(EFI_GUID), &i, sizeof(i));
+            list[sizeof(list) - 1] = t;
+            auth[i] = sign_auth(targets[t].name, targets[t].name_len,
+                                &gEfiImageSecurityDatabaseGuid, attr,
+                                list, sizeof(list), &auth_len[i]);
+        }
+
+        for (i = 0; i < AUTH_APPENDS; i++) {
+            put_set_variable(targets[t].name, targets[t].name_len,
+                             &gEfiImageSecurityDatabaseGuid,
+                             auth[i], auth_len[i], attr);
+            if ((status = timed_dispatch(workload)) != EFI_SUCCESS)
+                fail("SetVariable(append)", status);
+            free(auth[i]);
+        }
+    }
+
+    free(auth);
+    free(auth_len);
+}
+
+/*
+ * Persistence
+ */
+
+/*
+ * A mock XAPI listening on a UNIX socket. It answers the calls made by
+ * xapidb-lib.c and stores the last NVRAM it was sent, doing as little work
+ * as possible so that the time measured is mostly varstored's.
+ */
+#define MOCK_RESPONSE \
+    "<?xml version='1.0'?><methodResponse><params><param><value><struct>" \
+    "<member><name>Status</name><value>Success</value></member>" \
+    "<member><name>Value</name><value>%s</value></member>" \
+    "</struct></value></param></params></methodResponse>"
+
+#define MOCK_NVRAM \
+    "<struct><member><name>EFI-variables</name><value>%s</value></member>" \
+    "</struct>"
+
+static char mock_dir[] = "/tmp/varstored-bench-XXXXXX";
+static char mock_socket[sizeof(mock_dir) + 16];
+static char mock_save[sizeof(mock_dir) + 16];
+static pid_t mock_pid;
+
+static bool
+mock_write(int fd, const char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = write(fd, buf, len);
+        if (ret <= 0)
+            return false;
+        buf += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+/* Returns the nth string argument of the call in body. */
+static char *
+mock_arg(char *body, int n)
+{
+    char *ptr = body, *end;
+
+    while (n-- >= 0) {
+        ptr = strstr(ptr, "<string>");
+        if (!ptr)
+            return NULL;
+        ptr += strlen("<string>");
+    }
+    end = strchr(ptr, '<');
+    if (!end)
+        return NULL;
+
+    return strndup(ptr, end - ptr);
+}
+
+/* Answers the calls on one connection until it is closed. */
+static void
+mock_connection(int fd, char **nvram)
+{
+    char *buf, *body, *end, *method, *value, *response, *header;
+    size_t len = 0, body_off, content_len;
+    const size_t size = 2 * MAX_HTTP_SIZE;
+    ssize_t ret;
+
+    buf = malloc(size + 1);
+    if (!buf)
+        return;
+
+    for (;;) {
+        while (!(end = strstr(buf, "\r\n\r\n")) || len < 4) {
+            ret = read(fd, buf + len, size - len);
+            if (ret <= 0)
+                goto out;
+            len += ret;
+            buf[len] = '\0';
+        }
+        body_off = end - buf + 4;
+        header = strcasestr(buf, "\r\nContent-Length:");
+        if (!header || header > end)
+            goto out;
+        content_len = strtoul(header + strlen("\r\nContent-Length:"), NULL, 10);
+        if (content_len > size - body_off)
+            goto out;
+        while (len < body_off + content_len) {
+            ret = read(fd, buf + len, size - len);
+            if (ret <= 0)
+                goto out;
+            len += ret;
+        }
+
+        body = buf + body_off;
+        value = NULL;
+        method = strstr(body, "<methodName>");
+        if (method && !strncmp(method + strlen("<methodName>"),
+                               "VM.set_NVRAM_EFI_variables", 26)) {
+            free(*nvram);
+            *nvram = mock_arg(body, 2);
+        } else if (method && !strncmp(method + strlen("<methodName>"),
+                                      "VM.get_NVRAM", 12)) {
+            if (asprintf(&value, MOCK_NVRAM, *nvram ? *nvram : "") == -1)
+                value = NULL;
+        } else if (method && !strncmp(method + strlen("<methodName>"),
+                                      "session.login_with_password", 27)) {
+            value = strdup("OpaqueRef:session");
+        } else if (method && !strncmp(method + strlen("<methodName>"),
+                                      "VM.get_by_uuid", 14)) {
+            value = strdup("OpaqueRef:vm");
+        }
+
+        if (asprintf(&body, MOCK_RESPONSE, value ? value : "") == -1)
+            goto out;
+        free(value);
+        if (asprintf(&response, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n%s",
+                     strlen(body), body) == -1) {
+            free(body);
+            goto out;
+        }
+        free(body);
+        ret = mock_write(fd, response, strlen(response));
+        free(response);
+        if (!ret)
+            goto out;
+
+        len -= body_off + content_len;
+        memmove(buf, buf + body_off + content_len, len);
+        buf[len] = '\0';
+    }
+
+out:
+    free(buf);
+}
+
+static void
+mock_start(void)
+{
+    struct sockaddr_un addr;
+    char *nvram = NULL;
+    int fd, conn;
+
+    if (!mkdtemp(mock_dir))
+        fail("mkdtemp", errno);
+    snprintf(mock_socket, sizeof(mock_socket), "%s/xapi", mock_dir);
+    snprintf(mock_save, sizeof(mock_save), "%s/save", mock_dir);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, mock_socket, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(fd, 4) == -1)
+        fail("mock socket", errno);
+
+    mock_pid = fork();
+    if (mock_pid == -1)
+        fail("fork", errno);
+    if (mock_pid == 0) {
+        for (;;) {
+            conn = accept(fd, NULL, NULL);
+            if (conn == -1)
+                _exit(1);
+            mock_connection(conn, &nvram);
+            close(conn);
+        }
+    }
+    close(fd);
+
+    xapidb_arg_socket = mock_socket;
+    xapidb_arg_uuid = "00000000-0000-0000-0000-000000000000";
+    arg_save = mock_save;
+    arg_resume = mock_save;
+    opt_resume = true;
+}
+
+static void
+mock_stop(void)
+{
+    kill(mock_pid, SIGTERM);
+    waitpid(mock_pid, NULL, 0);
+    unlink(mock_socket);
+    unlink(mock_save);
+    rmdir(mock_dir);
+}
+
+/*
+ * Fills the store with NV variables up to percent of TOTAL_LIMIT. The data is
+ * random, like the hashes and certificates that make up most real stores, so
+ * compressing it would not help.
+ */
+static unsigned int
+fill_store(unsigned int percent)
+{
+    const uint64_t target = (uint64_t)TOTAL_LIMIT * percent / 100;
+    uint8_t name[NAME_LIMIT], data[2048];
+    uint32_t seed = percent;
+    UINTN name_len, data_len, i;
+    EFI_STATUS status;
+    char ascii[16];
+    unsigned int count;
+
+    reset_vars();
+    if (!setup_variables())
+        fail("setup_variables", 0);
+
+    for (count = 0;; count++) {
+        snprintf(ascii, sizeof(ascii), "BenchVar%04u", count);
+        name_len = make_name(name, ascii);
+        data_len = 256 + (count * 397) % (sizeof(data) - 256);
+        if (get_space_usage() + name_len + data_len +
+                VARIABLE_SIZE_OVERHEAD > target)
+            break;
+
+        for (i = 0; i < data_len; i++) {
+            seed = seed * 1103515245 + 12345;
+            data[i] = seed >> 16;
+        }
+        status = internal_set_variable(name, name_len, &bench_guid, data,
+                                       data_len, ATTR_BRNV);
+        if (status != EFI_SUCCESS)
+            fail("internal_set_variable", status);
+    }
+
+    return count;
+}
+
+/*
+ * Drops the variables loaded by xapidb_resume along with the mapping of the
+ * save file they point into, which varstored itself keeps for good.
+ */
+static void
+drop_resumed(void)
+{
+    reset_vars();
+    xapidb_resume_unmap();
+}
+
+#define PERSIST_ROUNDS 50
+
+static void
+bench_persist(const char *workload, unsigned int percent)
+{
+    uint8_t *raw, *blob, *ptr;
+    size_t raw_len, blob_len;
+    struct sample sample;
+    unsigned int count;
+    char *encoded;
+    int round;
+
+    count = fill_store(percent);
+
+    for (round = 0; round < PERSIST_ROUNDS; round++) {
+        sample_begin(&sample);
+        if (!xapidb_serialize_variables(&raw, &raw_len, true))
+            fail("xapidb_serialize_variables", 0);
+        sample_end(&sample, workload, "serialize_variables");
+
+        encoded = malloc(BASE64_ENCODED_LEN(raw_len) + 1);
+        if (!encoded)
+            fail("malloc", 0);
+        sample_begin(&sample);
+        base64_encode(raw, raw_len, encoded);
+        sample_end(&sample, workload, "base64_encode");
+        encoded[BASE64_ENCODED_LEN(raw_len)] = '\0';
+
+        sample_begin(&sample);
+        if (!send_to_xapi(xapidb_arg_uuid, encoded))
+            fail("send_to_xapi", 0);
+        sample_end(&sample, workload, "send_to_xapi");
+
+        sample_begin(&sample);
+        if (!get_from_xapi(xapidb_arg_uuid, &blob, &blob_len))
+            fail("get_from_xapi", 0);
+        sample_end(&sample, workload, "get_from_xapi");
+        if (!blob || blob_len != raw_len || memcmp(blob, raw, raw_len))
+            fail("get_from_xapi(mismatch)", 0);
+
+        reset_vars();
+        ptr = blob;
+        sample_begin(&sample);
+        if (!xapidb_parse_blob(&ptr, blob_len))
+            fail("xapidb_parse_blob", 0);
+        sample_end(&sample, workload, "parse_blob");
+
+        sample_begin(&sample);
+        if (!xapidb_save())
+            fail("xapidb_save", 0);
+        sample_end(&sample, workload, "xapidb_save");
+
+        reset_vars();
+        sample_begin(&sample);
+        if (!xapidb_resume())
+            fail("xapidb_resume", 0);
+        sample_end(&sample, workload, "xapidb_resume");
+
+        drop_resumed();
+        ptr = blob;
+        if (!xapidb_parse_blob(&ptr, blob_len))
+            fail("xapidb_parse_blob", 0);
+
+        free(blob);
+        free(encoded);
+        free(raw);
+    }
+
+    printf("workload=%s variables=%u space_used=%llu blob_bytes=%zu "
+           "encoded_bytes=%zu\n", workload, count,
+           (unsigned long long)get_space_usage(), raw_len,
+           (size_t)BASE64_ENCODED_LEN(raw_len));
+    report();
+    reset_vars();
+}
+
+/*
+ * Each size is run in its own process so that the peak RSS reported is for
+ * that size alone.
+ */
+static void
+bench_persist_sizes(void)
+{
+    static const struct {
+        const char *workload;
+        unsigned int percent;
+    } sizes[] = {
+        {"persist_10pct", 10},
+        {"persist_50pct", 50},
+        {"persist_100pct", 100},
+    };
+    int i, status;
+    pid_t pid;
+
+    mock_start();
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        pid = fork();
+        if (pid == -1)
+            fail("fork", errno);
+        if (pid == 0) {
+            bench_persist(sizes[i].workload, sizes[i].percent);
+            exit(0);
+        }
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+                WEXITSTATUS(status))
+            exit(1);
+    }
+
+    mock_stop();
+}
+
+int
+main(void)
+{
+    int i;
+
+    if (!setup_crypto())
+        fail("setup_crypto", 0);
+    secure_boot_enable = true;
+    load_signer("testPK.pem", "testPK.key");
+    make_auth_data();
+
+    bench_persist_sizes();
+    bench_cold_boot_enum();
+    bench_cold_boot_enum_batch();
+    bench_boot_churn();
+    bench_query_info();
+    bench_first_boot();
+    bench_auth_append();
+
+    report();
+
+    for (i = 0; i < ARRAY_SIZE(auth_info); i++)
+        free(auth_info[i].data);
+    X509_free(sign_cert);
+    EVP_PKEY_free(sign_key);
+    reset_vars();
+
+    return 0;
+}
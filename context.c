@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <context.h>
+
+struct context {
+    size_t size;
+    uint8_t data[];
+};
+
+static const struct context_region **tables;
+static size_t nr_tables;
+static size_t context_size;
+static struct context *current;
+static bool started;
+
+bool
+context_add(const struct context_region *regions)
+{
+    const struct context_region **new_tables;
+    const struct context_region *r;
+
+    assert(!started);
+
+    new_tables = realloc(tables, sizeof(*tables) * (nr_tables + 1));
+    if (!new_tables)
+        return false;
+    tables = new_tables;
+    tables[nr_tables++] = regions;
+
+    for (r = regions; r->ptr; r++)
+        context_size += r->size;
+
+    return true;
+}
+
+static void
+context_save(struct context *ctx)
+{
+    const struct context_region *r;
+    size_t i, off = 0;
+
+    for (i = 0; i < nr_tables; i++) {
+        for (r = tables[i]; r->ptr; r++) {
+            memcpy(ctx->data + off, r->ptr, r->size);
+            off += r->size;
+        }
+    }
+}
+
+static void
+context_load(const struct context *ctx)
+{
+    const struct context_region *r;
+    size_t i, off = 0;
+
+    assert(ctx->size == context_size);
+
+    for (i = 0; i < nr_tables; i++) {
+        for (r = tables[i]; r->ptr; r++) {
+            memcpy(r->ptr, ctx->data + off, r->size);
+            off += r->size;
+        }
+    }
+}
+
+struct context *
+context_new(void)
+{
+    struct context *ctx;
+
+    started = true;
+
+    ctx = malloc(sizeof(*ctx) + context_size);
+    if (!ctx)
+        return NULL;
+    ctx->size = context_size;
+    context_save(ctx);
+
+    return ctx;
+}
+
+void
+context_switch(struct context *ctx)
+{
+    if (ctx == current)
+        return;
+
+    if (current)
+        context_save(current);
+    context_load(ctx);
+    current = ctx;
+}
+
+void
+context_free(struct context *ctx)
+{
+    if (ctx == current)
+        current = NULL;
+    free(ctx);
+}
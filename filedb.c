@@ -0,0 +1,1268 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A backend that keeps NVRAM in local files, for hosts without XAPI. The
+ * NV variables live in a snapshot, in the same blob format as the xapidb
+ * backend, followed by a journal of the updates made since the snapshot was
+ * taken. An update appends one record to the journal; once the journal grows
+ * past a limit, the next update writes a new snapshot and starts an empty
+ * journal instead. Loading reads the snapshot and replays the journal on top.
+ *
+ * set_variable is called without being told what changed, and some changes
+ * (e.g. to the MOR key) never go through it. So the backend keeps a shadow
+ * copy of what it last wrote out and journals the difference between that and
+ * the variables in memory.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <backend.h>
+#include <debug.h>
+#include <efi.h>
+#include <handler.h>
+#include <mor.h>
+#include <ppi.h>
+#include <serialize.h>
+#include <xapidb.h>
+#include <zlib.h>
+
+#include "option.h"
+
+#define SNAPSHOT_MAGIC "VSNP"
+#define JOURNAL_MAGIC "VJNL"
+#define FILEDB_VERSION 1
+
+/*
+ * The snapshot and the journal each carry the generation of the snapshot.
+ * A journal left over from an older generation was already folded into the
+ * snapshot and is ignored.
+ */
+struct snapshot_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t generation;
+    uint64_t len; /* Length of the blob that follows. */
+    uint32_t crc; /* CRC-32 of the blob. */
+    uint32_t reserved;
+};
+
+struct journal_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t generation;
+};
+
+/*
+ * Each update is one record holding a list of entries, so that an update is
+ * replayed either as a whole or, if it was torn by a crash, not at all.
+ */
+struct journal_record {
+    uint32_t len; /* Length of the entries that follow. */
+    uint32_t crc; /* CRC-32 of the entries. */
+};
+
+enum journal_entry {
+    ENTRY_PUT = 1, /* A whole variable, added or replaced. */
+    ENTRY_DELETE,  /* The name and GUID of a removed variable. */
+    ENTRY_ANCILLARY, /* The mor_key and ppi_vdata. */
+};
+
+#define MAX_SNAPSHOT_SIZE \
+    (sizeof(struct snapshot_header) + DB_HEADER_LEN + ANCILLARY_DATA_LEN + \
+     MAX_FILE_SIZE)
+#define MAX_JOURNAL_SIZE (64 * 1024 * 1024)
+#define DEFAULT_COMPACT (2 * MAX_FILE_SIZE)
+
+/*
+ * With group commit, the most updates that may wait for one fsync. Past
+ * that, the update is synced straight away.
+ */
+#define GROUP_MAX_PENDING 32
+/* How long to wait before retrying a deferred sync that failed. */
+#define SYNC_RETRY_MS 1000
+
+/* Prefix of the files holding the variables. */
+static char *arg_path;
+/* Path to the file used for resuming. */
+static char *arg_resume;
+/* Path to the file used for saving. */
+static char *arg_save;
+/*
+ * Window in milliseconds over which journal updates share one fsync. When
+ * zero, every update is synced before it is acknowledged.
+ */
+static unsigned int arg_group;
+/* Size in bytes at which the journal is compacted into a new snapshot. */
+static unsigned long arg_compact = DEFAULT_COMPACT;
+
+static char *snapshot_file;
+static char *journal_file;
+static int journal_fd = -1;
+static uint64_t generation;
+static size_t journal_len; /* Length of the journal up to the last record. */
+static bool compact_needed; /* The journal can't be appended to. */
+
+static bool sync_dirty; /* Updates are waiting to be synced. */
+static unsigned int sync_pending; /* Number of updates waiting. */
+static bool sync_failed; /* The last deferred sync failed. */
+static struct timespec sync_deadline;
+/* Completions of the updates waiting, called once they are synced. */
+static void (*sync_waiters[GROUP_MAX_PENDING])(bool saved);
+
+/* A copy of an NV variable as it was last written out. */
+struct shadow_var {
+    struct shadow_var *next; /* Next in the same bucket. */
+    struct shadow_var *staged; /* Next in the list of pending replacements. */
+    struct shadow_var *old; /* The entry this one is to replace. */
+    bool seen;
+    uint32_t hash;
+    uint8_t *name;
+    UINTN name_len;
+    uint8_t *data;
+    UINTN data_len;
+    EFI_GUID guid;
+    UINT32 attributes;
+    EFI_TIME timestamp;
+    uint8_t cert[SHA256_DIGEST_SIZE];
+    uint8_t payload[];
+};
+
+static struct shadow_var *shadow[VARIABLE_INDEX_SIZE];
+static uint8_t shadow_ancillary[ANCILLARY_DATA_LEN];
+
+static void
+ancillary_get(uint8_t *buf)
+{
+    memcpy(buf, mor_key, sizeof(mor_key));
+    memcpy(buf + sizeof(mor_key), &ppi_vdata, sizeof(ppi_vdata));
+}
+
+static void
+ancillary_set(const uint8_t *buf)
+{
+    memcpy(mor_key, buf, sizeof(mor_key));
+    memcpy(&ppi_vdata, buf + sizeof(mor_key), sizeof(ppi_vdata));
+}
+
+static struct shadow_var **
+shadow_bucket(uint32_t hash)
+{
+    return &shadow[hash & (VARIABLE_INDEX_SIZE - 1)];
+}
+
+static struct shadow_var *
+shadow_find(const struct efi_variable *l)
+{
+    struct shadow_var *s;
+
+    for (s = *shadow_bucket(l->hash); s; s = s->next) {
+        if (s->hash == l->hash && s->name_len == l->name_len &&
+                !memcmp(s->name, l->name, l->name_len) &&
+                !memcmp(&s->guid, &l->guid, GUID_LEN))
+            return s;
+    }
+
+    return NULL;
+}
+
+static bool
+shadow_same(const struct shadow_var *s, const struct efi_variable *l)
+{
+    return s->attributes == l->attributes &&
+           s->data_len == l->data_len &&
+           !memcmp(&s->timestamp, &l->timestamp, sizeof(s->timestamp)) &&
+           !memcmp(s->cert, l->cert, sizeof(s->cert)) &&
+           !memcmp(s->data, l->data, l->data_len);
+}
+
+static struct shadow_var *
+shadow_copy(const struct efi_variable *l)
+{
+    struct shadow_var *s;
+
+    s = malloc(sizeof(*s) + l->name_len + l->data_len);
+    if (!s) {
+        ERR("Failed to allocate memory\n");
+        return NULL;
+    }
+
+    s->next = NULL;
+    s->staged = NULL;
+    s->old = NULL;
+    s->seen = false;
+    s->hash = l->hash;
+    s->name = s->payload;
+    s->name_len = l->name_len;
+    memcpy(s->name, l->name, l->name_len);
+    s->data = s->payload + l->name_len;
+    s->data_len = l->data_len;
+    memcpy(s->data, l->data, l->data_len);
+    s->guid = l->guid;
+    s->attributes = l->attributes;
+    s->timestamp = l->timestamp;
+    memcpy(s->cert, l->cert, sizeof(s->cert));
+
+    return s;
+}
+
+static void
+shadow_unlink(struct shadow_var *s)
+{
+    struct shadow_var **p = shadow_bucket(s->hash);
+
+    while (*p != s)
+        p = &(*p)->next;
+    *p = s->next;
+}
+
+static void
+shadow_link(struct shadow_var *s)
+{
+    struct shadow_var **bucket = shadow_bucket(s->hash);
+
+    s->next = *bucket;
+    *bucket = s;
+}
+
+static void
+shadow_clear(void)
+{
+    struct shadow_var *s, *next;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(shadow); i++) {
+        for (s = shadow[i]; s; s = next) {
+            next = s->next;
+            free(s);
+        }
+        shadow[i] = NULL;
+    }
+}
+
+/* Makes the shadow match the variables in memory, which were just written. */
+static bool
+shadow_rebuild(void)
+{
+    struct efi_variable *l;
+    struct shadow_var *s;
+
+    shadow_clear();
+
+    for (l = var_list; l; l = l->next) {
+        if (!(l->attributes & EFI_VARIABLE_NON_VOLATILE))
+            continue;
+
+        s = shadow_copy(l);
+        if (!s) {
+            shadow_clear();
+            return false;
+        }
+        shadow_link(s);
+    }
+    ancillary_get(shadow_ancillary);
+
+    return true;
+}
+
+/* A journal record being built, starting with room for its header. */
+struct batch {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+};
+
+static uint8_t *
+batch_reserve(struct batch *b, size_t len)
+{
+    uint8_t *buf, *ptr;
+    size_t cap;
+
+    if (!b->buf)
+        b->len = sizeof(struct journal_record);
+
+    if (b->len + len > b->cap) {
+        cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len)
+            cap *= 2;
+        buf = realloc(b->buf, cap);
+        if (!buf) {
+            ERR("Failed to allocate memory\n");
+            return NULL;
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+
+    ptr = b->buf + b->len;
+    b->len += len;
+
+    return ptr;
+}
+
+static bool
+batch_put(struct batch *b, const struct shadow_var *s)
+{
+    uint8_t *ptr;
+
+    ptr = batch_reserve(b, sizeof(UINT32) +
+                           sizeof(s->name_len) + s->name_len +
+                           sizeof(s->data_len) + s->data_len +
+                           GUID_LEN + sizeof(s->attributes) +
+                           sizeof(s->timestamp) + sizeof(s->cert));
+    if (!ptr)
+        return false;
+
+    serialize_uint32(&ptr, ENTRY_PUT);
+    serialize_data(&ptr, s->name, s->name_len);
+    serialize_data(&ptr, s->data, s->data_len);
+    serialize_guid(&ptr, &s->guid);
+    serialize_uint32(&ptr, s->attributes);
+    memcpy(ptr, &s->timestamp, sizeof(s->timestamp));
+    ptr += sizeof(s->timestamp);
+    memcpy(ptr, s->cert, sizeof(s->cert));
+
+    return true;
+}
+
+static bool
+batch_delete(struct batch *b, const struct shadow_var *s)
+{
+    uint8_t *ptr;
+
+    ptr = batch_reserve(b, sizeof(UINT32) + sizeof(s->name_len) +
+                           s->name_len + GUID_LEN);
+    if (!ptr)
+        return false;
+
+    serialize_uint32(&ptr, ENTRY_DELETE);
+    serialize_data(&ptr, s->name, s->name_len);
+    serialize_guid(&ptr, &s->guid);
+
+    return true;
+}
+
+static bool
+batch_ancillary(struct batch *b, const uint8_t *ancillary)
+{
+    uint8_t *ptr;
+
+    ptr = batch_reserve(b, sizeof(UINT32) + ANCILLARY_DATA_LEN);
+    if (!ptr)
+        return false;
+
+    serialize_uint32(&ptr, ENTRY_ANCILLARY);
+    memcpy(ptr, ancillary, ANCILLARY_DATA_LEN);
+
+    return true;
+}
+
+static bool
+file_write_all(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t rc;
+
+    while (len) {
+        rc = write(fd, buf, len);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += rc;
+        len -= rc;
+    }
+
+    return true;
+}
+
+/*
+ * Reads the whole of path into a new buffer. *buf is NULL if the file
+ * doesn't exist.
+ */
+static bool
+file_read_all(const char *path, uint8_t **buf, size_t *len, size_t max)
+{
+    struct stat st;
+    ssize_t rc;
+    size_t off = 0;
+    int fd;
+
+    *buf = NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return true;
+        ERR("Failed to open '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size > max) {
+        ERR("Size of '%s' is invalid\n", path);
+        goto err;
+    }
+
+    *buf = malloc(st.st_size ? st.st_size : 1);
+    if (!*buf) {
+        ERR("Failed to allocate memory\n");
+        goto err;
+    }
+
+    while (off < st.st_size) {
+        rc = read(fd, *buf + off, st.st_size - off);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            ERR("Failed to read '%s'\n", path);
+            goto err;
+        }
+        off += rc;
+    }
+    *len = off;
+
+    close(fd);
+    return true;
+
+err:
+    free(*buf);
+    *buf = NULL;
+    close(fd);
+    return false;
+}
+
+/* Makes a rename in the directory holding the files durable. */
+static bool
+dir_sync(void)
+{
+    char *path, *dir;
+    int fd;
+    bool ret;
+
+    path = strdup(arg_path);
+    if (!path) {
+        ERR("Failed to allocate memory\n");
+        return false;
+    }
+    dir = dirname(path);
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        ERR("Failed to open '%s': %s\n", dir, strerror(errno));
+        free(path);
+        return false;
+    }
+    ret = fsync(fd) == 0;
+    if (!ret)
+        ERR("Failed to sync '%s': %s\n", dir, strerror(errno));
+
+    close(fd);
+    free(path);
+    return ret;
+}
+
+/* Atomically replaces path with a header followed by a body. */
+static bool
+file_replace(const char *path, const void *hdr, size_t hdr_len,
+             const uint8_t *body, size_t body_len)
+{
+    char *tmp;
+    int fd;
+
+    if (asprintf(&tmp, "%s.tmp", path) == -1) {
+        ERR("Failed to allocate memory\n");
+        return false;
+    }
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        ERR("Failed to open '%s': %s\n", tmp, strerror(errno));
+        goto err;
+    }
+    if (!file_write_all(fd, hdr, hdr_len) || !file_write_all(fd, body, body_len) ||
+            fdatasync(fd) == -1) {
+        ERR("Failed to write '%s': %s\n", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        goto err;
+    }
+    close(fd);
+
+    if (rename(tmp, path) == -1) {
+        ERR("Failed to rename '%s': %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        goto err;
+    }
+    free(tmp);
+
+    return dir_sync();
+
+err:
+    free(tmp);
+    return false;
+}
+
+/* Replaces the journal with an empty one for the current generation. */
+static bool
+journal_reset(void)
+{
+    struct journal_header hdr = {
+        .magic = JOURNAL_MAGIC,
+        .version = FILEDB_VERSION,
+        .generation = generation,
+    };
+
+    if (journal_fd != -1) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+
+    if (!file_replace(journal_file, &hdr, sizeof(hdr), NULL, 0))
+        return false;
+
+    journal_fd = open(journal_file, O_WRONLY | O_APPEND);
+    if (journal_fd == -1) {
+        ERR("Failed to open '%s': %s\n", journal_file, strerror(errno));
+        return false;
+    }
+    journal_len = sizeof(hdr);
+
+    return true;
+}
+
+/*
+ * Ends the wait of every update whose sync is pending. If it failed, they
+ * are rolled back by their callers.
+ */
+static void
+sync_complete(bool saved)
+{
+    unsigned int i, n = sync_pending;
+
+    sync_dirty = false;
+    sync_pending = 0;
+    for (i = 0; i < n; i++)
+        sync_waiters[i](saved);
+}
+
+/*
+ * Writes the NV variables in memory as the snapshot of a new generation
+ * and starts an empty journal. Both files are synced before returning.
+ */
+static bool
+store_compact(void)
+{
+    struct snapshot_header hdr = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = FILEDB_VERSION,
+    };
+    uint8_t *blob;
+    size_t len;
+    bool ok;
+
+    if (!xapidb_serialize_variables(&blob, &len, true))
+        return false;
+
+    hdr.generation = generation + 1;
+    hdr.len = len;
+    hdr.crc = crc32(0, blob, len);
+
+    ok = file_replace(snapshot_file, &hdr, sizeof(hdr), blob, len);
+    free(blob);
+    if (!ok)
+        return false;
+
+    /*
+     * The snapshot holds everything now, so the update is durable even if
+     * the journal can't be replaced. Until it is, whatever it holds is stale
+     * and the next update compacts again.
+     */
+    generation++;
+    compact_needed = !journal_reset();
+    if (compact_needed)
+        ERR("Failed to start a new journal\n");
+
+    sync_failed = false;
+    sync_complete(true);
+
+    return true;
+}
+
+/*
+ * Writes a new snapshot and brings the shadow in line with memory, for when
+ * the shadow may not match what is on disk.
+ */
+static bool
+store_all(void)
+{
+    return store_compact() && shadow_rebuild();
+}
+
+/* Appends a record, or compacts instead if the journal is full or unusable. */
+static bool
+journal_write(struct batch *b)
+{
+    struct journal_record rec;
+
+    rec.len = b->len - sizeof(rec);
+    rec.crc = crc32(0, b->buf + sizeof(rec), rec.len);
+    memcpy(b->buf, &rec, sizeof(rec));
+
+    if (compact_needed || journal_fd == -1 ||
+            journal_len + b->len > arg_compact)
+        return store_compact();
+
+    if (!file_write_all(journal_fd, b->buf, b->len)) {
+        ERR("Failed to append to '%s': %s\n", journal_file, strerror(errno));
+        /* Don't leave a torn record for later records to follow. */
+        if (ftruncate(journal_fd, journal_len) == -1)
+            compact_needed = true;
+        return false;
+    }
+    journal_len += b->len;
+
+    return true;
+}
+
+/*
+ * Writes out whatever differs between the variables in memory and the
+ * shadow, then brings the shadow up to date. Nothing in the shadow changes
+ * unless the write succeeds.
+ */
+static bool
+journal_changes(void)
+{
+    struct efi_variable *l;
+    struct shadow_var *s, *n, **p, *staged = NULL;
+    struct batch b = { NULL, 0, 0 };
+    uint8_t ancillary[ANCILLARY_DATA_LEN];
+    bool ancillary_changed, ret = false;
+    size_t i;
+
+    /*
+     * The updates of a failed sync have been rolled back in memory but not
+     * in the shadow.
+     */
+    if (compact_needed)
+        return store_all();
+
+    for (i = 0; i < ARRAY_SIZE(shadow); i++)
+        for (s = shadow[i]; s; s = s->next)
+            s->seen = false;
+
+    for (l = var_list; l; l = l->next) {
+        if (!(l->attributes & EFI_VARIABLE_NON_VOLATILE))
+            continue;
+
+        s = shadow_find(l);
+        if (s) {
+            s->seen = true;
+            if (shadow_same(s, l))
+                continue;
+        }
+
+        n = shadow_copy(l);
+        if (!n)
+            goto out;
+        n->old = s;
+        n->staged = staged;
+        staged = n;
+        if (!batch_put(&b, n))
+            goto out;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(shadow); i++) {
+        for (s = shadow[i]; s; s = s->next) {
+            if (!s->seen && !batch_delete(&b, s))
+                goto out;
+        }
+    }
+
+    ancillary_get(ancillary);
+    ancillary_changed = memcmp(ancillary, shadow_ancillary, sizeof(ancillary));
+    if (ancillary_changed && !batch_ancillary(&b, ancillary))
+        goto out;
+
+    if (!b.buf) {
+        ret = true;
+        goto out;
+    }
+
+    if (!journal_write(&b))
+        goto out;
+
+    for (i = 0; i < ARRAY_SIZE(shadow); i++) {
+        p = &shadow[i];
+        while (*p) {
+            s = *p;
+            if (s->seen) {
+                p = &s->next;
+            } else {
+                *p = s->next;
+                free(s);
+            }
+        }
+    }
+    while (staged) {
+        n = staged;
+        staged = n->staged;
+        if (n->old) {
+            shadow_unlink(n->old);
+            free(n->old);
+        }
+        shadow_link(n);
+    }
+    memcpy(shadow_ancillary, ancillary, sizeof(ancillary));
+    ret = true;
+
+out:
+    while (staged) {
+        n = staged;
+        staged = n->staged;
+        free(n);
+    }
+    free(b.buf);
+
+    return ret;
+}
+
+static void
+arm_sync(long ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, &sync_deadline);
+    sync_deadline.tv_sec += ms / 1000;
+    sync_deadline.tv_nsec += (ms % 1000) * 1000000L;
+    if (sync_deadline.tv_nsec >= 1000000000L) {
+        sync_deadline.tv_sec++;
+        sync_deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * Syncs the journal and completes the updates waiting for it. If that fails,
+ * what reached the disk is unknown, so everything is written out again
+ * through a new snapshot, at the next update or after SYNC_RETRY_MS. The wait
+ * keeps the main loop from spinning while the disk is failing.
+ */
+static bool
+journal_sync(void)
+{
+    if (fdatasync(journal_fd) == -1) {
+        ERR("Failed to sync '%s': %s\n", journal_file, strerror(errno));
+        sync_failed = true;
+        compact_needed = true;
+        sync_complete(false);
+        sync_dirty = true;
+        arm_sync(SYNC_RETRY_MS);
+        return false;
+    }
+
+    sync_failed = false;
+    sync_complete(true);
+
+    return true;
+}
+
+/*
+ * With group commit enabled, leave the update waiting for the main loop to
+ * sync the journal once the window closes, along with any others written
+ * meanwhile. Once too many are waiting, or while syncing is failing, the
+ * caller must sync now.
+ */
+static bool
+group_defer(void (*done)(bool saved))
+{
+    if (!arg_group || sync_failed || sync_pending >= GROUP_MAX_PENDING)
+        return false;
+
+    if (!sync_dirty) {
+        arm_sync(arg_group);
+        sync_dirty = true;
+    }
+    sync_waiters[sync_pending++] = done;
+
+    return true;
+}
+
+static enum backend_save_status
+filedb_set_variable_async(void (*done)(bool saved))
+{
+    uint64_t old_generation = generation;
+    size_t old_len = journal_len;
+
+    if (!journal_changes())
+        return BACKEND_SAVE_FAILURE;
+
+    /* Nothing was appended, or it went into a new snapshot, already synced. */
+    if (journal_len == old_len || generation != old_generation)
+        return BACKEND_SAVE_SUCCESS;
+
+    if (group_defer(done))
+        return BACKEND_SAVE_PENDING;
+
+    return journal_sync() ? BACKEND_SAVE_SUCCESS : BACKEND_SAVE_FAILURE;
+}
+
+static bool
+filedb_set_variable(void)
+{
+    uint64_t old_generation = generation;
+    size_t old_len = journal_len;
+
+    if (!journal_changes())
+        return false;
+
+    if (journal_len == old_len || generation != old_generation)
+        return true;
+
+    return journal_sync();
+}
+
+static int
+filedb_flush_timeout(void)
+{
+    struct timespec now;
+    long ms;
+
+    if (!sync_dirty)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (sync_deadline.tv_sec - now.tv_sec) * 1000 +
+         (sync_deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+    return ms > 0 ? ms : 0;
+}
+
+static bool
+filedb_flush(bool force)
+{
+    if (!sync_dirty)
+        return true;
+
+    if (!force && filedb_flush_timeout() != 0)
+        return true;
+
+    if (!(compact_needed ? store_all() : journal_sync())) {
+        ERR("Failed to sync deferred updates\n");
+        sync_complete(false);
+        sync_dirty = true;
+        arm_sync(SYNC_RETRY_MS);
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+replay_put(uint8_t **ptr, uint8_t *end)
+{
+    struct efi_variable *l, *old;
+    const uint8_t *name, *data;
+    UINTN name_len, data_len;
+
+    if (end - *ptr < sizeof(name_len))
+        return false;
+    name = unserialize_data_view(ptr, end, &name_len, NAME_LIMIT);
+    if (!name || end - *ptr < sizeof(data_len))
+        return false;
+    data = unserialize_data_view(ptr, end, &data_len, DATA_LIMIT);
+    if (!data || end - *ptr < GUID_LEN + sizeof(l->attributes) +
+                              sizeof(l->timestamp) + sizeof(l->cert))
+        return false;
+
+    l = alloc_efi_variable(name, name_len, data_len);
+    if (!l) {
+        ERR("Failed to allocate memory\n");
+        return false;
+    }
+    memcpy(l->data, data, data_len);
+    unserialize_guid(ptr, &l->guid);
+    l->attributes = unserialize_uint32(ptr);
+    unserialize_timestamp(ptr, &l->timestamp);
+    memcpy(l->cert, *ptr, sizeof(l->cert));
+    *ptr += sizeof(l->cert);
+
+    old = find_variable(l->name, l->name_len, &l->guid);
+    if (old) {
+        replace_variable(old, l);
+        free_efi_variable(old);
+    } else {
+        insert_variable(l);
+    }
+
+    return true;
+}
+
+static bool
+replay_delete(uint8_t **ptr, uint8_t *end)
+{
+    struct efi_variable *l;
+    const uint8_t *name;
+    UINTN name_len;
+    EFI_GUID guid;
+
+    if (end - *ptr < sizeof(name_len))
+        return false;
+    name = unserialize_data_view(ptr, end, &name_len, NAME_LIMIT);
+    if (!name || end - *ptr < GUID_LEN)
+        return false;
+    unserialize_guid(ptr, &guid);
+
+    l = find_variable(name, name_len, &guid);
+    if (l) {
+        remove_variable(l);
+        free_efi_variable(l);
+    }
+
+    return true;
+}
+
+static bool
+replay_record(uint8_t *ptr, uint8_t *end)
+{
+    while (ptr < end) {
+        if (end - ptr < sizeof(UINT32))
+            return false;
+
+        switch (unserialize_uint32(&ptr)) {
+        case ENTRY_PUT:
+            if (!replay_put(&ptr, end))
+                return false;
+            break;
+        case ENTRY_DELETE:
+            if (!replay_delete(&ptr, end))
+                return false;
+            break;
+        case ENTRY_ANCILLARY:
+            if (end - ptr < ANCILLARY_DATA_LEN)
+                return false;
+            ancillary_set(ptr);
+            ptr += ANCILLARY_DATA_LEN;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+load_snapshot(bool *found)
+{
+    struct snapshot_header hdr;
+    uint8_t *buf, *ptr;
+    size_t len;
+    bool ret;
+
+    generation = 0;
+    *found = false;
+
+    if (!file_read_all(snapshot_file, &buf, &len, MAX_SNAPSHOT_SIZE))
+        return false;
+    if (!buf)
+        return true;
+
+    memcpy(&hdr, buf, len < sizeof(hdr) ? len : sizeof(hdr));
+    if (len < sizeof(hdr) ||
+            memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+            hdr.version != FILEDB_VERSION || hdr.len != len - sizeof(hdr) ||
+            hdr.crc != crc32(0, buf + sizeof(hdr), hdr.len)) {
+        ERR("Snapshot '%s' is invalid\n", snapshot_file);
+        free(buf);
+        return false;
+    }
+
+    ptr = buf + sizeof(hdr);
+    ret = xapidb_parse_blob(&ptr, hdr.len);
+    free(buf);
+
+    generation = hdr.generation;
+    *found = true;
+
+    return ret;
+}
+
+/*
+ * Reads just the generation of the snapshot, so that the next one written
+ * never shares its generation with a journal already on disk.
+ */
+static bool
+read_generation(void)
+{
+    struct snapshot_header hdr;
+    ssize_t rc;
+    int fd;
+
+    generation = 0;
+
+    fd = open(snapshot_file, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return true;
+        ERR("Failed to open '%s': %s\n", snapshot_file, strerror(errno));
+        return false;
+    }
+    rc = read(fd, &hdr, sizeof(hdr));
+    close(fd);
+
+    if (rc != sizeof(hdr) ||
+            memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic))) {
+        ERR("Snapshot '%s' is invalid\n", snapshot_file);
+        return false;
+    }
+    generation = hdr.generation;
+
+    return true;
+}
+
+/*
+ * Replays the journal onto the variables from the snapshot. A torn record at
+ * the end, left by a crash while appending, is dropped.
+ */
+static bool
+replay_journal(size_t *count)
+{
+    struct journal_header hdr;
+    struct journal_record rec;
+    uint8_t *buf;
+    size_t len, off;
+
+    *count = 0;
+
+    if (!file_read_all(journal_file, &buf, &len, MAX_JOURNAL_SIZE))
+        return false;
+
+    if (!buf || len < sizeof(hdr)) {
+        free(buf);
+        return journal_reset();
+    }
+
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) ||
+            hdr.version != FILEDB_VERSION) {
+        ERR("Journal '%s' is invalid\n", journal_file);
+        free(buf);
+        return false;
+    }
+    if (hdr.generation != generation) {
+        DBG("Ignoring journal from generation %lu\n", hdr.generation);
+        free(buf);
+        return journal_reset();
+    }
+
+    off = sizeof(hdr);
+    while (len - off >= sizeof(rec)) {
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (rec.len > len - off - sizeof(rec) ||
+                rec.crc != crc32(0, buf + off + sizeof(rec), rec.len))
+            break;
+
+        if (!replay_record(buf + off + sizeof(rec),
+                           buf + off + sizeof(rec) + rec.len)) {
+            ERR("Journal record at %lu is invalid\n", off);
+            free(buf);
+            return false;
+        }
+        off += sizeof(rec) + rec.len;
+        (*count)++;
+    }
+    free(buf);
+
+    journal_fd = open(journal_file, O_WRONLY | O_APPEND);
+    if (journal_fd == -1) {
+        ERR("Failed to open '%s': %s\n", journal_file, strerror(errno));
+        return false;
+    }
+
+    if (off != len) {
+        WARN("Dropping %lu bytes of torn journal\n", len - off);
+        if (ftruncate(journal_fd, off) == -1 || fdatasync(journal_fd) == -1) {
+            ERR("Failed to truncate '%s': %s\n", journal_file,
+                strerror(errno));
+            return false;
+        }
+    }
+    journal_len = off;
+
+    return true;
+}
+
+static enum backend_init_status
+filedb_init(void)
+{
+    bool found;
+    size_t count;
+
+    if (!load_snapshot(&found) || !replay_journal(&count) ||
+            !shadow_rebuild())
+        return BACKEND_INIT_FAILURE;
+
+    return found || count ? BACKEND_INIT_SUCCESS : BACKEND_INIT_FIRSTBOOT;
+}
+
+static bool
+filedb_parse_arg(const char *name, const char *val)
+{
+    if (!strcmp(name, "path"))
+        arg_path = strdup(val);
+    else if (!strcmp(name, "resume"))
+        arg_resume = strdup(val);
+    else if (!strcmp(name, "save"))
+        arg_save = strdup(val);
+    else if (!strcmp(name, "group")) {
+        char *end;
+
+        arg_group = strtoul(val, &end, 0);
+        if (*val == '\0' || *end != '\0')
+            return false;
+    } else if (!strcmp(name, "compact")) {
+        char *end;
+
+        arg_compact = strtoul(val, &end, 0);
+        if (*val == '\0' || *end != '\0' || arg_compact == 0 ||
+                arg_compact > MAX_JOURNAL_SIZE)
+            return false;
+    } else
+        return false;
+
+    return true;
+}
+
+static bool
+filedb_check_args(void)
+{
+    if (!arg_path) {
+        fprintf(stderr, "Backend arg 'path' is required\n");
+        return false;
+    }
+    if (!opt_resume && arg_resume) {
+        fprintf(stderr, "Backend arg 'resume' is invalid when not resuming\n");
+        return false;
+    }
+
+    if (asprintf(&snapshot_file, "%s.snapshot", arg_path) == -1 ||
+            asprintf(&journal_file, "%s.journal", arg_path) == -1) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+filedb_save(void)
+{
+    return arg_save ? xapidb_save_to_file(arg_save) : true;
+}
+
+/*
+ * The save file holds the volatile variables as well, so it is used in
+ * preference to the store when given. The store is then rewritten from it.
+ */
+static bool
+filedb_resume(void)
+{
+    if (!arg_resume)
+        return filedb_init() != BACKEND_INIT_FAILURE;
+
+    if (!xapidb_resume_from_file(arg_resume) || !read_generation())
+        return false;
+
+    return store_all();
+}
+
+static bool
+filedb_sb_notify(void)
+{
+    WARN("The VM failed to pass Secure Boot verification\n");
+    return true;
+}
+
+static void
+filedb_fini(void)
+{
+    if (journal_fd != -1) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    shadow_clear();
+}
+
+static const struct context_region filedb_context_regions[] = {
+    CONTEXT_REGION(arg_path),
+    CONTEXT_REGION(arg_resume),
+    CONTEXT_REGION(arg_save),
+    CONTEXT_REGION(arg_group),
+    CONTEXT_REGION(arg_compact),
+    CONTEXT_REGION(snapshot_file),
+    CONTEXT_REGION(journal_file),
+    CONTEXT_REGION(journal_fd),
+    CONTEXT_REGION(generation),
+    CONTEXT_REGION(journal_len),
+    CONTEXT_REGION(compact_needed),
+    CONTEXT_REGION(sync_dirty),
+    CONTEXT_REGION(sync_pending),
+    CONTEXT_REGION(sync_failed),
+    CONTEXT_REGION(sync_deadline),
+    CONTEXT_REGION(sync_waiters),
+    CONTEXT_REGION(shadow),
+    CONTEXT_REGION(shadow_ancillary),
+    CONTEXT_END
+};
+
+static const struct context_region *const filedb_context[] = {
+    filedb_context_regions,
+    NULL
+};
+
+const struct backend filedb = {
+    .parse_arg = filedb_parse_arg,
+    .check_args = filedb_check_args,
+    .init = filedb_init,
+    .save = filedb_save,
+    .resume = filedb_resume,
+    .set_variable = filedb_set_variable,
+    .set_variable_async = filedb_set_variable_async,
+    .sb_notify = filedb_sb_notify,
+    .flush_timeout = filedb_flush_timeout,
+    .flush = filedb_flush,
+    .fini = filedb_fini,
+    .context = filedb_context,
+};
@@ -59,12 +59,16 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <openssl/objects.h>
@@ -82,6 +86,8 @@
 #include <handler.h>
 #include <mor.h>
 #include <ppi.h>
+#include <stats.h>
+#include <trace.h>
 
 struct auth_info {
     const char *pretty_name;
@@ -93,6 +99,7 @@ struct auth_info {
     bool required;
     uint8_t *data;
     off_t data_len;
+    bool mapped; /* data is a mapping of the file rather than malloced. */
 };
 
 /* Some values from edk2. */
@@ -122,6 +129,29 @@ static const EFI_SIGNATURE_ITEM mSupportSigItem[] = {
 
 #define NUM_OF_SUPPORTED_SIG_ITEMS    (sizeof(mSupportSigItem) / sizeof(EFI_SIGNATURE_ITEM))
 
+/*
+ * The first byte of each supported SignatureType is distinct, so index
+ * mSupportSigItem by it (plus 1, 0 if unsupported) rather than scanning.
+ * This must be kept in step with mSupportSigItem.
+ */
+static const uint8_t mSupportSigIndex[256] = {
+    [0x26] = 1, [0xe8] = 2, [0x90] = 3, [0x12] = 4, [0x4f] = 5, [0xa1] = 6,
+    [0x33] = 7, [0x07] = 8, [0xae] = 9, [0x92] = 10, [0x6e] = 11, [0x63] = 12,
+};
+
+static const EFI_SIGNATURE_ITEM *
+find_sig_item(const EFI_GUID *type)
+{
+    const EFI_SIGNATURE_ITEM *item;
+    uint8_t i = mSupportSigIndex[((const uint8_t *)type)[0]];
+
+    if (i == 0)
+        return NULL;
+
+    item = &mSupportSigItem[i - 1];
+    return memcmp(type, &item->SigType, GUID_LEN) ? NULL : item;
+}
+
 static const uint8_t EFI_SETUP_MODE_NAME[] = {'S',0,'e',0,'t',0,'u',0,'p',0,'M',0,'o',0,'d',0,'e',0};
 static const uint8_t EFI_AUDIT_MODE_NAME[] = {'A',0,'u',0,'d',0,'i',0,'t',0,'M',0,'o',0,'d',0,'e',0};
 static const uint8_t EFI_DEPLOYED_MODE_NAME[] = {'D',0,'e',0,'p',0,'l',0,'o',0,'y',0,'e',0,'d',0,'M',0,'o',0,'d',0,'e',0};
@@ -145,6 +175,65 @@ static const uint8_t EFI_IMAGE_SECURITY_DATABASE[] = {'d',0,'b',0};
 static const uint8_t EFI_IMAGE_SECURITY_DATABASE1[] = {'d',0,'b',0,'x',0};
 static const uint8_t EFI_IMAGE_SECURITY_DATABASE2[] = {'d',0,'b',0,'t',0};
 
+/*
+ * Variables that SetVariable and the Secure Boot state machine treat
+ * specially. Each is interned as a variable handle so that finding one, or
+ * finding out whether a name is one of them, does not search.
+ */
+enum well_known_var {
+    WK_SETUP_MODE,
+    WK_AUDIT_MODE,
+    WK_DEPLOYED_MODE,
+    WK_SECURE_BOOT,
+    WK_SIGNATURE_SUPPORT,
+    WK_PK,
+    WK_KEK,
+    WK_DB,
+    WK_DBX,
+    WK_DBT,
+    WK_COUNT,
+    WK_NONE = WK_COUNT,
+};
+
+/* The guest cannot write the variable. */
+#define WK_READ_ONLY        (1 << 0)
+/* A key variable which must be written with time based authentication. */
+#define WK_KEY              (1 << 1)
+/* A signature database (db, dbx or dbt). */
+#define WK_SIGNATURE_DB     (1 << 2)
+/* Holds trust anchors; see trust_generation. */
+#define WK_TRUST_ANCHOR     (1 << 3)
+
+static const struct {
+    const uint8_t *name;
+    UINTN name_len;
+    const EFI_GUID *guid;
+    unsigned int flags;
+} well_known[WK_COUNT] = {
+    [WK_SETUP_MODE] = {EFI_SETUP_MODE_NAME, sizeof(EFI_SETUP_MODE_NAME),
+                       &gEfiGlobalVariableGuid, WK_READ_ONLY},
+    [WK_AUDIT_MODE] = {EFI_AUDIT_MODE_NAME, sizeof(EFI_AUDIT_MODE_NAME),
+                       &gEfiGlobalVariableGuid, WK_READ_ONLY},
+    [WK_DEPLOYED_MODE] = {EFI_DEPLOYED_MODE_NAME, sizeof(EFI_DEPLOYED_MODE_NAME),
+                          &gEfiGlobalVariableGuid, WK_READ_ONLY},
+    [WK_SECURE_BOOT] = {EFI_SECURE_BOOT_MODE_NAME, sizeof(EFI_SECURE_BOOT_MODE_NAME),
+                        &gEfiGlobalVariableGuid, WK_READ_ONLY},
+    [WK_SIGNATURE_SUPPORT] = {EFI_SIGNATURE_SUPPORT_NAME,
+                              sizeof(EFI_SIGNATURE_SUPPORT_NAME),
+                              &gEfiGlobalVariableGuid, WK_READ_ONLY},
+    [WK_PK] = {EFI_PLATFORM_KEY_NAME, sizeof(EFI_PLATFORM_KEY_NAME),
+               &gEfiGlobalVariableGuid, WK_KEY | WK_TRUST_ANCHOR},
+    [WK_KEK] = {EFI_KEY_EXCHANGE_KEY_NAME, sizeof(EFI_KEY_EXCHANGE_KEY_NAME),
+                &gEfiGlobalVariableGuid, WK_KEY | WK_TRUST_ANCHOR},
+    [WK_DB] = {EFI_IMAGE_SECURITY_DATABASE, sizeof(EFI_IMAGE_SECURITY_DATABASE),
+               &gEfiImageSecurityDatabaseGuid,
+               WK_SIGNATURE_DB | WK_TRUST_ANCHOR},
+    [WK_DBX] = {EFI_IMAGE_SECURITY_DATABASE1, sizeof(EFI_IMAGE_SECURITY_DATABASE1),
+                &gEfiImageSecurityDatabaseGuid, WK_SIGNATURE_DB},
+    [WK_DBT] = {EFI_IMAGE_SECURITY_DATABASE2, sizeof(EFI_IMAGE_SECURITY_DATABASE2),
+                &gEfiImageSecurityDatabaseGuid, WK_SIGNATURE_DB},
+};
+
 #define AUTH_PATH_PREFIX "/var/lib/varstored"
 
 /*
@@ -168,71 +257,671 @@ struct efi_variable *var_list;
 bool secure_boot_enable;
 bool auth_enforce = true;
 bool persistent = true;
+bool low_memory;
+
+/*
+ * Index of var_list keyed on (name, guid) so that looking up a variable does
+ * not require walking the whole list. Each bucket is a singly linked chain
+ * through efi_variable.index_next.
+ */
+static struct efi_variable *var_index[VARIABLE_INDEX_SIZE];
+
+/*
+ * Storage used by var_list as counted against TOTAL_LIMIT. Kept up to date
+ * as variables are linked, unlinked and resized so that checking the limit
+ * does not require walking the list.
+ */
+static uint64_t space_used;
+
+/*
+ * Bumped whenever one of the variables holding trust anchors (PK, KEK or db)
+ * is added, replaced or removed so that anything derived from them can tell
+ * when it is stale.
+ */
+static unsigned int trust_generation;
 
 static uint64_t
-get_space_usage(void)
+variable_size(const struct efi_variable *l)
+{
+    return l->name_len + l->data_len + VARIABLE_SIZE_OVERHEAD;
+}
+
+/* FNV-1a over the name followed by the guid. */
+static uint32_t
+variable_hash(const uint8_t *name, UINTN name_len, const EFI_GUID *guid)
+{
+    uint32_t hash = 2166136261u;
+    UINTN i;
+
+    for (i = 0; i < name_len; i++)
+        hash = (hash ^ name[i]) * 16777619u;
+    for (i = 0; i < GUID_LEN; i++)
+        hash = (hash ^ guid->data[i]) * 16777619u;
+
+    return hash;
+}
+
+static struct efi_variable **
+index_bucket(uint32_t hash)
+{
+    return &var_index[hash & (VARIABLE_INDEX_SIZE - 1)];
+}
+
+struct efi_variable *
+find_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid)
 {
     struct efi_variable *l;
-    uint64_t total = 0;
+    uint32_t hash = variable_hash(name, name_len, guid);
 
-    l = var_list;
-    while (l) {
-        total += l->name_len + l->data_len + VARIABLE_SIZE_OVERHEAD;
-        l = l->next;
+    for (l = *index_bucket(hash); l; l = l->index_next) {
+        if (l->hash == hash &&
+                l->name_len == name_len &&
+                !memcmp(l->name, name, name_len) &&
+                !memcmp(&l->guid, guid, GUID_LEN))
+            return l;
     }
 
-    return total;
+    return NULL;
 }
 
-/* A limited version of SetVariable for internal use. */
-EFI_STATUS
-internal_set_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
-                      const uint8_t *data, UINTN data_len, UINT32 attr)
+static void
+index_add(struct efi_variable *l)
+{
+    struct efi_variable **bucket;
+
+    l->hash = variable_hash(l->name, l->name_len, &l->guid);
+    bucket = index_bucket(l->hash);
+    l->index_next = *bucket;
+    *bucket = l;
+}
+
+static void
+index_del(struct efi_variable *l)
+{
+    struct efi_variable **p = index_bucket(l->hash);
+
+    while (*p) {
+        if (*p == l) {
+            *p = l->index_next;
+            break;
+        }
+        p = &(*p)->index_next;
+    }
+    l->index_next = NULL;
+}
+
+/*
+ * Variables with fixed names that are looked up by handle. The names are
+ * the same for every domain; handle_var holds the variable each handle
+ * currently refers to, kept up to date as variables are linked, removed and
+ * moved so that internal_variable_ref() does not have to search for it.
+ */
+static struct {
+    const uint8_t *name;
+    UINTN name_len;
+    const EFI_GUID *guid;
+    uint32_t hash;
+} handles[MAX_VARIABLE_HANDLES];
+static int handle_count;
+static struct efi_variable *handle_var[MAX_VARIABLE_HANDLES];
+
+static void
+handle_link(struct efi_variable *l)
+{
+    int i;
+
+    for (i = 0; i < handle_count; i++) {
+        if (handles[i].hash == l->hash &&
+                handles[i].name_len == l->name_len &&
+                !memcmp(handles[i].name, l->name, l->name_len) &&
+                !memcmp(handles[i].guid, &l->guid, GUID_LEN))
+            handle_var[i] = l;
+    }
+}
+
+static void
+handle_move(struct efi_variable *old, struct efi_variable *new)
+{
+    int i;
+
+    for (i = 0; i < handle_count; i++) {
+        if (handle_var[i] == old)
+            handle_var[i] = new;
+    }
+}
+
+/*
+ * Returns a handle for the variable with the given name and GUID, which must
+ * stay valid for the life of the process, or -1 if there are too many.
+ */
+int
+internal_variable_handle(const uint8_t *name, UINTN name_len,
+                         const EFI_GUID *guid)
+{
+    int i;
+
+    for (i = 0; i < handle_count; i++) {
+        if (handles[i].name_len == name_len &&
+                !memcmp(handles[i].name, name, name_len) &&
+                !memcmp(handles[i].guid, guid, GUID_LEN))
+            return i;
+    }
+
+    if (handle_count == MAX_VARIABLE_HANDLES)
+        return -1;
+
+    handles[i].name = name;
+    handles[i].name_len = name_len;
+    handles[i].guid = guid;
+    handles[i].hash = variable_hash(name, name_len, guid);
+    handle_var[i] = find_variable(name, name_len, guid);
+    handle_count++;
+
+    return i;
+}
+
+/*
+ * Returns the variable a handle refers to, or NULL if it does not exist or
+ * the handle is invalid. The variable is borrowed: it must not be modified
+ * and is only valid until the next change to any variable.
+ */
+static struct efi_variable *
+handle_resolve(int handle)
+{
+    if (handle < 0 || handle >= handle_count)
+        return NULL;
+
+    /*
+     * Variables loaded in another domain before the handle was created are
+     * not tracked yet.
+     */
+    if (!handle_var[handle])
+        handle_var[handle] = find_variable(handles[handle].name,
+                                           handles[handle].name_len,
+                                           handles[handle].guid);
+
+#ifdef DEBUG_CHECKS
+    assert(handle_var[handle] == find_variable(handles[handle].name,
+                                               handles[handle].name_len,
+                                               handles[handle].guid));
+#endif
+
+    return handle_var[handle];
+}
+
+const struct efi_variable *
+internal_variable_ref(int handle)
+{
+    return handle_resolve(handle);
+}
+
+static int well_known_handle[WK_COUNT];
+static uint32_t well_known_hash[WK_COUNT];
+static bool well_known_ready;
+
+static void
+setup_well_known(void)
+{
+    int i;
+
+    for (i = 0; i < WK_COUNT; i++) {
+        well_known_handle[i] = internal_variable_handle(well_known[i].name,
+                                                        well_known[i].name_len,
+                                                        well_known[i].guid);
+        assert(well_known_handle[i] >= 0);
+        well_known_hash[i] = variable_hash(well_known[i].name,
+                                           well_known[i].name_len,
+                                           well_known[i].guid);
+    }
+    well_known_ready = true;
+}
+
+/* Returns which well known variable a (name, GUID) with the given hash is. */
+static enum well_known_var
+well_known_lookup(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+                  uint32_t hash)
+{
+    int i;
+
+    if (!well_known_ready)
+        setup_well_known();
+
+    for (i = 0; i < WK_COUNT; i++) {
+        if (well_known_hash[i] == hash &&
+                well_known[i].name_len == name_len &&
+                !memcmp(well_known[i].name, name, name_len) &&
+                !memcmp(well_known[i].guid, guid, GUID_LEN))
+            return i;
+    }
+
+    return WK_NONE;
+}
+
+static enum well_known_var
+classify_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid)
+{
+    return well_known_lookup(name, name_len, guid,
+                             variable_hash(name, name_len, guid));
+}
+
+static unsigned int
+well_known_flags(enum well_known_var wk)
+{
+    return wk == WK_NONE ? 0 : well_known[wk].flags;
+}
+
+/*
+ * Whether a write to the variable has its payload checked by
+ * check_signature_list_format.
+ */
+static bool
+signature_list_var(enum well_known_var wk, UINT32 attr)
+{
+    return (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+           (wk == WK_PK || wk == WK_KEK ||
+            (well_known_flags(wk) & WK_SIGNATURE_DB));
+}
+
+static struct efi_variable *
+well_known_var(enum well_known_var wk)
+{
+    if (!well_known_ready)
+        setup_well_known();
+
+    return handle_resolve(well_known_handle[wk]);
+}
+
+static void
+check_trust_anchor_change(const struct efi_variable *l)
+{
+    if (well_known_flags(well_known_lookup(l->name, l->name_len, &l->guid,
+                                           l->hash)) & WK_TRUST_ANCHOR)
+        trust_generation++;
+}
+
+/*
+ * The variable most recently returned by GetNextVariableName. If it is
+ * removed, its key and successor are kept in enum_resume so that a caller
+ * which deletes variables as it enumerates them can carry on from where it
+ * left off. enum_resume.next is kept pointing at a live variable (or NULL at
+ * the end of the list) as further variables are removed.
+ */
+static struct efi_variable *enum_last;
+static struct {
+    uint8_t *name;
+    UINTN name_len;
+    EFI_GUID guid;
+    UINT32 attributes;
+    struct efi_variable *next;
+} enum_resume;
+
+static void
+enum_forget(struct efi_variable *l)
+{
+    if (l == enum_resume.next)
+        enum_resume.next = l->next;
+
+    if (l != enum_last)
+        return;
+
+    enum_last = NULL;
+    free(enum_resume.name);
+    enum_resume.name = malloc(l->name_len);
+    if (!enum_resume.name)
+        return;
+    memcpy(enum_resume.name, l->name, l->name_len);
+    enum_resume.name_len = l->name_len;
+    enum_resume.guid = l->guid;
+    enum_resume.attributes = l->attributes;
+    enum_resume.next = l->next;
+}
+
+/* Link l into var_list after prev, or at the head if prev is NULL. */
+static void
+link_variable(struct efi_variable *l, struct efi_variable *prev)
+{
+    l->prev = prev;
+    if (prev) {
+        l->next = prev->next;
+        prev->next = l;
+    } else {
+        l->next = var_list;
+        var_list = l;
+    }
+    if (l->next)
+        l->next->prev = l;
+    index_add(l);
+    handle_link(l);
+    space_used += variable_size(l);
+    check_trust_anchor_change(l);
+}
+
+/* Insert a new variable at the head of var_list. */
+void
+insert_variable(struct efi_variable *l)
+{
+    link_variable(l, NULL);
+}
+
+void
+remove_variable(struct efi_variable *l)
+{
+    enum_forget(l);
+    if (l->prev)
+        l->prev->next = l->next;
+    else
+        var_list = l->next;
+    if (l->next)
+        l->next->prev = l->prev;
+    index_del(l);
+    handle_move(l, NULL);
+    space_used -= variable_size(l);
+    check_trust_anchor_change(l);
+    l->next = NULL;
+    l->prev = NULL;
+}
+
+/* Put new in the place old occupies in var_list and the index. */
+void
+replace_variable(struct efi_variable *old, struct efi_variable *new)
+{
+    struct efi_variable *prev = old->prev;
+
+    remove_variable(old);
+    link_variable(new, prev);
+}
+
+/*
+ * Each variable is a single record holding the efi_variable followed by its
+ * name and data. Records are carved sequentially out of an arena with room
+ * for everything TOTAL_LIMIT allows plus a maximum sized record being built
+ * to replace an existing one. Freed records are reclaimed by compacting the
+ * arena between requests. If the arena is exhausted (e.g. internal variables
+ * which are not counted against TOTAL_LIMIT), records fall back to malloc.
+ */
+struct var_record {
+    size_t size; /* Size of the whole record. */
+    bool live;
+    bool external; /* The name and data are not in the payload. */
+    /* Leading bytes of the data known to be valid signature lists. */
+    UINTN verified_len;
+    struct efi_variable var;
+    uint8_t payload[];
+};
+
+#define RECORD_SIZE(name_len, data_len) \
+    ((offsetof(struct var_record, payload) + (name_len) + (data_len) + 7) & ~(size_t)7)
+#define ARENA_SIZE \
+    (TOTAL_LIMIT + MAX_VARIABLE_COUNT * RECORD_SIZE(0, 0) + \
+     RECORD_SIZE(NAME_LIMIT, DATA_LIMIT))
+/* Compact once this many bytes of the arena are taken by freed records. */
+#define ARENA_COMPACT_THRESHOLD (16 * PAGE_SIZE)
+
+static uint8_t *arena;
+static size_t arena_top;
+static size_t arena_dead;
+
+/*
+ * The signature data of the last variable that signature lists were appended
+ * to, in an open-addressed hash set so that duplicates are found in linear
+ * time. Each used slot holds the offsets in sig_cache.var's data of an
+ * EFI_SIGNATURE_DATA and of the list it is in. Variables are never modified,
+ * so the set stays valid until the variable is freed. An append carries it
+ * over to the variable that replaces sig_cache.var.
+ */
+struct sig_slot {
+    uint32_t list; /* Offset of the EFI_SIGNATURE_LIST. */
+    uint32_t cert; /* Offset of the EFI_SIGNATURE_DATA plus 1, 0 if unused. */
+};
+
+static struct {
+    const struct efi_variable *var;
+    struct sig_slot *slots;
+    size_t size; /* Number of slots, a power of 2. */
+    size_t count;
+} sig_cache;
+
+static struct var_record *
+to_record(struct efi_variable *l)
+{
+    return (struct var_record *)((uint8_t *)l - offsetof(struct var_record, var));
+}
+
+static bool
+in_arena(const void *p)
+{
+    return arena && (const uint8_t *)p >= arena &&
+           (const uint8_t *)p < arena + ARENA_SIZE;
+}
+
+/*
+ * Allocate a variable with room for data_len bytes of data. The name is
+ * copied in; the data is left for the caller to fill in.
+ */
+struct efi_variable *
+alloc_efi_variable(const uint8_t *name, UINTN name_len, UINTN data_len)
+{
+    struct var_record *r;
+    size_t size = RECORD_SIZE(name_len, data_len);
+
+    if (!arena) {
+        arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED)
+            arena = NULL;
+    }
+
+    if (arena && ARENA_SIZE - arena_top >= size) {
+        r = (struct var_record *)(arena + arena_top);
+        arena_top += size;
+    } else {
+        r = malloc(size);
+        if (!r)
+            return NULL;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->size = size;
+    r->live = true;
+    r->var.name = r->payload;
+    r->var.name_len = name_len;
+    memcpy(r->var.name, name, name_len);
+    r->var.data = r->payload + name_len;
+    r->var.data_len = data_len;
+
+    return &r->var;
+}
+
+/*
+ * Allocate a variable whose name and data are used in place rather than
+ * copied. Variables are never modified in place, so they must stay valid and
+ * unchanged until the variable is freed.
+ */
+struct efi_variable *
+alloc_efi_variable_view(const uint8_t *name, UINTN name_len,
+                        const uint8_t *data, UINTN data_len)
 {
     struct efi_variable *l;
-    uint8_t *new_data;
 
-    new_data = malloc(data_len);
-    if (!new_data)
-        return EFI_DEVICE_ERROR;
-    memcpy(new_data, data, data_len);
+    l = alloc_efi_variable(name, 0, 0);
+    if (!l)
+        return NULL;
 
-    l = var_list;
-    while (l) {
-        if (l->name_len == name_len &&
-                !memcmp(l->name, name, name_len) &&
-                !memcmp(&l->guid, guid, GUID_LEN)) {
-            free(l->data);
-            l->data = new_data;
-            l->data_len = data_len;
-            return EFI_SUCCESS;
+    to_record(l)->external = true;
+    l->name = (uint8_t *)name;
+    l->name_len = name_len;
+    l->data = (uint8_t *)data;
+    l->data_len = data_len;
+
+    return l;
+}
+
+/* Copy everything about a variable except its name and data. */
+static void
+copy_variable_info(struct efi_variable *dst, const struct efi_variable *src)
+{
+    dst->guid = src->guid;
+    dst->attributes = src->attributes;
+    dst->timestamp = src->timestamp;
+    memcpy(dst->cert, src->cert, sizeof(dst->cert));
+}
+
+void
+free_efi_variable(struct efi_variable *l)
+{
+    struct var_record *r;
+
+    if (!l)
+        return;
+
+    if (l == sig_cache.var)
+        sig_cache.var = NULL;
+
+    r = to_record(l);
+    if (!in_arena(r)) {
+        free(r);
+        return;
+    }
+
+    r->live = false;
+    if ((uint8_t *)r + r->size == arena + arena_top)
+        arena_top -= r->size;
+    else
+        arena_dead += r->size;
+}
+
+/* Fix up every reference to a record that has moved from old to new. */
+static void
+relocate_variable(struct efi_variable *old, struct efi_variable *new)
+{
+    struct efi_variable **p;
+
+    if (!to_record(new)->external) {
+        new->name = to_record(new)->payload;
+        new->data = new->name + new->name_len;
+    }
+
+    if (new->prev)
+        new->prev->next = new;
+    else if (var_list == old)
+        var_list = new;
+    if (new->next)
+        new->next->prev = new;
+
+    for (p = index_bucket(new->hash); *p; p = &(*p)->index_next) {
+        if (*p == old) {
+            *p = new;
+            break;
         }
-        l = l->next;
     }
 
-    l = calloc(1, sizeof *l);
-    if (!l) {
-        free(new_data);
-        return EFI_DEVICE_ERROR;
+    handle_move(old, new);
+    if (sig_cache.var == old)
+        sig_cache.var = new;
+    if (enum_last == old)
+        enum_last = new;
+    if (enum_resume.next == old)
+        enum_resume.next = new;
+}
+
+/*
+ * Slide the live records down over the freed ones and give the pages left
+ * unused at the end of the arena back to the system. This moves variables so
+ * it must only be called when no references to them are held outside
+ * var_list, the index and the enumeration state.
+ */
+static void
+compact_variables(void)
+{
+    size_t src = 0, dst = 0, size, keep;
+    struct var_record *r;
+
+    if (!arena_dead)
+        return;
+
+    while (src < arena_top) {
+        r = (struct var_record *)(arena + src);
+        size = r->size;
+        if (r->live) {
+            if (src != dst) {
+                memmove(arena + dst, r, size);
+                relocate_variable(&r->var,
+                                  &((struct var_record *)(arena + dst))->var);
+            }
+            dst += size;
+        }
+        src += size;
     }
-    l->name = malloc(name_len);
-    if (!l->name) {
-        free(l);
-        free(new_data);
+
+    keep = (dst + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (keep < arena_top)
+        madvise(arena + keep, arena_top - keep, MADV_DONTNEED);
+
+    arena_top = dst;
+    arena_dead = 0;
+}
+
+static uint64_t
+get_space_usage(void)
+{
+#ifdef DEBUG_CHECKS
+    struct efi_variable *l;
+    uint64_t total = 0;
+
+    for (l = var_list; l; l = l->next)
+        total += variable_size(l);
+    assert(total == space_used);
+#endif
+
+    return space_used;
+}
+
+/* Sets a variable for internal use, where old is its current value if any. */
+static EFI_STATUS
+set_internal_variable(struct efi_variable *old,
+                      const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+                      const uint8_t *data, UINTN data_len, UINT32 attr)
+{
+    struct efi_variable *l;
+
+    l = alloc_efi_variable(name, name_len, data_len);
+    if (!l)
         return EFI_DEVICE_ERROR;
+    memcpy(l->data, data, data_len);
+
+    if (old) {
+        copy_variable_info(l, old);
+        replace_variable(old, l);
+        free_efi_variable(old);
+        return EFI_SUCCESS;
     }
-    memcpy(l->name, name, name_len);
-    l->name_len = name_len;
+
     memcpy(&l->guid, guid, GUID_LEN);
-    l->data = new_data;
-    l->data_len = data_len;
     l->attributes = attr;
-    l->next = var_list;
-    var_list = l;
+    insert_variable(l);
 
     return EFI_SUCCESS;
 }
 
+/* A limited version of SetVariable for internal use. */
+EFI_STATUS
+internal_set_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+                      const uint8_t *data, UINTN data_len, UINT32 attr)
+{
+    return set_internal_variable(find_variable(name, name_len, guid),
+                                 name, name_len, guid, data, data_len, attr);
+}
+
+/* Sets one of the single byte Secure Boot mode variables. */
+static EFI_STATUS
+set_mode_variable(enum well_known_var wk, uint8_t value)
+{
+    return set_internal_variable(well_known_var(wk),
+                                 well_known[wk].name, well_known[wk].name_len,
+                                 well_known[wk].guid, &value, sizeof(value),
+                                 ATTR_BR);
+}
+
 /* A limited version of GetVariable for internal use. */
 EFI_STATUS
 internal_get_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
@@ -240,29 +929,24 @@ internal_get_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
 {
     struct efi_variable *l;
 
-    l = var_list;
-    while (l) {
-        if (l->name_len == name_len &&
-                !memcmp(l->name, name, name_len) &&
-                !memcmp(&l->guid, guid, GUID_LEN)) {
+    l = find_variable(name, name_len, guid);
+    if (!l)
+        return EFI_NOT_FOUND;
 
-            *data = malloc(l->data_len);
-            if (!*data)
-                return EFI_DEVICE_ERROR;
-            memcpy(*data, l->data, l->data_len);
-            *data_len = l->data_len;
-            return EFI_SUCCESS;
-        }
-        l = l->next;
-    }
+    *data = malloc(l->data_len);
+    if (!*data)
+        return EFI_DEVICE_ERROR;
+    memcpy(*data, l->data, l->data_len);
+    *data_len = l->data_len;
 
-    return EFI_NOT_FOUND;
+    return EFI_SUCCESS;
 }
 
 static void
 do_get_variable(uint8_t *comm_buf)
 {
-    uint8_t *ptr, *name;
+    uint8_t *ptr;
+    const uint8_t *name;
     EFI_GUID guid;
     UINTN name_len, data_len;
     BOOLEAN at_runtime;
@@ -271,7 +955,8 @@ do_get_variable(uint8_t *comm_buf)
     ptr = comm_buf;
     unserialize_uint32(&ptr); /* version */
     unserialize_command(&ptr);
-    name = unserialize_data(&ptr, &name_len, NAME_LIMIT);
+    name = unserialize_data_view(&ptr, comm_buf + SHMEM_SIZE, &name_len,
+                                 NAME_LIMIT);
     if (!name) {
         serialize_result(&comm_buf, name_len == 0 ? EFI_NOT_FOUND : EFI_DEVICE_ERROR);
         return;
@@ -280,33 +965,22 @@ do_get_variable(uint8_t *comm_buf)
     data_len = unserialize_uintn(&ptr);
     at_runtime = unserialize_boolean(&ptr);
 
+    /* name points into comm_buf so it must not be used after this. */
     ptr = comm_buf;
-    l = var_list;
-    while (l) {
-        if (l->name_len == name_len &&
-                !memcmp(l->name, name, name_len) &&
-                !memcmp(&l->guid, &guid, GUID_LEN)) {
-            if (at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS)) {
-                l = l->next;
-                continue;
-            }
-            if (data_len < l->data_len) {
-                serialize_result(&ptr, EFI_BUFFER_TOO_SMALL);
-                serialize_uintn(&ptr, l->data_len);
-            } else {
-                serialize_result(&ptr, EFI_SUCCESS);
-                serialize_uint32(&ptr, l->attributes);
-                serialize_data(&ptr, l->data, l->data_len);
-            }
-            goto out;
-        }
-        l = l->next;
-    }
-
-    serialize_result(&ptr, EFI_NOT_FOUND);
+    l = find_variable(name, name_len, &guid);
+    if (l && at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS))
+        l = NULL;
 
-out:
-    free(name);
+    if (!l) {
+        serialize_result(&ptr, EFI_NOT_FOUND);
+    } else if (data_len < l->data_len) {
+        serialize_result(&ptr, EFI_BUFFER_TOO_SMALL);
+        serialize_uintn(&ptr, l->data_len);
+    } else {
+        serialize_result(&ptr, EFI_SUCCESS);
+        serialize_uint32(&ptr, l->attributes);
+        serialize_data(&ptr, l->data, l->data_len);
+    }
 }
 
 static X509 *
@@ -551,62 +1225,68 @@ wrap_pkcs7_data(const uint8_t *p7data, UINTN p7_len,
     return EFI_SUCCESS;
 }
 
-/*
- * Verify the validity of PKCS#7 data.
- * Adapted from edk2.
- */
+/* Make a store which trusts only trusted_cert, set up for pkcs7_verify(). */
 static EFI_STATUS
-pkcs7_verify(const uint8_t *p7data, UINTN p7_len, X509 *trusted_cert,
-             uint8_t *verify_buf, UINTN verify_len)
+new_trust_store(X509 *trusted_cert, X509_STORE **store)
 {
-    EFI_STATUS status;
-    const uint8_t *ptr;
-    PKCS7 *pkcs7 = NULL;
-    BIO *data_bio = NULL;
-    X509_STORE *cert_store = NULL;
-
-    ptr = p7data;
-    pkcs7 = d2i_PKCS7(NULL, &ptr, (int)p7_len);
-    if (!pkcs7) {
-        status = EFI_SECURITY_VIOLATION;
-        goto out;
-    }
-
-    if (!PKCS7_type_is_signed(pkcs7)) {
-        status = EFI_SECURITY_VIOLATION;
-        goto out;
-    }
+    X509_STORE *cert_store;
 
     cert_store = X509_STORE_new();
-    if (!cert_store) {
-        status = EFI_DEVICE_ERROR;
-        goto out;
-    }
+    if (!cert_store)
+        return EFI_DEVICE_ERROR;
 
 #ifndef X509_V_FLAG_NO_CHECK_TIME
     cert_store->verify_cb = X509_verify_cb;
 #endif
 
     if (!(X509_STORE_add_cert(cert_store, trusted_cert))) {
-        status = EFI_SECURITY_VIOLATION;
-        goto out;
+        X509_STORE_free(cert_store);
+        return EFI_SECURITY_VIOLATION;
     }
 
-    data_bio = BIO_new(BIO_s_mem());
-    if (!data_bio) {
-        status = EFI_DEVICE_ERROR;
-        goto out;
+    X509_STORE_set_flags(cert_store,
+                         X509_V_FLAG_PARTIAL_CHAIN | OPENSSL_NO_CHECK_TIME);
+    X509_STORE_set_purpose(cert_store, X509_PURPOSE_ANY);
+
+    *store = cert_store;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS
+pkcs7_parse_signed(const uint8_t *p7data, UINTN p7_len, PKCS7 **pkcs7)
+{
+    const uint8_t *ptr = p7data;
+
+    *pkcs7 = d2i_PKCS7(NULL, &ptr, (int)p7_len);
+    if (!*pkcs7)
+        return EFI_SECURITY_VIOLATION;
+
+    if (!PKCS7_type_is_signed(*pkcs7)) {
+        PKCS7_free(*pkcs7);
+        *pkcs7 = NULL;
+        return EFI_SECURITY_VIOLATION;
     }
 
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS
+pkcs7_verify_store(PKCS7 *pkcs7, X509_STORE *cert_store,
+                   uint8_t *verify_buf, UINTN verify_len)
+{
+    EFI_STATUS status;
+    BIO *data_bio;
+
+    data_bio = BIO_new(BIO_s_mem());
+    if (!data_bio)
+        return EFI_DEVICE_ERROR;
+
     if (BIO_write(data_bio, verify_buf, (int)verify_len) != verify_len) {
         status = EFI_SECURITY_VIOLATION;
         goto out;
     }
 
-    X509_STORE_set_flags(cert_store,
-                         X509_V_FLAG_PARTIAL_CHAIN | OPENSSL_NO_CHECK_TIME);
-    X509_STORE_set_purpose(cert_store, X509_PURPOSE_ANY);
-
+    TRACE(pkcs7__verify__start, verify_len);
     if (PKCS7_verify(pkcs7, NULL, cert_store, data_bio, NULL, PKCS7_BINARY))
         status = EFI_SUCCESS;
     else {
@@ -617,14 +1297,131 @@ pkcs7_verify(const uint8_t *p7data, UINTN p7_len, X509 *trusted_cert,
         }
         status = EFI_SECURITY_VIOLATION;
     }
+    TRACE(pkcs7__verify__done, status);
 
 out:
     BIO_free(data_bio);
+    return status;
+}
+
+/*
+ * Verify the validity of PKCS#7 data.
+ * Adapted from edk2.
+ */
+static EFI_STATUS
+pkcs7_verify(const uint8_t *p7data, UINTN p7_len, X509 *trusted_cert,
+             uint8_t *verify_buf, UINTN verify_len)
+{
+    EFI_STATUS status;
+    PKCS7 *pkcs7 = NULL;
+    X509_STORE *cert_store = NULL;
+
+    status = pkcs7_parse_signed(p7data, p7_len, &pkcs7);
+    if (status != EFI_SUCCESS)
+        goto out;
+
+    status = new_trust_store(trusted_cert, &cert_store);
+    if (status != EFI_SUCCESS)
+        goto out;
+
+    status = pkcs7_verify_store(pkcs7, cert_store, verify_buf, verify_len);
+
+out:
     X509_STORE_free(cert_store);
     PKCS7_free(pkcs7);
     return status;
 }
 
+/*
+ * Trust stores for each X509 certificate in KEK, in the order they appear.
+ * They are built the first time they are needed and kept until KEK (or
+ * another trust anchor variable) changes.
+ */
+static struct {
+    bool valid;
+    unsigned int generation;
+    X509_STORE **stores;
+    int count;
+} kek_stores;
+
+static void
+free_kek_stores(void)
+{
+    int i;
+
+    for (i = 0; i < kek_stores.count; i++)
+        X509_STORE_free(kek_stores.stores[i]);
+    free(kek_stores.stores);
+    kek_stores.stores = NULL;
+    kek_stores.count = 0;
+    kek_stores.valid = false;
+}
+
+static EFI_STATUS
+load_kek_stores(void)
+{
+    struct efi_variable *l;
+    EFI_SIGNATURE_LIST *cert_list;
+    EFI_SIGNATURE_DATA *cert;
+    X509_STORE **stores, *store;
+    X509 *trusted_cert;
+    int remaining, i, count;
+
+    if (kek_stores.valid && kek_stores.generation == trust_generation)
+        return EFI_SUCCESS;
+
+    free_kek_stores();
+
+    l = well_known_var(WK_KEK);
+    if (!l)
+        return EFI_SECURITY_VIOLATION;
+
+    remaining = (UINT32)l->data_len;
+    /*
+     * cert_list (i.e. the contents of KEK) was verified to be valid when
+     * it was written. Therefore no checking of validity is needed here.
+     */
+    cert_list = (EFI_SIGNATURE_LIST *)l->data;
+    while (remaining > 0) {
+        if (!memcmp(&cert_list->SignatureType, &gEfiCertX509Guid, GUID_LEN)) {
+            cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert_list +
+                   sizeof(EFI_SIGNATURE_LIST) + cert_list->SignatureHeaderSize);
+            count  = (cert_list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
+                      cert_list->SignatureHeaderSize) / cert_list->SignatureSize;
+
+            for (i = 0; i < count; i++) {
+                trusted_cert = X509_from_buf(cert->SignatureData,
+                    cert_list->SignatureSize - EFI_SIG_DATA_SIZE);
+                if (trusted_cert) {
+                    if (new_trust_store(trusted_cert, &store) == EFI_SUCCESS) {
+                        stores = realloc(kek_stores.stores,
+                                         (kek_stores.count + 1) * sizeof(*stores));
+                        if (!stores) {
+                            X509_STORE_free(store);
+                            X509_free(trusted_cert);
+                            free_kek_stores();
+                            return EFI_DEVICE_ERROR;
+                        }
+                        stores[kek_stores.count++] = store;
+                        kek_stores.stores = stores;
+                    }
+                    X509_free(trusted_cert);
+                }
+                cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert +
+                       cert_list->SignatureSize);
+            }
+        }
+        remaining -= cert_list->SignatureListSize;
+        cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)cert_list +
+                    cert_list->SignatureListSize);
+    }
+
+    kek_stores.valid = true;
+    kek_stores.generation = trust_generation;
+
+    return EFI_SUCCESS;
+}
+
 /*
  * Get the signer's certificates from PKCS#7 signed data.
  * Adapted from edk2.
@@ -685,15 +1482,31 @@ enum auth_type {
     AUTH_TYPE_NONE,
 };
 
+/*
+ * If cur is given, the part of data that is the same as the verified prefix
+ * of cur is not checked again. This must not be used for the PK since the
+ * whole list is needed to count the entries.
+ */
 static EFI_STATUS
-check_signature_list_format(uint8_t *data, UINTN data_len, bool is_pk)
+check_signature_list_format(uint8_t *data, UINTN data_len, bool is_pk,
+                            struct efi_variable *cur)
 {
     EFI_SIGNATURE_LIST *sig_list;
+    const EFI_SIGNATURE_ITEM *item;
     int count;
     UINTN remaining, list_items;
-    int i;
     size_t list_body_size;
 
+    if (cur) {
+        UINTN verified = to_record(cur)->verified_len;
+
+        if (verified != 0 && verified <= data_len &&
+                !memcmp(data, cur->data, verified)) {
+            data += verified;
+            data_len -= verified;
+        }
+    }
+
     if (data_len == 0)
         return EFI_SUCCESS;
 
@@ -702,21 +1515,15 @@ check_signature_list_format(uint8_t *data, UINTN data_len, bool is_pk)
     remaining = data_len;
 
     while ((remaining >= sizeof(*sig_list)) &&
-           (remaining >= sig_list->SignatureListSize)) {
-        for (i = 0; i < NUM_OF_SUPPORTED_SIG_ITEMS; i++) {
-            if (!memcmp(&sig_list->SignatureType, &mSupportSigItem[i].SigType,
-                        GUID_LEN)) {
-                if (mSupportSigItem[i].SigDataSize != (UINT32)~0 &&
-                        (sig_list->SignatureSize - GUID_LEN) != mSupportSigItem[i].SigDataSize)
-                    return EFI_INVALID_PARAMETER;
-                if (mSupportSigItem[i].SigHeaderSize != ((UINT32) ~0) &&
-                        sig_list->SignatureHeaderSize != mSupportSigItem[i].SigHeaderSize)
-                    return EFI_INVALID_PARAMETER;
-                break;
-            }
-        }
-
-        if (i == NUM_OF_SUPPORTED_SIG_ITEMS)
+           (remaining >= sig_list->SignatureListSize)) {
+        item = find_sig_item(&sig_list->SignatureType);
+        if (!item)
+            return EFI_INVALID_PARAMETER;
+        if (item->SigDataSize != (UINT32)~0 &&
+                (sig_list->SignatureSize - GUID_LEN) != item->SigDataSize)
+            return EFI_INVALID_PARAMETER;
+        if (item->SigHeaderSize != ((UINT32) ~0) &&
+                sig_list->SignatureHeaderSize != item->SigHeaderSize)
             return EFI_INVALID_PARAMETER;
 
         /*
@@ -796,6 +1603,68 @@ check_signature_list_format(uint8_t *data, UINTN data_len, bool is_pk)
     return EFI_SUCCESS;
 }
 
+/*
+ * Results of signature verification, so that re-applying an identical
+ * authenticated write (e.g. a retried dbx update) does not need to repeat the
+ * PKCS#7 work. Entries are keyed on a hash of everything that was verified
+ * and are only valid for the trust_generation they were made in. The
+ * timestamp checks against the current variable are not cached and neither
+ * are failures which depend on the current variable.
+ */
+#define VERIFY_CACHE_SIZE 16
+
+static struct {
+    bool valid;
+    unsigned int generation;
+    uint8_t key[SHA256_DIGEST_SIZE];
+    EFI_STATUS status;
+    uint8_t digest[SHA256_DIGEST_SIZE]; /* Signer digest for AUTH_TYPE_PRIVATE */
+} verify_cache[VERIFY_CACHE_SIZE];
+static unsigned int verify_cache_next;
+
+static bool
+verify_cache_key(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+                 UINT32 attr, enum auth_type auth_type,
+                 const uint8_t *data, UINTN data_len, uint8_t *key)
+{
+    SHA256_CTX ctx;
+
+    return SHA256_Init(&ctx) &&
+           SHA256_Update(&ctx, &auth_type, sizeof(auth_type)) &&
+           SHA256_Update(&ctx, name, name_len) &&
+           SHA256_Update(&ctx, guid, GUID_LEN) &&
+           SHA256_Update(&ctx, &attr, sizeof(attr)) &&
+           SHA256_Update(&ctx, data, data_len) &&
+           SHA256_Final(key, &ctx);
+}
+
+static int
+verify_cache_lookup(const uint8_t *key)
+{
+    int i;
+
+    for (i = 0; i < VERIFY_CACHE_SIZE; i++) {
+        if (verify_cache[i].valid &&
+                verify_cache[i].generation == trust_generation &&
+                !memcmp(verify_cache[i].key, key, SHA256_DIGEST_SIZE))
+            return i;
+    }
+
+    return -1;
+}
+
+static void
+verify_cache_add(const uint8_t *key, EFI_STATUS status, const uint8_t *digest)
+{
+    unsigned int i = verify_cache_next++ % VERIFY_CACHE_SIZE;
+
+    verify_cache[i].valid = true;
+    verify_cache[i].generation = trust_generation;
+    memcpy(verify_cache[i].key, key, SHA256_DIGEST_SIZE);
+    verify_cache[i].status = status;
+    memcpy(verify_cache[i].digest, digest, SHA256_DIGEST_SIZE);
+}
+
 /*
  * Verify the authentication descriptor for a time based authentication
  * variable.
@@ -814,13 +1683,13 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
                      uint8_t *digest, EFI_TIME *timestamp)
 {
     uint8_t *ptr, *sig = NULL, *payload, *verify_buf = NULL, *tlc_buf = NULL;
-    uint8_t *var_data = NULL;
     EFI_VARIABLE_AUTHENTICATION_2 *d;
-    UINTN sig_len, verify_len, payload_len, var_len;
+    UINTN sig_len, verify_len, payload_len;
     STACK_OF(X509) *certs = NULL;
     X509 *top_level_cert;
     PKCS7 *pkcs7 = NULL;
     EFI_STATUS status;
+    uint8_t cache_key[SHA256_DIGEST_SIZE];
 
     if (data_len < offsetof(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo.CertData))
         return EFI_SECURITY_VIOLATION;
@@ -850,6 +1719,34 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
     payload = d->AuthInfo.CertData + sig_len;
     payload_len = data_len - offsetof(EFI_VARIABLE_AUTHENTICATION_2, AuthInfo) - d->AuthInfo.Hdr.dwLength;
 
+    if (auth_type != AUTH_TYPE_NONE) {
+        int hit;
+
+        /* data holds the timestamp, signature and payload. */
+        if (!verify_cache_key(name, name_len, guid,
+                              append ? attr | EFI_VARIABLE_APPEND_WRITE : attr,
+                              auth_type, data, data_len, cache_key))
+            return EFI_DEVICE_ERROR;
+
+        hit = verify_cache_lookup(cache_key);
+        if (hit >= 0) {
+            if (verify_cache[hit].status != EFI_SUCCESS)
+                return verify_cache[hit].status;
+            if (auth_type == AUTH_TYPE_PRIVATE) {
+                memcpy(digest, verify_cache[hit].digest, SHA256_DIGEST_SIZE);
+                if (auth_enforce && cur &&
+                        memcmp(digest, cur->cert, SHA256_DIGEST_SIZE))
+                    return EFI_SECURITY_VIOLATION;
+            }
+            *payload_len_out = payload_len;
+            *payload_out = malloc(payload_len);
+            if (!*payload_out)
+                return EFI_DEVICE_ERROR;
+            memcpy(*payload_out, payload, payload_len);
+            return EFI_SUCCESS;
+        }
+    }
+
     if (auth_type == AUTH_TYPE_NONE) {
         sig = malloc(sig_len);
         if (!sig)
@@ -898,6 +1795,7 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
     if (auth_type == AUTH_TYPE_PK) {
         EFI_SIGNATURE_LIST *cert_list;
         EFI_SIGNATURE_DATA *cert;
+        struct efi_variable *pk;
         int tlc_len;
 
         status = pkcs7_get_signers(sig, sig_len, &pkcs7, &certs);
@@ -915,16 +1813,13 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
             goto out;
         }
 
-        status = internal_get_variable(EFI_PLATFORM_KEY_NAME,
-                                       sizeof(EFI_PLATFORM_KEY_NAME),
-                                       &gEfiGlobalVariableGuid,
-                                       &var_data, &var_len);
-        if (status != EFI_SUCCESS) {
+        pk = well_known_var(WK_PK);
+        if (!pk) {
             status = EFI_SECURITY_VIOLATION;
             goto out;
         }
 
-        cert_list = (EFI_SIGNATURE_LIST *)var_data;
+        cert_list = (EFI_SIGNATURE_LIST *)pk->data;
         cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert_list +
                sizeof(EFI_SIGNATURE_LIST) + cert_list->SignatureHeaderSize);
         if ((tlc_len != (cert_list->SignatureSize - EFI_SIG_DATA_SIZE)) ||
@@ -944,57 +1839,28 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
                 status = EFI_DEVICE_ERROR;
         }
     } else if (auth_type == AUTH_TYPE_KEK) {
-        EFI_SIGNATURE_LIST *cert_list;
-        EFI_SIGNATURE_DATA *cert;
-        int remaining, i, count;
-        X509 *trusted_cert;
+        int i;
 
-        status = internal_get_variable(EFI_KEY_EXCHANGE_KEY_NAME,
-                                       sizeof(EFI_KEY_EXCHANGE_KEY_NAME),
-                                       &gEfiGlobalVariableGuid,
-                                       &var_data, &var_len);
-        if (status != EFI_SUCCESS) {
-            status = EFI_SECURITY_VIOLATION;
+        status = load_kek_stores();
+        if (status != EFI_SUCCESS)
             goto out;
-        }
 
-        remaining = (UINT32)var_len;
-        /*
-         * cert_list (i.e. the contents of KEK) was verified to be valid when
-         * it was written. Therefore no checking of validity is needed here.
-         */
-        cert_list = (EFI_SIGNATURE_LIST *)var_data;
-        while (remaining > 0) {
-            if (!memcmp(&cert_list->SignatureType, &gEfiCertX509Guid, GUID_LEN)) {
-                cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert_list +
-                       sizeof(EFI_SIGNATURE_LIST) + cert_list->SignatureHeaderSize);
-                count  = (cert_list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
-                          cert_list->SignatureHeaderSize) / cert_list->SignatureSize;
-
-                for (i = 0; i < count; i++) {
-                    trusted_cert = X509_from_buf(cert->SignatureData,
-                        cert_list->SignatureSize - EFI_SIG_DATA_SIZE);
-                    if (trusted_cert) {
-                        status = pkcs7_verify(sig, sig_len, trusted_cert,
-                                              verify_buf, verify_len);
-                        X509_free(trusted_cert);
-                        if (status == EFI_SUCCESS) {
-                            *payload_len_out = payload_len;
-                            *payload_out = malloc(payload_len);
-                            if (*payload_out)
-                                memcpy(*payload_out, payload, payload_len);
-                            else
-                                status = EFI_DEVICE_ERROR;
-                            goto out;
-                        }
-                    }
-                    cert = (EFI_SIGNATURE_DATA *)((uint8_t *)cert +
-                           cert_list->SignatureSize);
-                }
+        status = pkcs7_parse_signed(sig, sig_len, &pkcs7);
+        if (status != EFI_SUCCESS)
+            goto out;
+
+        for (i = 0; i < kek_stores.count; i++) {
+            status = pkcs7_verify_store(pkcs7, kek_stores.stores[i],
+                                        verify_buf, verify_len);
+            if (status == EFI_SUCCESS) {
+                *payload_len_out = payload_len;
+                *payload_out = malloc(payload_len);
+                if (*payload_out)
+                    memcpy(*payload_out, payload, payload_len);
+                else
+                    status = EFI_DEVICE_ERROR;
+                goto out;
             }
-            remaining -= cert_list->SignatureListSize;
-            cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)cert_list +
-                        cert_list->SignatureListSize);
         }
         status = EFI_SECURITY_VIOLATION;
     } else if (auth_type == AUTH_TYPE_PAYLOAD) {
@@ -1089,8 +1955,11 @@ verify_auth_var_type(uint8_t *name, UINTN name_len,
     }
 
 out:
+    if (auth_type != AUTH_TYPE_NONE &&
+            (status == EFI_SUCCESS ||
+             (status == EFI_SECURITY_VIOLATION && auth_type != AUTH_TYPE_PRIVATE)))
+        verify_cache_add(cache_key, status, digest);
     free(sig);
-    free(var_data);
     free(tlc_buf);
     free(verify_buf);
     sk_X509_free(certs);
@@ -1100,29 +1969,24 @@ out:
 
 static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
                                   uint8_t *data, UINTN data_len,
-                                  EFI_GUID *guid, UINT32 attr, bool append,
+                                  EFI_GUID *guid, enum well_known_var wk,
+                                  UINT32 attr, bool append,
                                   struct efi_variable *cur,
                                   uint8_t **payload_out, UINTN *payload_len_out,
                                   uint8_t *digest, EFI_TIME *timestamp)
 {
     EFI_STATUS status;
-    uint8_t *var;
-    uint8_t setup_mode, secure_boot;
-    UINTN var_len;
+    const struct efi_variable *var;
+    uint8_t setup_mode;
 
     *payload_out = NULL;
 
-    status = internal_get_variable(EFI_SETUP_MODE_NAME,
-                                   sizeof(EFI_SETUP_MODE_NAME),
-                                   &gEfiGlobalVariableGuid, &var, &var_len);
-    if (status != EFI_SUCCESS)
-        return status;
-    setup_mode = var[0];
-    free(var);
+    var = well_known_var(WK_SETUP_MODE);
+    if (!var)
+        return EFI_NOT_FOUND;
+    setup_mode = var->data[0];
 
-    if (name_len == sizeof(EFI_PLATFORM_KEY_NAME) &&
-            !memcmp(name, EFI_PLATFORM_KEY_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) {
+    if (wk == WK_PK) {
         enum auth_type type = AUTH_TYPE_PK;
 
         /*
@@ -1151,88 +2015,50 @@ static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
             goto out;
 
         status = check_signature_list_format(*payload_out, *payload_len_out,
-                                             true);
+                                             true, NULL);
         if (status != EFI_SUCCESS)
             goto out;
 
         if (setup_mode == 1 && *payload_len_out != 0) {
             EFI_STATUS saved_status;
-            uint8_t deployed_mode = 1;
 
             /*
              * Always try to update all the internal variables but return an
              * error if any fail.
              */
             status = EFI_SUCCESS;
-            setup_mode = 0;
-            saved_status = internal_set_variable(EFI_SETUP_MODE_NAME,
-                                                 sizeof(EFI_SETUP_MODE_NAME),
-                                                 &gEfiGlobalVariableGuid,
-                                                 &setup_mode,
-                                                 sizeof(setup_mode),
-                                                 ATTR_BR);
+            saved_status = set_mode_variable(WK_SETUP_MODE, 0);
             if (saved_status != EFI_SUCCESS)
                 status = saved_status;
 
-            saved_status = internal_set_variable(EFI_DEPLOYED_MODE_NAME,
-                                                 sizeof(EFI_DEPLOYED_MODE_NAME),
-                                                 &gEfiGlobalVariableGuid,
-                                                 &deployed_mode,
-                                                 sizeof(deployed_mode),
-                                                 ATTR_BR);
+            saved_status = set_mode_variable(WK_DEPLOYED_MODE, 1);
             if (saved_status != EFI_SUCCESS)
                 status = saved_status;
 
-            secure_boot = secure_boot_enable;
-            saved_status = internal_set_variable(EFI_SECURE_BOOT_MODE_NAME,
-                                                 sizeof(EFI_SECURE_BOOT_MODE_NAME),
-                                                 &gEfiGlobalVariableGuid,
-                                                 &secure_boot,
-                                                 sizeof(secure_boot),
-                                                 ATTR_BR);
+            saved_status = set_mode_variable(WK_SECURE_BOOT, secure_boot_enable);
             if (saved_status != EFI_SUCCESS)
                 status = saved_status;
         } else if (setup_mode == 0 && *payload_len_out == 0) {
             EFI_STATUS saved_status;
-            uint8_t deployed_mode = 0;
 
             /*
              * Always try to update all the internal variables but return an
              * error if any fail.
              */
             status = EFI_SUCCESS;
-            setup_mode = 1;
-            saved_status = internal_set_variable(EFI_SETUP_MODE_NAME,
-                                                 sizeof(EFI_SETUP_MODE_NAME),
-                                                 &gEfiGlobalVariableGuid,
-                                                 &setup_mode,
-                                                 sizeof(setup_mode),
-                                                 ATTR_BR);
+            saved_status = set_mode_variable(WK_SETUP_MODE, 1);
             if (saved_status != EFI_SUCCESS)
                 status = saved_status;
 
-            saved_status = internal_set_variable(EFI_DEPLOYED_MODE_NAME,
-                                                 sizeof(EFI_DEPLOYED_MODE_NAME),
-                                                 &gEfiGlobalVariableGuid,
-                                                 &deployed_mode,
-                                                 sizeof(deployed_mode),
-                                                 ATTR_BR);
+            saved_status = set_mode_variable(WK_DEPLOYED_MODE, 0);
             if (saved_status != EFI_SUCCESS)
                 status = saved_status;
 
-            secure_boot = 0;
-            saved_status = internal_set_variable(EFI_SECURE_BOOT_MODE_NAME,
-                                                 sizeof(EFI_SECURE_BOOT_MODE_NAME),
-                                                 &gEfiGlobalVariableGuid,
-                                                 &secure_boot,
-                                                 sizeof(secure_boot),
-                                                 ATTR_BR);
+            saved_status = set_mode_variable(WK_SECURE_BOOT, 0);
             if (saved_status != EFI_SUCCESS)
                 status = saved_status;
         }
-    } else if (name_len == sizeof(EFI_KEY_EXCHANGE_KEY_NAME) &&
-               !memcmp(name, EFI_KEY_EXCHANGE_KEY_NAME, name_len) &&
-               !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) {
+    } else if (wk == WK_KEK) {
         enum auth_type type = AUTH_TYPE_PK;
 
         if (setup_mode == 1 || !auth_enforce)
@@ -1246,14 +2072,8 @@ static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
                                       digest, timestamp);
         if (status == EFI_SUCCESS)
             status = check_signature_list_format(*payload_out, *payload_len_out,
-                                                 false);
-    } else if (!memcmp(guid, &gEfiImageSecurityDatabaseGuid, GUID_LEN) &&
-               ((name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE, name_len)) ||
-                (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE1) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE1, name_len)) ||
-                (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE2) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE2, name_len)))) {
+                                                 false, append ? NULL : cur);
+    } else if (well_known_flags(wk) & WK_SIGNATURE_DB) {
         if (setup_mode == 1 || !auth_enforce) {
             status = verify_auth_var_type(name, name_len,
                                           data, data_len,
@@ -1279,7 +2099,7 @@ static EFI_STATUS verify_auth_var(uint8_t *name, UINTN name_len,
 
         if (status == EFI_SUCCESS)
             status = check_signature_list_format(*payload_out, *payload_len_out,
-                                                 false);
+                                                 false, append ? NULL : cur);
     } else {
         status = verify_auth_var_type(name, name_len,
                                       data, data_len,
@@ -1342,214 +2162,230 @@ check_ppi_variables(uint8_t *name, UINTN name_len, EFI_GUID *guid, uint8_t *data
 }
 
 static bool
-check_ro_variable(uint8_t *name, UINTN name_len, EFI_GUID *guid)
-{
-    if ((name_len == sizeof(EFI_AUDIT_MODE_NAME) &&
-            !memcmp(name, EFI_AUDIT_MODE_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_DEPLOYED_MODE_NAME) &&
-            !memcmp(name, EFI_DEPLOYED_MODE_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_SECURE_BOOT_MODE_NAME) &&
-            !memcmp(name, EFI_SECURE_BOOT_MODE_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_SETUP_MODE_NAME) &&
-            !memcmp(name, EFI_SETUP_MODE_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_SIGNATURE_SUPPORT_NAME) &&
-            !memcmp(name, EFI_SIGNATURE_SUPPORT_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)))
-        return true;
-    return false;
+check_ro_variable(enum well_known_var wk)
+{
+    return !!(well_known_flags(wk) & WK_READ_ONLY);
 }
 
 static bool
-check_attr(uint8_t *name, UINTN name_len, EFI_GUID *guid, UINT32 attr)
-{
-    if ((name_len == sizeof(EFI_PLATFORM_KEY_NAME) &&
-            !memcmp(name, EFI_PLATFORM_KEY_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN)) ||
-        (name_len == sizeof(EFI_KEY_EXCHANGE_KEY_NAME) &&
-            !memcmp(name, EFI_KEY_EXCHANGE_KEY_NAME, name_len) &&
-            !memcmp(guid, &gEfiGlobalVariableGuid, GUID_LEN))) {
-        if (attr != (ATTR_BRNV | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS))
-            return true;
-    } else if (!memcmp(guid, &gEfiImageSecurityDatabaseGuid, GUID_LEN) &&
-               ((name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE, name_len)) ||
-                (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE1) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE1, name_len)) ||
-                (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE2) &&
-                 !memcmp(name, EFI_IMAGE_SECURITY_DATABASE2, name_len)))) {
-        if (attr != (ATTR_BRNV | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS))
-            return true;
-    }
+check_attr(enum well_known_var wk, UINT32 attr)
+{
+    if (well_known_flags(wk) & (WK_KEY | WK_SIGNATURE_DB))
+        return attr != (ATTR_BRNV | EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS);
 
     return false;
 }
 
+/* FNV-1a over the signature type, size and data. */
+static uint32_t
+signature_hash(const EFI_SIGNATURE_LIST *list, const uint8_t *cert)
+{
+    uint32_t hash = 2166136261u;
+    const uint8_t *p = (const uint8_t *)&list->SignatureType;
+    UINT32 i, size = list->SignatureSize;
+
+    for (i = 0; i < GUID_LEN; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    for (i = 0; i < sizeof(size); i++)
+        hash = (hash ^ ((size >> (8 * i)) & 0xff)) * 16777619u;
+    for (i = 0; i < size; i++)
+        hash = (hash ^ cert[i]) * 16777619u;
+
+    return hash;
+}
+
 /*
- * Append a signature list, new_data, to an existing signature list, data,
- * while removing duplicates. This function must only be called with valid
- * signature lists (i.e. check_signature_list_format has already been called
- * on the signature list).
+ * Calls fn for each EFI_SIGNATURE_DATA in data[from, data_len). Stops early
+ * at a malformed list rather than looping.
  */
-static EFI_STATUS
-filter_signature_list(uint8_t *data, UINTN data_len,
-                      uint8_t *new_data, UINTN *new_data_len)
+static void
+for_each_signature(const uint8_t *data, UINTN data_len, UINTN from,
+                   void (*fn)(const uint8_t *data, UINTN list, UINTN cert))
 {
-    EFI_SIGNATURE_LIST *cert_list, *new_cert_list, *old_cert_list;
-    EFI_SIGNATURE_DATA *new_cert, *old_cert;
-    UINTN new_rem, old_rem;
-    uint8_t *buf, *ptr;
-    int i, j, new_cert_count, old_cert_count;
-
-    buf = malloc(*new_data_len);
-    if (!buf)
-        return EFI_DEVICE_ERROR;
-    ptr = buf;
-
-    new_cert_list = (EFI_SIGNATURE_LIST *)new_data;
-    new_rem = *new_data_len;
-
-    while ((new_rem > 0) && (new_rem >= new_cert_list->SignatureListSize)) {
-        int copied = 0;
-
-        new_cert = (EFI_SIGNATURE_DATA *)((uint8_t *)new_cert_list +
-                   sizeof(EFI_SIGNATURE_LIST) + new_cert_list->SignatureHeaderSize);
-        new_cert_count = (new_cert_list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
-                          new_cert_list->SignatureHeaderSize) / new_cert_list->SignatureSize;
-
-        for (i = 0; i < new_cert_count; i++) {
-            bool is_new_cert = true;
-
-            old_rem = data_len;
-            old_cert_list = (EFI_SIGNATURE_LIST *)data;
-            while ((old_rem > 0) && (old_rem >= old_cert_list->SignatureListSize)) {
-                if (!memcmp(&old_cert_list->SignatureType, &new_cert_list->SignatureType, GUID_LEN) &&
-                        (old_cert_list->SignatureSize == new_cert_list->SignatureSize)) {
-                    old_cert = (EFI_SIGNATURE_DATA *)((uint8_t *)old_cert_list +
-                               sizeof(EFI_SIGNATURE_LIST) + old_cert_list->SignatureHeaderSize);
-                    old_cert_count = (old_cert_list->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
-                                      old_cert_list->SignatureHeaderSize) / old_cert_list->SignatureSize;
-
-                    for (j = 0; j < old_cert_count; j++) {
-                        if (!memcmp(new_cert, old_cert, old_cert_list->SignatureSize)) {
-                            is_new_cert = false;
-                            break;
-                        }
-                        old_cert = (EFI_SIGNATURE_DATA *)((uint8_t *)old_cert + old_cert_list->SignatureSize);
-                    }
-                }
-                if (!is_new_cert)
-                    break;
-
-                old_rem -= old_cert_list->SignatureListSize;
-                old_cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)old_cert_list +
-                                old_cert_list->SignatureListSize);
-            }
-
-            if (is_new_cert) {
-                if (copied == 0) {
-                    memcpy(ptr, new_cert_list,
-                           sizeof(EFI_SIGNATURE_LIST) + new_cert_list->SignatureHeaderSize);
-                    ptr += sizeof(EFI_SIGNATURE_LIST) + new_cert_list->SignatureHeaderSize;
-                }
-
-                memcpy(ptr, new_cert, new_cert_list->SignatureSize);
-                ptr += new_cert_list->SignatureSize;
-                copied++;
-            }
+    const EFI_SIGNATURE_LIST *list;
+    UINTN off = from, cert, end;
+
+    while (data_len - off >= sizeof(EFI_SIGNATURE_LIST)) {
+        list = (const EFI_SIGNATURE_LIST *)(data + off);
+        if (list->SignatureListSize > data_len - off ||
+                list->SignatureSize == 0 ||
+                list->SignatureListSize < sizeof(EFI_SIGNATURE_LIST) +
+                                          list->SignatureHeaderSize)
+            return;
 
-            new_cert = (EFI_SIGNATURE_DATA *)((uint8_t *)new_cert +
-                       new_cert_list->SignatureSize);
-        }
+        end = off + list->SignatureListSize;
+        cert = off + sizeof(EFI_SIGNATURE_LIST) + list->SignatureHeaderSize;
+        for (; end - cert >= list->SignatureSize; cert += list->SignatureSize)
+            fn(data, off, cert);
 
-        if (copied != 0) {
-            int size = sizeof(EFI_SIGNATURE_LIST) + new_cert_list->SignatureHeaderSize +
-                       (copied * new_cert_list->SignatureSize);
-            cert_list = (EFI_SIGNATURE_LIST *)(ptr - size);
-            cert_list->SignatureListSize = size;
-        }
+        off = end;
+    }
+}
 
-        new_rem -= new_cert_list->SignatureListSize;
-        new_cert_list = (EFI_SIGNATURE_LIST *)((uint8_t *)new_cert_list +
-                        new_cert_list->SignatureListSize);
+static struct sig_slot *
+sig_cache_find(const uint8_t *data, const EFI_SIGNATURE_LIST *list,
+               const uint8_t *cert)
+{
+    const EFI_SIGNATURE_LIST *old_list;
+    struct sig_slot *slot;
+    size_t i, n;
+
+    i = signature_hash(list, cert) & (sig_cache.size - 1);
+    for (n = 0; n < sig_cache.size; n++) {
+        slot = &sig_cache.slots[i];
+        if (!slot->cert)
+            return slot;
+
+        old_list = (const EFI_SIGNATURE_LIST *)(data + slot->list);
+        if (old_list->SignatureSize == list->SignatureSize &&
+                !memcmp(&old_list->SignatureType, &list->SignatureType, GUID_LEN) &&
+                !memcmp(data + slot->cert - 1, cert, list->SignatureSize))
+            return slot;
+
+        i = (i + 1) & (sig_cache.size - 1);
     }
 
-    *new_data_len = ptr - buf;
-    memcpy(new_data, buf, *new_data_len);
-    free(buf);
+    /* Not found and no free slot, which the load factor should prevent. */
+    return NULL;
+}
 
-    return EFI_SUCCESS;
+static void
+sig_cache_add(const uint8_t *data, UINTN list, UINTN cert)
+{
+    struct sig_slot *slot;
+
+    slot = sig_cache_find(data, (const EFI_SIGNATURE_LIST *)(data + list),
+                          data + cert);
+    if (slot && !slot->cert) {
+        slot->list = list;
+        slot->cert = cert + 1;
+        sig_cache.count++;
+    }
 }
 
-static struct efi_variable *
-copy_efi_variable(struct efi_variable *efi_var)
+static void
+sig_cache_count(const uint8_t *data, UINTN list, UINTN cert)
 {
-    struct efi_variable *new_efi_var;
+    sig_cache.count++;
+}
 
-    if (efi_var == NULL)
-        return NULL;
+/* Hashes every signature in l, reusing the slots if they are big enough. */
+static bool
+sig_cache_build(const struct efi_variable *l)
+{
+    size_t size = 16;
+    struct sig_slot *slots;
 
-    new_efi_var = malloc(sizeof *new_efi_var);
-    if (!new_efi_var)
-        return NULL;
+    sig_cache.var = NULL;
+    sig_cache.count = 0;
+    for_each_signature(l->data, l->data_len, 0, sig_cache_count);
 
-    *new_efi_var = *efi_var;
-    new_efi_var->next = NULL;
+    /* Keep the load factor at or below a half. */
+    while (size < 2 * sig_cache.count)
+        size *= 2;
 
-    new_efi_var->name = malloc(efi_var->name_len);
-    if (!new_efi_var->name) {
-        free(new_efi_var);
-        return NULL;
+    if (size > sig_cache.size) {
+        slots = realloc(sig_cache.slots, size * sizeof(*slots));
+        if (!slots)
+            return false;
+        sig_cache.slots = slots;
+        sig_cache.size = size;
     }
-    memcpy(new_efi_var->name, efi_var->name, efi_var->name_len);
+    memset(sig_cache.slots, 0, sig_cache.size * sizeof(*sig_cache.slots));
 
-    new_efi_var->data = malloc(efi_var->data_len);
-    if (!new_efi_var->data) {
-        free(new_efi_var->name);
-        free(new_efi_var);
-        return NULL;
-    }
-    memcpy(new_efi_var->data, efi_var->data, efi_var->data_len);
+    sig_cache.count = 0;
+    for_each_signature(l->data, l->data_len, 0, sig_cache_add);
+    sig_cache.var = l;
 
-    return new_efi_var;
+    return true;
 }
 
+/*
+ * Moves the set over from old to new, where new is old with more signature
+ * lists appended.
+ */
 static void
-free_efi_variable(struct efi_variable *efi_var)
+sig_cache_extend(const struct efi_variable *old, const struct efi_variable *new)
 {
-    if (efi_var == NULL)
+    size_t count;
+
+    if (sig_cache.var != old)
+        return;
+
+    /* Rebuild later rather than let the set fill up. */
+    count = sig_cache.count;
+    for_each_signature(new->data, new->data_len, old->data_len,
+                       sig_cache_count);
+    if (2 * sig_cache.count > sig_cache.size) {
+        sig_cache.var = NULL;
         return;
+    }
 
-    free(efi_var->name);
-    free(efi_var->data);
-    free(efi_var);
+    sig_cache.count = count;
+    sig_cache.var = new;
+    for_each_signature(new->data, new->data_len, old->data_len, sig_cache_add);
 }
 
-/* Returns true if two EFI variables are equivalent, false otherwise. */
-static bool
-cmp_efi_variable(struct efi_variable *a, struct efi_variable *b)
+/*
+ * Append a signature list, new_data, to an existing signature list, the data
+ * of l, while removing duplicates. new_data is filtered in place. This
+ * function must only be called with valid signature lists (i.e.
+ * check_signature_list_format has already been called on the signature list).
+ */
+static EFI_STATUS
+filter_signature_list(const struct efi_variable *l,
+                      uint8_t *new_data, UINTN *new_data_len)
 {
-    if (a->name_len != b->name_len)
-        return false;
-    if (a->data_len != b->data_len)
-        return false;
-    if (a->attributes != b->attributes)
-        return false;
-    if (memcmp(&a->guid, &b->guid, GUID_LEN))
-        return false;
-    if (memcmp(&a->timestamp, &b->timestamp, sizeof(a->timestamp)))
-        return false;
-    if (memcmp(a->cert, b->cert, sizeof(a->cert)))
-        return false;
-    if (memcmp(a->name, b->name, a->name_len))
-        return false;
-    if (memcmp(a->data, b->data, a->data_len))
-        return false;
+    EFI_SIGNATURE_LIST list, *out_list;
+    struct sig_slot *slot;
+    uint8_t *ptr, *cert, *list_end;
+    UINTN new_rem, hdr_size;
+    int copied;
 
-    return true;
+    if (sig_cache.var != l && !sig_cache_build(l))
+        return EFI_DEVICE_ERROR;
+
+    /*
+     * Nothing is ever written ahead of where it is read, but a list header
+     * may be overwritten while the list is being filtered so keep a copy.
+     */
+    ptr = new_data;
+    new_rem = *new_data_len;
+    cert = new_data;
+
+    while ((new_rem > 0) && (new_rem >= ((EFI_SIGNATURE_LIST *)cert)->SignatureListSize)) {
+        memcpy(&list, cert, sizeof(list));
+        hdr_size = sizeof(EFI_SIGNATURE_LIST) + list.SignatureHeaderSize;
+        list_end = cert + list.SignatureListSize;
+        out_list = (EFI_SIGNATURE_LIST *)ptr;
+        copied = 0;
+
+        for (cert += hdr_size; list_end - cert >= list.SignatureSize;
+             cert += list.SignatureSize) {
+            slot = sig_cache_find(l->data, &list, cert);
+            if (slot && slot->cert)
+                continue;
+
+            if (copied == 0) {
+                memmove(ptr, list_end - list.SignatureListSize, hdr_size);
+                ptr += hdr_size;
+            }
+
+            memmove(ptr, cert, list.SignatureSize);
+            ptr += list.SignatureSize;
+            copied++;
+        }
+
+        if (copied != 0)
+            out_list->SignatureListSize = hdr_size + copied * list.SignatureSize;
+
+        new_rem -= list.SignatureListSize;
+        cert = list_end;
+    }
+
+    *new_data_len = ptr - new_data;
+
+    return EFI_SUCCESS;
 }
 
 #if 0
@@ -1569,15 +2405,127 @@ debug_all_variables(const struct efi_variable *l)
 }
 #endif
 
+/* Set while dispatching a command that may wait on an asynchronous save. */
+static bool dispatch_async;
+
+/* A SetVariable waiting for the backend to finish saving. */
+static struct {
+    bool active;
+    uint8_t *comm_buf;
+    struct efi_variable *l, *prev, *rollback_var;
+    uint64_t start;
+    uint32_t hash; /* For tracing. */
+} pending_set;
+
+/*
+ * Completes a SetVariable once the backend has saved the update. If the save
+ * failed, the update is undone: rollback_var is NULL for a new variable, l
+ * itself for a deletion and the previous copy otherwise.
+ */
+static void
+finish_set_variable(uint8_t *comm_buf, struct efi_variable *l,
+                    struct efi_variable *prev,
+                    struct efi_variable *rollback_var, bool saved)
+{
+    if (!saved) {
+        if (!rollback_var) {
+            /* new variable case: drop it */
+            remove_variable(l);
+            free_efi_variable(l);
+        } else if (rollback_var == l) {
+            /* efivar delete case: put it back where it was */
+            link_variable(l, prev);
+        } else {
+            /* append/update case: restore the previous copy */
+            replace_variable(l, rollback_var);
+            free_efi_variable(l);
+        }
+        serialize_result(&comm_buf, EFI_DEVICE_ERROR);
+        return;
+    }
+
+    free_efi_variable(rollback_var);
+    serialize_result(&comm_buf, EFI_SUCCESS);
+}
+
+/* Returns the status written back for a request. */
+static UINTN
+command_status(uint8_t *comm_buf)
+{
+    return unserialize_uintn(&comm_buf);
+}
+
+static void
+set_variable_done(bool saved)
+{
+    assert(pending_set.active);
+
+    pending_set.active = false;
+    stats_record(STAT_BACKEND_SET_VARIABLE, pending_set.start);
+    TRACE(backend__set__done, saved);
+    finish_set_variable(pending_set.comm_buf, pending_set.l, pending_set.prev,
+                        pending_set.rollback_var, saved);
+    TRACE(command__done, COMMAND_SET_VARIABLE, pending_set.hash,
+          command_status(pending_set.comm_buf));
+}
+
+static void
+save_variables(uint8_t *comm_buf, struct efi_variable *l,
+               struct efi_variable *prev, struct efi_variable *rollback_var)
+{
+    uint64_t start = stats_now();
+    bool saved;
+
+    if (dispatch_async && db->set_variable_async) {
+        TRACE(backend__set__start, 1);
+        switch (db->set_variable_async(set_variable_done)) {
+        case BACKEND_SAVE_PENDING:
+            pending_set.active = true;
+            pending_set.comm_buf = comm_buf;
+            pending_set.l = l;
+            pending_set.prev = prev;
+            pending_set.rollback_var = rollback_var;
+            pending_set.start = start;
+            return;
+        case BACKEND_SAVE_SUCCESS:
+            stats_record(STAT_BACKEND_SET_VARIABLE, start);
+            TRACE(backend__set__done, true);
+            finish_set_variable(comm_buf, l, prev, rollback_var, true);
+            return;
+        case BACKEND_SAVE_FAILURE:
+            stats_record(STAT_BACKEND_SET_VARIABLE, start);
+            TRACE(backend__set__done, false);
+            finish_set_variable(comm_buf, l, prev, rollback_var, false);
+            return;
+        }
+    }
+
+    TRACE(backend__set__start, 0);
+    saved = db->set_variable();
+    stats_record(STAT_BACKEND_SET_VARIABLE, start);
+    TRACE(backend__set__done, saved);
+    finish_set_variable(comm_buf, l, prev, rollback_var, saved);
+}
+
+bool
+command_pending(void)
+{
+    return pending_set.active;
+}
+
 static void
 do_set_variable(uint8_t *comm_buf)
 {
     UINTN name_len, data_len;
-    struct efi_variable *l, *prev = NULL;
-    uint8_t *ptr, *name, *data;
+    struct efi_variable *l;
+    uint8_t *ptr, *data = NULL;
+    const uint8_t *name_view, *data_view;
+    uint8_t name[NAME_LIMIT];
     EFI_GUID guid;
     UINT32 attr;
     BOOLEAN at_runtime, append;
+    enum well_known_var wk;
+    uint64_t start;
     EFI_STATUS status;
     uint8_t digest[SHA256_DIGEST_SIZE] = {0};
     EFI_TIME timestamp;
@@ -1585,22 +2533,31 @@ do_set_variable(uint8_t *comm_buf)
     ptr = comm_buf;
     unserialize_uint32(&ptr); /* version */
     unserialize_command(&ptr);
-    name = unserialize_data(&ptr, &name_len, NAME_LIMIT);
-    if (!name) {
+    name_view = unserialize_data_view(&ptr, comm_buf + SHMEM_SIZE, &name_len,
+                                      NAME_LIMIT);
+    if (!name_view) {
         serialize_result(&comm_buf, name_len == 0 ? EFI_INVALID_PARAMETER : EFI_DEVICE_ERROR);
         return;
     }
     unserialize_guid(&ptr, &guid);
-    data = unserialize_data(&ptr, &data_len, DATA_LIMIT);
-    if (!data && data_len) {
+    data_view = unserialize_data_view(&ptr, comm_buf + SHMEM_SIZE, &data_len,
+                                      DATA_LIMIT);
+    if (!data_view && data_len) {
         serialize_result(&comm_buf, data_len > DATA_LIMIT ? EFI_OUT_OF_RESOURCES : EFI_DEVICE_ERROR);
-        free(name);
         return;
     }
     attr = unserialize_uint32(&ptr);
     at_runtime = unserialize_boolean(&ptr);
     ptr = comm_buf;
 
+    /*
+     * The guest can change the buffer while the request is being handled, so
+     * take a private copy of the name now. The data is copied once the cheap
+     * attribute checks have passed, before anything inspects it.
+     */
+    memcpy(name, name_view, name_len);
+    wk = classify_variable(name, name_len, &guid);
+
     append = !!(attr & EFI_VARIABLE_APPEND_WRITE);
     attr &= ~EFI_VARIABLE_APPEND_WRITE;
 
@@ -1635,6 +2592,15 @@ do_set_variable(uint8_t *comm_buf)
         goto err;
     }
 
+    if (data_len) {
+        data = malloc(data_len);
+        if (!data) {
+            serialize_result(&ptr, EFI_DEVICE_ERROR);
+            return;
+        }
+        memcpy(data, data_view, data_len);
+    }
+
     if (is_mor_control(name, name_len, &guid)) {
         serialize_result(&ptr, do_set_mor_control(data, data_len, attr, append));
         goto err;
@@ -1645,174 +2611,169 @@ do_set_variable(uint8_t *comm_buf)
         goto err;
     }
 
-    l = var_list;
-    while (l) {
-        if (l->name_len == name_len &&
-                !memcmp(l->name, name, name_len) &&
-                !memcmp(&l->guid, &guid, GUID_LEN)) {
-            struct efi_variable *rollback_var = NULL;
-            bool should_save = !!(l->attributes & EFI_VARIABLE_NON_VOLATILE);
+    l = find_variable(name, name_len, &guid);
+    if (l) {
+        struct efi_variable *rollback_var = NULL, *new;
+        struct efi_variable *prev = l->prev;
+        bool should_save = !!(l->attributes & EFI_VARIABLE_NON_VOLATILE);
 
-            /* Only runtime variables can be updated/deleted at runtime. */
-            if (at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS)) {
-                serialize_result(&ptr, EFI_INVALID_PARAMETER);
-                goto err;
-            }
+        /* Only runtime variables can be updated/deleted at runtime. */
+        if (at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS)) {
+            serialize_result(&ptr, EFI_INVALID_PARAMETER);
+            goto err;
+        }
 
-            /* Only NV variables can be update/deleted at runtime. */
-            if (at_runtime && !(l->attributes & EFI_VARIABLE_NON_VOLATILE)) {
-                serialize_result(&ptr, EFI_WRITE_PROTECTED);
-                goto err;
-            }
+        /* Only NV variables can be update/deleted at runtime. */
+        if (at_runtime && !(l->attributes & EFI_VARIABLE_NON_VOLATILE)) {
+            serialize_result(&ptr, EFI_WRITE_PROTECTED);
+            goto err;
+        }
+
+        if (check_ro_variable(wk)) {
+            serialize_result(&ptr, EFI_WRITE_PROTECTED);
+            goto err;
+        }
+
+        status = check_ppi_variables(name, name_len, &guid, data, data_len);
+        if (status != EFI_SUCCESS) {
+            serialize_result(&ptr, status);
+            goto err;
+        }
+        if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
+            uint8_t *payload;
+            UINTN payload_len;
 
-            if (check_ro_variable(name, name_len, &guid)) {
-                serialize_result(&ptr, EFI_WRITE_PROTECTED);
+            /*
+             * Authenticated variables cannot be deleted by setting no
+             * access bits so ensure the bits are unchanged early.
+             */
+            if (l->attributes != attr) {
+                serialize_result(&ptr, EFI_INVALID_PARAMETER);
                 goto err;
             }
 
-            status = check_ppi_variables(name, name_len, &guid, data, data_len);
+            start = stats_now();
+            status = verify_auth_var(name, name_len,
+                                     data, data_len,
+                                     &guid, wk, attr, append,
+                                     l,
+                                     &payload, &payload_len,
+                                     digest, &timestamp);
+            stats_record(STAT_AUTH_VERIFY, start);
             if (status != EFI_SUCCESS) {
                 serialize_result(&ptr, status);
                 goto err;
             }
-            if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
-                uint8_t *payload;
-                UINTN payload_len;
-
-                /*
-                 * Authenticated variables cannot be deleted by setting no
-                 * access bits so ensure the bits are unchanged early.
-                 */
-                if (l->attributes != attr) {
-                    serialize_result(&ptr, EFI_INVALID_PARAMETER);
-                    goto err;
-                }
+            free(data);
+            data = payload;
+            data_len = payload_len;
+        }
 
-                status = verify_auth_var(name, name_len,
-                                         data, data_len,
-                                         &guid, attr, append,
-                                         l,
-                                         &payload, &payload_len,
-                                         digest, &timestamp);
-                if (status != EFI_SUCCESS) {
-                    serialize_result(&ptr, status);
-                    goto err;
-                }
-                free(data);
-                data = payload;
-                data_len = payload_len;
+        if ((data_len == 0 && !append) || !(attr & ATTR_BR)) {
+            /*
+             * Authenticated variables cannot be deleted by unsetting
+             * attributes. (2.7A page 248)
+             */
+            if ((l->attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+                (l->attributes != attr)) {
+                serialize_result(&ptr, EFI_INVALID_PARAMETER);
+                goto err;
             }
 
-            if ((data_len == 0 && !append) || !(attr & ATTR_BR)) {
-                /*
-                 * Authenticated variables cannot be deleted by unsetting
-                 * attributes. (2.7A page 248)
-                 */
-                if ((l->attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
-                    (l->attributes != attr)) {
-                    serialize_result(&ptr, EFI_INVALID_PARAMETER);
-                    goto err;
-                }
-
-                if (prev)
-                    prev->next = l->next;
-                else
-                    var_list = l->next;
-                rollback_var = l;
-                free(data);
-            } else {
-                if (l->attributes != attr) {
-                    serialize_result(&ptr, EFI_INVALID_PARAMETER);
-                    goto err;
-                }
-                if (append) {
-                    uint8_t *new_data;
-
-                    if ((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
-                            !memcmp(&guid, &gEfiImageSecurityDatabaseGuid, GUID_LEN) &&
-                            ((name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE) &&
-                              !memcmp(name, EFI_IMAGE_SECURITY_DATABASE, name_len)) ||
-                             (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE1) &&
-                              !memcmp(name, EFI_IMAGE_SECURITY_DATABASE1, name_len)) ||
-                             (name_len == sizeof(EFI_IMAGE_SECURITY_DATABASE2) &&
-                              !memcmp(name, EFI_IMAGE_SECURITY_DATABASE2, name_len)))) {
-                        status = filter_signature_list(l->data, l->data_len, data, &data_len);
-                        if (status != EFI_SUCCESS) {
-                            serialize_result(&ptr, status);
-                            goto err;
-                        }
-                    }
-
-                    if (get_space_usage() + data_len > TOTAL_LIMIT) {
-                        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
-                        goto err;
-                    }
-
-                    rollback_var = copy_efi_variable(l);
-                    if (!rollback_var) {
-                        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
-                        goto err;
-                    }
-
-                    new_data = realloc(l->data, l->data_len + data_len);
-                    if (!new_data) {
-                        serialize_result(&ptr, EFI_DEVICE_ERROR);
-                        free_efi_variable(rollback_var);
-                        goto err;
-                    }
-                    if ((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
-                            time_later(&l->timestamp, &timestamp))
-                        l->timestamp = timestamp;
-                    l->data = new_data;
-                    memcpy(l->data + l->data_len, data, data_len);
-                    free(data);
-                    l->data_len += data_len;
-                } else {
-                    if (get_space_usage() - l->data_len + data_len > TOTAL_LIMIT) {
-                        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+            remove_variable(l);
+            rollback_var = l;
+            free(data);
+        } else {
+            if (l->attributes != attr) {
+                serialize_result(&ptr, EFI_INVALID_PARAMETER);
+                goto err;
+            }
+            if (append) {
+                if ((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+                        (well_known_flags(wk) & WK_SIGNATURE_DB)) {
+                    status = filter_signature_list(l, data, &data_len);
+                    if (status != EFI_SUCCESS) {
+                        serialize_result(&ptr, status);
                         goto err;
                     }
+                }
 
-                    rollback_var = copy_efi_variable(l);
-                    if (!rollback_var) {
-                        serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
-                        goto err;
-                    }
+                if (data_len == 0 &&
+                        !((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+                          time_later(&l->timestamp, &timestamp)))
+                    goto unchanged;
 
-                    if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS)
-                        l->timestamp = timestamp;
-                    free(l->data);
-                    l->data = data;
-                    l->data_len = data_len;
+                if (get_space_usage() + data_len > TOTAL_LIMIT) {
+                    serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+                    goto err;
                 }
 
-                /* Skip saving if nothing changed. */
-                if (cmp_efi_variable(l, rollback_var))
-                    should_save = false;
-            }
-            free(name);
-            if (should_save && persistent) {
-                if (!db->set_variable()) {
-                    /* efivar delete and append/update case */
-                    rollback_var->next = l->next;
-                    if (prev)
-                        prev->next = rollback_var;
-                    else
-                        var_list = rollback_var;
-
-                    /* Free the changed var in the append/update case */
-                    if (rollback_var != l)
-                        free_efi_variable(l);
-                    serialize_result(&ptr, EFI_DEVICE_ERROR);
-                    return;
+                new = alloc_efi_variable(name, name_len, l->data_len + data_len);
+                if (!new) {
+                    serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+                    goto err;
+                }
+                copy_variable_info(new, l);
+                if ((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+                        time_later(&l->timestamp, &timestamp))
+                    new->timestamp = timestamp;
+                memcpy(new->data, l->data, l->data_len);
+                memcpy(new->data + l->data_len, data, data_len);
+                sig_cache_extend(l, new);
+                if (signature_list_var(wk, attr)) {
+                    struct var_record *r = to_record(l);
+
+                    to_record(new)->verified_len =
+                        r->verified_len == l->data_len ? new->data_len :
+                                                         r->verified_len;
+                }
+            } else {
+                if (data_len == l->data_len &&
+                        !((attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) &&
+                          memcmp(&l->timestamp, &timestamp, sizeof(timestamp))) &&
+                        !memcmp(l->data, data, data_len))
+                    goto unchanged;
+
+                if (get_space_usage() - l->data_len + data_len > TOTAL_LIMIT) {
+                    serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+                    goto err;
+                }
+
+                new = alloc_efi_variable(name, name_len, data_len);
+                if (!new) {
+                    serialize_result(&ptr, EFI_OUT_OF_RESOURCES);
+                    goto err;
                 }
+                copy_variable_info(new, l);
+                if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS)
+                    new->timestamp = timestamp;
+                memcpy(new->data, data, data_len);
+                if (signature_list_var(wk, attr))
+                    to_record(new)->verified_len = data_len;
             }
-            free_efi_variable(rollback_var);
-            serialize_result(&ptr, EFI_SUCCESS);
+            free(data);
+
+            /*
+             * The old variable is the undo record: it is kept out of the list
+             * rather than copied and is put back if the save fails.
+             */
+            replace_variable(l, new);
+            rollback_var = l;
+            l = new;
+        }
+        if (should_save && persistent) {
+            save_variables(comm_buf, l, prev, rollback_var);
             return;
         }
-        prev = l;
-        l = l->next;
+        free_efi_variable(rollback_var);
+        serialize_result(&ptr, EFI_SUCCESS);
+        return;
+
+unchanged:
+        /* Nothing to replace, save or roll back. */
+        free(data);
+        serialize_result(&ptr, EFI_SUCCESS);
+        return;
     }
 
     if (data_len == 0 || !(attr & ATTR_BR)) {
@@ -1825,7 +2786,7 @@ do_set_variable(uint8_t *comm_buf)
             goto err;
         }
 
-        if (check_attr(name, name_len, &guid, attr)) {
+        if (check_attr(wk, attr)) {
             serialize_result(&ptr, EFI_INVALID_PARAMETER);
             goto err;
         }
@@ -1834,12 +2795,14 @@ do_set_variable(uint8_t *comm_buf)
             uint8_t *payload;
             UINTN payload_len;
 
+            start = stats_now();
             status = verify_auth_var(name, name_len,
                                      data, data_len,
-                                     &guid, attr, append,
+                                     &guid, wk, attr, append,
                                      NULL,
                                      &payload, &payload_len,
                                      digest, &timestamp);
+            stats_record(STAT_AUTH_VERIFY, start);
             if (status != EFI_SUCCESS) {
                 serialize_result(&ptr, status);
                 goto err;
@@ -1860,33 +2823,26 @@ do_set_variable(uint8_t *comm_buf)
             goto err;
         }
 
-        l = calloc(1, sizeof(*l));
+        l = alloc_efi_variable(name, name_len, data_len);
         if (!l) {
             serialize_result(&ptr, EFI_DEVICE_ERROR);
             goto err;
         }
 
-        l->name = name;
-        l->name_len = name_len;
+        memcpy(l->data, data, data_len);
+        if (signature_list_var(wk, attr))
+            to_record(l)->verified_len = data_len;
+        free(data);
         memcpy(&l->guid, &guid, GUID_LEN);
-        l->data = data;
-        l->data_len = data_len;
         l->attributes = attr;
         if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
             l->timestamp = timestamp;
             memcpy(l->cert, digest, SHA256_DIGEST_SIZE);
         }
-        l->next = var_list;
-        var_list = l;
+        insert_variable(l);
         if ((attr & EFI_VARIABLE_NON_VOLATILE) && persistent) {
-            if (!db->set_variable()) {
-                /* remove var inserted to head */
-                var_list = l->next;
-
-                free_efi_variable(l);
-                serialize_result(&ptr, EFI_DEVICE_ERROR);
-                return;
-            }
+            save_variables(comm_buf, l, NULL, NULL);
+            return;
         }
         serialize_result(&ptr, EFI_SUCCESS);
     }
@@ -1894,24 +2850,74 @@ do_set_variable(uint8_t *comm_buf)
     return;
 
 err:
-    free(name);
     free(data);
 }
 
+/* Returns l or the first variable after it that the caller can see. */
+static struct efi_variable *
+enum_visible(struct efi_variable *l, BOOLEAN at_runtime)
+{
+    while (at_runtime && l && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS))
+        l = l->next;
+
+    return l;
+}
+
+/*
+ * Finds where an enumeration continues after the variable given by name and
+ * guid, or where it starts if name_len is 0. *next is NULL at the end.
+ */
+static EFI_STATUS
+enum_next(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
+          BOOLEAN at_runtime, struct efi_variable **next)
+{
+    struct efi_variable *l = var_list;
+
+    if (name_len) {
+        UINT32 prev_attr;
+
+        l = find_variable(name, name_len, guid);
+        if (l) {
+            prev_attr = l->attributes;
+            l = l->next;
+        } else if (enum_resume.name &&
+                   enum_resume.name_len == name_len &&
+                   !memcmp(enum_resume.name, name, name_len) &&
+                   !memcmp(&enum_resume.guid, guid, GUID_LEN)) {
+            /* The previous variable was deleted during the enumeration. */
+            prev_attr = enum_resume.attributes;
+            l = enum_resume.next;
+        } else {
+            /* Given name & guid didn't match an existing variable */
+            return EFI_INVALID_PARAMETER;
+        }
+
+        if (at_runtime && !(prev_attr & EFI_VARIABLE_RUNTIME_ACCESS))
+            return EFI_INVALID_PARAMETER;
+    }
+
+    /* Find the next valid variable, if any. */
+    *next = enum_visible(l, at_runtime);
+    return EFI_SUCCESS;
+}
+
 static void
 do_get_next_variable(uint8_t *comm_buf)
 {
     UINTN name_len, avail_len;
-    uint8_t *ptr, *name;
+    uint8_t *ptr;
+    const uint8_t *name;
     struct efi_variable *l;
     EFI_GUID guid;
     BOOLEAN at_runtime;
+    EFI_STATUS status;
 
     ptr = comm_buf;
     unserialize_uint32(&ptr); /* version */
     unserialize_command(&ptr);
     avail_len = unserialize_uintn(&ptr);
-    name = unserialize_data(&ptr, &name_len, NAME_LIMIT);
+    name = unserialize_data_view(&ptr, comm_buf + SHMEM_SIZE, &name_len,
+                                 NAME_LIMIT);
     if (!name && name_len) {
         serialize_result(&comm_buf, EFI_DEVICE_ERROR);
         return;
@@ -1919,31 +2925,13 @@ do_get_next_variable(uint8_t *comm_buf)
     unserialize_guid(&ptr, &guid);
     at_runtime = unserialize_boolean(&ptr);
 
+    /* name points into comm_buf so it must not be used after the lookup. */
+    status = enum_next(name, name_len, &guid, at_runtime, &l);
     ptr = comm_buf;
-    l = var_list;
-
-    if (name_len) {
-        while (l) {
-            if (l->name_len == name_len &&
-                    !memcmp(l->name, name, name_len) &&
-                    !memcmp(&l->guid, &guid, GUID_LEN) &&
-                    (!at_runtime || (l->attributes & EFI_VARIABLE_RUNTIME_ACCESS)))
-                break;
-            l = l->next;
-        }
-        if (!l) {
-            /* Given name & guid didn't match an existing variable */
-            serialize_result(&ptr, EFI_INVALID_PARAMETER);
-            goto out;
-        }
-        l = l->next;
-    }
-
-    /* Find the next valid variable, if any. */
-    while (at_runtime && l && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS))
-        l = l->next;
 
-    if (l) {
+    if (status != EFI_SUCCESS) {
+        serialize_result(&ptr, status);
+    } else if (l) {
         if (avail_len < l->name_len + sizeof(CHAR16)) {
             serialize_result(&ptr, EFI_BUFFER_TOO_SMALL);
             serialize_uintn(&ptr, l->name_len + sizeof(CHAR16));
@@ -1951,13 +2939,158 @@ do_get_next_variable(uint8_t *comm_buf)
             serialize_result(&ptr, EFI_SUCCESS);
             serialize_data(&ptr, l->name, l->name_len);
             serialize_guid(&ptr, &l->guid);
+            enum_last = l;
         }
     } else {
         serialize_result(&ptr, EFI_NOT_FOUND);
     }
+}
 
-out:
-    free(name);
+/*
+ * Returns as many variables as fit in the buffer (or max_count if that is
+ * not 0), continuing an enumeration from a cursor as GetNextVariableName
+ * does. The request is the cursor's name and GUID, at_runtime and then
+ * max_count. The response is the status, the number of entries, whether the
+ * enumeration is done and then each entry's name, GUID, attributes and data
+ * size. The last entry is the cursor to continue from.
+ */
+static void
+do_get_next_variable_batch(uint8_t *comm_buf)
+{
+    UINTN name_len, max_count, count = 0;
+    uint8_t *ptr, *count_ptr;
+    const uint8_t *name;
+    struct efi_variable *l;
+    EFI_GUID guid;
+    BOOLEAN at_runtime;
+    EFI_STATUS status;
+    size_t entry;
+
+    ptr = comm_buf;
+    unserialize_uint32(&ptr); /* version */
+    unserialize_command(&ptr);
+    name = unserialize_data_view(&ptr, comm_buf + SHMEM_SIZE, &name_len,
+                                 NAME_LIMIT);
+    if (!name && name_len) {
+        serialize_result(&comm_buf, EFI_DEVICE_ERROR);
+        return;
+    }
+    unserialize_guid(&ptr, &guid);
+    at_runtime = unserialize_boolean(&ptr);
+    max_count = unserialize_uintn(&ptr);
+
+    /* name points into comm_buf so it must not be used after the lookup. */
+    status = enum_next(name, name_len, &guid, at_runtime, &l);
+    ptr = comm_buf;
+
+    if (status != EFI_SUCCESS) {
+        serialize_result(&ptr, status);
+        return;
+    }
+    if (!l) {
+        serialize_result(&ptr, EFI_NOT_FOUND);
+        return;
+    }
+
+    serialize_result(&ptr, EFI_SUCCESS);
+    count_ptr = ptr;
+    ptr += sizeof(UINTN) + sizeof(BOOLEAN);
+
+    while (l && (max_count == 0 || count < max_count)) {
+        entry = sizeof(UINTN) + l->name_len + GUID_LEN + sizeof(UINT32) +
+                sizeof(UINTN);
+        if (entry > (size_t)(comm_buf + SHMEM_SIZE - ptr))
+            break;
+
+        serialize_data(&ptr, l->name, l->name_len);
+        serialize_guid(&ptr, &l->guid);
+        serialize_uint32(&ptr, l->attributes);
+        serialize_uintn(&ptr, l->data_len);
+        enum_last = l;
+        count++;
+
+        l = enum_visible(l->next, at_runtime);
+    }
+
+    serialize_uintn(&count_ptr, count);
+    serialize_boolean(&count_ptr, !l);
+}
+
+/*
+ * Gets a number of variables at once. The request is the number of
+ * variables, each one's name and GUID and then at_runtime. The response is
+ * the status, the number of results that fit and then for each a status
+ * and, if it is EFI_SUCCESS, the attributes and data. Any results that did
+ * not fit must be asked for again.
+ */
+static void
+do_get_variable_batch(uint8_t *comm_buf)
+{
+    struct efi_variable *vars[MAX_VARIABLE_COUNT];
+    UINTN count, name_len, i;
+    uint8_t *ptr, *count_ptr;
+    const uint8_t *name;
+    EFI_GUID guid;
+    BOOLEAN at_runtime;
+    struct efi_variable *l;
+    size_t entry;
+
+    ptr = comm_buf;
+    unserialize_uint32(&ptr); /* version */
+    unserialize_command(&ptr);
+    count = unserialize_uintn(&ptr);
+    if (count == 0 || count > MAX_VARIABLE_COUNT) {
+        serialize_result(&comm_buf, EFI_INVALID_PARAMETER);
+        return;
+    }
+
+    /* The names point into comm_buf so look them all up before replying. */
+    for (i = 0; i < count; i++) {
+        if ((size_t)(comm_buf + SHMEM_SIZE - ptr) < sizeof(UINTN)) {
+            serialize_result(&comm_buf, EFI_DEVICE_ERROR);
+            return;
+        }
+        name = unserialize_data_view(&ptr, comm_buf + SHMEM_SIZE, &name_len,
+                                     NAME_LIMIT);
+        if (!name || (size_t)(comm_buf + SHMEM_SIZE - ptr) < GUID_LEN) {
+            serialize_result(&comm_buf, name_len == 0 ? EFI_NOT_FOUND : EFI_DEVICE_ERROR);
+            return;
+        }
+        unserialize_guid(&ptr, &guid);
+        vars[i] = find_variable(name, name_len, &guid);
+    }
+    if ((size_t)(comm_buf + SHMEM_SIZE - ptr) < sizeof(BOOLEAN)) {
+        serialize_result(&comm_buf, EFI_DEVICE_ERROR);
+        return;
+    }
+    at_runtime = unserialize_boolean(&ptr);
+
+    ptr = comm_buf;
+    serialize_result(&ptr, EFI_SUCCESS);
+    count_ptr = ptr;
+    ptr += sizeof(UINTN);
+
+    for (i = 0; i < count; i++) {
+        l = vars[i];
+        if (l && at_runtime && !(l->attributes & EFI_VARIABLE_RUNTIME_ACCESS))
+            l = NULL;
+
+        entry = sizeof(UINTN);
+        if (l)
+            entry += sizeof(UINT32) + sizeof(UINTN) + l->data_len;
+        if (entry > (size_t)(comm_buf + SHMEM_SIZE - ptr))
+            break;
+
+        if (l) {
+            serialize_result(&ptr, EFI_SUCCESS);
+            serialize_uint32(&ptr, l->attributes);
+            serialize_data(&ptr, l->data, l->data_len);
+        } else {
+            serialize_result(&ptr, EFI_NOT_FOUND);
+        }
+    }
+
+    serialize_uintn(&count_ptr, i);
 }
 
 static void
@@ -1988,48 +3121,88 @@ do_query_variable_info(uint8_t *comm_buf)
     serialize_uint64(&ptr, DATA_LIMIT);
 }
 
+static bool sb_failure_notified;
+
 static void
 do_notify_sb_failure(uint8_t *comm_buf)
 {
     uint8_t *ptr;
     bool ret;
-    static bool called;
+    uint64_t start;
 
     /*
      * Emit only one alert per VM start (actually per varstored instance, but
      * this is sufficient) to avoid the VM creating a flood of messages (either
      * maliciously or by accident).
      */
-    if (called) {
+    if (sb_failure_notified) {
         ptr = comm_buf;
         serialize_result(&ptr, EFI_ACCESS_DENIED);
         return;
     }
-    called = true;
+    sb_failure_notified = true;
 
     ptr = comm_buf;
     unserialize_uint32(&ptr); /* version */
     unserialize_command(&ptr);
 
+    start = stats_now();
     ret = db->sb_notify();
+    stats_record(STAT_BACKEND_SB_NOTIFY, start);
 
     ptr = comm_buf;
     serialize_result(&ptr, ret ? EFI_SUCCESS : EFI_DEVICE_ERROR);
 }
 
+/*
+ * For tracing: the hash of the variable named in a request, or 0 if it
+ * doesn't name one.
+ */
+static uint32_t
+command_name_hash(enum command_t command, uint8_t *ptr, uint8_t *comm_buf)
+{
+    const uint8_t *name;
+    UINTN name_len;
+    EFI_GUID guid;
+
+    if (command != COMMAND_GET_VARIABLE && command != COMMAND_SET_VARIABLE &&
+            command != COMMAND_GET_NEXT_VARIABLE &&
+            command != COMMAND_GET_NEXT_VARIABLE_BATCH)
+        return 0;
+    if (command == COMMAND_GET_NEXT_VARIABLE)
+        unserialize_uintn(&ptr); /* The size of the guest's name buffer. */
+
+    name = unserialize_data_view(&ptr, comm_buf + SHMEM_SIZE, &name_len,
+                                 NAME_LIMIT);
+    if (!name)
+        return 0;
+    unserialize_guid(&ptr, &guid);
+
+    return variable_hash(name, name_len, &guid);
+}
+
 void dispatch_command(uint8_t *comm_buf)
 {
     enum command_t command;
     UINT32 version;
     uint8_t *ptr = comm_buf;
+    uint64_t start = stats_now();
+    uint32_t hash = 0;
 
     version = unserialize_uint32(&ptr);
-    if (version != 1) {
+    if (version == 0 || version > PROTOCOL_VERSION) {
         DBG("Unknown version: %u\n", version);
         return;
     }
 
     command = unserialize_command(&ptr);
+    /* Version 1 guests don't know about the batched commands. */
+    if (version < 2 && command >= COMMAND_GET_NEXT_VARIABLE_BATCH)
+        command = COMMAND_COUNT;
+    if (TRACE_ENABLED(command__start) || TRACE_ENABLED(command__done))
+        hash = command_name_hash(command, ptr, comm_buf);
+    TRACE(command__start, command, hash);
+
     switch (command) {
     case COMMAND_GET_VARIABLE:
         DBG("COMMAND_GET_VARIABLE\n");
@@ -2051,10 +3224,47 @@ void dispatch_command(uint8_t *comm_buf)
         DBG("COMMAND_NOTIFY_SB_FAILURE\n");
         do_notify_sb_failure(comm_buf);
         break;
+    case COMMAND_GET_NEXT_VARIABLE_BATCH:
+        DBG("COMMAND_GET_NEXT_VARIABLE_BATCH\n");
+        do_get_next_variable_batch(comm_buf);
+        break;
+    case COMMAND_GET_VARIABLE_BATCH:
+        DBG("COMMAND_GET_VARIABLE_BATCH\n");
+        do_get_variable_batch(comm_buf);
+        break;
     default:
         DBG("Unknown command\n");
         break;
     };
+
+    /*
+     * Nothing holds on to variables between requests so this is a safe
+     * point to reclaim the space left by deleted and replaced variables,
+     * unless a SetVariable is still waiting to be saved.
+     */
+    if (!pending_set.active &&
+            (arena_dead >= ARENA_COMPACT_THRESHOLD ||
+             (arena_dead && ARENA_SIZE - arena_top < RECORD_SIZE(NAME_LIMIT, DATA_LIMIT))))
+        compact_variables();
+
+    /* The command stats are in the same order as the commands. */
+    if ((unsigned int)command < COMMAND_COUNT)
+        stats_record((enum stat_id)command, start);
+
+    /* A pending SetVariable is done once the backend has saved. */
+    if (pending_set.active)
+        pending_set.hash = hash;
+    else
+        TRACE(command__done, command, hash, command_status(comm_buf));
+}
+
+void dispatch_command_async(uint8_t *comm_buf)
+{
+    assert(!pending_set.active);
+
+    dispatch_async = true;
+    dispatch_command(comm_buf);
+    dispatch_async = false;
 }
 
 bool
@@ -2067,12 +3277,13 @@ bool
 setup_variables(void)
 {
     EFI_STATUS status;
-    UINTN data_len;
     uint8_t setup_mode = 0;
-    uint8_t *data;
     uint8_t secure_boot = 0, deployed_mode = 1, audit_mode = 0;
 
-    status = internal_set_variable(EFI_SIGNATURE_SUPPORT_NAME,
+    setup_well_known();
+
+    status = set_internal_variable(well_known_var(WK_SIGNATURE_SUPPORT),
+                                   EFI_SIGNATURE_SUPPORT_NAME,
                                    sizeof(EFI_SIGNATURE_SUPPORT_NAME),
                                    &gEfiGlobalVariableGuid,
                                    mSignatureSupport,
@@ -2081,70 +3292,80 @@ setup_variables(void)
     if (status != EFI_SUCCESS)
         return false;
 
-    status = internal_get_variable(EFI_PLATFORM_KEY_NAME,
-                                   sizeof(EFI_PLATFORM_KEY_NAME),
-                                   &gEfiGlobalVariableGuid, &data, &data_len);
-    if (status == EFI_NOT_FOUND) {
+    if (!well_known_var(WK_PK)) {
         setup_mode = 1;
         deployed_mode = 0;
-    } else if (status == EFI_SUCCESS) {
-        free(data);
-        secure_boot = secure_boot_enable;
     } else {
-        return false;
+        secure_boot = secure_boot_enable;
     }
 
-    status = internal_set_variable(EFI_SETUP_MODE_NAME,
-                                   sizeof(EFI_SETUP_MODE_NAME),
-                                   &gEfiGlobalVariableGuid,
-                                   &setup_mode,
-                                   sizeof(setup_mode),
-                                   ATTR_BR);
-    if (status != EFI_SUCCESS)
+    if (set_mode_variable(WK_SETUP_MODE, setup_mode) != EFI_SUCCESS ||
+            set_mode_variable(WK_AUDIT_MODE, audit_mode) != EFI_SUCCESS ||
+            set_mode_variable(WK_DEPLOYED_MODE, deployed_mode) != EFI_SUCCESS ||
+            set_mode_variable(WK_SECURE_BOOT, secure_boot) != EFI_SUCCESS)
         return false;
 
-    status = internal_set_variable(EFI_AUDIT_MODE_NAME,
-                                   sizeof(EFI_AUDIT_MODE_NAME),
-                                   &gEfiGlobalVariableGuid,
-                                   &audit_mode,
-                                   sizeof(audit_mode),
-                                   ATTR_BR);
-    if (status != EFI_SUCCESS)
-        return false;
+    return true;
+}
 
-    status = internal_set_variable(EFI_DEPLOYED_MODE_NAME,
-                                   sizeof(EFI_DEPLOYED_MODE_NAME),
-                                   &gEfiGlobalVariableGuid,
-                                   &deployed_mode,
-                                   sizeof(deployed_mode),
-                                   ATTR_BR);
-    if (status != EFI_SUCCESS)
-        return false;
+/*
+ * Frees every variable and the memory and caches behind them, leaving an
+ * empty store. For the tools, which go through many VMs in one process.
+ */
+void
+free_variables(void)
+{
+    struct efi_variable *l;
 
-    status = internal_set_variable(EFI_SECURE_BOOT_MODE_NAME,
-                                   sizeof(EFI_SECURE_BOOT_MODE_NAME),
-                                   &gEfiGlobalVariableGuid,
-                                   &secure_boot,
-                                   sizeof(secure_boot),
-                                   ATTR_BR);
-    if (status != EFI_SUCCESS)
-        return false;
+    while (var_list) {
+        l = var_list;
+        remove_variable(l);
+        free_efi_variable(l);
+    }
 
-    return true;
+    if (arena)
+        munmap(arena, ARENA_SIZE);
+    arena = NULL;
+    arena_top = 0;
+    arena_dead = 0;
+
+    free_verify_state();
+}
+
+/*
+ * Drops the state built up to verify authenticated variables. It is rebuilt
+ * the next time it is needed.
+ */
+void
+free_verify_state(void)
+{
+    free_kek_stores();
+    free(sig_cache.slots);
+    memset(&sig_cache, 0, sizeof(sig_cache));
 }
 
 static bool
 set_variable_from_auth(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
                        const uint8_t *data, off_t data_len, bool append)
 {
-    uint8_t buf[SHMEM_SIZE];
-    uint8_t *ptr;
+    uint8_t *buf, *ptr;
     EFI_STATUS status;
     UINT32 attr = ATTR_BRNV_TIME;
 
     if (append)
         attr |= EFI_VARIABLE_APPEND_WRITE;
 
+    /*
+     * Sized for the request rather than a whole SHMEM_SIZE on the stack, which
+     * would stay resident for the life of the process.
+     */
+    buf = malloc(2 * sizeof(UINT32) + sizeof(UINTN) + name_len + GUID_LEN +
+                 sizeof(UINTN) + data_len + sizeof(UINT32) + 1);
+    if (!buf) {
+        ERR("Out of memory!\n");
+        return false;
+    }
+
     ptr = buf;
     serialize_uint32(&ptr, 1); /* version */
     serialize_uint32(&ptr, COMMAND_SET_VARIABLE);
@@ -2157,6 +3378,7 @@ set_variable_from_auth(const uint8_t *name, UINTN name_len, const EFI_GUID *guid
 
     ptr = buf;
     status = unserialize_uintn(&ptr);
+    free(buf);
     if (status != EFI_SUCCESS) {
         ERR("Failed to execute auth data: 0x%lx\n", status);
         return false;
@@ -2203,15 +3425,20 @@ setup_keys(void)
     return true;
 }
 
+/*
+ * The auth files are mapped rather than read so that every varstored on the
+ * host shares the one copy in the page cache.
+ */
 static bool
-load_one_auth_data(const char *path, uint8_t **data_out, off_t *len)
+load_one_auth_data(const char *path, uint8_t **data_out, off_t *len,
+                   bool *mapped)
 {
     struct stat st;
-    FILE *f;
     uint8_t *data;
+    int fd;
 
-    f = fopen(path, "r");
-    if (!f) {
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
         if (errno == ENOENT) {
             WARN("Auth file '%s' is missing!\n", path);
             return true;
@@ -2221,35 +3448,40 @@ load_one_auth_data(const char *path, uint8_t **data_out, off_t *len)
         }
     }
 
-    if (fstat(fileno(f), &st) == -1) {
+    if (fstat(fd, &st) == -1) {
         ERR("Failed to stat '%s'\n", path);
-        fclose(f);
+        close(fd);
         return false;
     }
 
     /*
      * This will be checked later during SetVariable but check it now to avoid
-     * reading a malicously large file into memory.
+     * mapping a malicously large file.
      */
     if (st.st_size > DATA_LIMIT) {
         ERR("Auth file '%s' is too large: %ld\n", path, st.st_size);
-        fclose(f);
+        close(fd);
         return false;
     }
 
-    data = malloc(st.st_size);
-    if (!data) {
-        ERR("Out of memory!\n");
-        fclose(f);
-        return false;
-    }
-    if (fread(data, 1, st.st_size, f) != st.st_size) {
-        ERR("Failed to read '%s'\n", path);
-        fclose(f);
-        free(data);
-        return false;
+    /* An empty file can't be mapped; SetVariable rejects it later. */
+    if (st.st_size == 0) {
+        close(fd);
+        data = malloc(1);
+        if (!data) {
+            ERR("Out of memory!\n");
+            return false;
+        }
+        *mapped = false;
+    } else {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            ERR("Failed to map '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        *mapped = true;
     }
-    fclose(f);
 
     *data_out = data;
     *len = st.st_size;
@@ -2265,7 +3497,8 @@ load_auth_data(void)
     for (i = 0; i < ARRAY_SIZE(auth_info); i++) {
         if (!load_one_auth_data(auth_info[i].path,
                                 &auth_info[i].data,
-                                &auth_info[i].data_len))
+                                &auth_info[i].data_len,
+                                &auth_info[i].mapped))
             return false;
     }
 
@@ -2278,7 +3511,65 @@ free_auth_data(void)
     int i;
 
     for (i = 0; i < ARRAY_SIZE(auth_info); i++) {
-        free(auth_info[i].data);
+        if (auth_info[i].mapped)
+            munmap(auth_info[i].data, auth_info[i].data_len);
+        else
+            free(auth_info[i].data);
         auth_info[i].data = NULL;
+        auth_info[i].mapped = false;
+    }
+}
+
+/*
+ * Calculate a SHA256 digest identifying the variables setup_keys would create
+ * from the loaded auth data: auth_enforce, then the length and contents of
+ * each auth file in order.
+ */
+bool
+auth_data_digest(uint8_t *digest)
+{
+    SHA256_CTX ctx;
+    uint8_t enforce = auth_enforce;
+    int i;
+
+    if (!SHA256_Init(&ctx))
+        return false;
+
+    if (!SHA256_Update(&ctx, &enforce, sizeof(enforce)))
+        return false;
+
+    for (i = 0; i < ARRAY_SIZE(auth_info); i++) {
+        uint64_t len = auth_info[i].data ? auth_info[i].data_len : 0;
+
+        if (!SHA256_Update(&ctx, &len, sizeof(len)))
+            return false;
+        if (len && !SHA256_Update(&ctx, auth_info[i].data, len))
+            return false;
     }
+
+    return SHA256_Final(digest, &ctx);
 }
+
+/* The state of each guest's variable store, for multi-domain mode. */
+const struct context_region handler_context[] = {
+    CONTEXT_REGION(var_list),
+    CONTEXT_REGION(secure_boot_enable),
+    CONTEXT_REGION(auth_enforce),
+    CONTEXT_REGION(var_index),
+    CONTEXT_REGION(handle_var),
+    CONTEXT_REGION(space_used),
+    CONTEXT_REGION(trust_generation),
+    CONTEXT_REGION(enum_last),
+    CONTEXT_REGION(enum_resume),
+    CONTEXT_REGION(arena),
+    CONTEXT_REGION(arena_top),
+    CONTEXT_REGION(arena_dead),
+    CONTEXT_REGION(kek_stores),
+    CONTEXT_REGION(verify_cache),
+    CONTEXT_REGION(verify_cache_next),
+    CONTEXT_REGION(sig_cache),
+    CONTEXT_REGION(dispatch_async),
+    CONTEXT_REGION(pending_set),
+    CONTEXT_REGION(sb_failure_notified),
+    CONTEXT_END
+};
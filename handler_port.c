@@ -36,6 +36,7 @@
 #include <xenctrl.h>
 #include <debug.h>
 #include <handler_port.h>
+#include <stats.h>
 
 #include "io_port.h"
 
@@ -44,13 +45,29 @@
 static struct {
     xenforeignmemory_handle *fmem;
     domid_t domid;
+    /*
+     * The guest normally uses the same buffer for every call, so keep the
+     * last mapping around rather than mapping and unmapping it each time.
+     */
+    void *shmem;
+    xen_pfn_t pfn;
 } io_info;
 
+void
+invalidate_handler_io_port(void)
+{
+    if (!io_info.shmem)
+        return;
+
+    xenforeignmemory_unmap(io_info.fmem, io_info.shmem, SHMEM_PAGES);
+    io_info.shmem = NULL;
+}
+
 static void
 io_port_writel(uint64_t offset, uint64_t size, uint32_t val)
 {
     xen_pfn_t pfns[SHMEM_PAGES];
-    void *shmem;
+    uint64_t start;
     int i;
 
     if (offset != 0 || size != sizeof(uint32_t)) {
@@ -58,23 +75,29 @@ io_port_writel(uint64_t offset, uint64_t size, uint32_t val)
         return;
     }
 
-    for (i = 0; i < SHMEM_PAGES; i++)
-        pfns[i] = val + i;
     DBG("io_port write\n");
 
-    shmem = xenforeignmemory_map(io_info.fmem,
-                                 io_info.domid,
-                                 PROT_READ | PROT_WRITE,
-                                 SHMEM_PAGES, pfns, NULL);
-    if (!shmem) {
-        DBG("map foreign range failed: %d\n", errno);
-        return;
-    }
+    if (io_info.shmem && io_info.pfn != val)
+        invalidate_handler_io_port();
 
-    dispatch_command(shmem);
+    if (!io_info.shmem) {
+        for (i = 0; i < SHMEM_PAGES; i++)
+            pfns[i] = val + i;
 
-    xenforeignmemory_unmap(io_info.fmem, shmem, SHMEM_PAGES);
+        start = stats_now();
+        io_info.shmem = xenforeignmemory_map(io_info.fmem,
+                                             io_info.domid,
+                                             PROT_READ | PROT_WRITE,
+                                             SHMEM_PAGES, pfns, NULL);
+        stats_record(STAT_FOREIGN_MAP, start);
+        if (!io_info.shmem) {
+            DBG("map foreign range failed: %d\n", errno);
+            return;
+        }
+        io_info.pfn = val;
+    }
 
+    dispatch_command_async(io_info.shmem);
 }
 
 bool
@@ -86,3 +109,8 @@ setup_handler_io_port(domid_t domid, xenforeignmemory_handle *fmem) {
     return register_io_port_writel_handler(HANDLER_PORT_ADDRESS, io_port_writel);
 }
 
+
+const struct context_region handler_port_context[] = {
+    CONTEXT_REGION(io_info),
+    CONTEXT_END
+};
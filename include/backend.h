@@ -31,12 +31,20 @@
 
 #include <stdbool.h>
 
+#include "context.h"
+
 enum backend_init_status {
     BACKEND_INIT_FAILURE,
     BACKEND_INIT_SUCCESS,
     BACKEND_INIT_FIRSTBOOT,
 };
 
+enum backend_save_status {
+    BACKEND_SAVE_FAILURE,
+    BACKEND_SAVE_SUCCESS,
+    BACKEND_SAVE_PENDING,
+};
+
 struct backend {
     /* Called to handle arguments specific to the backend. */
     bool (*parse_arg)(const char *name, const char *val);
@@ -44,18 +52,72 @@ struct backend {
     bool (*check_args)(void);
     /* Called at startup when not resuming to load the initial data. */
     enum backend_init_status (*init)(void);
+    /*
+     * Optional. Like init, but the load is finished from poll_event, which
+     * calls done with the result.
+     */
+    bool (*init_async)(void (*done)(enum backend_init_status status));
     /* Called to save state when exiting. */
     bool (*save)(void);
     /* Called to resume from previously saved state. */
     bool (*resume)(void);
     /* Called when set_variable updates an NV variable. */
     bool (*set_variable)(void);
+    /*
+     * Optional. Like set_variable, but may return BACKEND_SAVE_PENDING to
+     * finish the save from the main loop. In that case, done is called from
+     * poll_event or flush once the update is durable or the save has failed.
+     */
+    enum backend_save_status (*set_variable_async)(void (*done)(bool saved));
+    /*
+     * Optional. Starts a transaction. Until commit or abort is called,
+     * set_variable only notes that there are updates to write out.
+     */
+    bool (*begin)(void);
+    /* Optional. Writes out the updates made since begin in one go. */
+    bool (*commit)(void);
+    /*
+     * Optional. Like commit, but may return BACKEND_SAVE_PENDING to finish
+     * from poll_event, as for set_variable_async.
+     */
+    enum backend_save_status (*commit_async)(void (*done)(bool saved));
+    /*
+     * Optional. Ends a transaction without writing out its updates. The
+     * variables in memory are left as they are.
+     */
+    void (*abort)(void);
     /* Called when a Secure Boot verification failure occurs. */
     bool (*sb_notify)(void);
+    /*
+     * Optional. Called from the main loop to get the number of milliseconds
+     * until deferred updates are due to be written out, or -1 if there are
+     * none.
+     */
+    int (*flush_timeout)(void);
+    /*
+     * Optional. Called to write out deferred updates once they are due, or
+     * unconditionally if force is set.
+     */
+    bool (*flush)(bool force);
+    /*
+     * Optional. Returns a file descriptor for the main loop to poll and sets
+     * events, or returns -1 if there is nothing to wait for.
+     */
+    int (*poll_fd)(short *events);
+    /* Optional. Called when the file descriptor from poll_fd is ready. */
+    void (*poll_event)(short revents);
+    /* Optional. Called after the final save to release any resources. */
+    void (*fini)(void);
+    /*
+     * Optional. NULL-terminated list of tables of the backend's per-domain
+     * state, for multi-domain mode.
+     */
+    const struct context_region *const *context;
 };
 
 extern const struct backend *db;
 extern const struct backend xapidb;
+extern const struct backend filedb;
 extern const struct backend xapidb_cmdline;
 
 #endif
@@ -36,7 +36,8 @@ enum log_level {
     LOG_LVL_DEBUG,
 };
 
-extern const enum log_level log_level;
+/* May be changed at any time, e.g. to turn on debugging in a running process. */
+extern enum log_level log_level;
 
 #ifdef __COVERITY__
 
@@ -47,43 +48,41 @@ extern const enum log_level log_level;
 
 #else
 
-#define ERR(...)                                \
-    do {                                        \
-        if (log_level >= LOG_LVL_ERROR) {       \
-            fprintf(stderr, "%s: ", __func__);  \
-            fprintf(stderr, __VA_ARGS__);       \
-            fflush(stderr);                     \
-        }                                       \
-    } while (0)
-
-#define WARN(...)                               \
-    do {                                        \
-        if (log_level >= LOG_LVL_WARN) {        \
-            fprintf(stderr, "%s: ", __func__);  \
-            fprintf(stderr, __VA_ARGS__);       \
-            fflush(stderr);                     \
-        }                                       \
-    } while (0)
+/*
+ * Writes a message prefixed with func: errors and warnings to stderr, the
+ * rest to stdout. The message goes out straight away unless the log ring is
+ * enabled.
+ */
+void log_printf(enum log_level level, const char *func, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
 
-#define INFO(...)                               \
-    do {                                        \
-        if (log_level >= LOG_LVL_INFO) {        \
-            printf("%s: ", __func__);           \
-            printf(__VA_ARGS__);                \
-            fflush(stdout);                     \
-        }                                       \
+/* A disabled log site costs only the test of log_level. */
+#define LOG(level, ...)                                     \
+    do {                                                    \
+        if (__builtin_expect(log_level >= (level), 0))      \
+            log_printf((level), __func__, __VA_ARGS__);     \
     } while (0)
 
-#define DBG(...)                                \
-    do {                                        \
-        if (log_level >= LOG_LVL_DEBUG) {       \
-            printf("%s: ", __func__);           \
-            printf(__VA_ARGS__);                \
-            fflush(stdout);                     \
-        }                                       \
-    } while (0)
+#define ERR(...) LOG(LOG_LVL_ERROR, __VA_ARGS__)
+#define WARN(...) LOG(LOG_LVL_WARN, __VA_ARGS__)
+#define INFO(...) LOG(LOG_LVL_INFO, __VA_ARGS__)
+#define DBG(...) LOG(LOG_LVL_DEBUG, __VA_ARGS__)
 
 #endif
 
+/*
+ * Instead of writing messages out as they are logged, keeps them in a ring
+ * in memory for log_drain() to write out when it won't block. Whatever is
+ * left is written out at exit and if the process crashes.
+ */
+void log_ring_enable(void);
+/*
+ * Writes out as much of the ring as can be written without blocking.
+ * Returns the fd waiting to be written to, or -1 once the ring is empty.
+ */
+int log_drain(void);
+/* Writes out the whole ring, blocking if need be. */
+void log_flush(void);
+
 #endif  /* _DEBUG_H */
 
@@ -32,6 +32,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "context.h"
 #include "efi.h"
 
 #define NAME_LIMIT 4096 /* Maximum length of name */
@@ -46,18 +47,35 @@
 #define VARIABLE_SIZE_OVERHEAD 128
 #define MAX_VARIABLE_COUNT (TOTAL_LIMIT / VARIABLE_SIZE_OVERHEAD)
 
+/* Number of buckets in the (name, GUID) index. Must be a power of 2. */
+#define VARIABLE_INDEX_SIZE 256
+
+/* Maximum number of variables that can be looked up by handle. */
+#define MAX_VARIABLE_HANDLES 16
+
 #define PAGE_SIZE 4096
 #define SHMEM_PAGES 16
 #define SHMEM_SIZE (SHMEM_PAGES * PAGE_SIZE)
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
+/*
+ * Version 2 of the protocol adds the batched commands. Everything else is
+ * the same in both versions. Requests with a version that isn't supported
+ * are left untouched, so a guest can tell by presetting the status.
+ */
+#define PROTOCOL_VERSION 2
+
 enum command_t {
     COMMAND_GET_VARIABLE,
     COMMAND_SET_VARIABLE,
     COMMAND_GET_NEXT_VARIABLE,
     COMMAND_QUERY_VARIABLE_INFO,
     COMMAND_NOTIFY_SB_FAILURE,
+    /* Version 2 only. */
+    COMMAND_GET_NEXT_VARIABLE_BATCH,
+    COMMAND_GET_VARIABLE_BATCH,
+    COMMAND_COUNT
 };
 
 struct efi_variable {
@@ -70,16 +88,42 @@ struct efi_variable {
     EFI_TIME timestamp;
     uint8_t cert[SHA256_DIGEST_SIZE];
     struct efi_variable *next;
+    struct efi_variable *prev;
+    /* Hash of name and guid, and the next entry in the same index bucket. */
+    uint32_t hash;
+    struct efi_variable *index_next;
 };
 
 extern struct efi_variable *var_list;
 
+struct efi_variable *
+find_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid);
+void insert_variable(struct efi_variable *l);
+void remove_variable(struct efi_variable *l);
+void replace_variable(struct efi_variable *old, struct efi_variable *new);
+struct efi_variable *
+alloc_efi_variable(const uint8_t *name, UINTN name_len, UINTN data_len);
+struct efi_variable *
+alloc_efi_variable_view(const uint8_t *name, UINTN name_len,
+                        const uint8_t *data, UINTN data_len);
+void free_efi_variable(struct efi_variable *l);
+
 void dispatch_command(uint8_t *comm_buf);
+/*
+ * Like dispatch_command, but SetVariable may be left pending while the
+ * backend saves asynchronously. The result is written to comm_buf once
+ * command_pending() returns false.
+ */
+void dispatch_command_async(uint8_t *comm_buf);
+bool command_pending(void);
 bool setup_crypto(void);
 bool setup_variables(void);
+void free_variables(void);
+void free_verify_state(void);
 bool setup_keys(void);
 bool load_auth_data(void);
 void free_auth_data(void);
+bool auth_data_digest(uint8_t *digest);
 
 EFI_STATUS
 internal_set_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
@@ -87,6 +131,11 @@ internal_set_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
 EFI_STATUS
 internal_get_variable(const uint8_t *name, UINTN name_len, const EFI_GUID *guid,
                       uint8_t **data, UINTN *data_len);
+int internal_variable_handle(const uint8_t *name, UINTN name_len,
+                             const EFI_GUID *guid);
+const struct efi_variable *internal_variable_ref(int handle);
+
+extern const struct context_region handler_context[];
 
 extern const uint8_t TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME[];
 extern const size_t TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME_SIZE;
@@ -94,5 +143,10 @@ extern const size_t TCG2_PHYSICAL_PRESENCEFLAGSLOCK_NAME_SIZE;
 extern bool secure_boot_enable;
 extern bool auth_enforce;
 extern bool persistent;
+/*
+ * Trade speed for memory where the difference is small, for hosts running
+ * many instances.
+ */
+extern bool low_memory;
 
 #endif
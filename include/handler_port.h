@@ -37,4 +37,9 @@
 
 bool setup_handler_io_port(domid_t domid, xenforeignmemory_handle *fmem);
 
+/* Drop the cached mapping of the guest's command buffer. */
+void invalidate_handler_io_port(void);
+
+extern const struct context_region handler_port_context[];
+
 #endif
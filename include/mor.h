@@ -39,4 +39,6 @@ EFI_STATUS do_set_mor_control_lock(uint8_t *data, UINTN data_len,
 #define MOR_LOCK_REV2_LEN 8
 extern uint8_t mor_key[MOR_LOCK_REV2_LEN];
 
+extern const struct context_region mor_context[];
+
 #endif
@@ -32,6 +32,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <context.h>
+
 typedef struct {
           uint32_t idx;
           uint8_t func[256];
@@ -39,6 +41,7 @@ typedef struct {
 
 
 extern ppi_vdata_t ppi_vdata;
+extern const struct context_region ppi_context[];
 
 bool setup_ppi_port(void);
 bool setup_ppi_variables(void);
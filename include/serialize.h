@@ -99,6 +99,13 @@ serialize_uint64(uint8_t **ptr, UINT64 var)
     *ptr += sizeof var;
 }
 
+static inline void
+serialize_boolean(uint8_t **ptr, BOOLEAN var)
+{
+    memcpy(*ptr, &var, sizeof(var));
+    *ptr += sizeof var;
+}
+
 static inline uint8_t *
 unserialize_data(uint8_t **ptr, UINTN *len, UINTN limit)
 {
@@ -120,6 +127,34 @@ unserialize_data(uint8_t **ptr, UINTN *len, UINTN limit)
     return data;
 }
 
+/*
+ * Like unserialize_data() but return a pointer into the buffer rather than a
+ * copy. NULL is returned if the length is 0, greater than limit or if the
+ * length or data would run past end.
+ */
+static inline const uint8_t *
+unserialize_data_view(uint8_t **ptr, const uint8_t *end, UINTN *len,
+                      UINTN limit)
+{
+    const uint8_t *data;
+
+    if (*ptr > end || (size_t)(end - *ptr) < sizeof(*len)) {
+        *len = 0;
+        return NULL;
+    }
+
+    memcpy(len, *ptr, sizeof(*len));
+    *ptr += sizeof *len;
+
+    if (*len > limit || *len == 0 || *len > (UINTN)(end - *ptr))
+        return NULL;
+
+    data = *ptr;
+    *ptr += *len;
+
+    return data;
+}
+
 static inline void
 unserialize_data_inplace(uint8_t **ptr, uint8_t *buf, UINTN len)
 {
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef  STATS_H
+#define  STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "context.h"
+
+/*
+ * Call counts and latency histograms for the commands and the slow
+ * operations behind them, kept per domain. Bucket 0 counts operations that
+ * took less than 1us, bucket i those that took [2^(i-1), 2^i)us and the
+ * last bucket everything longer.
+ */
+#define STATS_BUCKETS 24
+
+enum stat_id {
+    /* One per enum command_t, in the same order. */
+    STAT_GET_VARIABLE,
+    STAT_SET_VARIABLE,
+    STAT_GET_NEXT_VARIABLE,
+    STAT_QUERY_VARIABLE_INFO,
+    STAT_NOTIFY_SB_FAILURE,
+    STAT_GET_NEXT_VARIABLE_BATCH,
+    STAT_GET_VARIABLE_BATCH,
+    /* Authenticated variable verification within SetVariable. */
+    STAT_AUTH_VERIFY,
+    STAT_BACKEND_INIT,
+    STAT_BACKEND_RESUME,
+    STAT_BACKEND_SAVE,
+    STAT_BACKEND_SET_VARIABLE,
+    STAT_BACKEND_SB_NOTIFY,
+    /* Mapping the guest's communication buffer. */
+    STAT_FOREIGN_MAP,
+    /* Sleeping for send credit, and saves deferred for lack of it. */
+    STAT_RATE_LIMIT_SLEEP,
+    STAT_RATE_LIMIT_DEFER,
+    STAT_COUNT
+};
+
+/* Returns a monotonic timestamp in nanoseconds. */
+uint64_t stats_now(void);
+/* Records an operation of the given duration. */
+void stats_add(enum stat_id id, uint64_t ns);
+/* Records an operation that began at start, a stats_now() timestamp. */
+void stats_record(enum stat_id id, uint64_t start);
+/* Writes out the statistics, one line per operation that has happened. */
+void stats_print(FILE *f, unsigned int domid);
+void stats_reset(void);
+
+extern const struct context_region stats_context[];
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef  TRACE_H
+#define  TRACE_H
+
+/*
+ * Static tracepoints for bpftrace, SystemTap and perf, built in with
+ * "make SDT=y". Each probe is a single nop when nothing is attached. Any
+ * argument that takes work to compute should only be computed when
+ * TRACE_ENABLED() says someone is listening.
+ */
+#define TRACE_PROBES(X) \
+    X(ioreq__start) \
+    X(ioreq__done) \
+    X(command__start) \
+    X(command__done) \
+    X(pkcs7__verify__start) \
+    X(pkcs7__verify__done) \
+    X(backend__set__start) \
+    X(backend__set__done) \
+    X(rate__limit__sleep__start) \
+    X(rate__limit__sleep__done) \
+    X(rate__limit__defer)
+
+#ifdef HAVE_SDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define TRACE_SEMAPHORE(name) \
+    extern unsigned short varstored_##name##_semaphore;
+TRACE_PROBES(TRACE_SEMAPHORE)
+#undef TRACE_SEMAPHORE
+
+#define TRACE_ENABLED(name) \
+    __builtin_expect(varstored_##name##_semaphore != 0, 0)
+#define TRACE(name, ...) STAP_PROBEV(varstored, name, ##__VA_ARGS__)
+
+#else
+
+static inline void trace_args(int unused, ...) {}
+
+#define TRACE_ENABLED(name) 0
+/* The arguments still count as used but are never evaluated. */
+#define TRACE(name, ...) \
+    do { if (0) trace_args(0, ##__VA_ARGS__); } while (0)
+
+#endif
+
+#endif
@@ -36,7 +36,10 @@
 #include "efi.h"
 
 #define DB_MAGIC "VARS"
-#define DB_VERSION 2
+#define DB_VERSION 3
+/* Version 3 is version 2 with everything after the header compressed. */
+#define DB_VERSION_UNCOMPRESSED 2
+#define DB_VERSION_COMPRESSED 3
 /* magic, version, count, data length */
 #define DB_HEADER_LEN \
     (strlen(DB_MAGIC) + sizeof(UINT32) + sizeof(UINTN) + sizeof(UINTN))
@@ -49,14 +52,68 @@
 
 #define MAX_FILE_SIZE (128 * 1024)
 
+/*
+ * The save file used across suspend/resume and migration. It is laid out to
+ * be mapped and used in place: the header, a table with an entry for each
+ * variable and then the names and data at the offsets given in the table.
+ * The checksum covers the header (with the checksum as 0) and the table.
+ */
+#define SAVE_MAGIC "VSAV"
+#define SAVE_VERSION 1
+
+struct save_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t checksum;
+    uint64_t size; /* Size of the whole file. */
+    uint64_t count;
+    uint8_t ancillary[ANCILLARY_DATA_LEN];
+};
+
+struct save_entry {
+    uint64_t name_off;
+    uint64_t name_len;
+    uint64_t data_off;
+    uint64_t data_len;
+    EFI_GUID guid;
+    EFI_TIME timestamp;
+    uint8_t cert[SHA256_DIGEST_SIZE];
+    uint32_t attributes;
+};
+
+#define MAX_SAVE_SIZE \
+    (sizeof(struct save_header) + \
+     MAX_VARIABLE_COUNT * sizeof(struct save_entry) + MAX_FILE_SIZE)
+
 extern char *xapidb_arg_uuid;
 extern char *xapidb_arg_socket;
+extern unsigned int xapidb_arg_writeback;
+extern unsigned int xapidb_arg_compress;
 
 bool xapidb_serialize_variables(uint8_t **out, size_t *out_len, bool only_nv);
 bool xapidb_set_variable(void);
+enum backend_save_status xapidb_set_variable_async(void (*done)(bool saved));
+bool xapidb_begin(void);
+bool xapidb_commit(void);
+enum backend_save_status xapidb_commit_async(void (*done)(bool saved));
+void xapidb_abort(void);
+int xapidb_flush_timeout(void);
+bool xapidb_flush(bool force);
+int xapidb_poll_fd(short *events);
+void xapidb_poll_event(short revents);
+void xapidb_fini(void);
+void xapidb_close(void);
 bool xapidb_parse_blob(uint8_t **buf, int len);
+bool xapidb_serialize_save(uint8_t **out, size_t *out_len);
+bool xapidb_parse_save(const uint8_t *buf, size_t len);
+bool xapidb_save_to_file(const char *path);
+bool xapidb_resume_from_file(const char *path);
+void xapidb_resume_unmap(void);
 enum backend_init_status xapidb_init(void);
+bool xapidb_init_async(void (*done)(enum backend_init_status status));
 enum backend_init_status xapidb_file_init(void);
 bool xapidb_sb_notify(void);
 
+extern const struct context_region xapidb_lib_context[];
+
 #endif
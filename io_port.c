@@ -236,3 +236,8 @@ io_port_initialize(xendevicemodel_handle *dmod,
 
     return 0;
 }
+
+const struct context_region io_port_context[] = {
+    CONTEXT_REGION(io_port),
+    CONTEXT_END
+};
@@ -32,6 +32,8 @@
 #include <xendevicemodel.h>
 #include <xenforeignmemory.h>
 
+#include <context.h>
+
 #define IO_PORT_UNMAPPED (~(0u))
 
 typedef void (*writel_callback_t)(uint64_t offset, uint64_t size, uint32_t val);
@@ -50,4 +52,6 @@ int  io_port_initialize(xendevicemodel_handle *dmod,
                         ioservid_t ioservid,
                         uint64_t addr, uint64_t size);
 
+extern const struct context_region io_port_context[];
+
 #endif /* _IO_PORT_H */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <debug.h>
+
+/*
+ * Longest message kept in the ring, including the function name. It must be
+ * less than PIPE_BUF (4096 on Linux).
+ */
+#define LOG_MESSAGE_MAX 1024
+
+/* Must be a power of 2. */
+#define LOG_RING_SIZE (64 * 1024)
+
+/*
+ * Each message in the ring is a header followed by its text, wrapping at the
+ * end. Only the main thread logs and drains, but a crash may interrupt either
+ * at any point, so head is only advanced once a message is complete and the
+ * crash handler writes out what lies between tail and head.
+ */
+struct log_header {
+    uint16_t len;
+    uint8_t fd;
+} __attribute__((packed));
+
+static bool ring_enabled;
+static char ring[LOG_RING_SIZE];
+static size_t ring_head, ring_tail; /* Free running. */
+/* Bytes of the message at ring_tail already written out. */
+static size_t ring_written;
+static unsigned long ring_dropped;
+
+static void
+ring_copy_out(size_t pos, void *buf, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+
+    memcpy(buf, ring + off, first);
+    memcpy((char *)buf + first, ring, len - first);
+}
+
+static void
+ring_copy_in(size_t pos, const void *buf, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+
+    memcpy(ring + off, buf, first);
+    memcpy(ring, (const char *)buf + first, len - first);
+}
+
+static bool
+ring_put(int fd, const char *msg, size_t len)
+{
+    struct log_header hdr = {.len = len, .fd = fd};
+    size_t head = ring_head;
+
+    if (LOG_RING_SIZE - (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE)) <
+            sizeof(hdr) + len)
+        return false;
+
+    ring_copy_in(head, &hdr, sizeof(hdr));
+    ring_copy_in(head + sizeof(hdr), msg, len);
+    __atomic_store_n(&ring_head, head + sizeof(hdr) + len, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void
+log_printf(enum log_level level, const char *func, const char *fmt, ...)
+{
+    FILE *stream = level <= LOG_LVL_WARN ? stderr : stdout;
+    char msg[LOG_MESSAGE_MAX];
+    va_list ap;
+    int len, n;
+
+    if (!ring_enabled) {
+        fprintf(stream, "%s: ", func);
+        va_start(ap, fmt);
+        vfprintf(stream, fmt, ap);
+        va_end(ap);
+        fflush(stream);
+        return;
+    }
+
+    if (ring_dropped) {
+        len = snprintf(msg, sizeof(msg), "%s: %lu messages dropped\n",
+                       __func__, ring_dropped);
+        if (!ring_put(STDERR_FILENO, msg, len)) {
+            ring_dropped++;
+            return;
+        }
+        ring_dropped = 0;
+    }
+
+    len = snprintf(msg, sizeof(msg), "%s: ", func);
+    if (len < 0 || len >= sizeof(msg))
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(msg + len, sizeof(msg) - len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    len += n;
+    if (len >= sizeof(msg)) {
+        /* Truncated, but still a line. */
+        len = sizeof(msg) - 1;
+        msg[len - 1] = '\n';
+    }
+
+    if (!ring_put(fileno(stream), msg, len))
+        ring_dropped++;
+}
+
+/* This is used from signal handlers so it must stay async-signal-safe. */
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = write(fd, buf, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return;
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/*
+ * Writes out the rest of the message at the tail. Unless blocking, only
+ * writes if the fd is ready for it and returns false if the message is not
+ * done. A message is shorter than PIPE_BUF, so writing it to a pipe that is
+ * ready does not block.
+ */
+static bool
+drain_one(bool block)
+{
+    char buf[LOG_MESSAGE_MAX];
+    struct log_header hdr;
+    struct pollfd pfd;
+    size_t tail = ring_tail, len;
+    ssize_t ret;
+
+    ring_copy_out(tail, &hdr, sizeof(hdr));
+    len = hdr.len - ring_written;
+    ring_copy_out(tail + sizeof(hdr) + ring_written, buf, len);
+
+    if (block) {
+        write_all(hdr.fd, buf, len);
+        ret = len;
+    } else {
+        pfd.fd = hdr.fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, 0) != 1)
+            return false;
+
+        ret = write(hdr.fd, buf, len);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return false;
+            /* Give up on the message rather than retrying forever. */
+            ret = len;
+        }
+    }
+
+    ring_written += ret;
+    if (ring_written < hdr.len)
+        return false;
+
+    ring_written = 0;
+    __atomic_store_n(&ring_tail, tail + sizeof(hdr) + hdr.len, __ATOMIC_RELEASE);
+    return true;
+}
+
+int
+log_drain(void)
+{
+    struct log_header hdr;
+
+    while (ring_tail != __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE)) {
+        if (!drain_one(false)) {
+            ring_copy_out(ring_tail, &hdr, sizeof(hdr));
+            return hdr.fd;
+        }
+    }
+
+    return -1;
+}
+
+void
+log_flush(void)
+{
+    while (ring_tail != __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE))
+        drain_one(true);
+}
+
+static void
+log_crash(int num)
+{
+    log_flush();
+    /* The handler has been reset so this is fatal. */
+    raise(num);
+}
+
+void
+log_ring_enable(void)
+{
+    static const int crash_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    struct sigaction sa;
+    int i;
+
+    if (ring_enabled)
+        return;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = log_crash;
+    sa.sa_flags = SA_RESETHAND;
+    for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++)
+        sigaction(crash_signals[i], &sa, NULL);
+
+    atexit(log_flush);
+    ring_enabled = true;
+}
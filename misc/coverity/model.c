@@ -101,12 +101,6 @@ int vasprintf(char **strp, const char *fmt, va_list ap)
     }
 }
 
-typedef void* xmlXPathObjectPtr;
-void xmlXPathFreeObject(xmlXPathObjectPtr obj)
-{
-    __coverity_free__(obj);
-}
-
 /*
  * Local variables:
  * mode: C
@@ -93,6 +93,31 @@ setup_mor_variables(void)
     return true;
 }
 
+/*
+ * Returns the state of MemoryOverwriteRequestControlLock without searching
+ * for or copying the variable.
+ */
+static EFI_STATUS
+get_mor_locked_state(uint8_t *state)
+{
+    static int handle = -1;
+    const struct efi_variable *l;
+
+    if (handle < 0)
+        handle = internal_variable_handle(MOR_CONTROL_LOCK_NAME,
+                                          sizeof(MOR_CONTROL_LOCK_NAME),
+                                          &morControlLockGuid);
+
+    l = internal_variable_ref(handle);
+    if (!l)
+        return EFI_NOT_FOUND;
+
+    assert(l->data_len == 1);
+    *state = l->data[0];
+
+    return EFI_SUCCESS;
+}
+
 bool
 is_mor_control(uint8_t *name, UINTN name_len, EFI_GUID *guid)
 {
@@ -114,8 +139,6 @@ do_set_mor_control(uint8_t *data, UINTN data_len, UINT32 attr, BOOLEAN append)
 {
     EFI_STATUS status;
     uint8_t mor_locked_state;
-    uint8_t *buf;
-    UINTN buf_len;
 
     if (attr != ATTR_BRNV || append || data_len != MOR_CONTROL_LEN)
         return EFI_INVALID_PARAMETER;
@@ -123,16 +146,10 @@ do_set_mor_control(uint8_t *data, UINTN data_len, UINT32 attr, BOOLEAN append)
     if (*data != (*data & MOR_ACTION_VALID_MASK))
         return EFI_INVALID_PARAMETER;
 
-    status = internal_get_variable(MOR_CONTROL_LOCK_NAME,
-                                   sizeof(MOR_CONTROL_LOCK_NAME),
-                                   &morControlLockGuid, &buf, &buf_len);
+    status = get_mor_locked_state(&mor_locked_state);
     if (status != EFI_SUCCESS)
         return status;
 
-    assert(buf_len == 1);
-    mor_locked_state = buf[0];
-    free(buf);
-
     if (mor_locked_state == MOR_LOCKED_WITH_KEY ||
             mor_locked_state == MOR_LOCKED_WITHOUT_KEY)
         return EFI_WRITE_PROTECTED;
@@ -151,8 +168,6 @@ do_set_mor_control_lock(uint8_t *data, UINTN data_len,
 {
     EFI_STATUS status;
     uint8_t mor_locked_state;
-    uint8_t *buf;
-    UINTN buf_len;
 
     if (attr == 0 || data_len == 0)
         return EFI_WRITE_PROTECTED;
@@ -161,16 +176,10 @@ do_set_mor_control_lock(uint8_t *data, UINTN data_len,
             (data_len != MOR_LOCK_REV1_LEN && data_len != MOR_LOCK_REV2_LEN))
         return EFI_INVALID_PARAMETER;
 
-    status = internal_get_variable(MOR_CONTROL_LOCK_NAME,
-                                   sizeof(MOR_CONTROL_LOCK_NAME),
-                                   &morControlLockGuid, &buf, &buf_len);
+    status = get_mor_locked_state(&mor_locked_state);
     if (status != EFI_SUCCESS)
         return status;
 
-    assert(buf_len == 1);
-    mor_locked_state = buf[0];
-    free(buf);
-
     if (data_len == MOR_LOCK_REV1_LEN) {
         if (*data == MOR_LOCK_REV1_UNLOCK) {
             if (mor_locked_state == MOR_UNLOCKED)
@@ -215,3 +224,8 @@ do_set_mor_control_lock(uint8_t *data, UINTN data_len,
                                  sizeof(mor_locked_state),
                                  ATTR_BRNV);
 }
+
+const struct context_region mor_context[] = {
+    CONTEXT_REGION(mor_key),
+    CONTEXT_END
+};
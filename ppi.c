@@ -105,11 +105,23 @@ ppi_idx_port_writel(uint64_t offset, uint64_t size, uint32_t val)
     ppi_vdata.idx = val;
 }
 
+/* Returns the PPIBuffer variable without searching for or copying it. */
+static const struct efi_variable *
+ppi_buffer(void)
+{
+    static int handle = -1;
+
+    if (handle < 0)
+        handle = internal_variable_handle(PPI_NAME, sizeof(PPI_NAME),
+                                          &gEfiTcg2PpiXenGuid);
+
+    return internal_variable_ref(handle);
+}
+
 static uint32_t
 ppi_data_readl(uint64_t offset, uint64_t size)
 {
     uint32_t ret = 0;
-    EFI_STATUS status;
 
     if (ppi_vdata.idx + size > PPI_BUFF_SIZE) {
        INFO("PPI IDX out of range. 0x%" PRIx32 "+ %" PRIx64 "\n", ppi_vdata.idx, size);
@@ -117,20 +129,16 @@ ppi_data_readl(uint64_t offset, uint64_t size)
     }
 
     if (ppi_vdata.idx >= PPI_VOLATILE_SIZE) {
-        uint8_t *data;
-        UINTN data_len;
-        status = internal_get_variable(PPI_NAME,
-                                       sizeof(PPI_NAME),
-                                       &gEfiTcg2PpiXenGuid, &data, &data_len);
-
-        if (status == EFI_SUCCESS) {
-            memcpy(&ret, data + offset + (ppi_vdata.idx - PPI_VOLATILE_SIZE), size);
-            free(data);
-            return ret;
-        } else {
-            ERR("ppi read failure 0x%016lx!\n", status);
+        const struct efi_variable *l = ppi_buffer();
+        uint64_t off = offset + (ppi_vdata.idx - PPI_VOLATILE_SIZE);
+
+        if (!l || off + size > l->data_len) {
+            ERR("ppi read failure!\n");
             return 0;
         }
+
+        memcpy(&ret, l->data + off, size);
+        return ret;
     } else {
         memcpy(&ret, ppi_vdata.func + offset + ppi_vdata.idx, size);
         return ret;
@@ -29,3 +29,8 @@
 #include <ppi.h>
 
 ppi_vdata_t ppi_vdata;
+
+const struct context_region ppi_context[] = {
+    CONTEXT_REGION(ppi_vdata),
+    CONTEXT_END
+};
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <stats.h>
+
+struct stat_entry {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[STATS_BUCKETS];
+};
+
+static struct stat_entry stats[STAT_COUNT];
+
+static const char *const stat_names[STAT_COUNT] = {
+    [STAT_GET_VARIABLE] = "get_variable",
+    [STAT_SET_VARIABLE] = "set_variable",
+    [STAT_GET_NEXT_VARIABLE] = "get_next_variable",
+    [STAT_QUERY_VARIABLE_INFO] = "query_variable_info",
+    [STAT_NOTIFY_SB_FAILURE] = "notify_sb_failure",
+    [STAT_GET_NEXT_VARIABLE_BATCH] = "get_next_variable_batch",
+    [STAT_GET_VARIABLE_BATCH] = "get_variable_batch",
+    [STAT_AUTH_VERIFY] = "auth_verify",
+    [STAT_BACKEND_INIT] = "backend_init",
+    [STAT_BACKEND_RESUME] = "backend_resume",
+    [STAT_BACKEND_SAVE] = "backend_save",
+    [STAT_BACKEND_SET_VARIABLE] = "backend_set_variable",
+    [STAT_BACKEND_SB_NOTIFY] = "backend_sb_notify",
+    [STAT_FOREIGN_MAP] = "foreign_map",
+    [STAT_RATE_LIMIT_SLEEP] = "rate_limit_sleep",
+    [STAT_RATE_LIMIT_DEFER] = "rate_limit_defer",
+};
+
+uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+stats_add(enum stat_id id, uint64_t ns)
+{
+    struct stat_entry *s = &stats[id];
+    uint64_t us = ns / 1000;
+    unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+
+    s->count++;
+    s->total_ns += ns;
+    if (ns > s->max_ns)
+        s->max_ns = ns;
+    s->hist[bucket]++;
+}
+
+void
+stats_record(enum stat_id id, uint64_t start)
+{
+    stats_add(id, stats_now() - start);
+}
+
+void
+stats_print(FILE *f, unsigned int domid)
+{
+    const struct stat_entry *s;
+    int i, j, last;
+
+    for (i = 0; i < STAT_COUNT; i++) {
+        s = &stats[i];
+        if (!s->count)
+            continue;
+
+        fprintf(f, "domain=%u op=%s count=%llu total_us=%llu max_us=%llu hist=",
+                domid, stat_names[i], (unsigned long long)s->count,
+                (unsigned long long)(s->total_ns / 1000),
+                (unsigned long long)(s->max_ns / 1000));
+
+        /* Leave out the empty buckets at the end. */
+        for (last = STATS_BUCKETS - 1; last > 0 && !s->hist[last]; last--)
+            ;
+        for (j = 0; j <= last; j++)
+            fprintf(f, "%s%llu", j ? "," : "", (unsigned long long)s->hist[j]);
+        fputc('\n', f);
+    }
+}
+
+void
+stats_reset(void)
+{
+    memset(stats, 0, sizeof(stats));
+}
+
+const struct context_region stats_context[] = {
+    CONTEXT_REGION(stats),
+    CONTEXT_END
+};
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <debug.h>
+#include <handler.h>
+#include <mor.h>
+#include <ppi.h>
+#include <template.h>
+#include <xapidb.h>
+
+#define TEMPLATE_HEADER_LEN (strlen(TEMPLATE_MAGIC) + SHA256_DIGEST_SIZE)
+
+/* The template loaded by template_load(), or NULL if there is none. */
+static uint8_t *template;
+static size_t template_len;
+
+/*
+ * Serializes the NV variables, which must be just those created by
+ * setup_keys, into a key template for the loaded auth data. The buffer must
+ * be freed by the caller.
+ */
+bool
+template_create(uint8_t **out, size_t *out_len)
+{
+    uint8_t *blob, *buf;
+    size_t blob_len;
+
+    if (!xapidb_serialize_variables(&blob, &blob_len, true))
+        return false;
+
+    buf = malloc(TEMPLATE_HEADER_LEN + blob_len);
+    if (!buf) {
+        ERR("Out of memory!\n");
+        free(blob);
+        return false;
+    }
+
+    memcpy(buf, TEMPLATE_MAGIC, strlen(TEMPLATE_MAGIC));
+    if (!auth_data_digest(buf + strlen(TEMPLATE_MAGIC))) {
+        ERR("Failed to hash auth data\n");
+        free(blob);
+        free(buf);
+        return false;
+    }
+    memcpy(buf + TEMPLATE_HEADER_LEN, blob, blob_len);
+    free(blob);
+
+    *out = buf;
+    *out_len = TEMPLATE_HEADER_LEN + blob_len;
+
+    return true;
+}
+
+/* Writes a key template to path, replacing any existing one atomically. */
+bool
+template_write(const char *path)
+{
+    uint8_t *buf;
+    size_t len;
+    char *tmp;
+    FILE *f;
+    bool ret = false;
+
+    if (!template_create(&buf, &len))
+        return false;
+
+    if (asprintf(&tmp, "%s.tmp", path) == -1) {
+        ERR("Out of memory!\n");
+        free(buf);
+        return false;
+    }
+
+    f = fopen(tmp, "w");
+    if (!f) {
+        ERR("Failed to open '%s': %d, %s\n", tmp, errno, strerror(errno));
+        goto out;
+    }
+
+    if (fwrite(buf, 1, len, f) != len) {
+        ERR("Failed to write '%s'\n", tmp);
+        fclose(f);
+        unlink(tmp);
+        goto out;
+    }
+
+    if (fclose(f) || rename(tmp, path) == -1) {
+        ERR("Failed to write '%s': %d, %s\n", path, errno, strerror(errno));
+        unlink(tmp);
+        goto out;
+    }
+
+    ret = true;
+out:
+    free(tmp);
+    free(buf);
+    return ret;
+}
+
+/*
+ * Maps the key template from path, so that every varstored on the host shares
+ * the one copy in the page cache. This must be done before chrooting. A
+ * missing or unusable template is not an error; first boot then falls back to
+ * setup_keys.
+ */
+bool
+template_load(const char *path)
+{
+    struct stat st;
+    uint8_t *buf;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            WARN("Failed to open '%s': %d, %s\n", path, errno, strerror(errno));
+        return true;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        WARN("Failed to stat '%s'\n", path);
+        close(fd);
+        return true;
+    }
+
+    if (st.st_size < (off_t)TEMPLATE_HEADER_LEN ||
+            st.st_size > (off_t)(TEMPLATE_HEADER_LEN + MAX_FILE_SIZE)) {
+        WARN("Key template '%s' has invalid size: %ld\n", path, st.st_size);
+        close(fd);
+        return true;
+    }
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        WARN("Failed to map key template '%s': %s\n", path, strerror(errno));
+        return true;
+    }
+
+    if (memcmp(buf, TEMPLATE_MAGIC, strlen(TEMPLATE_MAGIC))) {
+        WARN("Failed to read key template '%s'\n", path);
+        munmap(buf, st.st_size);
+        return true;
+    }
+
+    template_free();
+    template = buf;
+    template_len = st.st_size;
+
+    return true;
+}
+
+/*
+ * On first boot, adds the variables from the key template in place of
+ * setup_keys if it was made from the same auth data. This must be called
+ * before setup_variables so that the Secure Boot mode variables reflect the
+ * keys. Returns false if the template was not used.
+ */
+bool
+template_apply(void)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint8_t saved_mor_key[sizeof(mor_key)];
+    ppi_vdata_t saved_ppi_vdata;
+    struct efi_variable *head = var_list;
+    uint8_t *ptr;
+    bool ok;
+
+    if (!template)
+        return false;
+
+    if (!auth_data_digest(digest) ||
+            memcmp(template + strlen(TEMPLATE_MAGIC), digest, sizeof(digest))) {
+        INFO("Key template does not match the auth data\n");
+        return false;
+    }
+
+    /* The ancillary data in the blob is not part of the template. */
+    memcpy(saved_mor_key, mor_key, sizeof(mor_key));
+    saved_ppi_vdata = ppi_vdata;
+
+    ptr = template + TEMPLATE_HEADER_LEN;
+    ok = xapidb_parse_blob(&ptr, template_len - TEMPLATE_HEADER_LEN);
+
+    memcpy(mor_key, saved_mor_key, sizeof(mor_key));
+    ppi_vdata = saved_ppi_vdata;
+
+    if (!ok) {
+        struct efi_variable *l;
+
+        ERR("Failed to parse key template\n");
+
+        /* Parsing only inserts at the head so drop what was added. */
+        while (var_list != head) {
+            l = var_list;
+            remove_variable(l);
+            free_efi_variable(l);
+        }
+        return false;
+    }
+
+    INFO("Set keys from template\n");
+    return true;
+}
+
+void
+template_free(void)
+{
+    if (template)
+        munmap(template, template_len);
+    template = NULL;
+    template_len = 0;
+}
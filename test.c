@@ -27,16 +27,24 @@
  */
 
 /* Including this directly allows us to poke into the implementation. */
+#include "base64.c"
+#include "context.c"
+#include "filedb.c"
 #include "handler.c"
+#include "log.c"
 #include "mor.c"
+#include "stats.c"
+#include "template.c"
+#include "xapidb-lib.c"
 
 #include <glib.h>
 #include <openssl/pem.h>
 #include <assert.h>
+#include <fcntl.h>
 
 static char *save_name = "test.dat";
 
-const enum log_level log_level = LOG_LVL_ERROR;
+enum log_level log_level = LOG_LVL_ERROR;
 
 /* The communication buffer. */
 static uint8_t buf[16 * 4096];
@@ -212,25 +220,23 @@ static enum backend_init_status testdb_init(void)
     }
 
     for (;;) {
-        UINTN name_len;
+        UINTN name_len, data_len;
+        uint8_t name[NAME_LIMIT];
 
         if (fread(&name_len, sizeof name_len, 1, f) != 1)
             break;
 
-        l = malloc(sizeof *l);
+        assert(name_len <= NAME_LIMIT);
+        fread(name, 1, name_len, f);
+        fread(&data_len, sizeof data_len, 1, f);
+        l = alloc_efi_variable(name, name_len, data_len);
         if (!l)
             abort();
 
-        l->name_len = name_len;
-        l->name = malloc(l->name_len);
-        fread(l->name, 1, l->name_len, f);
-        fread(&l->data_len, sizeof l->data_len, 1, f);
-        l->data = malloc(l->data_len);
         fread(l->data, 1, l->data_len, f);
         fread(&l->guid, 1, GUID_LEN, f);
         fread(&l->attributes, 1, sizeof l->attributes, f);
-        l->next = var_list;
-        var_list = l;
+        insert_variable(l);
     }
 
     fclose(f);
@@ -273,6 +279,24 @@ const struct backend testdb = {
     .set_variable = testdb_save,
 };
 const struct backend *db = &testdb;
+bool opt_resume;
+
+/* A backend that leaves every save pending until the test completes it. */
+static void (*testdb_done)(bool saved);
+
+static enum backend_save_status
+testdb_set_variable_async(void (*done)(bool saved))
+{
+    g_assert(!testdb_done);
+    testdb_done = done;
+    return BACKEND_SAVE_PENDING;
+}
+
+const struct backend testdb_async = {
+    .init = testdb_init,
+    .set_variable = testdb_save,
+    .set_variable_async = testdb_set_variable_async,
+};
 
 static void read_x509_into_CertList(char *certfile,
                                     EFI_SIGNATURE_LIST **ret_cert, size_t *len);
@@ -335,17 +359,13 @@ static void free_globals(void)
 
 static void reset_vars(void)
 {
-    struct efi_variable *l, *tmp;
+    struct efi_variable *l;
 
-    l = var_list;
-    while (l) {
-        tmp = l;
-        l = tmp->next;
-        free(tmp->name);
-        free(tmp->data);
-        free(tmp);
+    while (var_list) {
+        l = var_list;
+        remove_variable(l);
+        free_efi_variable(l);
     }
-    var_list = NULL;
 }
 
 static void call_get_variable(const dstring *name, const EFI_GUID *guid,
@@ -405,9 +425,9 @@ static void call_get_next_variable(UINTN avail, const dstring *name,
     dispatch_command(buf);
 }
 
-static void call_set_variable(const dstring *name, const EFI_GUID *guid,
-                              const uint8_t *data, UINTN data_len,
-                              UINT32 attr, BOOLEAN at_runtime)
+static void serialize_set_variable(const dstring *name, const EFI_GUID *guid,
+                                   const uint8_t *data, UINTN data_len,
+                                   UINT32 attr, BOOLEAN at_runtime)
 {
     uint8_t *ptr = buf;
     size_t name_size = dstring_data_size(name);
@@ -419,7 +439,13 @@ static void call_set_variable(const dstring *name, const EFI_GUID *guid,
     serialize_data(&ptr, data, data_len);
     serialize_uint32(&ptr, attr);
     *ptr++ = at_runtime;
+}
 
+static void call_set_variable(const dstring *name, const EFI_GUID *guid,
+                              const uint8_t *data, UINTN data_len,
+                              UINT32 attr, BOOLEAN at_runtime)
+{
+    serialize_set_variable(name, guid, data, data_len, attr, at_runtime);
     dispatch_command(buf);
 }
 
@@ -1159,6 +1185,281 @@ static void test_get_next_variable_all(void)
     g_assert_cmpuint(status, ==, EFI_NOT_FOUND);
 }
 
+static void check_next_variable(const dstring *name, const EFI_GUID *guid)
+{
+    uint8_t *ptr, *data;
+    UINTN data_len;
+    EFI_STATUS status;
+    EFI_GUID next_guid;
+
+    ptr = buf;
+    status = unserialize_uintn(&ptr);
+    g_assert_cmpuint(status, ==, EFI_SUCCESS);
+    data = unserialize_data(&ptr, &data_len, BSIZ);
+    g_assert_cmpuint(data_len, ==, dstring_data_size(name));
+    g_assert(!memcmp(name->data, data, data_len));
+    unserialize_guid(&ptr, &next_guid);
+    g_assert(!memcmp(&next_guid, guid, GUID_LEN));
+    free(data);
+}
+
+static void test_get_next_variable_delete(void)
+{
+    uint8_t *ptr;
+    EFI_STATUS status;
+
+    /*
+     * Deleting the variable just returned, or one not yet returned, must
+     * not break the enumeration.
+     */
+
+    reset_vars();
+    sv_ok(tname5, &tguid5, tdata5, sizeof(tdata5), ATTR_B);
+    sv_ok(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_B);
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_B);
+    sv_ok(tname3, &tguid3, tdata3, sizeof(tdata3), ATTR_B);
+
+    call_get_next_variable(BSIZ, NULL, &nullguid, 0);
+    check_next_variable(tname3, &tguid3);
+    sv_ok(tname3, &tguid3, NULL, 0, ATTR_B);
+
+    call_get_next_variable(BSIZ, tname3, &tguid3, 0);
+    check_next_variable(tname4, &tguid4);
+    sv_ok(tname1, &tguid1, NULL, 0, ATTR_B);
+    sv_ok(tname4, &tguid4, NULL, 0, ATTR_B);
+
+    /* Only the most recently returned variable can be resumed from. */
+    call_get_next_variable(BSIZ, tname3, &tguid3, 0);
+    ptr = buf;
+    status = unserialize_uintn(&ptr);
+    g_assert_cmpuint(status, ==, EFI_INVALID_PARAMETER);
+
+    call_get_next_variable(BSIZ, tname4, &tguid4, 0);
+    check_next_variable(tname2, &tguid2);
+
+    call_get_next_variable(BSIZ, tname2, &tguid2, 0);
+    check_next_variable(tname5, &tguid5);
+
+    call_get_next_variable(BSIZ, tname5, &tguid5, 0);
+    ptr = buf;
+    status = unserialize_uintn(&ptr);
+    g_assert_cmpuint(status, ==, EFI_NOT_FOUND);
+}
+
+static void call_get_next_variable_batch(const dstring *name,
+                                         const EFI_GUID *guid,
+                                         BOOLEAN at_runtime, UINTN max_count)
+{
+    uint8_t *ptr = buf;
+    size_t len = name ? dstring_data_size(name) : 0;
+    const uint8_t *data = (uint8_t *)(name ? name->data : NULL);
+
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_NEXT_VARIABLE_BATCH);
+    serialize_data(&ptr, data, len);
+    serialize_guid(&ptr, guid);
+    *ptr++ = at_runtime;
+    serialize_uintn(&ptr, max_count);
+
+    dispatch_command(buf);
+}
+
+/* Checks the next batch entry is the given variable. */
+static void check_batch_entry(uint8_t **ptr, const dstring *name,
+                              const EFI_GUID *guid, UINT32 attr,
+                              UINTN data_len)
+{
+    uint8_t *data;
+    UINTN len;
+    EFI_GUID g;
+
+    data = unserialize_data(ptr, &len, BSIZ);
+    g_assert_cmpuint(len, ==, dstring_data_size(name));
+    g_assert(!memcmp(name->data, data, len));
+    free(data);
+    unserialize_guid(ptr, &g);
+    g_assert(!memcmp(&g, guid, GUID_LEN));
+    g_assert_cmpuint(unserialize_uint32(ptr), ==, attr);
+    g_assert_cmpuint(unserialize_uintn(ptr), ==, data_len);
+}
+
+/* A batch enumerates the same variables in the same order, from a cursor. */
+static void test_get_next_variable_batch(void)
+{
+    uint8_t *ptr;
+
+    reset_vars();
+    sv_ok(tname5, &tguid5, tdata5, sizeof(tdata5), ATTR_B);
+    sv_ok(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_BR);
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BR);
+    sv_ok(tname3, &tguid3, tdata3, sizeof(tdata3), ATTR_B);
+
+    call_get_next_variable_batch(NULL, &nullguid, 0, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, 5);
+    g_assert_cmpuint(unserialize_boolean(&ptr), ==, 1);
+    check_batch_entry(&ptr, tname3, &tguid3, ATTR_B, sizeof(tdata3));
+    check_batch_entry(&ptr, tname4, &tguid4, ATTR_BR, sizeof(tdata4));
+    check_batch_entry(&ptr, tname1, &tguid1, ATTR_B, sizeof(tdata1));
+    check_batch_entry(&ptr, tname2, &tguid2, ATTR_BR, sizeof(tdata2));
+    check_batch_entry(&ptr, tname5, &tguid5, ATTR_B, sizeof(tdata5));
+
+    /* Continue from the last entry of a limited batch. */
+    call_get_next_variable_batch(NULL, &nullguid, 0, 2);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, 2);
+    g_assert_cmpuint(unserialize_boolean(&ptr), ==, 0);
+    call_get_next_variable_batch(tname4, &tguid4, 0, 2);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, 2);
+    g_assert_cmpuint(unserialize_boolean(&ptr), ==, 0);
+    check_batch_entry(&ptr, tname1, &tguid1, ATTR_B, sizeof(tdata1));
+    check_batch_entry(&ptr, tname2, &tguid2, ATTR_BR, sizeof(tdata2));
+
+    call_get_next_variable_batch(tname5, &tguid5, 0, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_NOT_FOUND);
+
+    /* At runtime, only runtime variables are seen. */
+    call_get_next_variable_batch(NULL, &nullguid, 1, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, 2);
+    g_assert_cmpuint(unserialize_boolean(&ptr), ==, 1);
+    check_batch_entry(&ptr, tname4, &tguid4, ATTR_BR, sizeof(tdata4));
+    check_batch_entry(&ptr, tname2, &tguid2, ATTR_BR, sizeof(tdata2));
+
+    call_get_next_variable_batch(tname4, &tguid2, 0, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_INVALID_PARAMETER);
+
+    /* Version 1 requests don't have the batched commands. */
+    ptr = buf;
+    serialize_uint32(&ptr, 1);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_NEXT_VARIABLE_BATCH);
+    serialize_data(&ptr, NULL, 0);
+    serialize_guid(&ptr, &nullguid);
+    *ptr++ = 0;
+    serialize_uintn(&ptr, 0);
+    dispatch_command(buf);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, 1);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==,
+                     COMMAND_GET_NEXT_VARIABLE_BATCH);
+}
+
+/* Each variable in a batched GetVariable gets its own result. */
+static void test_get_variable_batch(void)
+{
+    uint8_t *ptr, *data;
+    UINTN len;
+
+    reset_vars();
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BR);
+
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE_BATCH);
+    serialize_uintn(&ptr, 3);
+    serialize_data(&ptr, (uint8_t *)tname1->data, dstring_data_size(tname1));
+    serialize_guid(&ptr, &tguid1);
+    serialize_data(&ptr, (uint8_t *)tname4->data, dstring_data_size(tname4));
+    serialize_guid(&ptr, &tguid4);
+    serialize_data(&ptr, (uint8_t *)tname1->data, dstring_data_size(tname1));
+    serialize_guid(&ptr, &tguid3);
+    *ptr++ = 0;
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, 3);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, ATTR_B);
+    data = unserialize_data(&ptr, &len, BSIZ);
+    g_assert_cmpuint(len, ==, sizeof(tdata1));
+    g_assert(!memcmp(data, tdata1, len));
+    free(data);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, ATTR_BR);
+    data = unserialize_data(&ptr, &len, BSIZ);
+    g_assert_cmpuint(len, ==, sizeof(tdata4));
+    g_assert(!memcmp(data, tdata4, len));
+    free(data);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_NOT_FOUND);
+
+    /* At runtime, a boot service variable is not found. */
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE_BATCH);
+    serialize_uintn(&ptr, 1);
+    serialize_data(&ptr, (uint8_t *)tname1->data, dstring_data_size(tname1));
+    serialize_guid(&ptr, &tguid1);
+    *ptr++ = 1;
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, 1);
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_NOT_FOUND);
+}
+
+/* A batch that runs off the end of the buffer is rejected. */
+static void test_get_variable_batch_truncated(void)
+{
+    uint8_t name[102] = {'A', 0};
+    uint8_t *ptr;
+    int i;
+
+    reset_vars();
+
+    /* 520 names exactly fill the buffer, leaving no room for the rest. */
+    memset(buf, 0, sizeof(buf));
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE_BATCH);
+    serialize_uintn(&ptr, 521);
+    for (i = 0; i < 520; i++) {
+        serialize_data(&ptr, name, sizeof(name));
+        serialize_guid(&ptr, &tguid1);
+    }
+    g_assert(ptr == buf + sizeof(buf));
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+
+    /* So does at_runtime after the last name. */
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE_BATCH);
+    serialize_uintn(&ptr, 520);
+    for (i = 0; i < 520; i++) {
+        serialize_data(&ptr, name, sizeof(name));
+        serialize_guid(&ptr, &tguid1);
+    }
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+
+    /* A name longer than the rest of the buffer. */
+    ptr = buf;
+    serialize_uint32(&ptr, 2);
+    serialize_uint32(&ptr, (UINT32)COMMAND_GET_VARIABLE_BATCH);
+    serialize_uintn(&ptr, 1);
+    serialize_uintn(&ptr, sizeof(buf));
+    dispatch_command(buf);
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+}
+
 static void test_set_variable_attr(void)
 {
     uint8_t *ptr;
@@ -1564,6 +1865,201 @@ static void test_set_variable_many_vars(void)
     free_dstring(dname);
 }
 
+/*
+ * Set enough variables to put several in each index bucket, delete every
+ * other one and check that lookups still find exactly the live variables.
+ */
+static void test_set_variable_index(void)
+{
+    struct efi_variable *l;
+    uint8_t *ptr;
+    EFI_STATUS status;
+    int i, n;
+    uint8_t tmp = 0;
+    dstring *dname = alloc_dstring_unset(5);
+    char *name = (char *)dname->data;
+    const int count = VARIABLE_INDEX_SIZE * 3;
+
+    reset_vars();
+
+    for (i = 0; i < count; i++) {
+        sprintf(name, "%04d", i);
+        sv_ok(dname, &tguid1, &tmp, 1, ATTR_B);
+    }
+
+    /* Same name, different GUID must be a distinct variable. */
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+    sv_ok(tname1, &tguid3, tdata2, sizeof(tdata2), ATTR_B);
+    l = find_variable((uint8_t *)tname1->data, dstring_data_size(tname1), &tguid3);
+    g_assert(l);
+    g_assert_cmpuint(l->data_len, ==, sizeof(tdata2));
+
+    for (i = 0; i < count; i += 2) {
+        sprintf(name, "%04d", i);
+        call_set_variable(dname, &tguid1, NULL, 0, ATTR_B, 0);
+        ptr = buf;
+        status = unserialize_uintn(&ptr);
+        g_assert_cmpuint(status, ==, EFI_SUCCESS);
+    }
+
+    for (i = 0; i < count; i++) {
+        sprintf(name, "%04d", i);
+        l = find_variable((uint8_t *)dname->data, dstring_data_size(dname), &tguid1);
+        if (i % 2)
+            g_assert(l);
+        else
+            g_assert(!l);
+    }
+
+    /* The list and the index must agree. */
+    n = 0;
+    for (l = var_list; l; l = l->next) {
+        g_assert(l == find_variable(l->name, l->name_len, &l->guid));
+        g_assert(!l->next || l->next->prev == l);
+        n++;
+    }
+    g_assert_cmpuint(n, ==, count / 2 + 2);
+
+    free_dstring(dname);
+}
+
+/*
+ * Repeatedly replace variables so that the record arena is compacted and
+ * check that every variable survives being moved.
+ */
+static void test_set_variable_compact(void)
+{
+    struct efi_variable *l;
+    uint8_t *ptr, *data;
+    EFI_STATUS status;
+    UINTN data_len;
+    UINT32 attr;
+    int i, round, n;
+    uint8_t tmp[1000];
+    dstring *dname = alloc_dstring_unset(5);
+    char *name = (char *)dname->data;
+    const int count = 100;
+
+    reset_vars();
+    compact_variables();
+
+    for (round = 0; round < 4; round++) {
+        for (i = 0; i < count; i++) {
+            sprintf(name, "%04d", i);
+            memset(tmp, i + round, sizeof(tmp));
+            /* Leave holes between the records that are kept. */
+            if (round == 3 && i % 3 == 0)
+                call_set_variable(dname, &tguid1, NULL, 0, ATTR_B, 0);
+            else
+                call_set_variable(dname, &tguid1, tmp, sizeof(tmp), ATTR_B, 0);
+            ptr = buf;
+            status = unserialize_uintn(&ptr);
+            g_assert_cmpuint(status, ==, EFI_SUCCESS);
+        }
+    }
+    g_assert_cmpuint(arena_dead, <, ARENA_COMPACT_THRESHOLD);
+
+    compact_variables();
+    g_assert_cmpuint(arena_dead, ==, 0);
+
+    for (i = 0; i < count; i++) {
+        sprintf(name, "%04d", i);
+        call_get_variable(dname, &tguid1, BSIZ, 0);
+        ptr = buf;
+        status = unserialize_uintn(&ptr);
+        if (i % 3 == 0) {
+            g_assert_cmpuint(status, ==, EFI_NOT_FOUND);
+            continue;
+        }
+        g_assert_cmpuint(status, ==, EFI_SUCCESS);
+        attr = unserialize_uint32(&ptr);
+        g_assert_cmpuint(attr, ==, ATTR_B);
+        data = unserialize_data(&ptr, &data_len, BSIZ);
+        memset(tmp, i + 3, sizeof(tmp));
+        g_assert_cmpuint(data_len, ==, sizeof(tmp));
+        g_assert(!memcmp(tmp, data, data_len));
+        free(data);
+    }
+
+    n = 0;
+    for (l = var_list; l; l = l->next) {
+        g_assert(in_arena(l));
+        g_assert(l == find_variable(l->name, l->name_len, &l->guid));
+        g_assert(!l->next || l->next->prev == l);
+        n++;
+    }
+    g_assert_cmpuint(n, ==, count - (count + 2) / 3);
+
+    free_dstring(dname);
+}
+
+/* Completes the pending save and checks the result of the SetVariable. */
+static void complete_set_variable(bool saved, EFI_STATUS expected)
+{
+    void (*done)(bool saved) = testdb_done;
+    uint8_t *ptr;
+
+    g_assert(command_pending());
+    g_assert(done);
+    testdb_done = NULL;
+    done(saved);
+    g_assert(!command_pending());
+
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, expected);
+}
+
+static void test_set_variable_async(void)
+{
+    struct efi_variable *l;
+
+    reset_vars();
+    db = &testdb_async;
+
+    /* Volatile variables complete straight away. */
+    serialize_set_variable(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_B, 0);
+    dispatch_command_async(buf);
+    g_assert(!command_pending());
+    g_assert(find_variable((uint8_t *)tname2->data, dstring_data_size(tname2),
+                           &tguid2));
+
+    /* A new variable is dropped if the save fails. */
+    serialize_set_variable(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV, 0);
+    dispatch_command_async(buf);
+    complete_set_variable(false, EFI_DEVICE_ERROR);
+    g_assert(!find_variable((uint8_t *)tname1->data, dstring_data_size(tname1),
+                            &tguid1));
+
+    serialize_set_variable(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV, 0);
+    dispatch_command_async(buf);
+    complete_set_variable(true, EFI_SUCCESS);
+
+    /* An update is rolled back if the save fails. */
+    serialize_set_variable(tname1, &tguid1, tdata3, sizeof(tdata3), ATTR_BNV, 0);
+    dispatch_command_async(buf);
+    complete_set_variable(false, EFI_DEVICE_ERROR);
+    l = find_variable((uint8_t *)tname1->data, dstring_data_size(tname1),
+                      &tguid1);
+    g_assert(l);
+    g_assert_cmpuint(l->data_len, ==, sizeof(tdata1));
+    g_assert(!memcmp(l->data, tdata1, sizeof(tdata1)));
+
+    /* So is a deletion. */
+    serialize_set_variable(tname1, &tguid1, NULL, 0, ATTR_BNV, 0);
+    dispatch_command_async(buf);
+    complete_set_variable(false, EFI_DEVICE_ERROR);
+    g_assert(find_variable((uint8_t *)tname1->data, dstring_data_size(tname1),
+                           &tguid1));
+
+    serialize_set_variable(tname1, &tguid1, NULL, 0, ATTR_BNV, 0);
+    dispatch_command_async(buf);
+    complete_set_variable(true, EFI_SUCCESS);
+    g_assert(!find_variable((uint8_t *)tname1->data, dstring_data_size(tname1),
+                            &tguid1));
+
+    db = &testdb;
+}
+
 static void test_set_variable_non_volatile(void)
 {
     uint8_t *ptr, *data;
@@ -2635,6 +3131,870 @@ static void test_secure_set_dbt_usermode(void)
     test_secure_set_db__usermode(dbt_name);
 }
 
+static unsigned int count_verify_cache(EFI_STATUS status)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < VERIFY_CACHE_SIZE; i++)
+        if (verify_cache[i].valid &&
+                verify_cache[i].generation == trust_generation &&
+                verify_cache[i].status == status)
+            n++;
+
+    return n;
+}
+
+/*
+ * Re-applying an identical authenticated append should be answered from the
+ * verification cache, and changing KEK must invalidate what was cached.
+ */
+static void test_secure_set_verify_cache(void)
+{
+    EFI_TIME test_time = {2018, 6, 20, 13, 38, 0, 0, 0, 0, 0, 0};
+    unsigned int next;
+
+    reset_vars();
+    setup_variables();
+    set_usermode();
+
+    sign_and_check(KEK_name, &gEfiGlobalVariableGuid, ATTR_BRNV_TIME,
+                   &test_time, (uint8_t *)certB, certB_len,
+                   &sign_testPK, EFI_SUCCESS);
+    g_assert_cmpuint(count_verify_cache(EFI_SUCCESS), ==, 0);
+
+    /* Writing db changes the trust anchors, leaving nothing cached. */
+    test_time.Second++;
+    sign_and_check(db_name, &gEfiImageSecurityDatabaseGuid,
+                   ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_certB, EFI_SUCCESS);
+    g_assert_cmpuint(count_verify_cache(EFI_SUCCESS), ==, 0);
+
+    /*
+     * dbx is tried against PK (fails) and then KEK (succeeds). Both results
+     * are cached so the second identical write adds no entries.
+     */
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid,
+                   ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_certB, EFI_SUCCESS);
+    g_assert_cmpuint(count_verify_cache(EFI_SUCCESS), ==, 1);
+    g_assert_cmpuint(count_verify_cache(EFI_SECURITY_VIOLATION), ==, 1);
+    next = verify_cache_next;
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid,
+                   ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_certB, EFI_SUCCESS);
+    g_assert_cmpuint(verify_cache_next, ==, next);
+
+    /* Once KEK no longer holds certB the cached result must not be used. */
+    test_time.Second++;
+    sign_and_check(KEK_name, &gEfiGlobalVariableGuid, ATTR_BRNV_TIME,
+                   &test_time, (uint8_t *)certPK, certPK_len,
+                   &sign_testPK, EFI_SUCCESS);
+    g_assert_cmpuint(count_verify_cache(EFI_SUCCESS), ==, 0);
+    sign_and_check(dbx_name, &gEfiImageSecurityDatabaseGuid,
+                   ATTR_BRNV_TIME | EFI_VARIABLE_APPEND_WRITE, &test_time,
+                   (uint8_t *)certA, certA_len, &sign_certB,
+                   EFI_SECURITY_VIOLATION);
+}
+
+/*
+ * In multi-domain mode each guest has its own variable store. Variables set
+ * in one context must not be visible in another and must still be there
+ * after switching back.
+ */
+static void test_context_switch(void)
+{
+    struct context *a, *b;
+    struct efi_variable *l;
+    bool ok;
+
+    reset_vars();
+
+    ok = context_add(handler_context) && context_add(mor_context);
+    g_assert(ok);
+    a = context_new();
+    /* Like any new domain, b starts without a record arena. */
+    arena = NULL;
+    arena_top = 0;
+    arena_dead = 0;
+    b = context_new();
+    g_assert(a && b);
+
+    context_switch(a);
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_B);
+
+    context_switch(b);
+    g_assert(!find_variable((uint8_t *)tname1->data,
+                            dstring_data_size(tname1), &tguid1));
+    g_assert_cmpuint(get_space_usage(), ==, 0);
+    sv_ok(tname2, &tguid1, tdata2, sizeof(tdata2), ATTR_B);
+
+    context_switch(a);
+    l = find_variable((uint8_t *)tname1->data, dstring_data_size(tname1),
+                      &tguid1);
+    g_assert(l);
+    g_assert_cmpuint(l->data_len, ==, sizeof(tdata1));
+    g_assert(!find_variable((uint8_t *)tname2->data,
+                            dstring_data_size(tname2), &tguid1));
+
+    context_switch(b);
+    reset_vars();
+    munmap(arena, ARENA_SIZE);
+    context_switch(a);
+    reset_vars();
+    context_free(b);
+    context_free(a);
+}
+
+/* Builds a signature list of n 48 byte signatures numbered from first. */
+static size_t make_sig_list(uint8_t *out, int n, int first)
+{
+    EFI_SIGNATURE_LIST *list = (EFI_SIGNATURE_LIST *)out;
+    int i;
+
+    memcpy(&list->SignatureType, &tguid1, GUID_LEN);
+    list->SignatureHeaderSize = 0;
+    list->SignatureSize = 48;
+    list->SignatureListSize = sizeof(*list) + n * 48;
+    memset(out + sizeof(*list), 0, n * 48);
+    for (i = 0; i < n; i++)
+        out[sizeof(*list) + i * 48 + 16] = first + i;
+
+    return list->SignatureListSize;
+}
+
+/*
+ * Appending removes signatures already in the variable, including those
+ * added by an earlier append through the cached set, and the set must be
+ * dropped along with its variable.
+ */
+static void test_filter_signature_list(void)
+{
+    struct efi_variable *l, *new;
+    uint8_t list[sizeof(EFI_SIGNATURE_LIST) + 20 * 48];
+    UINTN len;
+
+    len = make_sig_list(list, 10, 0);
+    l = alloc_efi_variable((uint8_t *)dbx_name->data,
+                           dstring_data_size(dbx_name), len);
+    memcpy(l->data, list, len);
+
+    /* 5-14 overlaps 0-9 so only 10-14 are appended. */
+    len = make_sig_list(list, 10, 5);
+    g_assert_cmpuint(filter_signature_list(l, list, &len), ==, EFI_SUCCESS);
+    g_assert_cmpuint(len, ==, sizeof(EFI_SIGNATURE_LIST) + 5 * 48);
+    g_assert_cmpuint(list[sizeof(EFI_SIGNATURE_LIST) + 16], ==, 10);
+    g_assert_cmpuint(((EFI_SIGNATURE_LIST *)list)->SignatureListSize, ==, len);
+    g_assert(sig_cache.var == l);
+
+    new = alloc_efi_variable(l->name, l->name_len, l->data_len + len);
+    memcpy(new->data, l->data, l->data_len);
+    memcpy(new->data + l->data_len, list, len);
+    sig_cache_extend(l, new);
+    free_efi_variable(l);
+    g_assert(sig_cache.var == new);
+
+    /* Everything is a duplicate now. */
+    len = make_sig_list(list, 15, 0);
+    g_assert_cmpuint(filter_signature_list(new, list, &len), ==, EFI_SUCCESS);
+    g_assert_cmpuint(len, ==, 0);
+
+    free_efi_variable(new);
+    g_assert(!sig_cache.var);
+}
+
+/*
+ * An append too large for the cached set drops it rather than filling it, and
+ * the set is rebuilt at the next append.
+ */
+static void test_filter_signature_list_large(void)
+{
+    struct efi_variable *l, *new;
+    uint8_t list[sizeof(EFI_SIGNATURE_LIST) + 101 * 48];
+    UINTN len;
+
+    len = make_sig_list(list, 1, 0);
+    l = alloc_efi_variable((uint8_t *)dbx_name->data,
+                           dstring_data_size(dbx_name), len);
+    memcpy(l->data, list, len);
+
+    len = make_sig_list(list, 100, 1);
+    g_assert_cmpuint(filter_signature_list(l, list, &len), ==, EFI_SUCCESS);
+    g_assert_cmpuint(len, ==, sizeof(EFI_SIGNATURE_LIST) + 100 * 48);
+    g_assert(sig_cache.var == l);
+
+    new = alloc_efi_variable(l->name, l->name_len, l->data_len + len);
+    memcpy(new->data, l->data, l->data_len);
+    memcpy(new->data + l->data_len, list, len);
+    sig_cache_extend(l, new);
+    free_efi_variable(l);
+    g_assert(!sig_cache.var);
+
+    len = make_sig_list(list, 101, 0);
+    g_assert_cmpuint(filter_signature_list(new, list, &len), ==, EFI_SUCCESS);
+    g_assert_cmpuint(len, ==, 0);
+    g_assert(sig_cache.var == new);
+    g_assert_cmpuint(2 * sig_cache.count, <=, sig_cache.size);
+
+    free_efi_variable(new);
+    g_assert(!sig_cache.var);
+}
+
+/*
+ * Every supported type is found through the index, and the verified prefix of
+ * the current variable is skipped only where the new data matches it.
+ */
+static void test_check_signature_list_format(void)
+{
+    struct efi_variable *l;
+    uint8_t list[2 * (sizeof(EFI_SIGNATURE_LIST) + 4 * 48)];
+    EFI_GUID type;
+    UINTN len, len2;
+    int i;
+
+    for (i = 0; i < NUM_OF_SUPPORTED_SIG_ITEMS; i++)
+        g_assert(find_sig_item(&mSupportSigItem[i].SigType) ==
+                 &mSupportSigItem[i]);
+    g_assert(!find_sig_item(&tguid1));
+    memcpy(&type, &mSupportSigItem[0].SigType, GUID_LEN);
+    ((uint8_t *)&type)[GUID_LEN - 1] ^= 1;
+    g_assert(!find_sig_item(&type));
+
+    /* An unsupported type which is accepted only as a verified prefix. */
+    len = make_sig_list(list, 4, 0);
+    l = alloc_efi_variable((uint8_t *)dbx_name->data,
+                           dstring_data_size(dbx_name), len);
+    memcpy(l->data, list, len);
+    g_assert_cmpuint(check_signature_list_format(list, len, false, l), ==,
+                     EFI_INVALID_PARAMETER);
+    to_record(l)->verified_len = len;
+
+    len2 = make_sig_list(list + len, 4, 4);
+    memcpy(&((EFI_SIGNATURE_LIST *)(list + len))->SignatureType,
+           &mSupportSigItem[0].SigType, GUID_LEN);
+    g_assert_cmpuint(check_signature_list_format(list, len + len2, false, l),
+                     ==, EFI_SUCCESS);
+    g_assert_cmpuint(check_signature_list_format(list, len + len2, false, NULL),
+                     ==, EFI_INVALID_PARAMETER);
+
+    /* A changed prefix is checked in full. */
+    list[sizeof(EFI_SIGNATURE_LIST) + 16]++;
+    g_assert_cmpuint(check_signature_list_format(list, len + len2, false, l),
+                     ==, EFI_INVALID_PARAMETER);
+
+    free_efi_variable(l);
+}
+
+/*
+ * A handle follows its variable as it is created, replaced, moved by
+ * compaction and deleted.
+ */
+static void test_variable_handle(void)
+{
+    static const uint8_t name[] = {'H',0,'n',0,'d',0};
+    const struct efi_variable *l;
+    uint8_t data[100];
+    int h, i;
+
+    reset_vars();
+
+    h = internal_variable_handle(name, sizeof(name), &tguid1);
+    g_assert_cmpint(h, >=, 0);
+    g_assert_cmpint(internal_variable_handle(name, sizeof(name), &tguid1), ==, h);
+    g_assert(!internal_variable_ref(h));
+    g_assert(!internal_variable_ref(-1));
+
+    memset(data, 1, sizeof(data));
+    g_assert_cmpuint(internal_set_variable(name, sizeof(name), &tguid1, data,
+                                           sizeof(data), ATTR_B),
+                     ==, EFI_SUCCESS);
+    l = internal_variable_ref(h);
+    g_assert(l);
+    g_assert(l == find_variable(name, sizeof(name), &tguid1));
+
+    /* Leave a hole below the variable so that compaction moves it. */
+    g_assert_cmpuint(internal_set_variable((uint8_t *)tname1->data,
+                                           dstring_data_size(tname1), &tguid1,
+                                           data, sizeof(data), ATTR_B),
+                     ==, EFI_SUCCESS);
+    for (i = 2; i < 4; i++) {
+        memset(data, i, sizeof(data));
+        g_assert_cmpuint(internal_set_variable(name, sizeof(name), &tguid1,
+                                               data, sizeof(data), ATTR_B),
+                         ==, EFI_SUCCESS);
+    }
+    compact_variables();
+    l = internal_variable_ref(h);
+    g_assert(l == find_variable(name, sizeof(name), &tguid1));
+    g_assert_cmpuint(l->data[0], ==, 3);
+
+    reset_vars();
+    g_assert(!internal_variable_ref(h));
+}
+
+/* Each command is counted under its own entry and bucketed by latency. */
+static void test_stats(void)
+{
+    char *out;
+    size_t out_len;
+    FILE *f;
+    int i;
+    uint64_t sum = 0;
+
+    reset_vars();
+    stats_reset();
+
+    call_get_variable(tname1, &tguid1, BSIZ, 0);
+    call_get_variable(tname1, &tguid1, BSIZ, 0);
+    g_assert_cmpuint(stats[STAT_GET_VARIABLE].count, ==, 2);
+    g_assert_cmpuint(stats[STAT_SET_VARIABLE].count, ==, 0);
+    for (i = 0; i < STATS_BUCKETS; i++)
+        sum += stats[STAT_GET_VARIABLE].hist[i];
+    g_assert_cmpuint(sum, ==, 2);
+
+    stats_add(STAT_FOREIGN_MAP, 3000);
+    g_assert_cmpuint(stats[STAT_FOREIGN_MAP].hist[2], ==, 1);
+    g_assert_cmpuint(stats[STAT_FOREIGN_MAP].max_ns, ==, 3000);
+
+    f = open_memstream(&out, &out_len);
+    stats_print(f, 7);
+    fclose(f);
+    g_assert(strstr(out, "domain=7 op=get_variable count=2 "));
+    g_assert(strstr(out, "domain=7 op=foreign_map count=1 total_us=3 max_us=3 hist=0,0,1\n"));
+    g_assert(!strstr(out, "op=set_variable"));
+    free(out);
+}
+
+/* Reads whatever the log drained into the pipe so far. */
+static size_t read_log(int fd, char *buf, size_t len, size_t size)
+{
+    ssize_t ret;
+
+    while (len < size - 1 && (ret = read(fd, buf + len, size - 1 - len)) > 0)
+        len += ret;
+    buf[len] = '\0';
+
+    return len;
+}
+
+/*
+ * With the ring enabled, messages are only written out when drained, and
+ * those that don't fit are counted instead.
+ */
+static void test_log_ring(void)
+{
+    static char out[4 * LOG_RING_SIZE];
+    enum log_level saved_level = log_level;
+    int fds[2], saved_stdout, saved_stderr, i;
+    size_t len = 0;
+
+    g_assert(pipe(fds) == 0);
+    g_assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    saved_stdout = dup(STDOUT_FILENO);
+    saved_stderr = dup(STDERR_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    ring_enabled = true;
+    log_level = LOG_LVL_INFO;
+
+    INFO("hello %d\n", 1);
+    DBG("not logged\n");
+    g_assert_cmpuint(read_log(fds[0], out, len, sizeof(out)), ==, 0);
+    g_assert_cmpint(log_drain(), ==, -1);
+    len = read_log(fds[0], out, len, sizeof(out));
+    g_assert_cmpstr(out, ==, "test_log_ring: hello 1\n");
+
+    for (i = 0; i < LOG_RING_SIZE / 16; i++)
+        INFO("%d\n", i);
+    g_assert_cmpuint(ring_dropped, >, 0);
+    while (log_drain() != -1)
+        len = read_log(fds[0], out, len, sizeof(out));
+
+    /* The count goes out ahead of the next message. */
+    ERR("after\n");
+    g_assert_cmpuint(ring_dropped, ==, 0);
+    g_assert_cmpint(log_drain(), ==, -1);
+    len = read_log(fds[0], out, len, sizeof(out));
+
+    ring_enabled = false;
+    log_level = saved_level;
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+    close(fds[0]);
+    close(fds[1]);
+
+    g_assert(strstr(out, "test_log_ring: 0\n"));
+    g_assert(strstr(out, " messages dropped\n"));
+    g_assert(len > 6 && !strcmp(out + len - strlen("after\n"), "after\n"));
+}
+
+/*
+ * Variables resumed from a save file use their data in place until they are
+ * replaced, and must survive the arena being compacted.
+ */
+static void test_save_resume(void)
+{
+    struct efi_variable *l;
+    uint8_t *save;
+    size_t save_len;
+    uint8_t key[sizeof(mor_key)] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+    reset_vars();
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    sv_ok(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_B);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BRNV);
+    memcpy(mor_key, key, sizeof(key));
+    g_assert(xapidb_serialize_save(&save, &save_len));
+
+    reset_vars();
+    memset(mor_key, 0, sizeof(mor_key));
+    g_assert(xapidb_parse_save(save, save_len));
+    g_assert(!memcmp(mor_key, key, sizeof(key)));
+
+    l = find_variable((uint8_t *)tname2->data, dstring_data_size(tname2),
+                      &tguid2);
+    g_assert(l);
+    g_assert(l->data >= save && l->data < save + save_len);
+    g_assert_cmpuint(l->attributes, ==, ATTR_B);
+
+    sv_ok(tname1, &tguid1, tdata3, sizeof(tdata3), ATTR_BNV);
+    l = find_variable((uint8_t *)tname1->data, dstring_data_size(tname1),
+                      &tguid1);
+    g_assert(l);
+    g_assert(!(l->data >= save && l->data < save + save_len));
+
+    compact_variables();
+    check_variable_data(tname1, &tguid1, BSIZ, 0, tdata3, sizeof(tdata3));
+    check_variable_data(tname2, &tguid2, BSIZ, 0, tdata2, sizeof(tdata2));
+    check_variable_data(tname4, &tguid4, BSIZ, 0, tdata4, sizeof(tdata4));
+    reset_vars();
+
+    /* A corrupted table or a truncated file must be rejected. */
+    ((struct save_entry *)(save + sizeof(struct save_header)))->data_len++;
+    g_assert(!xapidb_parse_save(save, save_len));
+    ((struct save_entry *)(save + sizeof(struct save_header)))->data_len--;
+    g_assert(!xapidb_parse_save(save, save_len - 1));
+    g_assert(!var_list);
+
+    /*
+     * Saving over the file resumed from replaces it rather than rewriting it,
+     * so variables still pointing into the old mapping keep their data.
+     */
+    reset_vars();
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BRNV);
+    g_assert(xapidb_save_to_file("/tmp/varstored-save-test"));
+    reset_vars();
+    g_assert(xapidb_resume_from_file("/tmp/varstored-save-test"));
+    sv_ok(tname1, &tguid1, tdata3, sizeof(tdata3), ATTR_BNV);
+    g_assert(xapidb_save_to_file("/tmp/varstored-save-test"));
+    check_variable_data(tname4, &tguid4, BSIZ, 0, tdata4, sizeof(tdata4));
+    g_assert(access("/tmp/varstored-save-test.tmp", F_OK) == -1);
+    reset_vars();
+    xapidb_resume_unmap();
+    unlink("/tmp/varstored-save-test");
+
+    memset(mor_key, 0, sizeof(mor_key));
+    free(save);
+}
+
+/*
+ * A compressed blob must parse back to the same variables as an uncompressed
+ * one, and both kinds must be accepted whatever the current setting.
+ */
+static void test_compressed_blob(void)
+{
+    uint8_t *plain, *packed, *ptr;
+    size_t plain_len, packed_len;
+    uint8_t big[512];
+
+    reset_vars();
+    memset(big, 'x', sizeof(big));
+    sv_ok(tname1, &tguid1, big, sizeof(big), ATTR_BNV);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BNV);
+
+    g_assert(xapidb_serialize_variables(&plain, &plain_len, true));
+    xapidb_arg_compress = 6;
+    g_assert(xapidb_serialize_variables(&packed, &packed_len, true));
+    xapidb_arg_compress = 0;
+
+    ptr = plain + strlen(DB_MAGIC);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, DB_VERSION_UNCOMPRESSED);
+    ptr = packed + strlen(DB_MAGIC);
+    g_assert_cmpuint(unserialize_uint32(&ptr), ==, DB_VERSION_COMPRESSED);
+    g_assert_cmpuint(packed_len, <, plain_len / 4);
+
+    reset_vars();
+    ptr = packed;
+    g_assert(xapidb_parse_blob(&ptr, packed_len));
+    check_variable_data(tname1, &tguid1, BSIZ, 0, big, sizeof(big));
+    check_variable_data(tname4, &tguid4, BSIZ, 0, tdata4, sizeof(tdata4));
+
+    reset_vars();
+    ptr = plain;
+    g_assert(xapidb_parse_blob(&ptr, plain_len));
+    check_variable_data(tname1, &tguid1, BSIZ, 0, big, sizeof(big));
+
+    /* A truncated stream must be rejected. */
+    reset_vars();
+    ptr = packed;
+    g_assert(!xapidb_parse_blob(&ptr, packed_len - 1));
+    g_assert(!var_list);
+
+    free(plain);
+    free(packed);
+}
+
+/*
+ * Freeing the variables must leave an empty store that can be used again, as
+ * the tools do for each VM in fleet mode.
+ */
+static void test_free_variables(void)
+{
+    uint8_t *ptr;
+    EFI_STATUS status;
+
+    reset_vars();
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BNV);
+
+    free_variables();
+    g_assert(!var_list);
+    g_assert(!arena);
+    g_assert_cmpuint(space_used, ==, 0);
+    call_get_variable(tname1, &tguid1, BSIZ, 0);
+    ptr = buf;
+    status = unserialize_uintn(&ptr);
+    g_assert_cmpuint(status, ==, EFI_NOT_FOUND);
+
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    check_variable_data(tname1, &tguid1, BSIZ, 0, tdata1, sizeof(tdata1));
+    reset_vars();
+}
+
+/*
+ * Updates made in a transaction must not be sent until it commits, and not at
+ * all if it is aborted. There is no XAPI here, so any send fails.
+ */
+static void test_xapidb_transaction(void)
+{
+    char *socket = xapidb_arg_socket;
+
+    xapidb_arg_uuid = "00000000-0000-0000-0000-000000000000";
+    xapidb_arg_socket = "/nonexistent";
+
+    g_assert(xapidb_begin());
+    g_assert(xapidb_commit());
+
+    g_assert(xapidb_begin());
+    g_assert(xapidb_set_variable());
+    g_assert(xapidb_set_variable());
+    xapidb_abort();
+
+    g_assert(xapidb_begin());
+    g_assert(xapidb_set_variable());
+    g_assert(!xapidb_commit());
+    g_assert(!txn_active);
+    g_assert(!xapidb_set_variable());
+
+    writeback_failed = false;
+    xapidb_fini();
+    xapidb_arg_uuid = NULL;
+    xapidb_arg_socket = socket;
+}
+
+/*
+ * Updates written by the filedb backend must be there after a restart,
+ * including with a torn record at the end of the journal and once the
+ * journal has been compacted into a new snapshot.
+ */
+static void test_filedb(void)
+{
+    char dir[] = "/tmp/filedb-XXXXXX";
+    char *path;
+    uint8_t key[sizeof(mor_key)] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t *ptr;
+    struct stat st;
+    uint64_t gen;
+    int fd, pipefd[2];
+
+    g_assert(mkdtemp(dir));
+    g_assert(asprintf(&path, "%s/vm", dir) != -1);
+    g_assert(filedb_parse_arg("path", path));
+    g_assert(filedb_check_args());
+
+    reset_vars();
+    g_assert_cmpint(filedb_init(), ==, BACKEND_INIT_FIRSTBOOT);
+    db = &filedb;
+    sv_ok(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV);
+    sv_ok(tname2, &tguid2, tdata2, sizeof(tdata2), ATTR_B);
+    sv_ok(tname4, &tguid4, tdata4, sizeof(tdata4), ATTR_BNV);
+    sv_ok(tname4, &tguid4, NULL, 0, ATTR_BNV);
+    memcpy(mor_key, key, sizeof(key));
+    sv_ok(tname1, &tguid1, tdata3, sizeof(tdata3), ATTR_BNV);
+    filedb_fini();
+
+    /* Only the NV variables and the MOR key come back. */
+    reset_vars();
+    memset(mor_key, 0, sizeof(mor_key));
+    g_assert_cmpint(filedb_init(), ==, BACKEND_INIT_SUCCESS);
+    check_variable_data(tname1, &tguid1, BSIZ, 0, tdata3, sizeof(tdata3));
+    call_get_variable(tname2, &tguid2, BSIZ, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_NOT_FOUND);
+    call_get_variable(tname4, &tguid4, BSIZ, 0);
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_NOT_FOUND);
+    g_assert(!memcmp(mor_key, key, sizeof(key)));
+
+    /* A torn record is dropped and the journal truncated before it. */
+    fd = open(journal_file, O_WRONLY | O_APPEND);
+    g_assert(fd != -1);
+    g_assert(write(fd, "torn", 4) == 4);
+    close(fd);
+    filedb_fini();
+    reset_vars();
+    g_assert_cmpint(filedb_init(), ==, BACKEND_INIT_SUCCESS);
+    check_variable_data(tname1, &tguid1, BSIZ, 0, tdata3, sizeof(tdata3));
+    g_assert(stat(journal_file, &st) == 0);
+    g_assert_cmpuint(st.st_size, ==, journal_len);
+
+    /* A full journal is folded into a new snapshot. */
+    gen = generation;
+    arg_compact = sizeof(struct journal_header);
+    sv_ok(tname5, &tguid5, tdata5, sizeof(tdata5), ATTR_BNV);
+    g_assert_cmpuint(generation, ==, gen + 1);
+    g_assert_cmpuint(journal_len, ==, sizeof(struct journal_header));
+    arg_compact = DEFAULT_COMPACT;
+    sv_ok(tname1, &tguid1, tdata2, sizeof(tdata2), ATTR_BNV);
+    filedb_fini();
+
+    reset_vars();
+    memset(mor_key, 0, sizeof(mor_key));
+    g_assert_cmpint(filedb_init(), ==, BACKEND_INIT_SUCCESS);
+    check_variable_data(tname1, &tguid1, BSIZ, 0, tdata2, sizeof(tdata2));
+    check_variable_data(tname5, &tguid5, BSIZ, 0, tdata5, sizeof(tdata5));
+    g_assert(!memcmp(mor_key, key, sizeof(key)));
+
+    /*
+     * With group commit, an update is only acknowledged once the window
+     * closes and the journal is synced, and is rolled back if that fails.
+     * The failed sync is retried a while later through a new snapshot,
+     * rather than on every pass of the main loop.
+     */
+    arg_group = 1000;
+    serialize_set_variable(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV, 0);
+    dispatch_command_async(buf);
+    g_assert(command_pending());
+    g_assert(filedb_flush(false));
+    g_assert(command_pending());
+    g_assert(pipe(pipefd) == 0);
+    fd = journal_fd;
+    journal_fd = pipefd[0];
+    memset(&sync_deadline, 0, sizeof(sync_deadline));
+    g_assert(!filedb_flush(false));
+    g_assert(!command_pending());
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_DEVICE_ERROR);
+    check_variable_data(tname1, &tguid1, BSIZ, 0, tdata2, sizeof(tdata2));
+    g_assert(sync_dirty);
+    g_assert(compact_needed);
+    g_assert_cmpint(filedb_flush_timeout(), >, 0);
+    g_assert(filedb_flush(false));
+    g_assert(sync_dirty);
+    journal_fd = fd;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    gen = generation;
+    memset(&sync_deadline, 0, sizeof(sync_deadline));
+    g_assert(filedb_flush(false));
+    g_assert(!sync_dirty);
+    g_assert_cmpuint(generation, ==, gen + 1);
+
+    serialize_set_variable(tname1, &tguid1, tdata1, sizeof(tdata1), ATTR_BNV, 0);
+    dispatch_command_async(buf);
+    g_assert(command_pending());
+    memset(&sync_deadline, 0, sizeof(sync_deadline));
+    g_assert(filedb_flush(false));
+    g_assert(!command_pending());
+    ptr = buf;
+    g_assert_cmpuint(unserialize_uintn(&ptr), ==, EFI_SUCCESS);
+    arg_group = 0;
+    filedb_fini();
+
+    reset_vars();
+    g_assert_cmpint(filedb_init(), ==, BACKEND_INIT_SUCCESS);
+    check_variable_data(tname1, &tguid1, BSIZ, 0, tdata1, sizeof(tdata1));
+    filedb_fini();
+
+    db = &testdb;
+    reset_vars();
+    memset(mor_key, 0, sizeof(mor_key));
+    unlink(snapshot_file);
+    unlink(journal_file);
+    rmdir(dir);
+    free(snapshot_file);
+    free(journal_file);
+    free(arg_path);
+    free(path);
+    arg_path = NULL;
+}
+
+/*
+ * Setting up the keys from a key template must leave the same variables as
+ * running setup_keys, and a template for other auth data must not be used.
+ */
+static void test_template(void)
+{
+    struct {
+        const dstring *name;
+        const EFI_GUID *guid;
+        struct efi_variable *saved;
+    } vars[] = {
+        {PK_name, &gEfiGlobalVariableGuid},
+        {KEK_name, &gEfiGlobalVariableGuid},
+        {db_name, &gEfiImageSecurityDatabaseGuid},
+        {setupMode_name, &gEfiGlobalVariableGuid},
+        {deployedMode_name, &gEfiGlobalVariableGuid},
+        {secureBoot_name, &gEfiGlobalVariableGuid},
+    };
+    struct efi_variable *l;
+    uint64_t space;
+    int i;
+
+    /* PK, KEK and db are required; dbx is left out. */
+    auth_info[1].data_len = sign(&auth_info[1].data, db_name,
+                                 &gEfiImageSecurityDatabaseGuid,
+                                 ATTR_BRNV_TIME, &test_timea,
+                                 (uint8_t *)certA, certA_len, &sign_testPK);
+    auth_info[2].data_len = sign(&auth_info[2].data, KEK_name,
+                                 &gEfiGlobalVariableGuid,
+                                 ATTR_BRNV_TIME, &test_timea,
+                                 (uint8_t *)certB, certB_len, &sign_testPK);
+    auth_info[3].data_len = sign(&auth_info[3].data, PK_name,
+                                 &gEfiGlobalVariableGuid,
+                                 ATTR_BRNV_TIME, &test_timea,
+                                 (uint8_t *)certPK, certPK_len, &sign_testPK);
+
+    reset_vars();
+    setup_variables();
+    g_assert(setup_keys());
+    g_assert(template_write("test.template"));
+
+    for (i = 0; i < ARRAY_SIZE(vars); i++) {
+        l = find_variable((uint8_t *)vars[i].name->data,
+                          dstring_data_size(vars[i].name), vars[i].guid);
+        g_assert(l);
+        vars[i].saved = alloc_efi_variable(l->name, l->name_len, l->data_len);
+        memcpy(vars[i].saved->data, l->data, l->data_len);
+        vars[i].saved->attributes = l->attributes;
+        vars[i].saved->timestamp = l->timestamp;
+        memcpy(vars[i].saved->cert, l->cert, sizeof(l->cert));
+    }
+    space = get_space_usage();
+
+    reset_vars();
+    g_assert(template_load("test.template"));
+    unlink("test.template");
+    g_assert(template_apply());
+    setup_variables();
+
+    for (i = 0; i < ARRAY_SIZE(vars); i++) {
+        l = find_variable((uint8_t *)vars[i].name->data,
+                          dstring_data_size(vars[i].name), vars[i].guid);
+        g_assert(l);
+        g_assert_cmpuint(l->data_len, ==, vars[i].saved->data_len);
+        g_assert(!memcmp(l->data, vars[i].saved->data, l->data_len));
+        g_assert_cmpuint(l->attributes, ==, vars[i].saved->attributes);
+        g_assert(!memcmp(&l->timestamp, &vars[i].saved->timestamp,
+                         sizeof(l->timestamp)));
+        g_assert(!memcmp(l->cert, vars[i].saved->cert, sizeof(l->cert)));
+        free_efi_variable(vars[i].saved);
+    }
+    g_assert_cmpuint(get_space_usage(), ==, space);
+
+    /* Different auth data, or enforcement, needs setup_keys. */
+    reset_vars();
+    auth_enforce = false;
+    g_assert(!template_apply());
+    auth_enforce = true;
+    free(auth_info[1].data);
+    auth_info[1].data = NULL;
+    g_assert(!template_apply());
+    g_assert(!var_list);
+
+    template_free();
+    free_auth_data();
+    reset_vars();
+}
+
+/*
+ * Check every base64 implementation the CPU supports against the scalar
+ * code, across lengths that end in each position of a vector block.
+ */
+static void test_base64(void)
+{
+#ifdef BASE64_X86
+    encode_fn encoders[] = {encode_none, encode_ssse3, encode_avx2};
+    decode_fn decoders[] = {decode_none, decode_ssse3, decode_avx2};
+    bool supported[] = {true, __builtin_cpu_supports("ssse3"),
+                        __builtin_cpu_supports("avx2")};
+#else
+    encode_fn encoders[] = {encode_none};
+    decode_fn decoders[] = {decode_none};
+    bool supported[] = {true};
+#endif
+    uint8_t data[300], out[300];
+    char expected[BASE64_ENCODED_LEN(300)], text[BASE64_ENCODED_LEN(300) + 1];
+    size_t i, len, out_len;
+    unsigned int impl;
+
+    for (i = 0; i < sizeof(data); i++)
+        data[i] = i * 7 + (i >> 3);
+
+    select_impl();
+
+    for (impl = 0; impl < ARRAY_SIZE(encoders); impl++) {
+        if (!supported[impl])
+            continue;
+        for (len = 0; len <= sizeof(data); len++) {
+            encode_fast = encode_none;
+            base64_encode(data, len, expected);
+
+            encode_fast = encoders[impl];
+            decode_fast = decoders[impl];
+            base64_encode(data, len, text);
+            g_assert(!memcmp(text, expected, BASE64_ENCODED_LEN(len)));
+
+            g_assert(base64_decode(text, BASE64_ENCODED_LEN(len),
+                                   out, &out_len));
+            g_assert_cmpuint(out_len, ==, len);
+            g_assert(!memcmp(out, data, len));
+        }
+
+        /*
+         * Whitespace is skipped and anything else outside the alphabet is
+         * rejected, wherever it falls.
+         */
+        len = BASE64_ENCODED_LEN(sizeof(data));
+        base64_encode(data, sizeof(data), text);
+        for (i = 0; i < len; i += 13) {
+            memmove(text + i + 1, text + i, len - i);
+            text[i] = '\n';
+            g_assert(base64_decode(text, len + 1, out, &out_len));
+            g_assert_cmpuint(out_len, ==, sizeof(data));
+            g_assert(!memcmp(out, data, sizeof(data)));
+
+            text[i] = '*';
+            g_assert(!base64_decode(text, len + 1, out, &out_len));
+            memmove(text + i, text + i + 1, len - i);
+        }
+    }
+
+    select_impl();
+}
+
 int main(int argc, char **argv)
 {
     int r;
@@ -2668,6 +4028,14 @@ int main(int argc, char **argv)
                     test_get_next_variable_no_match);
     g_test_add_func("/test/get_next_variable/all",
                     test_get_next_variable_all);
+    g_test_add_func("/test/get_next_variable/delete",
+                    test_get_next_variable_delete);
+    g_test_add_func("/test/get_next_variable/batch",
+                    test_get_next_variable_batch);
+    g_test_add_func("/test/get_variable/batch",
+                    test_get_variable_batch);
+    g_test_add_func("/test/get_variable_batch/truncated",
+                    test_get_variable_batch_truncated);
     g_test_add_func("/test/set_variable/attr",
                     test_set_variable_attr);
     g_test_add_func("/test/set_variable/set",
@@ -2682,6 +4050,12 @@ int main(int argc, char **argv)
                     test_set_variable_resource_limit);
     g_test_add_func("/test/set_variable/many_vars",
                     test_set_variable_many_vars);
+    g_test_add_func("/test/set_variable/index",
+                    test_set_variable_index);
+    g_test_add_func("/test/set_variable/compact",
+                    test_set_variable_compact);
+    g_test_add_func("/test/set_variable/async",
+                    test_set_variable_async);
     g_test_add_func("/test/set_variable/non_volatile",
                     test_set_variable_non_volatile);
     g_test_add_func("/test/set_variable/special_vars",
@@ -2717,6 +4091,24 @@ int main(int argc, char **argv)
                     test_secure_set_dbx_usermode);
     g_test_add_func("/test/secure_set_variable/DBT/usermode",
                     test_secure_set_dbt_usermode);
+    g_test_add_func("/test/secure_set_variable/verify_cache",
+                    test_secure_set_verify_cache);
+    g_test_add_func("/test/context/switch", test_context_switch);
+    g_test_add_func("/test/filter_signature_list", test_filter_signature_list);
+    g_test_add_func("/test/filter_signature_list/large",
+                    test_filter_signature_list_large);
+    g_test_add_func("/test/check_signature_list_format",
+                    test_check_signature_list_format);
+    g_test_add_func("/test/variable_handle", test_variable_handle);
+    g_test_add_func("/test/stats", test_stats);
+    g_test_add_func("/test/log_ring", test_log_ring);
+    g_test_add_func("/test/save_resume", test_save_resume);
+    g_test_add_func("/test/compressed_blob", test_compressed_blob);
+    g_test_add_func("/test/free_variables", test_free_variables);
+    g_test_add_func("/test/xapidb_transaction", test_xapidb_transaction);
+    g_test_add_func("/test/filedb", test_filedb);
+    g_test_add_func("/test/template", test_template);
+    g_test_add_func("/test/base64", test_base64);
 
     r = g_test_run();
     free_globals();
@@ -31,10 +31,18 @@
 #include <stddef.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/stat.h>
 
 #include <backend.h>
+#include <context.h>
+#include <debug.h>
 #include <handler.h>
 #include <guid.h>
+#include <mor.h>
+#include <ppi.h>
 #include <serialize.h>
 
 #include "tool-lib.h"
@@ -65,6 +73,35 @@ tool_init(void)
     return true;
 }
 
+/*
+ * Start a transaction so that the updates made until tool_commit() are sent
+ * to the backend in one go. Backends without transactions write out each
+ * update as it is made.
+ */
+bool
+tool_begin(void)
+{
+    return db->begin ? db->begin() : true;
+}
+
+bool
+tool_commit(void)
+{
+    if (db->commit && !db->commit()) {
+        fprintf(stderr, "Failed to save variables\n");
+        return false;
+    }
+
+    return true;
+}
+
+void
+tool_abort(void)
+{
+    if (db->abort)
+        db->abort();
+}
+
 /*
  * Print out a useful message for an EFI_STATUS.
  */
@@ -289,6 +326,15 @@ print_depriv_options(void)
            "  [-u] <uid> - change process user\n");
 }
 
+void
+print_fleet_options(void)
+{
+    printf("\nOptions to work on many VMs at once:\n"
+           "  [-m] <uuid-file> - instead of <vm-uuid>, run for every VM listed in the file, or stdin if it is '-'\n"
+           "  [-j] <jobs> - number of VMs to have in flight at once (default %d)\n",
+           FLEET_DEFAULT_JOBS);
+}
+
 bool
 do_rm(const EFI_GUID *guid, const char *name)
 {
@@ -351,3 +397,475 @@ do_rm(const EFI_GUID *guid, const char *name)
 
     return true;
 }
+
+bool
+do_set(const EFI_GUID *guid, const char *name, UINT32 attr, const char *path)
+{
+    uint8_t buf[SHMEM_SIZE];
+    uint8_t *ptr, *data;
+    uint8_t variable_name[NAME_LIMIT];
+    EFI_STATUS status;
+    size_t name_size;
+    struct stat st;
+    FILE *f;
+
+    name_size = parse_name(name, variable_name);
+
+    f = fopen(path, "r");
+    if (!f) {
+        ERR("Failed to open %s\n", path);
+        return false;
+    }
+    if (fstat(fileno(f), &st) == -1 || st.st_size > DATA_LIMIT) {
+        printf("Invalid file size\n");
+        fclose(f);
+        return false;
+    }
+    data = malloc(st.st_size);
+    if (!data) {
+        ERR("Failed to allocate memory\n");
+        fclose(f);
+        return false;
+    }
+    if (fread(data, 1, st.st_size, f) != st.st_size) {
+        ERR("Failed to read from file\n");
+        fclose(f);
+        free(data);
+        return false;
+    }
+    fclose(f);
+
+    ptr = buf;
+    serialize_uint32(&ptr, 1); /* version */
+    serialize_uint32(&ptr, COMMAND_SET_VARIABLE);
+    serialize_data(&ptr, variable_name, name_size);
+    serialize_guid(&ptr, guid);
+    serialize_data(&ptr, data, st.st_size);
+    free(data);
+    serialize_uint32(&ptr, attr);
+    *ptr = 0;
+
+    dispatch_command(buf);
+
+    ptr = buf;
+    status = unserialize_uintn(&ptr);
+    if (status != EFI_SUCCESS) {
+        print_efi_error(status);
+        return false;
+    }
+
+    return true;
+}
+
+#define SCRIPT_MAX_ARGS 5
+
+/*
+ * Run one line of a script. Returns false if it is malformed or the
+ * operation fails.
+ */
+static bool
+run_script_line(char *line)
+{
+    char *argv[SCRIPT_MAX_ARGS + 1];
+    char *save;
+    int argc = 0, want;
+    EFI_GUID guid;
+    UINT32 attr;
+    char *end;
+
+    for (argv[argc] = strtok_r(line, " \t", &save);
+         argv[argc] && argc < SCRIPT_MAX_ARGS;
+         argv[argc] = strtok_r(NULL, " \t", &save))
+        argc++;
+
+    if (!strcmp(argv[0], "set")) {
+        want = 5;
+    } else if (!strcmp(argv[0], "rm")) {
+        want = 3;
+    } else {
+        fprintf(stderr, "Unknown command '%s'\n", argv[0]);
+        return false;
+    }
+
+    if (argv[argc] || argc != want) {
+        fprintf(stderr, "Wrong number of arguments for '%s'\n", argv[0]);
+        return false;
+    }
+
+    if (!parse_guid(&guid, argv[1])) {
+        ERR("Failed to parse GUID\n");
+        return false;
+    }
+
+    if (want == 5) {
+        errno = 0;
+        attr = strtoul(argv[3], &end, 0);
+        if (errno || *end != '\0') {
+            ERR("Failed to parse attributes\n");
+            return false;
+        }
+
+        return do_set(&guid, argv[2], attr, argv[4]);
+    }
+
+    return do_rm(&guid, argv[2]);
+}
+
+/*
+ * Apply the operations listed in a script, or stdin if path is "-". Each line
+ * is one of:
+ *
+ *   set <guid> <name> <attributes> <data-file>
+ *   rm <guid> <name>
+ *
+ * Blank lines and lines starting with '#' are ignored. Stops at the first
+ * line that fails.
+ */
+bool
+tool_apply_script(const char *path)
+{
+    FILE *f;
+    /* Room for a command, GUID, name, attributes and path. */
+    char line[NAME_LIMIT + PATH_MAX];
+    char *ptr;
+    int lineno = 0;
+    bool ret = false;
+
+    if (!strcmp(path, "-")) {
+        f = stdin;
+    } else {
+        f = fopen(path, "r");
+        if (!f) {
+            fprintf(stderr, "Could not open '%s': %d, %s\n",
+                    path, errno, strerror(errno));
+            return false;
+        }
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        /* Strip newline */
+        ptr = line + strlen(line) - 1;
+        while (ptr >= line && (*ptr == '\r' || *ptr == '\n'))
+            *ptr-- = '\0';
+
+        /* Ignore comments and blank lines */
+        ptr = line + strspn(line, " \t");
+        if (*ptr == '\0' || *ptr == '#')
+            continue;
+
+        if (!run_script_line(ptr)) {
+            fprintf(stderr, "Failed at line %d in '%s'.\n", lineno, path);
+            goto out;
+        }
+    }
+
+    if (ferror(f)) {
+        fprintf(stderr, "Failed to read '%s'\n", path);
+        goto out;
+    }
+
+    ret = true;
+
+out:
+    if (f != stdin)
+        fclose(f);
+    return ret;
+}
+
+/* Apply a script as a single transaction: if any line fails, nothing is saved. */
+bool
+tool_run_script(const char *path)
+{
+    if (!tool_begin())
+        return false;
+
+    if (!tool_apply_script(path)) {
+        tool_abort();
+        return false;
+    }
+
+    return tool_commit();
+}
+
+/*
+ * Read a list of VM UUIDs, one per line, from path or stdin if path is "-".
+ * Blank lines and lines starting with '#' are ignored.
+ */
+char **
+tool_read_uuids(const char *path, size_t *count)
+{
+    FILE *f;
+    char line[256];
+    char *ptr, **uuids = NULL, **new_uuids;
+    size_t n = 0;
+
+    if (!strcmp(path, "-")) {
+        f = stdin;
+    } else {
+        f = fopen(path, "r");
+        if (!f) {
+            fprintf(stderr, "Could not open '%s': %d, %s\n",
+                    path, errno, strerror(errno));
+            return NULL;
+        }
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        ptr = line + strlen(line) - 1;
+        while (ptr >= line && isspace(*ptr))
+            *ptr-- = '\0';
+
+        ptr = line + strspn(line, " \t");
+        if (*ptr == '\0' || *ptr == '#')
+            continue;
+
+        new_uuids = realloc(uuids, (n + 1) * sizeof(*uuids));
+        if (!new_uuids)
+            goto oom;
+        uuids = new_uuids;
+        uuids[n] = strdup(ptr);
+        if (!uuids[n])
+            goto oom;
+        n++;
+    }
+
+    if (ferror(f) || n == 0) {
+        fprintf(stderr, "No VM UUIDs read from '%s'\n", path);
+        goto fail;
+    }
+
+    if (f != stdin)
+        fclose(f);
+    *count = n;
+    return uuids;
+
+oom:
+    ERR("Out of memory\n");
+fail:
+    if (f != stdin)
+        fclose(f);
+    while (n)
+        free(uuids[--n]);
+    free(uuids);
+    return NULL;
+}
+
+/*
+ * Fleet mode runs an operation on many VMs in one process. While a VM is in
+ * flight it has its own copy of the per-VM state, i.e. the variable store and
+ * the backend's connection, and up to a given number of VMs have backend
+ * calls in flight at once. The backend's session is shared, so the first VM
+ * runs alone until it is loaded and the others find the session logged in.
+ */
+enum fleet_state {
+    FLEET_LOADING,
+    FLEET_SAVING,
+    FLEET_DONE,
+};
+
+struct fleet_vm {
+    const char *uuid;
+    struct context *ctx;
+    enum fleet_state state;
+    const char *result; /* NULL on success. */
+};
+
+static struct context *fleet_base; /* The state every VM starts from. */
+static struct fleet_vm *fleet_vm; /* The VM whose backend event is handled. */
+static bool (*fleet_op)(void);
+static bool fleet_session_up;
+
+static void
+fleet_finish(struct fleet_vm *vm, const char *result)
+{
+    vm->state = FLEET_DONE;
+    vm->result = result;
+}
+
+static void
+fleet_saved(bool saved)
+{
+    fleet_finish(fleet_vm, saved ? NULL : "failed to save");
+}
+
+/* Runs the operation once a VM's variables are loaded, then saves them. */
+static void
+fleet_loaded(enum backend_init_status status)
+{
+    struct fleet_vm *vm = fleet_vm;
+
+    if (status == BACKEND_INIT_FAILURE) {
+        fleet_finish(vm, "failed to load");
+        return;
+    }
+    fleet_session_up = true;
+
+    if (!setup_variables() || !tool_begin()) {
+        fleet_finish(vm, "failed to load");
+        return;
+    }
+
+    printf("VM %s:\n", vm->uuid);
+    if (!fleet_op()) {
+        tool_abort();
+        fleet_finish(vm, "failed");
+        return;
+    }
+
+    switch (db->commit_async(fleet_saved)) {
+    case BACKEND_SAVE_SUCCESS:
+        fleet_finish(vm, NULL);
+        break;
+    case BACKEND_SAVE_PENDING:
+        vm->state = FLEET_SAVING;
+        break;
+    case BACKEND_SAVE_FAILURE:
+        fleet_finish(vm, "failed to save");
+        break;
+    }
+}
+
+static void
+fleet_start(struct fleet_vm *vm)
+{
+    context_switch(fleet_base);
+    vm->ctx = context_new();
+    if (!vm->ctx) {
+        fleet_finish(vm, "out of memory");
+        return;
+    }
+    context_switch(vm->ctx);
+
+    vm->state = FLEET_LOADING;
+    fleet_vm = vm;
+    if (!db->parse_arg("uuid", vm->uuid) || !db->init_async(fleet_loaded))
+        fleet_finish(vm, "failed to load");
+}
+
+/* Releases everything a finished VM was using. */
+static void
+fleet_reap(struct fleet_vm *vm)
+{
+    if (!vm->ctx)
+        return;
+
+    context_switch(vm->ctx);
+    free_variables();
+    db->fini();
+    context_free(vm->ctx);
+    vm->ctx = NULL;
+}
+
+/*
+ * Run op on each VM in uuids with up to jobs of them in flight, then report
+ * how each one went. op runs with the VM's variables loaded and a
+ * transaction open, which is committed if it returns true. Returns true if
+ * every VM succeeded.
+ */
+bool
+tool_fleet_run(char **uuids, size_t count, unsigned int jobs, bool (*op)(void))
+{
+    const struct context_region *const *tables;
+    struct fleet_vm *vms, **active;
+    struct pollfd *pfd;
+    size_t next = 0, nr_active = 0, i, failed = 0;
+    bool ret = false;
+
+    if (!db->init_async || !db->commit_async || !db->poll_fd ||
+            !db->poll_event || !db->fini || !db->context) {
+        fprintf(stderr, "The backend does not support multiple VMs\n");
+        return false;
+    }
+
+    secure_boot_enable = false;
+    auth_enforce = false;
+
+    if (!context_add(handler_context) || !context_add(mor_context) ||
+            !context_add(ppi_context))
+        goto oom;
+    for (tables = db->context; *tables; tables++) {
+        if (!context_add(*tables))
+            goto oom;
+    }
+
+    vms = calloc(count, sizeof(*vms));
+    active = calloc(jobs, sizeof(*active));
+    pfd = calloc(jobs, sizeof(*pfd));
+    fleet_base = context_new();
+    if (!vms || !active || !pfd || !fleet_base) {
+        free(vms);
+        free(active);
+        free(pfd);
+        goto oom;
+    }
+
+    fleet_op = op;
+    for (i = 0; i < count; i++)
+        vms[i].uuid = uuids[i];
+
+    while (next < count || nr_active) {
+        while (nr_active < (fleet_session_up ? jobs : 1) && next < count) {
+            fleet_start(&vms[next]);
+            active[nr_active++] = &vms[next++];
+        }
+
+        for (i = 0; i < nr_active;) {
+            struct fleet_vm *vm = active[i];
+
+            if (vm->state != FLEET_DONE) {
+                context_switch(vm->ctx);
+                pfd[i].fd = db->poll_fd(&pfd[i].events);
+                pfd[i].revents = 0;
+                if (pfd[i].fd != -1) {
+                    i++;
+                    continue;
+                }
+                fleet_finish(vm, "failed");
+            }
+
+            fleet_reap(vm);
+            active[i] = active[--nr_active];
+        }
+
+        if (!nr_active)
+            continue;
+
+        if (poll(pfd, nr_active, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("poll failed: %d, %s\n", errno, strerror(errno));
+            goto out;
+        }
+
+        for (i = 0; i < nr_active; i++) {
+            if (!pfd[i].revents)
+                continue;
+            context_switch(active[i]->ctx);
+            fleet_vm = active[i];
+            db->poll_event(pfd[i].revents);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        printf("%s: %s\n", vms[i].uuid, vms[i].result ? vms[i].result : "ok");
+        if (vms[i].result)
+            failed++;
+    }
+    if (failed)
+        fprintf(stderr, "%lu of %lu VMs failed\n", failed, count);
+    ret = !failed;
+
+out:
+    /* Leave the initial state in place for the session to be ended with. */
+    context_switch(fleet_base);
+    context_free(fleet_base);
+    free(vms);
+    free(active);
+    free(pfd);
+    return ret;
+
+oom:
+    ERR("Out of memory\n");
+    return false;
+}
@@ -75,11 +75,47 @@
         } \
         break;
 
+/*
+ * Likewise for the options to run a tool on many VMs at once. These must
+ * come after DEPRIV_VARS.
+ */
+
+#define FLEET_DEFAULT_JOBS 16
+
+#define FLEET_VARS \
+    const char *opt_fleet = NULL; \
+    unsigned int opt_jobs = FLEET_DEFAULT_JOBS;
+
+#define FLEET_OPTS "j:m:"
+
+#define FLEET_CASES \
+    case 'j': \
+        opt_jobs = (unsigned int)strtoul(optarg, &end, 0); \
+        if (*end != '\0' || opt_jobs == 0) { \
+            fprintf(stderr, "invalid number of jobs '%s'\n", optarg); \
+            exit(1); \
+        } \
+        break; \
+    case 'm': \
+        opt_fleet = optarg; \
+        break;
+
 bool tool_init(void);
+bool tool_begin(void);
+bool tool_commit(void);
+void tool_abort(void);
 void print_efi_error(EFI_STATUS status);
 bool parse_guid(EFI_GUID *guid, const char *guid_str);
 size_t parse_name(const char *in, uint8_t *name);
 void print_depriv_options(void);
+void print_fleet_options(void);
 bool do_rm(const EFI_GUID *guid, const char *name);
+bool do_set(const EFI_GUID *guid, const char *name, UINT32 attr,
+            const char *path);
+bool tool_apply_script(const char *path);
+bool tool_run_script(const char *path);
+char **tool_read_uuids(const char *path, size_t *count);
+bool tool_fleet_run(char **uuids, size_t count, unsigned int jobs,
+                    bool (*op)(void));
 
 #endif
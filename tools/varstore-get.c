@@ -41,7 +41,7 @@
 #include "tool-lib.h"
 
 const struct backend *db = &xapidb_cmdline;
-const enum log_level log_level = LOG_LVL_INFO;
+enum log_level log_level = LOG_LVL_INFO;
 
 static void
 usage(const char *progname)
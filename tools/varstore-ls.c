@@ -41,14 +41,16 @@
 #include "tool-lib.h"
 
 const struct backend *db = &xapidb_cmdline;
-const enum log_level log_level = LOG_LVL_INFO;
+enum log_level log_level = LOG_LVL_INFO;
 
 static void
 usage(const char *progname)
 {
-    printf("usage: %s [-h] [depriv options] <vm-uuid>\n\n", progname);
+    printf("usage: %s [-h] [depriv options] [fleet options] <vm-uuid>\n\n",
+           progname);
     printf("Lists the VM's EFI variables.\n");
     print_depriv_options();
+    print_fleet_options();
 }
 
 static void
@@ -127,16 +129,20 @@ do_ls(void)
 
 int main(int argc, char **argv)
 {
+    char **uuids = NULL;
+    size_t count;
     DEPRIV_VARS
+    FLEET_VARS
 
     for (;;) {
-        int c = getopt(argc, argv, "h" DEPRIV_OPTS);
+        int c = getopt(argc, argv, "h" DEPRIV_OPTS FLEET_OPTS);
 
         if (c == -1)
             break;
 
         switch (c) {
         DEPRIV_CASES
+        FLEET_CASES
         case 'h':
             usage(argv[0]);
             exit(0);
@@ -146,12 +152,18 @@ int main(int argc, char **argv)
         }
     }
 
-    if (argc - optind != 1) {
+    if (argc - optind != (opt_fleet ? 0 : 1)) {
         usage(argv[0]);
         exit(1);
     }
 
-    db->parse_arg("uuid", argv[optind]);
+    if (opt_fleet) {
+        uuids = tool_read_uuids(opt_fleet, &count);
+        if (!uuids)
+            exit(1);
+    } else {
+        db->parse_arg("uuid", argv[optind]);
+    }
 
     if (opt_socket)
         db->parse_arg("socket", opt_socket);
@@ -159,6 +171,9 @@ int main(int argc, char **argv)
     if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
         exit(1);
 
+    if (opt_fleet)
+        return !tool_fleet_run(uuids, count, opt_jobs, do_ls);
+
     if (!tool_init())
         exit(1);
 
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) Citrix Systems, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <backend.h>
+#include <debug.h>
+#include <handler.h>
+#include <template.h>
+
+/* Nothing is persisted; the variables only go into the template. */
+static bool
+template_set_variable(void)
+{
+    return true;
+}
+
+static bool
+template_sb_notify(void)
+{
+    return true;
+}
+
+static const struct backend template_db = {
+    .set_variable = template_set_variable,
+    .sb_notify = template_sb_notify,
+};
+
+const struct backend *db = &template_db;
+enum log_level log_level = LOG_LVL_INFO;
+
+static void
+usage(const char *progname)
+{
+    printf("usage: %s [-h] [-n] [<output>]\n\n", progname);
+    printf("Sets up the first boot keys from the auth data and writes the\n"
+           "result as a key template to <output> (default %s).\n"
+           "varstored uses the template on first boot instead of verifying\n"
+           "the auth data again, as long as the auth data has not changed.\n"
+           "Rerun it whenever the auth files are updated.\n\n", TEMPLATE_PATH);
+    printf("  -n  make the template for VMs with authenticated variables\n"
+           "      not enforced\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = TEMPLATE_PATH;
+
+    for (;;) {
+        int c = getopt(argc, argv, "hn");
+
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'n':
+            auth_enforce = false;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (argc - optind > 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (argc - optind == 1)
+        path = argv[optind];
+
+    if (!load_auth_data())
+        exit(1);
+
+    if (!setup_crypto() || !setup_variables() || !setup_keys()) {
+        ERR("Failed to setup keys\n");
+        exit(1);
+    }
+
+    if (!template_write(path))
+        exit(1);
+
+    free_auth_data();
+
+    return 0;
+}
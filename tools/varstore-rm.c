@@ -47,7 +47,7 @@
 #define CLONE_RM_DIR "/etc/xapi.d/efi-clone"
 
 const struct backend *db = &xapidb_cmdline;
-const enum log_level log_level = LOG_LVL_INFO;
+enum log_level log_level = LOG_LVL_INFO;
 
 struct clone_variable
 {
@@ -62,13 +62,14 @@ static struct clone_variable *clone_vars;
 static void
 usage(const char *progname)
 {
-    printf("usage: %s [-c] [-h] [depriv options] <vm-uuid> [<guid> <name>]\n\n",
+    printf("usage: %s [-c] [-h] [depriv options] [fleet options] <vm-uuid> [<guid> <name>]\n\n",
            progname);
     printf("Removes an EFI variable (either normal or authenticated).\n"
            "Alternatively, if -c is given then guid and name should not given\n"
            "and it will remove all remove-on-clone variables configured in\n"
            CLONE_RM_DIR ".\n");
     print_depriv_options();
+    print_fleet_options();
 }
 
 static bool
@@ -180,7 +181,11 @@ out:
     return ret;
 }
 
-static void
+/*
+ * Remove every remove-on-clone variable. Variables that can't be removed
+ * (usually because the VM doesn't have them) are skipped.
+ */
+static bool
 do_rm_clone(void)
 {
     struct clone_variable *v = clone_vars;
@@ -190,21 +195,36 @@ do_rm_clone(void)
         do_rm(&v->guid, v->name);
         v = v->next;
     }
+
+    return true;
+}
+
+static EFI_GUID rm_guid;
+static const char *rm_name;
+
+static bool
+do_rm_one(void)
+{
+    return do_rm(&rm_guid, rm_name);
 }
 
 int main(int argc, char **argv)
 {
     bool clone_rm = false;
+    char **uuids = NULL, **args;
+    size_t count;
     DEPRIV_VARS
+    FLEET_VARS
 
     for (;;) {
-        int c = getopt(argc, argv, "ch" DEPRIV_OPTS);
+        int c = getopt(argc, argv, "ch" DEPRIV_OPTS FLEET_OPTS);
 
         if (c == -1)
             break;
 
         switch (c) {
         DEPRIV_CASES
+        FLEET_CASES
         case 'c':
             clone_rm = true;
             break;
@@ -217,12 +237,27 @@ int main(int argc, char **argv)
         }
     }
 
-    if ((clone_rm && argc - optind != 1) || (!clone_rm && argc - optind != 3)) {
+    if (argc - optind != (opt_fleet ? 0 : 1) + (clone_rm ? 0 : 2)) {
         usage(argv[0]);
         exit(1);
     }
+    args = argv + optind + (opt_fleet ? 0 : 1);
+
+    if (!clone_rm) {
+        if (!parse_guid(&rm_guid, args[0])) {
+            ERR("Failed to parse GUID\n");
+            return 1;
+        }
+        rm_name = args[1];
+    }
 
-    db->parse_arg("uuid", argv[optind]);
+    if (opt_fleet) {
+        uuids = tool_read_uuids(opt_fleet, &count);
+        if (!uuids)
+            exit(1);
+    } else {
+        db->parse_arg("uuid", argv[optind]);
+    }
 
     if (opt_socket)
         db->parse_arg("socket", opt_socket);
@@ -233,20 +268,20 @@ int main(int argc, char **argv)
     if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
         exit(1);
 
+    if (opt_fleet)
+        return !tool_fleet_run(uuids, count, opt_jobs,
+                               clone_rm ? do_rm_clone : do_rm_one);
+
     if (!tool_init())
         exit(1);
 
     if (clone_rm) {
-        do_rm_clone();
-        return 0;
-    } else {
-        EFI_GUID guid;
-
-        if (!parse_guid(&guid, argv[optind + 1])) {
-            ERR("Failed to parse GUID\n");
+        /* Save once after removing them all. */
+        if (!tool_begin())
             return 1;
-        }
-
-        return !do_rm(&guid, argv[optind + 2]);
+        do_rm_clone();
+        return !tool_commit();
     }
+
+    return !do_rm_one();
 }
@@ -45,32 +45,59 @@
 #include "tool-lib.h"
 
 const struct backend *db = &xapidb_cmdline;
-const enum log_level log_level = LOG_LVL_INFO;
+enum log_level log_level = LOG_LVL_INFO;
 
 static void
 usage(const char *progname)
 {
-    printf("usage: %s [-h] [depriv options] <vm-uuid> setup|user\n\n",
+    printf("usage: %s [-h] [depriv options] [fleet options] <vm-uuid> setup|user\n\n",
            progname);
     printf("If setup is given, clears a VM's EFI variables related to Secure Boot\n"
            "and places it into Setup Mode.\n"
            "If user is given, resets a VM's EFI variables related to Secure Boot\n"
            "to the defaults, placing it into User Mode.\n");
     print_depriv_options();
+    print_fleet_options();
+}
+
+static bool user_mode;
+
+static bool
+do_sb_state(void)
+{
+    /* Ignore errors in case the variables are missing. */
+    printf("Removing PK...\n");
+    do_rm(&gEfiGlobalVariableGuid, "PK");
+    printf("Removing KEK...\n");
+    do_rm(&gEfiGlobalVariableGuid, "KEK");
+    printf("Removing db...\n");
+    do_rm(&gEfiImageSecurityDatabaseGuid, "db");
+    printf("Removing dbx...\n");
+    do_rm(&gEfiImageSecurityDatabaseGuid, "dbx");
+
+    if (user_mode)
+        return setup_keys();
+    else
+        return true;
 }
 
 int main(int argc, char **argv)
 {
+    char **uuids = NULL;
+    size_t count;
+    const char *mode;
     DEPRIV_VARS
+    FLEET_VARS
 
     for (;;) {
-        int c = getopt(argc, argv, "h" DEPRIV_OPTS);
+        int c = getopt(argc, argv, "h" DEPRIV_OPTS FLEET_OPTS);
 
         if (c == -1)
             break;
 
         switch (c) {
         DEPRIV_CASES
+        FLEET_CASES
         case 'h':
             usage(argv[0]);
             exit(0);
@@ -80,39 +107,39 @@ int main(int argc, char **argv)
         }
     }
 
-    if ((argc - optind != 2) ||
-            (strcmp(argv[optind + 1], "setup") &&
-             strcmp(argv[optind + 1], "user"))) {
+    if (argc - optind != (opt_fleet ? 1 : 2)) {
+        usage(argv[0]);
+        exit(1);
+    }
+    mode = argv[argc - 1];
+    if (strcmp(mode, "setup") && strcmp(mode, "user")) {
         usage(argv[0]);
         exit(1);
     }
+    user_mode = !strcmp(mode, "user");
 
-    db->parse_arg("uuid", argv[optind]);
+    if (opt_fleet) {
+        uuids = tool_read_uuids(opt_fleet, &count);
+        if (!uuids)
+            exit(1);
+    } else {
+        db->parse_arg("uuid", argv[optind]);
+    }
 
     if (opt_socket)
         db->parse_arg("socket", opt_socket);
 
-    if (!strcmp(argv[optind + 1], "user"))
+    if (user_mode)
         load_auth_data();
 
     if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
         exit(1);
 
+    if (opt_fleet)
+        return !tool_fleet_run(uuids, count, opt_jobs, do_sb_state);
+
     if (!tool_init())
         exit(1);
 
-    /* Ignore errors in case the variables are missing. */
-    printf("Removing PK...\n");
-    do_rm(&gEfiGlobalVariableGuid, "PK");
-    printf("Removing KEK...\n");
-    do_rm(&gEfiGlobalVariableGuid, "KEK");
-    printf("Removing db...\n");
-    do_rm(&gEfiImageSecurityDatabaseGuid, "db");
-    printf("Removing dbx...\n");
-    do_rm(&gEfiImageSecurityDatabaseGuid, "dbx");
-
-    if (!strcmp(argv[optind + 1], "user"))
-        return setup_keys();
-    else
-        return 0;
+    return !do_sb_state();
 }
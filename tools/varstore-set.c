@@ -32,8 +32,6 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <unistd.h>
 
 #include <backend.h>
@@ -44,109 +42,64 @@
 #include "tool-lib.h"
 
 const struct backend *db = &xapidb_cmdline;
-const enum log_level log_level = LOG_LVL_INFO;
+enum log_level log_level = LOG_LVL_INFO;
 
 static void
 usage(const char *progname)
 {
-    printf("usage: %s [-h] [depriv options] <vm-uuid> <guid> <name> <attributes> <data-file>\n\n",
-           progname);
+    printf("usage: %s [-h] [depriv options] [fleet options] <vm-uuid> <guid> <name> <attributes> <data-file>\n"
+           "       %s [-h] [depriv options] [fleet options] -f <script> <vm-uuid>\n\n",
+           progname, progname);
     printf("Sets/updates/appends/removes an EFI variable for a VM.\n"
            "attributes is a bitmask specified as a number. E.g. '7' for 'boot|runtime|nvram'.\n"
            "Variables can be appended by specifying 'append' in the attributes.\n"
            "Normal variables can be removed by providing an empty data-file or by\n"
            "specifying neither 'boot' nor 'runtime' in the attributes.\n"
            "Authenticated variables can be removed by providing a valid authentication\n"
-           "descriptor with no data.\n");
+           "descriptor with no data.\n"
+           "If -f is given, applies every operation in script (or stdin if it is '-')\n"
+           "and saves the result once, or not at all if any of them fail. Each line\n"
+           "of the script is one of:\n"
+           "  set <guid> <name> <attributes> <data-file>\n"
+           "  rm <guid> <name>\n");
     print_depriv_options();
+    print_fleet_options();
 }
 
+static const char *script;
+static EFI_GUID set_guid;
+static const char *set_name, *set_path;
+static UINT32 set_attr;
+
+/* The operation for each VM in fleet mode, in the transaction it runs in. */
 static bool
-do_set(const char *guid_str, const char *name, const char *attr_str,
-       const char *path)
+do_fleet_set(void)
 {
-    uint8_t buf[SHMEM_SIZE];
-    uint8_t *ptr, *data;
-    uint8_t variable_name[NAME_LIMIT];
-    EFI_GUID guid;
-    EFI_STATUS status;
-    UINT32 attr;
-    size_t name_size;
-    struct stat st;
-    FILE *f;
-
-    name_size = parse_name(name, variable_name);
-
-    if (!parse_guid(&guid, guid_str)) {
-        ERR("Failed to parse GUID\n");
-        return false;
-    }
-
-    errno = 0;
-    attr = strtoul(attr_str, NULL, 0);
-    if (errno) {
-        ERR("Failed to parse attributes\n");
-        return false;
-    }
-
-    f = fopen(path, "r");
-    if (!f) {
-        ERR("Failed to open %s\n", path);
-        return false;
-    }
-    if (fstat(fileno(f), &st) == -1 || st.st_size > DATA_LIMIT) {
-        printf("Invalid file size\n");
-        fclose(f);
-        return false;
-    }
-    data = malloc(st.st_size);
-    if (!data) {
-        ERR("Failed to allocate memory\n");
-        fclose(f);
-        return false;
-    }
-    if (fread(data, 1, st.st_size, f) != st.st_size) {
-        ERR("Failed to read from file\n");
-        fclose(f);
-        free(data);
-        return false;
-    }
-    fclose(f);
-
-    ptr = buf;
-    serialize_uint32(&ptr, 1); /* version */
-    serialize_uint32(&ptr, COMMAND_SET_VARIABLE);
-    serialize_data(&ptr, variable_name, name_size);
-    serialize_guid(&ptr, &guid);
-    serialize_data(&ptr, data, st.st_size);
-    free(data);
-    serialize_uint32(&ptr, attr);
-    *ptr = 0;
-
-    dispatch_command(buf);
-
-    ptr = buf;
-    status = unserialize_uintn(&ptr);
-    if (status != EFI_SUCCESS) {
-        print_efi_error(status);
-        return false;
-    }
+    if (script)
+        return tool_apply_script(script);
 
-    return true;
+    return do_set(&set_guid, set_name, set_attr, set_path);
 }
 
 int main(int argc, char **argv)
 {
+    char **uuids = NULL, **args;
+    size_t count;
     DEPRIV_VARS
+    FLEET_VARS
 
     for (;;) {
-        int c = getopt(argc, argv, "h" DEPRIV_OPTS);
+        int c = getopt(argc, argv, "f:h" DEPRIV_OPTS FLEET_OPTS);
 
         if (c == -1)
             break;
 
         switch (c) {
         DEPRIV_CASES
+        FLEET_CASES
+        case 'f':
+            script = optarg;
+            break;
         case 'h':
             usage(argv[0]);
             exit(0);
@@ -156,12 +109,41 @@ int main(int argc, char **argv)
         }
     }
 
-    if (argc - optind != 5) {
+    if (argc - optind != (opt_fleet ? 0 : 1) + (script ? 0 : 4)) {
         usage(argv[0]);
         exit(1);
     }
+    args = argv + optind + (opt_fleet ? 0 : 1);
+
+    if (opt_fleet && script && !strcmp(script, "-")) {
+        fprintf(stderr, "The script must be a file with -m\n");
+        exit(1);
+    }
+
+    if (!script) {
+        if (!parse_guid(&set_guid, args[0])) {
+            ERR("Failed to parse GUID\n");
+            return 1;
+        }
+
+        errno = 0;
+        set_attr = strtoul(args[2], NULL, 0);
+        if (errno) {
+            ERR("Failed to parse attributes\n");
+            return 1;
+        }
+
+        set_name = args[1];
+        set_path = args[3];
+    }
 
-    db->parse_arg("uuid", argv[optind]);
+    if (opt_fleet) {
+        uuids = tool_read_uuids(opt_fleet, &count);
+        if (!uuids)
+            exit(1);
+    } else {
+        db->parse_arg("uuid", argv[optind]);
+    }
 
     if (opt_socket)
         db->parse_arg("socket", opt_socket);
@@ -169,9 +151,14 @@ int main(int argc, char **argv)
     if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
         exit(1);
 
+    if (opt_fleet)
+        return !tool_fleet_run(uuids, count, opt_jobs, do_fleet_set);
+
     if (!tool_init())
         exit(1);
 
-    return !do_set(argv[optind + 1], argv[optind + 2], argv[optind + 3],
-                   argv[optind + 4]);
+    if (script)
+        return !tool_run_script(script);
+
+    return !do_set(&set_guid, set_name, set_attr, set_path);
 }
@@ -58,9 +58,32 @@ xapidb_cmdline_check_args(void)
     return true;
 }
 
+/* Releases a VM's state without ending the session shared with the others. */
+static void
+xapidb_cmdline_fini(void)
+{
+    xapidb_close();
+    free(xapidb_arg_uuid);
+    xapidb_arg_uuid = NULL;
+}
+
+static const struct context_region *const xapidb_cmdline_context[] = {
+    xapidb_lib_context,
+    NULL
+};
+
 const struct backend xapidb_cmdline = {
     .parse_arg = xapidb_cmdline_parse_arg,
     .check_args = xapidb_cmdline_check_args,
     .init = xapidb_init,
+    .init_async = xapidb_init_async,
     .set_variable = xapidb_set_variable,
+    .begin = xapidb_begin,
+    .commit = xapidb_commit,
+    .commit_async = xapidb_commit_async,
+    .abort = xapidb_abort,
+    .poll_fd = xapidb_poll_fd,
+    .poll_event = xapidb_poll_event,
+    .fini = xapidb_cmdline_fini,
+    .context = xapidb_cmdline_context,
 };
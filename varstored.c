@@ -52,8 +52,10 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 
 #include <locale.h>
+#include <malloc.h>
 
 #include <xen/memory.h>
 #include <xen/hvm/ioreq.h>
@@ -68,17 +70,25 @@
 #include <handler_port.h>
 #include <mor.h>
 #include <ppi.h>
+#include <stats.h>
+#include <template.h>
+#include <trace.h>
 #include <backend.h>
 
 #include "io_port.h"
 #include "option.h"
 
+#if defined(__i386__) || defined(__x86_64__)
+# define cpu_relax() asm volatile ( "pause" ::: "memory" )
+#endif
+
 #if defined(__i386__)
 # define smp_mb()  asm volatile ( "lock addl $0, -4(%%esp)" ::: "memory" )
 #elif defined(__x86_64__)
 # define smp_mb()  asm volatile ( "lock addl $0, -32(%%rsp)" ::: "memory" )
 #endif
 
+
 #define IO_PORT_ADDRESS 0x0100
 #define XS_VARSTORED_PID_PATH "/local/domain/%u/varstored-pid"
 
@@ -93,6 +103,11 @@ enum {
     VARSTORED_OPT_PIDFILE,
     VARSTORED_OPT_BACKEND,
     VARSTORED_OPT_ARG,
+    VARSTORED_OPT_BUSY_POLL_US,
+    VARSTORED_OPT_STATS_FILE,
+    VARSTORED_OPT_LOG_LEVEL,
+    VARSTORED_OPT_LOW_MEMORY,
+    VARSTORED_OPT_RSS_BUDGET,
     VARSTORED_NR_OPTS
     };
 
@@ -107,6 +122,11 @@ static struct option varstored_option[] = {
     {"pidfile", 1, NULL, 0},
     {"backend", 1, NULL, 0},
     {"arg", 1, NULL, 0},
+    {"busy-poll-us", 1, NULL, 0},
+    {"stats-file", 1, NULL, 0},
+    {"log-level", 1, NULL, 0},
+    {"low-memory", 0, NULL, 0},
+    {"rss-budget", 1, NULL, 0},
     {NULL, 0, NULL, 0}
 };
 
@@ -121,11 +141,20 @@ static const char *varstored_option_text[] = {
     "<pidfile>",
     "<backend>",
     "<name>:<val>",
+    "<usecs>",
+    "<path>",
+    "<level>",
+    NULL,
+    "<KiB>",
 };
 
 const size_t num_io_port = 3;
 
 static sig_atomic_t run_main_loop = 0;
+/* Set by SIGUSR1 to have the main loop write out the statistics. */
+static volatile sig_atomic_t dump_stats = 0;
+/* Set by SIGUSR2 to have the main loop turn debug logging on or off. */
+static volatile sig_atomic_t toggle_debug = 0;
 
 static const char *prog;
 const struct backend *db;
@@ -134,7 +163,13 @@ static bool opt_depriv;
 static uid_t opt_uid;
 static gid_t opt_gid;
 static char *opt_chroot;
-const enum log_level log_level = LOG_LVL_INFO;
+static unsigned long opt_busy_poll_us;
+static char *opt_stats_file;
+static unsigned long opt_rss_budget;
+static int statm_fd = -1;
+enum log_level log_level = LOG_LVL_INFO;
+/* The level from the command line, restored when debugging is turned off. */
+static enum log_level opt_log_level = LOG_LVL_INFO;
 
 static void __attribute__((noreturn))
 usage(void)
@@ -169,10 +204,47 @@ typedef struct varstored_state {
     xenforeignmemory_resource_handle *iores;
     shared_iopage_t *iopage;
     xenevtchn_port_or_error_t *ioreq_local_port;
+    /* Maps a local port back to its vCPU, or -1. */
+    int *port_vcpu;
+    unsigned int port_vcpu_size;
+    /* vCPUs whose ports fired in the current wakeup. */
+    unsigned int *ioreq_fired;
+    /* The vCPU whose request is waiting on the backend, or -1. */
+    int ioreq_waiting;
+    /* vCPUs whose requests arrived while another was waiting. */
+    bool *ioreq_deferred;
+    unsigned long ioreqs_handled;
+    /* Busy-poll windows opened, and those that caught a request. */
+    unsigned long busy_poll_windows;
+    unsigned long busy_poll_hits;
+    unsigned long busy_poll_ioreqs;
 } varstored_state_t;
 
 static varstored_state_t varstored_state;
 
+static const struct context_region varstored_context[] = {
+    CONTEXT_REGION(varstored_state),
+    CONTEXT_END
+};
+
+/*
+ * A guest served by this process. Each has its own copy of the module state
+ * in ctx; what the main loop polls for is kept here so that it can wait on
+ * every domain without switching between them.
+ */
+struct domain {
+    domid_t domid;
+    struct context *ctx;
+    int evtchn_fd;
+    int backend_fd;
+    short backend_events;
+    bool flush_pending;
+    struct timespec flush_deadline;
+};
+
+static struct domain *domains;
+static unsigned int nr_domains;
+
 /*
  * Initialize various settings from xenstore.
  */
@@ -292,6 +364,7 @@ handle_ioreq(ioreq_t *ioreq)
         break;
 
     case IOREQ_TYPE_INVALIDATE:
+        invalidate_handler_io_port();
         break;
 
     default:
@@ -306,6 +379,7 @@ varstored_teardown(void)
     int i;
 
     io_port_deregister();
+    invalidate_handler_io_port();
 
     if (varstored_state.ioreq_local_port) {
         for (i = 0; i < varstored_state.vcpus; i++) {
@@ -315,6 +389,9 @@ varstored_teardown(void)
         }
         free(varstored_state.ioreq_local_port);
     }
+    free(varstored_state.ioreq_deferred);
+    free(varstored_state.port_vcpu);
+    free(varstored_state.ioreq_fired);
 
     if (varstored_state.ioserv_created)
         xendevicemodel_set_ioreq_server_state(varstored_state.dmod,
@@ -345,6 +422,30 @@ varstored_signal(int num)
         _exit(0);
 }
 
+static void
+varstored_stats_signal(int num)
+{
+    dump_stats = 1;
+}
+
+static void
+varstored_debug_signal(int num)
+{
+    toggle_debug = 1;
+}
+
+static void
+varstored_toggle_debug(void)
+{
+    if (log_level == LOG_LVL_DEBUG && opt_log_level != LOG_LVL_DEBUG) {
+        log_level = opt_log_level;
+        WARN("Debug logging disabled\n");
+    } else {
+        log_level = LOG_LVL_DEBUG;
+        WARN("Debug logging enabled\n");
+    }
+}
+
 static bool
 varstored_initialize(domid_t domid)
 {
@@ -353,6 +454,7 @@ varstored_initialize(domid_t domid)
     void *addr = NULL;
 
     varstored_state.domid = domid;
+    varstored_state.ioreq_waiting = -1;
 
     varstored_state.dmod = xendevicemodel_open(NULL, 0);
     if (!varstored_state.dmod) {
@@ -375,7 +477,18 @@ varstored_initialize(domid_t domid)
         goto err;
     }
 
-    rc = xentoolcore_restrict_all(domid);
+    /*
+     * A process serving a single domain can restrict every Xen handle it
+     * has. Otherwise restrict only this domain's handles.
+     */
+    if (nr_domains == 1)
+        rc = xentoolcore_restrict_all(domid);
+    else if (xendevicemodel_restrict(varstored_state.dmod, domid) < 0 ||
+             xenforeignmemory_restrict(varstored_state.fmem, domid) < 0 ||
+             xenevtchn_restrict(varstored_state.evth, domid) < 0)
+        rc = -1;
+    else
+        rc = 0;
     if (rc < 0) {
         ERR("Failed to restrict Xen handles: %d, %s\n", errno, strerror(errno));
         goto err;
@@ -434,6 +547,12 @@ varstored_initialize(domid_t domid)
         goto err;
     }
 
+    varstored_state.ioreq_deferred = calloc(sizeof(bool), varstored_state.vcpus);
+    if (!varstored_state.ioreq_deferred) {
+        ERR("Failed to alloc deferred array: %d, %s\n", errno, strerror(errno));
+        goto err;
+    }
+
     for (i = 0; i < varstored_state.vcpus; i++) {
         rc = xenevtchn_bind_interdomain(varstored_state.evth, varstored_state.domid,
                                         varstored_state.iopage->vcpu_ioreq[i].vp_eport);
@@ -444,6 +563,37 @@ varstored_initialize(domid_t domid)
         varstored_state.ioreq_local_port[i] = rc;
     }
 
+    varstored_state.ioreq_fired = calloc(sizeof(unsigned int),
+                                         varstored_state.vcpus);
+    if (!varstored_state.ioreq_fired) {
+        ERR("Failed to alloc fired array: %d, %s\n", errno, strerror(errno));
+        goto err;
+    }
+
+    for (i = 0; i < varstored_state.vcpus; i++) {
+        if (varstored_state.ioreq_local_port[i] >= varstored_state.port_vcpu_size)
+            varstored_state.port_vcpu_size = varstored_state.ioreq_local_port[i] + 1;
+    }
+    varstored_state.port_vcpu = malloc(sizeof(int) *
+                                       varstored_state.port_vcpu_size);
+    if (!varstored_state.port_vcpu) {
+        ERR("Failed to alloc port map: %d, %s\n", errno, strerror(errno));
+        goto err;
+    }
+    for (i = 0; i < varstored_state.port_vcpu_size; i++)
+        varstored_state.port_vcpu[i] = -1;
+    for (i = 0; i < varstored_state.vcpus; i++)
+        varstored_state.port_vcpu[varstored_state.ioreq_local_port[i]] = i;
+
+    /* Let a wakeup drain every pending port without blocking on the last. */
+    rc = fcntl(xenevtchn_fd(varstored_state.evth), F_GETFL);
+    if (rc < 0 || fcntl(xenevtchn_fd(varstored_state.evth), F_SETFL,
+                        rc | O_NONBLOCK) < 0) {
+        ERR("Failed to make evtchn non-blocking: %d, %s\n",
+            errno, strerror(errno));
+        goto err;
+    }
+
     for (i = 0; i < varstored_state.vcpus; i++)
         INFO("VCPU%d: %u -> %u\n", i,
             varstored_state.iopage->vcpu_ioreq[i].vp_eport,
@@ -466,10 +616,6 @@ varstored_initialize(domid_t domid)
        goto err;
     }
 
-    /* Load auth data _before_ chrooting. */
-    if (!load_auth_data())
-        goto err;
-
     xsh = xs_open(0);
     if (!xsh) {
         ERR("Couldn't open xenstore: %d, %s", errno, strerror(errno));
@@ -484,31 +630,39 @@ varstored_initialize(domid_t domid)
     }
 
     xs_close(xsh);
-    xsh = NULL;
-
-    if (!drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid))
-        goto err;
+    return true;
 
-    /* Guest data should not be accessed before this point. */
+err:
+    xs_close(xsh);
+    return false;
+}
 
-    if (!setup_crypto()) {
-        ERR("Failed to setup crypto\n");
-        goto err;
-    }
+/* Loads the variables of the current domain. */
+static bool
+varstored_load(void)
+{
+    uint64_t start = stats_now();
 
     if (opt_resume) {
         if (!db->resume()) {
             ERR("Failed to resume!\n");
             goto err;
         }
+        stats_record(STAT_BACKEND_RESUME, start);
     } else {
         enum backend_init_status status = db->init();
+        bool from_template = false;
+
+        stats_record(STAT_BACKEND_INIT, start);
 
         if (status == BACKEND_INIT_FAILURE) {
             ERR("Failed to initialize backend!\n");
             goto err;
         }
 
+        if (status == BACKEND_INIT_FIRSTBOOT)
+            from_template = template_apply();
+
         if (!setup_variables()) {
             ERR("Failed to setup variables\n");
             goto err;
@@ -524,7 +678,12 @@ varstored_initialize(domid_t domid)
             goto err;
         }
 
-        if (status == BACKEND_INIT_FIRSTBOOT) {
+        if (from_template) {
+            if (!db->set_variable()) {
+                ERR("Failed to save keys\n");
+                goto err;
+            }
+        } else if (status == BACKEND_INIT_FIRSTBOOT) {
             if (!setup_keys()) {
                 ERR("Failed to setup keys\n");
                 goto err;
@@ -532,20 +691,39 @@ varstored_initialize(domid_t domid)
         }
     }
 
-    free_auth_data();
     return true;
 
 err:
-    xs_close(xsh);
-    free_auth_data();
     return false;
 }
 
+static void
+varstored_complete_iopage(unsigned int i)
+{
+    ioreq_t         *ioreq;
+
+    ioreq = &varstored_state.iopage->vcpu_ioreq[i];
+    ioreq->state = STATE_IORESP_READY;
+    smp_mb();
+    TRACE(ioreq__done, i);
+
+    xenevtchn_notify(varstored_state.evth, varstored_state.ioreq_local_port[i]);
+}
+
 static void
 varstored_poll_iopage(unsigned int i)
 {
     ioreq_t         *ioreq;
 
+    /*
+     * Requests share the command buffer and the variable store, so hold
+     * back any that arrive while another is waiting on the backend.
+     */
+    if (command_pending()) {
+        varstored_state.ioreq_deferred[i] = true;
+        return;
+    }
+
     ioreq = &varstored_state.iopage->vcpu_ioreq[i];
     if (ioreq->state != STATE_IOREQ_READY) {
         fprintf(stderr, "IO request not ready\n");
@@ -554,49 +732,373 @@ varstored_poll_iopage(unsigned int i)
     smp_mb();
 
     ioreq->state = STATE_IOREQ_INPROCESS;
+    TRACE(ioreq__start, i, ioreq->addr, ioreq->data);
 
     handle_ioreq(ioreq);
     smp_mb();
+    varstored_state.ioreqs_handled++;
 
-    ioreq->state = STATE_IORESP_READY;
-    smp_mb();
+    if (command_pending()) {
+        varstored_state.ioreq_waiting = i;
+        return;
+    }
 
-    xenevtchn_notify(varstored_state.evth, varstored_state.ioreq_local_port[i]);
+    varstored_complete_iopage(i);
 }
 
+/* Completes the waiting request once the backend is done with it. */
 static void
-varstored_poll_iopages(void)
+varstored_poll_waiting(void)
 {
-    xenevtchn_port_or_error_t port;
     int i;
 
-    port = xenevtchn_pending(varstored_state.evth);
-    if (port < 0)
+    if (varstored_state.ioreq_waiting < 0 || command_pending())
         return;
 
+    varstored_complete_iopage(varstored_state.ioreq_waiting);
+    varstored_state.ioreq_waiting = -1;
+
     for (i = 0; i < varstored_state.vcpus; i++) {
-        if (port == varstored_state.ioreq_local_port[i]) {
-            xenevtchn_unmask(varstored_state.evth, port);
+        if (varstored_state.ioreq_deferred[i]) {
+            varstored_state.ioreq_deferred[i] = false;
             varstored_poll_iopage(i);
         }
     }
 }
 
+/*
+ * Services every port that is pending. A port stays masked until it is
+ * unmasked here, so each vCPU appears at most once per wakeup.
+ */
+static void
+varstored_poll_iopages(void)
+{
+    xenevtchn_port_or_error_t port;
+    unsigned int i, n = 0;
+    int vcpu;
+
+    while (n < varstored_state.vcpus &&
+           (port = xenevtchn_pending(varstored_state.evth)) >= 0) {
+        if (port >= varstored_state.port_vcpu_size)
+            continue;
+        vcpu = varstored_state.port_vcpu[port];
+        if (vcpu >= 0)
+            varstored_state.ioreq_fired[n++] = vcpu;
+    }
+
+    for (i = 0; i < n; i++)
+        xenevtchn_unmask(varstored_state.evth,
+                         varstored_state.ioreq_local_port[varstored_state.ioreq_fired[i]]);
+
+    for (i = 0; i < n; i++)
+        varstored_poll_iopage(varstored_state.ioreq_fired[i]);
+}
+
+static void
+timespec_add_ns(struct timespec *ts, long long ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+/* Milliseconds from now until ts, rounded up, or 0 if it has passed. */
+static int
+timespec_ms_until(const struct timespec *ts, const struct timespec *now)
+{
+    long long ns = (ts->tv_sec - now->tv_sec) * 1000000000LL +
+                   ts->tv_nsec - now->tv_nsec;
+
+    return ns > 0 ? (ns + 999999) / 1000000 : 0;
+}
+
+static bool
+varstored_ioreq_ready(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < varstored_state.vcpus; i++) {
+        if (varstored_state.iopage->vcpu_ioreq[i].state == STATE_IOREQ_READY)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Firmware tends to make bursts of back-to-back calls. After a request,
+ * spin on the ioreq page for up to opt_busy_poll_us so that the next one is
+ * picked up without a full wakeup. Each request caught restarts the window.
+ * This is only used with a single domain.
+ */
+static void
+varstored_busy_poll(void)
+{
+    struct timespec now, deadline;
+    unsigned long handled;
+    bool hit = false;
+
+    varstored_state.busy_poll_windows++;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now;
+    for (;;) {
+        timespec_add_ns(&deadline, opt_busy_poll_us * 1000LL);
+
+        /* The event may lag behind the state, so spin until it is handled. */
+        handled = varstored_state.ioreqs_handled;
+        while (varstored_state.ioreqs_handled == handled) {
+            /* A request waiting on the backend holds back any others. */
+            if (!run_main_loop || command_pending())
+                goto out;
+
+            cpu_relax();
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > deadline.tv_sec ||
+                (now.tv_sec == deadline.tv_sec &&
+                 now.tv_nsec >= deadline.tv_nsec))
+                goto out;
+
+            if (varstored_ioreq_ready())
+                varstored_poll_iopages();
+        }
+
+        varstored_state.busy_poll_ioreqs += varstored_state.ioreqs_handled - handled;
+        hit = true;
+        deadline = now;
+    }
+
+out:
+    if (hit)
+        varstored_state.busy_poll_hits++;
+}
+
+/* Records what the main loop should wait for on behalf of domain d. */
+static void
+varstored_refresh(struct domain *d)
+{
+    int ms;
+
+    d->evtchn_fd = xenevtchn_fd(varstored_state.evth);
+    d->backend_events = 0;
+    d->backend_fd = db->poll_fd ? db->poll_fd(&d->backend_events) : -1;
+
+    ms = db->flush ? db->flush_timeout() : -1;
+    d->flush_pending = ms >= 0;
+    if (d->flush_pending) {
+        clock_gettime(CLOCK_MONOTONIC, &d->flush_deadline);
+        timespec_add_ns(&d->flush_deadline, ms * 1000000LL);
+    }
+}
+
+/* Handles whatever woke the main loop up for domain d. */
+static void
+varstored_service(struct domain *d, short evtchn_revents,
+                  short backend_revents)
+{
+    unsigned long handled;
+
+    context_switch(d->ctx);
+
+    if (backend_revents)
+        db->poll_event(backend_revents);
+    varstored_poll_waiting();
+
+    if (evtchn_revents & POLLIN) {
+        handled = varstored_state.ioreqs_handled;
+        varstored_poll_iopages();
+        if (opt_busy_poll_us && varstored_state.ioreqs_handled != handled)
+            varstored_busy_poll();
+    }
+
+    /* A flush may complete a request that was waiting for it. */
+    if (db->flush) {
+        db->flush(false);
+        varstored_poll_waiting();
+    }
+
+    varstored_refresh(d);
+}
+
+/* Writes out and tears down domain d. Returns false if its state was lost. */
+static bool
+varstored_shutdown(struct domain *d)
+{
+    bool flushed, saved;
+    uint64_t start;
+
+    context_switch(d->ctx);
+
+    if (opt_busy_poll_us)
+        INFO("Busy-poll: %lu of %lu windows caught %lu request(s)\n",
+             varstored_state.busy_poll_hits, varstored_state.busy_poll_windows,
+             varstored_state.busy_poll_ioreqs);
+
+    /* Make sure any deferred updates are written out before exiting. */
+    flushed = !db->flush || db->flush(true);
+
+    varstored_teardown();
+
+    start = stats_now();
+    saved = db->save();
+    stats_record(STAT_BACKEND_SAVE, start);
+    if (db->fini)
+        db->fini();
+
+    return saved && flushed;
+}
+
+/*
+ * Writes the statistics of every domain to opt_stats_file, or to the log if
+ * there is none. The file is replaced as a whole so that readers never see
+ * it half written.
+ */
+static void
+varstored_write_stats(void)
+{
+    char *tmp = NULL, *buf = NULL, *line, *end;
+    size_t len;
+    FILE *f;
+    unsigned int i;
+
+    if (!opt_stats_file) {
+        f = open_memstream(&buf, &len);
+        if (!f) {
+            ERR("Out of memory\n");
+            return;
+        }
+    } else {
+        if (asprintf(&tmp, "%s.tmp", opt_stats_file) == -1) {
+            ERR("Out of memory\n");
+            return;
+        }
+        f = fopen(tmp, "w");
+        if (!f) {
+            ERR("Failed to open '%s': %d, %s\n", tmp, errno, strerror(errno));
+            free(tmp);
+            return;
+        }
+    }
+
+    for (i = 0; i < nr_domains; i++) {
+        context_switch(domains[i].ctx);
+        stats_print(f, domains[i].domid);
+    }
+
+    /*
+     * Without a file, go through the log so that the main loop never blocks
+     * on the write and the lines are not mixed up with queued messages. This
+     * is asked for, so it does not depend on the log level.
+     */
+    if (!opt_stats_file) {
+        if (fclose(f) != 0) {
+            ERR("Out of memory\n");
+            free(buf);
+            return;
+        }
+        for (line = buf; (end = strchr(line, '\n')); line = end + 1)
+            log_printf(LOG_LVL_INFO, __func__, "%.*s\n", (int)(end - line),
+                       line);
+        free(buf);
+        return;
+    }
+
+    if (fclose(f) != 0 || rename(tmp, opt_stats_file) == -1) {
+        ERR("Failed to write '%s': %d, %s\n",
+            opt_stats_file, errno, strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+static bool
+varstored_add_contexts(void)
+{
+    const struct context_region *const *tables;
+
+    if (!context_add(varstored_context) ||
+        !context_add(stats_context) ||
+        !context_add(handler_context) ||
+        !context_add(handler_port_context) ||
+        !context_add(io_port_context) ||
+        !context_add(mor_context) ||
+        !context_add(ppi_context))
+        return false;
+
+    for (tables = db->context; tables && *tables; tables++) {
+        if (!context_add(*tables))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Logs the memory in use once every domain is set up, against the budget if
+ * one was given. In multi-domain mode, the per-domain figure is the share of
+ * the whole process.
+ */
+static void
+report_memory(void)
+{
+    unsigned long size, resident, kib;
+    struct rusage usage;
+    char buf[64];
+    ssize_t len;
+
+    if (statm_fd == -1)
+        return;
+
+    len = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+    close(statm_fd);
+    statm_fd = -1;
+    if (len <= 0)
+        return;
+    buf[len] = '\0';
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+        return;
+
+    kib = resident * (sysconf(_SC_PAGESIZE) / 1024);
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+        usage.ru_maxrss = 0;
+
+    INFO("Memory: %lu KiB resident (%lu KiB per domain), %ld KiB peak\n",
+         kib, kib / nr_domains, usage.ru_maxrss);
+    if (opt_rss_budget && kib / nr_domains > opt_rss_budget)
+        WARN("Resident memory per domain is over the budget of %lu KiB\n",
+             opt_rss_budget);
+}
+
 int
 main(int argc, char **argv)
 {
     struct sigaction sig_handler;
-    char            *domain_str;
     char            *ptr;
     int             index;
     char            *end;
-    domid_t         domid;
-    struct pollfd   pfd;
-    int             rc;
+    long            domid;
+    struct pollfd   *pfd;
+    int             rc, timeout, ms;
+    unsigned int    i, j, nr_args;
+    struct timespec now;
+    struct domain   *d;
+    bool            ok;
+    /* Backend args, and the domain they follow or -1 for every domain. */
+    struct {
+        int domain;
+        char *name;
+        char *val;
+    } *args;
 
     prog = basename(argv[0]);
 
-    domain_str = NULL;
+    domains = calloc(argc, sizeof(*domains));
+    args = calloc(argc, sizeof(*args));
+    if (!domains || !args) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    nr_args = 0;
 
     for (;;) {
         char    c;
@@ -614,7 +1116,18 @@ main(int argc, char **argv)
 
         switch (index) {
         case VARSTORED_OPT_DOMAIN:
-            domain_str = optarg;
+            domid = strtol(optarg, &end, 0);
+            if (*end != '\0' || domid < 0 || domid >= DOMID_FIRST_RESERVED) {
+                fprintf(stderr, "invalid domain '%s'\n", optarg);
+                exit(1);
+            }
+            for (i = 0; i < nr_domains; i++) {
+                if (domains[i].domid == domid) {
+                    fprintf(stderr, "duplicate domain '%s'\n", optarg);
+                    exit(1);
+                }
+            }
+            domains[nr_domains++].domid = domid;
             break;
 
         case VARSTORED_OPT_RESUME:
@@ -658,6 +1171,8 @@ main(int argc, char **argv)
         case VARSTORED_OPT_BACKEND:
             if (!strcmp(optarg, "xapidb")) {
                 db = &xapidb;
+            } else if (!strcmp(optarg, "filedb")) {
+                db = &filedb;
             } else {
                 fprintf(stderr, "Invalid backend '%s'\n", optarg);
                 usage();
@@ -676,30 +1191,111 @@ main(int argc, char **argv)
             }
             *ptr = '\0';
             ptr++;
-            if (!db->parse_arg(optarg, ptr)) {
-                fprintf(stderr, "Invalid argument '%s:%s'\n", optarg, ptr);
-                usage();
+            /* Applied once each domain has its own context. */
+            args[nr_args].domain = (int)nr_domains - 1;
+            args[nr_args].name = optarg;
+            args[nr_args].val = ptr;
+            nr_args++;
+            break;
+
+        case VARSTORED_OPT_BUSY_POLL_US:
+            opt_busy_poll_us = strtoul(optarg, &end, 0);
+            if (*end != '\0' || opt_busy_poll_us > 1000000) {
+                fprintf(stderr, "invalid busy-poll-us '%s'\n", optarg);
+                exit(1);
             }
             break;
 
+        case VARSTORED_OPT_LOW_MEMORY:
+            low_memory = true;
+            break;
+
+        case VARSTORED_OPT_RSS_BUDGET:
+            opt_rss_budget = strtoul(optarg, &end, 0);
+            if (*optarg == '\0' || *end != '\0') {
+                fprintf(stderr, "invalid rss-budget '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case VARSTORED_OPT_STATS_FILE:
+            free(opt_stats_file);
+            opt_stats_file = strdup(optarg);
+            break;
+
+        case VARSTORED_OPT_LOG_LEVEL:
+            if (!strcmp(optarg, "error")) {
+                opt_log_level = LOG_LVL_ERROR;
+            } else if (!strcmp(optarg, "warn")) {
+                opt_log_level = LOG_LVL_WARN;
+            } else if (!strcmp(optarg, "info")) {
+                opt_log_level = LOG_LVL_INFO;
+            } else if (!strcmp(optarg, "debug")) {
+                opt_log_level = LOG_LVL_DEBUG;
+            } else {
+                fprintf(stderr, "invalid log-level '%s'\n", optarg);
+                exit(1);
+            }
+            log_level = opt_log_level;
+            break;
+
         default:
             assert(0);
             break;
         }
     }
 
-    if (domain_str == NULL ||
-        db == NULL ||
-        !db->check_args()) {
+    if (nr_domains == 0 || db == NULL)
         usage();
-        /*NOTREACHED*/
+
+    /*
+     * The window only watches the current domain's ioreq pages and a busy
+     * guest can keep it open, so it would starve the others.
+     */
+    if (opt_busy_poll_us && nr_domains > 1) {
+        fprintf(stderr, "busy-poll-us is only supported with one domain\n");
+        exit(1);
     }
 
-    domid = (domid_t)strtol(domain_str, &end, 0);
-    if (*end != '\0') {
-        fprintf(stderr, "invalid domain '%s'\n", domain_str);
+    /*
+     * Keep large buffers, such as the encoded NVRAM, out of the heap so that
+     * freeing them gives the memory back rather than leaving it resident.
+     */
+    if (low_memory)
+        mallopt(M_MMAP_THRESHOLD, 64 * 1024);
+
+    /*
+     * Every domain starts from the initial values of the per-domain state,
+     * then takes the backend args given before any --domain and those
+     * given after its own.
+     */
+    if (!varstored_add_contexts()) {
+        fprintf(stderr, "Out of memory\n");
         exit(1);
     }
+    for (i = 0; i < nr_domains; i++) {
+        domains[i].ctx = context_new();
+        if (!domains[i].ctx) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < nr_domains; i++) {
+        context_switch(domains[i].ctx);
+        for (j = 0; j < nr_args; j++) {
+            if (args[j].domain != -1 && args[j].domain != i)
+                continue;
+            if (!db->parse_arg(args[j].name, args[j].val)) {
+                fprintf(stderr, "Invalid argument '%s:%s'\n",
+                        args[j].name, args[j].val);
+                usage();
+            }
+        }
+        if (!db->check_args())
+            usage();
+    }
+    free(args);
 
     memset(&sig_handler, 0, sizeof (struct sigaction));
     sig_handler.sa_handler = varstored_signal;
@@ -708,36 +1304,139 @@ main(int argc, char **argv)
     sigaction(SIGINT, &sig_handler, NULL);
     sigaction(SIGHUP, &sig_handler, NULL);
 
+    sig_handler.sa_handler = varstored_stats_signal;
+    sigaction(SIGUSR1, &sig_handler, NULL);
+
+    sig_handler.sa_handler = varstored_debug_signal;
+    sigaction(SIGUSR2, &sig_handler, NULL);
+
     sig_handler.sa_handler = SIG_IGN;
     sigaction(SIGPIPE, &sig_handler, NULL);
 
-    if (!varstored_initialize(domid)) {
-        varstored_teardown();
+    /* Two for each domain and one for the log. */
+    pfd = calloc(2 * nr_domains + 1, sizeof(*pfd));
+    if (!pfd) {
+        ERR("Failed to alloc poll array\n");
         exit(1);
     }
 
-    pfd.fd = xenevtchn_fd(varstored_state.evth);
-    pfd.events = POLLIN | POLLERR | POLLHUP;
-    pfd.revents = 0;
+    /*
+     * Auth data and the key template are shared by every domain. Load them
+     * _before_ chrooting and keep them until every domain that may need them
+     * has been set up.
+     */
+    ok = load_auth_data() && template_load(TEMPLATE_PATH);
+
+    /* Opened now since /proc may not be reachable after chrooting. */
+    statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+
+    for (i = 0; ok && i < nr_domains; i++) {
+        context_switch(domains[i].ctx);
+        ok = varstored_initialize(domains[i].domid);
+    }
+
+    ok = ok && drop_privileges(opt_chroot, opt_depriv, opt_gid, opt_uid);
+
+    /* Guest data should not be accessed before this point. */
+
+    if (ok && !setup_crypto()) {
+        ERR("Failed to setup crypto\n");
+        ok = false;
+    }
+
+    for (i = 0; ok && i < nr_domains; i++) {
+        context_switch(domains[i].ctx);
+        ok = varstored_load();
+        if (ok)
+            varstored_refresh(&domains[i]);
+        /* First boot may have verified the keys; that state isn't needed. */
+        if (ok && low_memory)
+            free_verify_state();
+    }
+
+    free_auth_data();
+    template_free();
+    /* Give back what setting up the domains left free in the heap. */
+    malloc_trim(0);
+
+    if (!ok) {
+        for (i = 0; i < nr_domains; i++) {
+            context_switch(domains[i].ctx);
+            varstored_teardown();
+        }
+        exit(1);
+    }
+
+    report_memory();
+
+    /*
+     * From here on, logging must not hold up requests so messages are written
+     * out in the main loop when they can be.
+     */
+    log_ring_enable();
 
     run_main_loop = 1;
     while (run_main_loop) {
-        rc = poll(&pfd, 1, -1);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout = -1;
+        for (i = 0; i < nr_domains; i++) {
+            d = &domains[i];
+            pfd[2 * i].fd = d->evtchn_fd;
+            pfd[2 * i].events = POLLIN | POLLERR | POLLHUP;
+            pfd[2 * i].revents = 0;
+            /* A negative fd is ignored by poll(). */
+            pfd[2 * i + 1].fd = d->backend_fd;
+            pfd[2 * i + 1].events = d->backend_events;
+            pfd[2 * i + 1].revents = 0;
+
+            if (d->flush_pending) {
+                ms = timespec_ms_until(&d->flush_deadline, &now);
+                if (timeout < 0 || ms < timeout)
+                    timeout = ms;
+            }
+        }
+
+        pfd[2 * nr_domains].fd = log_drain();
+        pfd[2 * nr_domains].events = POLLOUT;
+        pfd[2 * nr_domains].revents = 0;
+
+        rc = poll(pfd, 2 * nr_domains + 1, timeout);
 
         if (!run_main_loop)
             break;
 
-        if (rc > 0 && pfd.revents & POLLIN)
-            varstored_poll_iopages();
-
         if (rc < 0 && errno != EINTR)
             break;
-    }
 
-    varstored_teardown();
+        if (dump_stats) {
+            dump_stats = 0;
+            varstored_write_stats();
+        }
+
+        if (toggle_debug) {
+            toggle_debug = 0;
+            varstored_toggle_debug();
+        }
 
-    if (!db->save())
-        return 1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (i = 0; i < nr_domains; i++) {
+            d = &domains[i];
+            if (pfd[2 * i].revents || pfd[2 * i + 1].revents ||
+                (d->flush_pending &&
+                 !timespec_ms_until(&d->flush_deadline, &now)))
+                varstored_service(d, pfd[2 * i].revents,
+                                  pfd[2 * i + 1].revents);
+        }
+    }
+
+    rc = 0;
+    for (i = 0; i < nr_domains; i++) {
+        if (!varstored_shutdown(&domains[i]))
+            rc = 1;
+        context_free(domains[i].ctx);
+    }
+    free(domains);
+    free(pfd);
 
-    return 0;
+    return rc;
 }
@@ -31,28 +31,33 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <assert.h>
+#include <zlib.h>
 
-#include <libxml/parser.h>
-#include <libxml/xpath.h>
-#include <openssl/bio.h>
-#include <openssl/evp.h>
-
+#include <base64.h>
 #include <debug.h>
 #include <efi.h>
 #include <handler.h>
 #include <mor.h>
 #include <ppi.h>
 #include <serialize.h>
+#include <stats.h>
+#include <trace.h>
 #include <xapidb.h>
 
 #define MAX_HTTP_SIZE (256 * 1024)
+/* Initial size of the receive buffer, which grows up to MAX_HTTP_SIZE. */
+#define HTTP_BUF_SIZE 4096
 
 #define HTTP_STATUS_OK 200
 
@@ -61,7 +66,7 @@
     "Host: _var_lib_xcp_xapi\r\n" \
     "Accept-Encoding: identity\r\n" \
     "User-Agent: varstored/0.1\r\n" \
-    "Connection: close\r\n" \
+    "Connection: keep-alive\r\n" \
     "Content-Type: text/xml\r\n" \
     "Content-Length: %lu\r\n" \
     "\r\n" \
@@ -154,6 +159,69 @@ static char *xapidb_vm_ref;
 static time_t last_time; /* Time of the last send. */
 static unsigned int send_credit = MAX_CREDIT; /* Number of allowed fast sends. */
 
+/*
+ * Delay in milliseconds before updates are written out to XAPI. When zero,
+ * every update is sent synchronously.
+ */
+unsigned int xapidb_arg_writeback;
+
+/* Maximum number of updates coalesced into a single deferred send. */
+#define WRITEBACK_MAX_PENDING 32
+
+static bool writeback_dirty; /* Updates are waiting to be sent. */
+static unsigned int writeback_pending; /* Number of updates waiting. */
+static bool writeback_failed; /* The last deferred send failed. */
+static struct timespec writeback_deadline;
+
+static bool txn_active; /* Updates are held until the transaction commits. */
+static bool txn_dirty; /* The transaction has updates to write out. */
+
+/*
+ * zlib level used to compress blobs, or 0 to write them uncompressed as
+ * before. Blobs of either kind are always accepted.
+ */
+unsigned int xapidb_arg_compress;
+
+/*
+ * Compresses everything after the header of an uncompressed blob. The blob is
+ * left alone if compressing would not make it smaller.
+ */
+static bool
+compress_blob(uint8_t **blob, size_t *len)
+{
+    uint8_t *buf, *ptr;
+    uLongf out_len;
+    size_t body_len = *len - DB_HEADER_LEN;
+
+    out_len = compressBound(body_len);
+    buf = malloc(DB_HEADER_LEN + out_len);
+    if (!buf) {
+        DBG("Failed to allocate memory\n");
+        return false;
+    }
+
+    if (compress2(buf + DB_HEADER_LEN, &out_len, *blob + DB_HEADER_LEN,
+                  body_len, xapidb_arg_compress) != Z_OK) {
+        ERR("Failed to compress variables\n");
+        free(buf);
+        return false;
+    }
+
+    if (out_len >= body_len) {
+        free(buf);
+        return true;
+    }
+
+    memcpy(buf, *blob, DB_HEADER_LEN);
+    ptr = buf + strlen(DB_MAGIC);
+    serialize_uint32(&ptr, DB_VERSION_COMPRESSED);
+
+    free(*blob);
+    *blob = buf;
+    *len = DB_HEADER_LEN + out_len;
+    return true;
+}
+
 /*
  * Serializes the list of variables into a buffer. The buffer must be freed by
  * the caller. Returns the length of the buffer on success otherwise 0.
@@ -194,7 +262,7 @@ xapidb_serialize_variables(uint8_t **out, size_t *out_len, bool only_nv)
 
     memcpy(ptr, DB_MAGIC, strlen(DB_MAGIC));
     ptr += strlen(DB_MAGIC);
-    serialize_uint32(&ptr, DB_VERSION);
+    serialize_uint32(&ptr, DB_VERSION_UNCOMPRESSED);
     serialize_uintn(&ptr, count);
     serialize_uintn(&ptr, data_len);
 
@@ -223,376 +291,1565 @@ xapidb_serialize_variables(uint8_t **out, size_t *out_len, bool only_nv)
 
     *out = buf;
     *out_len = data_len + DB_HEADER_LEN + ANCILLARY_DATA_LEN;
+
+    if (xapidb_arg_compress && !compress_blob(out, out_len)) {
+        free(*out);
+        return false;
+    }
+
     return true;
 }
 
+/*
+ * The keep-alive connection to XAPI. It is non-blocking and shared by every
+ * call: synchronous calls drive it with their own poll() loop and the
+ * asynchronous save drives it from the main loop.
+ */
+static struct {
+    int fd;
+    bool connected; /* The non-blocking connect has completed. */
+    bool reused; /* An earlier response was received on this connection. */
+    char *request;
+    size_t request_len, written;
+    char *buf; /* Allocated on first use and grown as needed. */
+    size_t buf_size;
+    size_t buf_len;
+    size_t body; /* Offset of the body, or 0 until the headers are in. */
+    size_t content_len;
+    bool has_content_len;
+    bool close; /* XAPI will close the connection after this response. */
+} http = {.fd = -1};
+
+enum http_state {
+    HTTP_AGAIN,
+    HTTP_DONE,
+    HTTP_ERROR,
+};
+
+static void
+http_close(void)
+{
+    if (http.fd != -1)
+        close(http.fd);
+    http.fd = -1;
+}
+
 static bool
-write_all(int fd, const char *buf, size_t remaining)
+http_connect(void)
 {
-    ssize_t ret;
+    struct sockaddr_un addr;
 
-    while (remaining > 0) {
-        ret = write(fd, buf, remaining < BUFSIZ ? remaining : BUFSIZ);
-        if (ret < 0)
-            return false;
-        if (ret == 0)
-            break;
-        remaining -= ret;
-        buf += ret;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, xapidb_arg_socket, sizeof(addr.sun_path) - 1);
+
+    http.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (http.fd == -1)
+        return false;
+    if (connect(http.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 &&
+            errno != EINPROGRESS) {
+        http_close();
+        return false;
     }
+    http.connected = false;
+    http.reused = false;
 
     return true;
 }
 
-static size_t
-read_all(int fd, char *buf, size_t limit)
+/*
+ * Drops a receive buffer that grew for a large response, such as the NVRAM
+ * itself, once the response has been used, rather than keeping it resident
+ * for the rest of the run.
+ */
+static void
+http_trim(void)
 {
-    ssize_t ret;
-    size_t total = 0, remaining;
+    if (http.buf_size > HTTP_BUF_SIZE) {
+        free(http.buf);
+        http.buf = NULL;
+        http.buf_size = 0;
+    }
+}
 
-    for (;;) {
-        remaining = limit - total - 1;
-        ret = read(fd, buf, remaining < BUFSIZ ? remaining : BUFSIZ);
-        if (ret <= 0)
-            break;
-        total += ret;
-        buf += ret;
+/*
+ * Makes room to read more of the response: all of its body if the length is
+ * known, otherwise twice as much as before.
+ */
+static bool
+http_grow(void)
+{
+    size_t size = http.buf_size * 2;
+    char *buf;
+
+    if (http.body && http.has_content_len &&
+            size < http.body + http.content_len + 1)
+        size = http.body + http.content_len + 1;
+    if (size > MAX_HTTP_SIZE)
+        size = MAX_HTTP_SIZE;
+
+    buf = realloc(http.buf, size);
+    if (!buf)
+        return false;
+    http.buf = buf;
+    http.buf_size = size;
+
+    return true;
+}
+
+/* Starts sending an XML-RPC call, reusing the connection if it is open. */
+static bool
+http_begin(const char *content)
+{
+    http_trim();
+
+    free(http.request);
+    if (asprintf(&http.request, HTTP_POST, strlen(content), content) == -1) {
+        http.request = NULL;
+        return false;
+    }
+    http.request_len = strlen(http.request);
+    http.written = 0;
+    http.buf_len = 0;
+    http.body = 0;
+
+    if (!http.buf) {
+        http.buf = malloc(HTTP_BUF_SIZE);
+        if (!http.buf)
+            return false;
+        http.buf_size = HTTP_BUF_SIZE;
     }
+    http.buf[0] = '\0';
 
-    *buf = '\0';
+    if (http.fd == -1 && !http_connect())
+        return false;
 
-    return total;
+    return true;
 }
 
-static int
-xmlrpc_call(char **response, const char *fmt, ...)
+static short
+http_events(void)
 {
-    va_list ap;
-    struct sockaddr_un addr;
-    int fd, status;
-    size_t n;
-    char *ptr, *request, *content;
-    char buf[MAX_HTTP_SIZE];
+    return http.written < http.request_len ? POLLOUT : POLLIN;
+}
 
-    va_start(ap, fmt);
-    if (vasprintf(&content, fmt, ap) == -1) {
-        va_end(ap);
-        return -1;
+/* Parses the headers once they are complete. */
+static bool
+http_parse_headers(void)
+{
+    char *end, *ptr;
+
+    end = strstr(http.buf, "\r\n\r\n");
+    if (!end)
+        return true;
+    http.body = end - http.buf + strlen("\r\n\r\n");
+
+    /* Limit the searches below to the headers. */
+    *end = '\0';
+    ptr = strcasestr(http.buf, "\r\nContent-Length:");
+    http.has_content_len = !!ptr;
+    if (ptr)
+        http.content_len = strtoul(ptr + strlen("\r\nContent-Length:"), NULL, 10);
+    http.close = !!strcasestr(http.buf, "\r\nConnection: close");
+    *end = '\r';
+
+    return !http.has_content_len ||
+           http.content_len < MAX_HTTP_SIZE - http.body;
+}
+
+/* Makes progress on the call in flight when the connection is ready. */
+static enum http_state
+http_event(void)
+{
+    ssize_t ret;
+
+    if (!http.connected) {
+        int err;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(http.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+                err)
+            goto broken;
+        http.connected = true;
     }
-    va_end(ap);
 
-    if (asprintf(&request, HTTP_POST, strlen(content), content) == -1) {
-        free(content);
-        return -1;
+    if (http.written < http.request_len) {
+        /* XAPI may have closed the connection, so don't raise SIGPIPE. */
+        ret = send(http.fd, http.request + http.written,
+                   http.request_len - http.written, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return HTTP_AGAIN;
+            goto broken;
+        }
+        http.written += ret;
+        return HTTP_AGAIN;
     }
-    free(content);
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, xapidb_arg_socket, sizeof(addr.sun_path) - 1);
+    if (http.buf_len + 1 == http.buf_size && !http_grow()) {
+        ERR("Failed to allocate memory\n");
+        http_close();
+        return HTTP_ERROR;
+    }
 
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd == -1) {
-        free(request);
-        return -1;
+    ret = read(http.fd, http.buf + http.buf_len,
+               http.buf_size - http.buf_len - 1);
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return HTTP_AGAIN;
+        goto broken;
     }
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-        free(request);
-        close(fd);
-        return -1;
+    if (ret == 0) {
+        /* Without a length, the response runs until the connection closes. */
+        if (!http.body || http.has_content_len)
+            goto broken;
+        http.close = true;
+        return HTTP_DONE;
     }
+    http.buf_len += ret;
+    http.buf[http.buf_len] = '\0';
 
-    if (!write_all(fd, request, strlen(request))) {
-        free(request);
-        close(fd);
-        return -1;
+    if (!http.body && !http_parse_headers()) {
+        ERR("XAPI response is too large\n");
+        http_close();
+        return HTTP_ERROR;
+    }
+    if (http.body && http.has_content_len &&
+            http.buf_len - http.body >= http.content_len)
+        return HTTP_DONE;
+    if (http.buf_len == MAX_HTTP_SIZE - 1) {
+        ERR("XAPI response is too large\n");
+        http_close();
+        return HTTP_ERROR;
     }
-    free(request);
 
-    n = read_all(fd, buf, sizeof(buf));
-    close(fd);
-    if (n == 0)
-        return -1;
+    return HTTP_AGAIN;
 
-    ptr = strchr(buf, ' ');
-    if (!ptr)
-        return -1;
-    status = atoi(ptr);
+broken:
+    /*
+     * XAPI may close an idle keep-alive connection at any time. If nothing
+     * came back, send the call again on a new connection.
+     */
+    http_close();
+    if (http.reused && http.buf_len == 0 && http_connect()) {
+        http.written = 0;
+        return HTTP_AGAIN;
+    }
+    return HTTP_ERROR;
+}
+
+/*
+ * Returns the HTTP status and the body of a complete response, which is only
+ * valid until the next call.
+ */
+static int
+http_response(const char **response)
+{
+    const char *ptr;
+    size_t len;
+
+    free(http.request);
+    http.request = NULL;
 
-    ptr = strstr(buf, "\r\n\r\n");
+    if (http.close)
+        http_close();
+    else
+        http.reused = true;
+
+    ptr = strchr(http.buf, ' ');
     if (!ptr)
         return -1;
 
-    *response = strdup(ptr + strlen("\r\n\r\n"));
+    len = http.has_content_len ? http.content_len : http.buf_len - http.body;
+    http.buf[http.body + len] = '\0';
+    *response = http.buf + http.body;
 
-    return status;
+    return atoi(ptr);
 }
 
-static bool
-xmlrpc_process(char *response, char **result)
+/*
+ * Formats a call whose first argument is the session. The first conversion
+ * in fmt must be the %s for the session.
+ */
+static char *
+format_session_call(const char *fmt, const char *session, va_list ap)
 {
-    xmlDocPtr doc = NULL;
-    xmlNodePtr node = NULL;
-    xmlXPathContextPtr xpath_ctx = NULL;
-    xmlXPathObjectPtr xpath_obj = NULL;
-    xmlChar *content = NULL;
-    bool ret = false;
-
-    doc = xmlReadMemory(response, strlen(response), "noname.xml", NULL, 0);
-    if (!doc)
-        goto out;
-    xpath_ctx = xmlXPathNewContext(doc);
-    if (!xpath_ctx)
-        goto out;
+    const char *pos = strstr(fmt, "%s");
+    char *tail, *content;
 
-    xpath_obj = xmlXPathEvalExpression(
-        BAD_CAST "/methodResponse/params/param/value/struct/member[1]/value",
-        xpath_ctx);
-    if (!xpath_obj || !xpath_obj->nodesetval || xpath_obj->nodesetval->nodeNr == 0)
-        goto out;
-    node = xpath_obj->nodesetval->nodeTab[0];
-    content = xmlNodeGetContent(node);
-    if (strcmp((char *)content, "Success"))
-        goto out;
+    assert(pos);
 
-    if (result) {
-        xmlFree(content);
+    if (vasprintf(&tail, pos + strlen("%s"), ap) == -1)
+        return NULL;
+    if (asprintf(&content, "%.*s%s%s", (int)(pos - fmt), fmt, session, tail) == -1)
         content = NULL;
-        xmlXPathFreeObject(xpath_obj);
-        xpath_obj = xmlXPathEvalExpression(
-            BAD_CAST "/methodResponse/params/param/value/struct/member[2]/value",
-            xpath_ctx);
-        if (!xpath_obj || !xpath_obj->nodesetval || xpath_obj->nodesetval->nodeNr == 0)
-            goto out;
-        node = xpath_obj->nodesetval->nodeTab[0];
-        content = xmlNodeGetContent(node);
-        *result = strdup((char *)content);
-    }
-
-    ret = true;
+    free(tail);
 
-out:
-    xmlFree(content);
-    xmlXPathFreeObject(xpath_obj);
-    xmlXPathFreeContext(xpath_ctx);
-    xmlFreeDoc(doc);
-    return ret;
+    return content;
 }
 
-static bool
-send_to_xapi(char *uuid, char *data)
+/*
+ * A small pull parser for the XML-RPC responses sent by XAPI. It works in
+ * place on the response and understands just enough XML for XML-RPC:
+ * elements, text, comments, processing instructions and entity references.
+ */
+enum xml_token {
+    XML_ERROR,
+    XML_EOF,
+    XML_START,
+    XML_END,
+    XML_EMPTY, /* <name/> */
+    XML_TEXT,
+};
+
+struct xml_reader {
+    const char *ptr;
+    /* The element name of the last tag or the raw text of the last text. */
+    const char *str;
+    size_t len;
+};
+
+static enum xml_token
+xml_next(struct xml_reader *r)
 {
-    int status;
-    bool ret = false;
-    char *session_ref = NULL, *response = NULL;
+    const char *p = r->ptr, *q;
 
-    status = xmlrpc_call(&response, LOGIN_CALL);
-    if (status != HTTP_STATUS_OK)
-        goto out;
-    if (!xmlrpc_process(response, &session_ref))
-        goto out;
-    free(response);
-    response = NULL;
+    for (;;) {
+        if (*p == '\0')
+            return XML_EOF;
+
+        if (*p != '<') {
+            q = strchrnul(p, '<');
+            r->str = p;
+            r->len = q - p;
+            r->ptr = q;
+            return XML_TEXT;
+        }
 
-    if (!xapidb_vm_ref) {
-        status = xmlrpc_call(&response, VM_GET_BY_UUID_CALL, session_ref, uuid);
-        if (status != HTTP_STATUS_OK) {
-            ERR("Failed to communicate with XAPI\n");
-            goto out;
+        if (!strncmp(p, "<!--", strlen("<!--"))) {
+            q = strstr(p, "-->");
+            if (!q)
+                return XML_ERROR;
+            p = q + strlen("-->");
+            continue;
         }
-        if (!xmlrpc_process(response, &xapidb_vm_ref)) {
-            ERR("Failed to lookup VM\n");
-            goto out;
+
+        q = strchr(p, '>');
+        if (!q)
+            return XML_ERROR;
+
+        if (p[1] == '?' || p[1] == '!') {
+            p = q + 1;
+            continue;
+        }
+
+        r->ptr = q + 1;
+        if (p[1] == '/') {
+            r->str = p + 2;
+            r->len = strcspn(r->str, " \t\r\n>");
+            return XML_END;
         }
-        free(response);
-        response = NULL;
+        r->str = p + 1;
+        r->len = strcspn(r->str, " \t\r\n/>");
+        return q[-1] == '/' ? XML_EMPTY : XML_START;
     }
+}
 
-    status = xmlrpc_call(&response, VM_SET_NVRAM_EFI_VARIABLES_CALL, session_ref, xapidb_vm_ref, data);
-    if (status != HTTP_STATUS_OK)
-        goto out;
-    if (!xmlrpc_process(response, NULL))
-        goto out;
-    free(response);
-    response = NULL;
+/* Like xml_next but skips whitespace between elements. */
+static enum xml_token
+xml_next_tag(struct xml_reader *r)
+{
+    enum xml_token token;
 
-    status = xmlrpc_call(&response, LOGOUT_CALL, session_ref);
-    if (status != HTTP_STATUS_OK)
-        goto out;
-    if (!xmlrpc_process(response, NULL))
-        goto out;
-    free(response);
-    response = NULL;
+    for (;;) {
+        token = xml_next(r);
+        if (token != XML_TEXT || r->len != strspn(r->str, " \t\r\n"))
+            return token;
+    }
+}
 
-    ret = true;
+static bool
+xml_is(const struct xml_reader *r, const char *str)
+{
+    return r->len == strlen(str) && !memcmp(r->str, str, r->len);
+}
 
-out:
-    free(session_ref);
-    free(response);
-    return ret;
+static bool
+xml_expect(struct xml_reader *r, enum xml_token token, const char *name)
+{
+    return xml_next_tag(r) == token && xml_is(r, name);
 }
 
+/*
+ * Reads a scalar <value> whose start tag has just been read, either bare
+ * text or a <string>, and returns its raw text.
+ */
 static bool
-base64_encode(const uint8_t *buf, size_t len, char **out)
+xmlrpc_scalar(struct xml_reader *r, const char **text, size_t *len)
 {
-    BIO *b64, *bio;
-    char *ptr;
-    int n;
-    long out_len;
-    size_t total = 0;
+    enum xml_token token;
+
+    *text = "";
+    *len = 0;
+
+    token = xml_next(r);
+    if (token == XML_TEXT) {
+        *text = r->str;
+        *len = r->len;
+        token = xml_next(r);
+        if (token == XML_END)
+            return xml_is(r, "value");
+        /* Whitespace before a <string>. */
+        if (*len != strspn(*text, " \t\r\n"))
+            return false;
+        *text = "";
+        *len = 0;
+    }
 
-    bio = BIO_new(BIO_s_mem());
-    if (!bio)
+    if (token == XML_END)
+        return xml_is(r, "value");
+    if (token == XML_EMPTY && xml_is(r, "string"))
+        return xml_expect(r, XML_END, "value");
+    if (token != XML_START || !xml_is(r, "string"))
         return false;
-    b64 = BIO_new(BIO_f_base64());
-    if (!b64) {
-        BIO_free_all(bio);
-        return false;
-    }
-    BIO_push(b64, bio);
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-    BIO_set_close(bio, BIO_CLOSE);
 
-    while ((len - total) > 0) {
-        n = BIO_write(b64, buf + total, (int)(len - total));
-        if (n <= 0)
-            break;
-        total += n;
+    token = xml_next(r);
+    if (token == XML_TEXT) {
+        *text = r->str;
+        *len = r->len;
+        token = xml_next(r);
     }
 
-    BIO_flush(b64);
+    return token == XML_END && xml_is(r, "string") &&
+           xml_expect(r, XML_END, "value");
+}
 
-    if (total != len) {
-        BIO_free_all(b64);
-        return false;
-    }
+/* Skips the rest of an element whose start tag has just been read. */
+static bool
+xml_skip(struct xml_reader *r)
+{
+    unsigned int depth = 1;
 
-    out_len = BIO_get_mem_data(b64, &ptr);
-    *out = malloc(out_len + 1);
-    if (!*out) {
-        BIO_free_all(b64);
-        return false;
+    while (depth) {
+        switch (xml_next(r)) {
+        case XML_START:
+            depth++;
+            break;
+        case XML_END:
+            depth--;
+            break;
+        case XML_EMPTY:
+        case XML_TEXT:
+            break;
+        default:
+            return false;
+        }
     }
-    memcpy(*out, ptr, out_len);
-    (*out)[out_len] = '\0';
-
-    BIO_free_all(b64);
 
     return true;
 }
 
-bool
-xapidb_set_variable(void)
+/* Returns a copy of text with the entity references replaced. */
+static char *
+xml_strdup(const char *text, size_t len)
 {
-    uint8_t *buf;
-    char *encoded;
-    size_t len;
-    bool ret;
-    time_t cur_time, diff_time;
+    char *out, *ptr;
+    const char *end = text + len, *semi;
+    unsigned long c;
 
-    if (!xapidb_arg_uuid)
-        return true;
+    out = ptr = malloc(len + 1);
+    if (!out)
+        return NULL;
 
-    if (!xapidb_serialize_variables(&buf, &len, true))
-        return false;
+    while (text < end) {
+        if (*text != '&') {
+            *ptr++ = *text++;
+            continue;
+        }
 
-    if (!base64_encode(buf, len, &encoded)) {
-        free(buf);
-        return false;
+        semi = memchr(text, ';', end - text);
+        if (!semi)
+            goto fail;
+        if (!strncmp(text, "&amp;", semi - text + 1)) {
+            *ptr++ = '&';
+        } else if (!strncmp(text, "&lt;", semi - text + 1)) {
+            *ptr++ = '<';
+        } else if (!strncmp(text, "&gt;", semi - text + 1)) {
+            *ptr++ = '>';
+        } else if (!strncmp(text, "&quot;", semi - text + 1)) {
+            *ptr++ = '"';
+        } else if (!strncmp(text, "&apos;", semi - text + 1)) {
+            *ptr++ = '\'';
+        } else if (text[1] == '#') {
+            c = text[2] == 'x' ? strtoul(text + 3, NULL, 16) :
+                                 strtoul(text + 2, NULL, 10);
+            /* Only ASCII is expected from XAPI. */
+            if (c == 0 || c > 0x7f)
+                goto fail;
+            *ptr++ = c;
+        } else {
+            goto fail;
+        }
+        text = semi + 1;
     }
-    free(buf);
+    *ptr = '\0';
 
-    /*
-     * To avoid a DoS on XAPI by the VM, rate limit sends to XAPI.
-     * Normal usage should never hit this.
-     */
-    cur_time = time(NULL);
-    diff_time = cur_time - last_time;
-    last_time = cur_time;
-    send_credit += diff_time * CREDIT_PER_SECOND;
-    if (send_credit > MAX_CREDIT)
-        send_credit = MAX_CREDIT;
+    return out;
 
-    if (send_credit > 0) {
-        send_credit--;
-    } else {
-        /* If no credit, wait the correct amount of time to get a credit. */
-        struct timespec ts = {0, NS_PER_CREDIT};
+fail:
+    free(out);
+    return NULL;
+}
 
-        nanosleep(&ts, NULL);
-        last_time = time(NULL);
-    }
+/*
+ * Reads a response up to the start of the value of its second member, which
+ * is Value on success and ErrorDescription otherwise. XAPI always sends the
+ * Status member first.
+ */
+static bool
+xmlrpc_open(const char *response, struct xml_reader *r, bool *success)
+{
+    const char *text;
+    size_t len;
 
-    ret = send_to_xapi(xapidb_arg_uuid, encoded);
-    free(encoded);
+    r->ptr = response;
 
-    return ret;
+    if (!xml_expect(r, XML_START, "methodResponse") ||
+            !xml_expect(r, XML_START, "params") ||
+            !xml_expect(r, XML_START, "param") ||
+            !xml_expect(r, XML_START, "value") ||
+            !xml_expect(r, XML_START, "struct"))
+        return false;
+
+    if (!xml_expect(r, XML_START, "member") ||
+            !xml_expect(r, XML_START, "name") ||
+            xml_next(r) != XML_TEXT || !xml_is(r, "Status") ||
+            !xml_expect(r, XML_END, "name") ||
+            !xml_expect(r, XML_START, "value") ||
+            !xmlrpc_scalar(r, &text, &len) ||
+            !xml_expect(r, XML_END, "member"))
+        return false;
+    *success = len == strlen("Success") && !memcmp(text, "Success", len);
+
+    return xml_expect(r, XML_START, "member") &&
+           xml_expect(r, XML_START, "name") &&
+           xml_next(r) == XML_TEXT &&
+           xml_expect(r, XML_END, "name") &&
+           xml_expect(r, XML_START, "value");
 }
 
 static bool
-unserialize_variables(uint8_t **buf, size_t count, size_t rem)
+xmlrpc_process(const char *response, char **result)
 {
-#define VARIABLE_SIZE \
+    struct xml_reader r;
+    const char *text;
+    size_t len;
+    bool success;
+
+    if (!xmlrpc_open(response, &r, &success) || !success)
+        return false;
+
+    if (result) {
+        if (!xmlrpc_scalar(&r, &text, &len))
+            return false;
+        *result = xml_strdup(text, len);
+        if (!*result)
+            return false;
+    }
+
+    return true;
+}
+
+/* Returns true if the call failed because the session is no longer valid. */
+static bool
+xmlrpc_session_invalid(const char *response)
+{
+    struct xml_reader r;
+    const char *text;
+    size_t len;
+    bool success;
+
+    if (!xmlrpc_open(response, &r, &success) || success)
+        return false;
+
+    return xml_expect(&r, XML_START, "array") &&
+           xml_expect(&r, XML_START, "data") &&
+           xml_expect(&r, XML_START, "value") &&
+           xmlrpc_scalar(&r, &text, &len) &&
+           len == strlen("SESSION_INVALID") &&
+           !memcmp(text, "SESSION_INVALID", len);
+}
+
+/*
+ * The session used for every call: it is created on first use and kept
+ * until XAPI reports that it is invalid. It is shared by every guest, each
+ * of which has its own connection, so that a process serving many guests
+ * logs in once. The generation tells a call whether the session it used has
+ * since been replaced.
+ */
+static char *session_ref;
+static unsigned int session_generation;
+
+/*
+ * Takes a new session, unless another guest has logged in meanwhile. Guests
+ * that found the old session invalid at the same time may each log in; the
+ * sessions not kept are left for XAPI to expire.
+ */
+static void
+session_set(char *session)
+{
+    if (session_ref) {
+        free(session);
+        return;
+    }
+    session_ref = session;
+    session_generation++;
+}
+
+static void logout(void);
+
+/* Ends the session when the process exits, whichever way it does. */
+static void
+logout_at_exit(void)
+{
+    static bool registered;
+
+    if (!registered) {
+        atexit(logout);
+        registered = true;
+    }
+}
+
+static void
+arm_writeback(long ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, &writeback_deadline);
+    writeback_deadline.tv_sec += ms / 1000;
+    writeback_deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (writeback_deadline.tv_nsec >= 1000000000) {
+        writeback_deadline.tv_sec++;
+        writeback_deadline.tv_nsec -= 1000000000;
+    }
+}
+
+enum async_step {
+    ASYNC_IDLE,
+    ASYNC_LOGIN,
+    ASYNC_GET_VM,
+    ASYNC_GET_NVRAM,
+    ASYNC_SET_NVRAM,
+};
+
+/*
+ * The same calls as send_to_xapi, or as xapidb_init for a load, driven by
+ * the main loop through xapidb_poll_fd and xapidb_poll_event so that it
+ * never blocks.
+ */
+static struct {
+    enum async_step step;
+    /* The encoded variables, owned by the blob cache. */
+    const char *data;
+    /* Whether to log in again if the session turns out to be invalid. */
+    bool relogin;
+    /* The session generation the call in flight was made with. */
+    unsigned int generation;
+    /* Called with the result; NULL for a write-behind flush. */
+    void (*done)(bool saved);
+    /* Called with the result of a load; NULL when saving. */
+    void (*loaded)(enum backend_init_status status);
+    /* Whether there were deferred updates when the send started. */
+    bool dirty;
+    /* A save requested while this one was in flight. */
+    bool queued;
+    void (*queued_done)(bool saved);
+} async;
+
+static bool async_start(void (*done)(bool saved));
+static void drop_encoding(void);
+static bool parse_get_nvram_call(const char *response, uint8_t **out,
+                                 size_t *out_len);
+
+static bool
+async_begin_call(enum async_step step, const char *fmt, ...)
+{
+    va_list ap;
+    char *content;
+    bool ret;
+
+    if (step == ASYNC_LOGIN) {
+        content = strdup(fmt);
+    } else {
+        va_start(ap, fmt);
+        content = format_session_call(fmt, session_ref, ap);
+        va_end(ap);
+        async.generation = session_generation;
+    }
+    if (!content)
+        return false;
+
+    ret = http_begin(content);
+    free(content);
+    if (ret)
+        async.step = step;
+
+    return ret;
+}
+
+/* Starts the next call needed to load or save the data. */
+static bool
+async_next_call(void)
+{
+    if (!session_ref)
+        return async_begin_call(ASYNC_LOGIN, LOGIN_CALL);
+    if (!xapidb_vm_ref)
+        return async_begin_call(ASYNC_GET_VM, VM_GET_BY_UUID_CALL,
+                                xapidb_arg_uuid);
+    if (async.loaded)
+        return async_begin_call(ASYNC_GET_NVRAM, VM_GET_NVRAM_CALL,
+                                xapidb_vm_ref);
+    return async_begin_call(ASYNC_SET_NVRAM, VM_SET_NVRAM_EFI_VARIABLES_CALL,
+                            xapidb_vm_ref, async.data);
+}
+
+static void
+async_load_finish(enum backend_init_status status)
+{
+    void (*loaded)(enum backend_init_status status) = async.loaded;
+
+    if (status == BACKEND_INIT_FAILURE)
+        http_close();
+    free(http.request);
+    http.request = NULL;
+    async.loaded = NULL;
+    async.step = ASYNC_IDLE;
+
+    loaded(status);
+}
+
+/* Parses the variables out of a VM.get_NVRAM response. */
+static enum backend_init_status
+async_load_parse(const char *response)
+{
+    uint8_t *buf, *ptr;
+    size_t len;
+    bool ret;
+
+    ret = parse_get_nvram_call(response, &buf, &len);
+    http_trim();
+    if (!ret) {
+        ERR("Failed to get EFI variables\n");
+        return BACKEND_INIT_FAILURE;
+    }
+    if (!buf)
+        return BACKEND_INIT_FIRSTBOOT;
+
+    ptr = buf;
+    ret = xapidb_parse_blob(&ptr, len);
+    free(buf);
+
+    return ret ? BACKEND_INIT_SUCCESS : BACKEND_INIT_FAILURE;
+}
+
+static void
+async_finish(bool saved)
+{
+    void (*done)(bool saved) = async.done;
+
+    if (async.loaded) {
+        /* Only a failure can end a load here. */
+        ERR("Failed to load variables from XAPI\n");
+        async_load_finish(BACKEND_INIT_FAILURE);
+        return;
+    }
+
+    if (!saved)
+        http_close();
+    free(http.request);
+    http.request = NULL;
+    async.data = NULL;
+    async.step = ASYNC_IDLE;
+    drop_encoding();
+
+    if (saved) {
+        writeback_failed = false;
+    } else {
+        ERR("Failed to save variables to XAPI\n");
+        writeback_failed = true;
+        /* Updates acknowledged before the send are still unsaved. */
+        if (async.dirty && !writeback_dirty) {
+            writeback_dirty = true;
+            arm_writeback(xapidb_arg_writeback);
+        }
+    }
+
+    if (done)
+        done(saved);
+
+    if (async.queued) {
+        async.queued = false;
+        if (!async_start(async.queued_done))
+            async.queued_done(false);
+    }
+}
+
+/* Handles a complete response and moves on to the next call. */
+static void
+async_advance(void)
+{
+    int status;
+    const char *response = NULL;
+    bool ok;
+
+    status = http_response(&response);
+    if (status != HTTP_STATUS_OK)
+        goto fail;
+
+    switch (async.step) {
+    case ASYNC_LOGIN: {
+        char *session;
+
+        if (!xmlrpc_process(response, &session))
+            goto fail;
+        session_set(session);
+        logout_at_exit();
+        break;
+    }
+    case ASYNC_GET_VM:
+    case ASYNC_GET_NVRAM:
+    case ASYNC_SET_NVRAM:
+        if (async.relogin && xmlrpc_session_invalid(response)) {
+            async.relogin = false;
+            /* Another guest may have logged in again already. */
+            if (async.generation == session_generation) {
+                free(session_ref);
+                session_ref = NULL;
+            }
+            break;
+        }
+        if (async.step == ASYNC_GET_NVRAM) {
+            async_load_finish(async_load_parse(response));
+            return;
+        }
+        if (async.step == ASYNC_SET_NVRAM) {
+            if (!xmlrpc_process(response, NULL))
+                goto fail;
+            async_finish(true);
+            return;
+        }
+        if (!xmlrpc_process(response, &xapidb_vm_ref)) {
+            ERR("Failed to lookup VM\n");
+            goto fail;
+        }
+        break;
+    default:
+        assert(0);
+        goto fail;
+    }
+
+    ok = async_next_call();
+    if (!ok)
+        async_finish(false);
+    return;
+
+fail:
+    async_finish(false);
+}
+
+int
+xapidb_poll_fd(short *events)
+{
+    if (async.step == ASYNC_IDLE)
+        return -1;
+
+    *events = http_events();
+    return http.fd;
+}
+
+void
+xapidb_poll_event(short revents)
+{
+    if (async.step == ASYNC_IDLE)
+        return;
+
+    switch (http_event()) {
+    case HTTP_AGAIN:
+        break;
+    case HTTP_DONE:
+        async_advance();
+        break;
+    case HTTP_ERROR:
+        async_finish(false);
+        break;
+    }
+}
+
+/* Runs the send in flight, if any, to completion. */
+static void
+async_wait(void)
+{
+    struct pollfd pfd;
+
+    while (async.step != ASYNC_IDLE) {
+        pfd.fd = xapidb_poll_fd(&pfd.events);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            async_finish(false);
+            continue;
+        }
+        xapidb_poll_event(pfd.revents);
+    }
+}
+
+/* Makes a call on the shared connection, waiting for the response. */
+static int
+http_call(const char **response, const char *content)
+{
+    struct pollfd pfd;
+
+    /* The connection may be in use by an asynchronous save. */
+    async_wait();
+
+    if (!http_begin(content))
+        return -1;
+
+    for (;;) {
+        pfd.fd = http.fd;
+        pfd.events = http_events();
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+
+        switch (http_event()) {
+        case HTTP_AGAIN:
+            continue;
+        case HTTP_DONE:
+            return http_response(response);
+        case HTTP_ERROR:
+            break;
+        }
+        break;
+    }
+
+    http_close();
+    free(http.request);
+    http.request = NULL;
+    return -1;
+}
+
+static bool
+login(void)
+{
+    int status;
+    const char *response = NULL;
+    char *session;
+    bool ret;
+
+    status = http_call(&response, LOGIN_CALL);
+    ret = status == HTTP_STATUS_OK && xmlrpc_process(response, &session);
+    if (ret) {
+        session_set(session);
+        logout_at_exit();
+    }
+
+    return ret;
+}
+
+/*
+ * Makes a call whose first argument is the session, logging in first if
+ * necessary. If the session has expired, logs in again and retries once.
+ * Returns the HTTP status, or -1 on error.
+ */
+static int
+session_call(const char **response, const char *fmt, ...)
+{
+    va_list ap;
+    char *content;
+    int status;
+    bool relogin = true;
+
+    for (;;) {
+        if (!session_ref && !login())
+            return -1;
+
+        va_start(ap, fmt);
+        content = format_session_call(fmt, session_ref, ap);
+        va_end(ap);
+        if (!content)
+            return -1;
+
+        status = http_call(response, content);
+        free(content);
+
+        if (status != HTTP_STATUS_OK || !relogin ||
+                !xmlrpc_session_invalid(*response))
+            return status;
+
+        relogin = false;
+        free(session_ref);
+        session_ref = NULL;
+    }
+}
+
+static void
+logout(void)
+{
+    const char *response = NULL;
+
+    if (!session_ref || async.step != ASYNC_IDLE)
+        return;
+
+    if (session_call(&response, LOGOUT_CALL) != HTTP_STATUS_OK ||
+            !xmlrpc_process(response, NULL))
+        DBG("Failed to logout\n");
+    free(session_ref);
+    session_ref = NULL;
+    http_close();
+}
+
+static bool
+send_to_xapi(char *uuid, const char *data)
+{
+    int status;
+    bool ret = false;
+    const char *response = NULL;
+
+    if (!xapidb_vm_ref) {
+        status = session_call(&response, VM_GET_BY_UUID_CALL, uuid);
+        if (status != HTTP_STATUS_OK) {
+            ERR("Failed to communicate with XAPI\n");
+            goto out;
+        }
+        if (!xmlrpc_process(response, &xapidb_vm_ref)) {
+            ERR("Failed to lookup VM\n");
+            goto out;
+        }
+    }
+
+    status = session_call(&response, VM_SET_NVRAM_EFI_VARIABLES_CALL, xapidb_vm_ref, data);
+    if (status != HTTP_STATUS_OK)
+        goto out;
+    if (!xmlrpc_process(response, NULL))
+        goto out;
+
+    ret = true;
+
+out:
+    return ret;
+}
+
+/* Refills the send credit. Returns true if a send is allowed now. */
+static bool
+refill_credit(void)
+{
+    time_t cur_time, diff_time;
+
+    cur_time = time(NULL);
+    diff_time = cur_time - last_time;
+    last_time = cur_time;
+    send_credit += diff_time * CREDIT_PER_SECOND;
+    if (send_credit > MAX_CREDIT)
+        send_credit = MAX_CREDIT;
+
+    return send_credit > 0;
+}
+
+static void
+rate_limit(void)
+{
+    /*
+     * To avoid a DoS on XAPI by the VM, rate limit sends to XAPI.
+     * Normal usage should never hit this.
+     */
+    if (refill_credit()) {
+        send_credit--;
+    } else {
+        /* If no credit, wait the correct amount of time to get a credit. */
+        struct timespec ts = {0, NS_PER_CREDIT};
+        uint64_t start = stats_now();
+
+        TRACE(rate__limit__sleep__start, ts.tv_nsec);
+        nanosleep(&ts, NULL);
+        stats_record(STAT_RATE_LIMIT_SLEEP, start);
+        TRACE(rate__limit__sleep__done);
+        last_time = time(NULL);
+    }
+}
+
+/*
+ * The last blob encoded for XAPI, with its base64 encoding. XAPI takes the
+ * whole blob on every save, but only the part that changed since the last
+ * one needs encoding again.
+ */
+static struct {
+    uint8_t *raw;
+    size_t raw_len;
+    char *encoded;
+    size_t encoded_size; /* Allocated size of encoded. */
+} blob;
+
+/*
+ * Encodes raw[from, to) into blob.encoded. from must be a multiple of 3 and
+ * to either a multiple of 3 or the end of the blob, so that the groups line
+ * up with the rest of the encoding.
+ */
+static void
+encode_range(const uint8_t *raw, size_t from, size_t to)
+{
+    if (from < to)
+        base64_encode(raw + from, to - from, blob.encoded + from / 3 * 4);
+}
+
+/*
+ * Updates the cached encoding for a new blob. A group of 3 bytes that is
+ * unchanged at the same offset keeps its encoding. If the length changed by
+ * a multiple of 3, the groups in the unchanged end of the blob still line up
+ * and their encoding is moved rather than redone.
+ */
+static bool
+update_encoding(uint8_t *raw, size_t len)
+{
+    size_t old_len = blob.raw_len, size = BASE64_ENCODED_LEN(len) + 1;
+    size_t tail = 0, min_len, split, old_split, g, end, run = SIZE_MAX;
+    char *encoded;
+
+    if (blob.encoded_size < size) {
+        encoded = realloc(blob.encoded, size);
+        if (!encoded)
+            goto fail;
+        blob.encoded = encoded;
+        blob.encoded_size = size;
+    }
+
+    if (!blob.raw)
+        old_len = 0;
+    min_len = old_len < len ? old_len : len;
+    while (tail < min_len &&
+           blob.raw[old_len - tail - 1] == raw[len - tail - 1])
+        tail++;
+
+    split = len;
+    if (old_len != len && (len > old_len ? len - old_len : old_len - len) % 3 == 0) {
+        split = (len - tail + 2) / 3 * 3;
+        if (split < len) {
+            old_split = split + old_len - len;
+            memmove(blob.encoded + split / 3 * 4,
+                    blob.encoded + old_split / 3 * 4,
+                    BASE64_ENCODED_LEN(old_len) - old_split / 3 * 4);
+        } else {
+            split = len;
+        }
+    }
+
+    /* Encode each run of changed groups before the split. */
+    for (g = 0; g < split; g += 3) {
+        end = g + 3 < len ? g + 3 : len;
+        if (end <= old_len && !memcmp(blob.raw + g, raw + g, end - g) &&
+                (end - g == 3 || old_len == len)) {
+            if (run != SIZE_MAX)
+                encode_range(raw, run, g);
+            run = SIZE_MAX;
+        } else if (run == SIZE_MAX) {
+            run = g;
+        }
+    }
+    if (run != SIZE_MAX)
+        encode_range(raw, run, split);
+    blob.encoded[BASE64_ENCODED_LEN(len)] = '\0';
+
+    free(blob.raw);
+    blob.raw = raw;
+    blob.raw_len = len;
+
+    return true;
+
+fail:
+    /* The encoding may now be inconsistent so start afresh next time. */
+    free(blob.raw);
+    blob.raw = NULL;
+    blob.raw_len = 0;
+    free(raw);
+    return false;
+}
+
+/*
+ * With low_memory, the blob and its encoding are not kept for the next save,
+ * which then encodes the whole blob again.
+ */
+static void
+drop_encoding(void)
+{
+    if (!low_memory)
+        return;
+
+    free(blob.raw);
+    free(blob.encoded);
+    memset(&blob, 0, sizeof(blob));
+}
+
+/* Returns the encoded variables; valid until the next call. */
+static const char *
+encode_variables(void)
+{
+    uint8_t *raw;
+    size_t len;
+
+    if (!xapidb_serialize_variables(&raw, &len, true))
+        return NULL;
+
+    if (!update_encoding(raw, len))
+        return NULL;
+
+    return blob.encoded;
+}
+
+static bool
+send_variables(void)
+{
+    const char *encoded;
+    bool ret;
+
+    /* Don't let an older snapshot in flight overwrite this one. */
+    async_wait();
+
+    encoded = encode_variables();
+    if (!encoded)
+        return false;
+
+    ret = send_to_xapi(xapidb_arg_uuid, encoded);
+    drop_encoding();
+
+    return ret;
+}
+
+/*
+ * Starts sending the current state of the variables to XAPI. The state is
+ * captured now, so any deferred updates are part of this send.
+ */
+static bool
+async_start(void (*done)(bool saved))
+{
+    assert(async.step == ASYNC_IDLE);
+
+    async.done = done;
+    async.dirty = writeback_dirty;
+    writeback_dirty = false;
+    writeback_pending = 0;
+
+    async.relogin = true;
+    async.data = encode_variables();
+    if (!async.data || !async_next_call()) {
+        async.done = NULL;
+        async_finish(false);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * With write-behind enabled, coalesce updates and let the main loop send
+ * them once the deadline passes. Once too many are waiting, or while XAPI is
+ * failing, the caller must send now so that a failure is reported back and
+ * the update is rolled back as usual.
+ */
+static bool
+writeback_defer(void)
+{
+    if (!xapidb_arg_writeback || writeback_failed ||
+            writeback_pending + 1 >= WRITEBACK_MAX_PENDING)
+        return false;
+
+    if (!writeback_dirty) {
+        arm_writeback(xapidb_arg_writeback);
+        writeback_dirty = true;
+    }
+    writeback_pending++;
+
+    return true;
+}
+
+bool
+xapidb_set_variable(void)
+{
+    if (!xapidb_arg_uuid)
+        return true;
+
+    if (txn_active) {
+        txn_dirty = true;
+        return true;
+    }
+
+    if (writeback_defer())
+        return true;
+
+    rate_limit();
+
+    if (!send_variables()) {
+        writeback_failed = true;
+        return false;
+    }
+
+    writeback_dirty = false;
+    writeback_pending = 0;
+    writeback_failed = false;
+
+    return true;
+}
+
+/*
+ * Transactions let the tools apply many updates to a VM and send the result
+ * to XAPI once, rather than once per variable.
+ */
+bool
+xapidb_begin(void)
+{
+    assert(!txn_active);
+
+    txn_active = true;
+    txn_dirty = false;
+
+    return true;
+}
+
+bool
+xapidb_commit(void)
+{
+    bool dirty = txn_dirty;
+
+    assert(txn_active);
+
+    txn_active = false;
+    txn_dirty = false;
+
+    return dirty ? xapidb_set_variable() : true;
+}
+
+/*
+ * Like xapidb_commit, but the send is finished from the main loop as for
+ * xapidb_set_variable_async.
+ */
+enum backend_save_status
+xapidb_commit_async(void (*done)(bool saved))
+{
+    bool dirty = txn_dirty;
+
+    assert(txn_active);
+
+    txn_active = false;
+    txn_dirty = false;
+
+    return dirty ? xapidb_set_variable_async(done) : BACKEND_SAVE_SUCCESS;
+}
+
+void
+xapidb_abort(void)
+{
+    txn_active = false;
+    txn_dirty = false;
+}
+
+enum backend_save_status
+xapidb_set_variable_async(void (*done)(bool saved))
+{
+    if (!xapidb_arg_uuid)
+        return BACKEND_SAVE_SUCCESS;
+
+    if (writeback_defer())
+        return BACKEND_SAVE_SUCCESS;
+
+    rate_limit();
+
+    if (async.step != ASYNC_IDLE) {
+        /* A write-behind flush is in flight; send again once it is done. */
+        assert(!async.queued);
+        async.queued = true;
+        async.queued_done = done;
+        return BACKEND_SAVE_PENDING;
+    }
+
+    return async_start(done) ? BACKEND_SAVE_PENDING : BACKEND_SAVE_FAILURE;
+}
+
+int
+xapidb_flush_timeout(void)
+{
+    struct timespec now;
+    long ms;
+
+    if (!writeback_dirty)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (writeback_deadline.tv_sec - now.tv_sec) * 1000 +
+         (writeback_deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+    return ms > 0 ? ms : 0;
+}
+
+bool
+xapidb_flush(bool force)
+{
+    if (force)
+        async_wait();
+
+    if (!writeback_dirty)
+        return true;
+
+    if (force) {
+        rate_limit();
+    } else {
+        if (async.step != ASYNC_IDLE || xapidb_flush_timeout() != 0)
+            return true;
+
+        /* Rather than sleeping in the main loop, retry once credit is due. */
+        if (!refill_credit()) {
+            stats_add(STAT_RATE_LIMIT_DEFER, 0);
+            TRACE(rate__limit__defer, NS_PER_CREDIT / 1000000);
+            arm_writeback(NS_PER_CREDIT / 1000000);
+            return true;
+        }
+        send_credit--;
+
+        return async_start(NULL);
+    }
+
+    if (!send_variables()) {
+        ERR("Failed to write deferred updates to XAPI\n");
+        writeback_failed = true;
+        arm_writeback(xapidb_arg_writeback);
+        return false;
+    }
+
+    writeback_dirty = false;
+    writeback_pending = 0;
+    writeback_failed = false;
+
+    return true;
+}
+
+static bool
+unserialize_variables(uint8_t **buf, size_t count, size_t rem)
+{
+#define VARIABLE_SIZE \
     (sizeof(l->name_len) + sizeof(l->data_len) + sizeof(l->guid) + \
      sizeof(l->attributes) + sizeof(l->timestamp) + sizeof(l->cert))
     struct efi_variable *l;
+    const uint8_t *name, *data;
+    UINTN name_len, data_len;
     size_t i;
 
     for (i = 0; i < count; i++) {
-        l = calloc(1, sizeof(*l));
+        if (rem < VARIABLE_SIZE)
+            goto invalid;
+        rem -= VARIABLE_SIZE;
+
+        name = unserialize_data_view(buf, *buf + sizeof(name_len) + rem,
+                                     &name_len,
+                                     rem < NAME_LIMIT ? rem : NAME_LIMIT);
+        if (!name)
+            goto invalid;
+        rem -= name_len;
+
+        data = unserialize_data_view(buf, *buf + sizeof(data_len) + rem,
+                                     &data_len,
+                                     rem < DATA_LIMIT ? rem : DATA_LIMIT);
+        if (!data)
+            goto invalid;
+        rem -= data_len;
+
+        l = alloc_efi_variable(name, name_len, data_len);
         if (!l) {
             ERR("Failed to allocate memory\n");
             return false;
         }
+        memcpy(l->data, data, data_len);
+
+        unserialize_guid(buf, &l->guid);
+        l->attributes = unserialize_uint32(buf);
+        unserialize_timestamp(buf, &l->timestamp);
+        memcpy(l->cert, *buf, sizeof(l->cert));
+        *buf += sizeof(l->cert);
+
+        insert_variable(l);
+    }
+
+    if (rem) {
+        ERR("More data than expected: %lu\n", rem);
+        return false;
+    }
+
+    return true;
+
+invalid:
+    ERR("Failed to unserialize variable!\n");
+
+    return false;
+#undef VARIABLE_SIZE
+}
+
+/* Parses the ancillary data and variables following the header. */
+static bool
+parse_blob_body(uint8_t **buf, uint32_t version, size_t count, size_t len)
+{
+    if (version >= 2) {
+        if (len < ANCILLARY_DATA_LEN_V2) {
+            ERR("Init file size is invalid\n");
+            return false;
+        }
 
-        if (rem < VARIABLE_SIZE)
-            goto invalid;
-        rem -= VARIABLE_SIZE;
+        unserialize_data_inplace(buf, mor_key, sizeof(mor_key));
+        unserialize_data_inplace(buf, (uint8_t *) &ppi_vdata, sizeof(ppi_vdata));
 
-        l->name = unserialize_data(buf, &l->name_len,
-                                   rem < NAME_LIMIT ? rem : NAME_LIMIT);
-        if (!l->name)
-            goto invalid;
-        rem -= l->name_len;
+        len -= ANCILLARY_DATA_LEN_V2;
+    }
 
-        l->data = unserialize_data(buf, &l->data_len,
-                                   rem < DATA_LIMIT ? rem : DATA_LIMIT);
-        if (!l->data)
-            goto invalid;
-        rem -= l->data_len;
+    return unserialize_variables(buf, count, len);
+}
 
-        unserialize_guid(buf, &l->guid);
-        l->attributes = unserialize_uint32(buf);
-        unserialize_timestamp(buf, &l->timestamp);
-        memcpy(l->cert, *buf, sizeof(l->cert));
-        *buf += sizeof(l->cert);
+/*
+ * Parses a compressed blob by inflating it into a temporary buffer. The
+ * header gives the size of the variable data so the uncompressed size is
+ * known, and bounded, before inflating.
+ */
+static bool
+parse_compressed_blob(uint8_t **buf, size_t count, size_t data_len, size_t len)
+{
+    uint8_t *raw, *ptr;
+    uLongf raw_len;
+    bool ret;
 
-        l->next = var_list;
-        var_list = l;
+    if (data_len > MAX_FILE_SIZE) {
+        ERR("Invalid data length %lu\n", data_len);
+        return false;
     }
 
-    if (rem) {
-        ERR("More data than expected: %lu\n", rem);
+    raw_len = ANCILLARY_DATA_LEN + data_len;
+    raw = malloc(raw_len);
+    if (!raw) {
+        ERR("Failed to allocate memory\n");
         return false;
     }
 
-    return true;
+    if (uncompress(raw, &raw_len, *buf, len) != Z_OK ||
+            raw_len != ANCILLARY_DATA_LEN + data_len) {
+        ERR("Failed to decompress variables\n");
+        free(raw);
+        return false;
+    }
+    *buf += len;
 
-invalid:
-    ERR("Failed to unserialize variable!\n");
-    free(l->name);
-    free(l->data);
-    free(l);
+    ptr = raw;
+    ret = parse_blob_body(&ptr, DB_VERSION_UNCOMPRESSED, count, raw_len);
+    free(raw);
 
-    return false;
-#undef VARIABLE_SIZE
+    return ret;
 }
 
 bool
 xapidb_parse_blob(uint8_t **buf, int len)
 {
     uint32_t version;
-    size_t count;
+    size_t count, data_len;
 
     if (len < DB_HEADER_LEN) {
         ERR("Init file size is invalid\n");
@@ -616,239 +1873,485 @@ xapidb_parse_blob(uint8_t **buf, int len)
         ERR("Invalid variable count %ld > %u\n", count, MAX_VARIABLE_COUNT);
         return false;
     }
-    unserialize_uintn(buf); /* data_len */
+    data_len = unserialize_uintn(buf);
 
     len -= DB_HEADER_LEN;
 
-    if (version == 2) {
-        if (len < ANCILLARY_DATA_LEN_V2) {
-            ERR("Init file size is invalid\n");
-            return false;
-        }
+    if (version == DB_VERSION_COMPRESSED)
+        return parse_compressed_blob(buf, count, data_len, len);
 
-        unserialize_data_inplace(buf, mor_key, sizeof(mor_key));
-        unserialize_data_inplace(buf, (uint8_t *) &ppi_vdata, sizeof(ppi_vdata));
+    return parse_blob_body(buf, version, count, len);
+}
 
-        len -= ANCILLARY_DATA_LEN_V2;
+/* FNV-1a over the save header and its table of entries. */
+static uint64_t
+save_checksum(const struct save_header *hdr)
+{
+    struct save_header copy = *hdr;
+    const uint8_t *p;
+    uint64_t hash = 14695981039346656037u;
+    size_t i, len;
+
+    copy.checksum = 0;
+    for (p = (const uint8_t *)&copy, i = 0; i < sizeof(copy); i++)
+        hash = (hash ^ p[i]) * 1099511628211u;
+
+    p = (const uint8_t *)(hdr + 1);
+    len = hdr->count * sizeof(struct save_entry);
+    for (i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 1099511628211u;
+
+    return hash;
+}
+
+/*
+ * Serializes every variable into the save file format. The buffer must be
+ * freed by the caller.
+ */
+bool
+xapidb_serialize_save(uint8_t **out, size_t *out_len)
+{
+    struct efi_variable *l;
+    struct save_header *hdr;
+    struct save_entry *e;
+    uint8_t *buf;
+    size_t count = 0, len, off;
+
+    len = sizeof(*hdr);
+    for (l = var_list; l; l = l->next) {
+        len += sizeof(*e) + l->name_len + l->data_len;
+        count++;
     }
+    assert(ANCILLARY_DATA_LEN == sizeof(mor_key) + sizeof(ppi_vdata));
 
-    return unserialize_variables(buf, count, len);
+    buf = calloc(1, len);
+    if (!buf) {
+        DBG("Failed to allocate memory\n");
+        return false;
+    }
+
+    hdr = (struct save_header *)buf;
+    memcpy(hdr->magic, SAVE_MAGIC, sizeof(hdr->magic));
+    hdr->version = SAVE_VERSION;
+    hdr->size = len;
+    hdr->count = count;
+    memcpy(hdr->ancillary, mor_key, sizeof(mor_key));
+    memcpy(hdr->ancillary + sizeof(mor_key), &ppi_vdata, sizeof(ppi_vdata));
+
+    e = (struct save_entry *)(hdr + 1);
+    off = sizeof(*hdr) + count * sizeof(*e);
+    for (l = var_list; l; l = l->next, e++) {
+        e->name_off = off;
+        e->name_len = l->name_len;
+        memcpy(buf + off, l->name, l->name_len);
+        off += l->name_len;
+
+        e->data_off = off;
+        e->data_len = l->data_len;
+        memcpy(buf + off, l->data, l->data_len);
+        off += l->data_len;
+
+        e->guid = l->guid;
+        e->timestamp = l->timestamp;
+        memcpy(e->cert, l->cert, sizeof(e->cert));
+        e->attributes = l->attributes;
+    }
+
+    hdr->checksum = save_checksum(hdr);
+
+    *out = buf;
+    *out_len = len;
+    return true;
 }
 
-static bool
-parse_get_nvram_call(const char *response, char **result)
+/*
+ * Loads the variables from a save file. Their names and data are used in
+ * place, so buf must stay mapped and unchanged for as long as any of them
+ * are in use.
+ */
+bool
+xapidb_parse_save(const uint8_t *buf, size_t len)
 {
-    xmlDocPtr doc = NULL;
-    xmlNodePtr node = NULL;
-    xmlXPathContextPtr xpath_ctx = NULL;
-    xmlXPathObjectPtr xpath_obj = NULL;
-    xmlChar *content = NULL;
-    bool ret = false;
+    const struct save_header *hdr = (const struct save_header *)buf;
+    const struct save_entry *e;
+    struct efi_variable *l;
+    size_t i, start;
 
-    doc = xmlReadMemory(response, strlen(response), "noname.xml", NULL, 0);
-    if (!doc)
-        goto out;
-    xpath_ctx = xmlXPathNewContext(doc);
-    if (!xpath_ctx)
-        goto out;
+    if (len < sizeof(*hdr) || memcmp(hdr->magic, SAVE_MAGIC, sizeof(hdr->magic))) {
+        ERR("Invalid save file\n");
+        return false;
+    }
 
-#define RESPONSE_XPATH "/methodResponse/params/param/value/struct"
+    if (hdr->version > SAVE_VERSION) {
+        ERR("Unsupported save file version %u\n", hdr->version);
+        return false;
+    }
 
-    xpath_obj = xmlXPathEvalExpression(
-        BAD_CAST RESPONSE_XPATH "/member[1]/value",
-        xpath_ctx);
-    if (!xpath_obj || !xpath_obj->nodesetval || xpath_obj->nodesetval->nodeNr == 0)
-        goto out;
-    node = xpath_obj->nodesetval->nodeTab[0];
-    content = xmlNodeGetContent(node);
-    if (strcmp((char *)content, "Success"))
-        goto out;
+    if (hdr->size != len || hdr->count > MAX_VARIABLE_COUNT ||
+            (len - sizeof(*hdr)) / sizeof(*e) < hdr->count) {
+        ERR("Save file size is invalid\n");
+        return false;
+    }
 
-    xmlFree(content);
-    content = NULL;
-    xmlXPathFreeObject(xpath_obj);
+    if (save_checksum(hdr) != hdr->checksum) {
+        ERR("Save file checksum mismatch\n");
+        return false;
+    }
 
-    ret = true;
-    *result = NULL;
-    xpath_obj = xmlXPathEvalExpression(BAD_CAST
-        RESPONSE_XPATH "/member/value/struct/member[name=\"EFI-variables\"]/value",
-        xpath_ctx);
-    if (!xpath_obj || !xpath_obj->nodesetval || xpath_obj->nodesetval->nodeNr == 0)
-        goto out;
-    node = xpath_obj->nodesetval->nodeTab[0];
-    content = xmlNodeGetContent(node);
-    *result = strdup((char *)content);
+    memcpy(mor_key, hdr->ancillary, sizeof(mor_key));
+    memcpy(&ppi_vdata, hdr->ancillary + sizeof(mor_key), sizeof(ppi_vdata));
+
+    e = (const struct save_entry *)(hdr + 1);
+    start = sizeof(*hdr) + hdr->count * sizeof(*e);
+    for (i = 0; i < hdr->count; i++, e++) {
+        if (e->name_len > NAME_LIMIT || e->data_len > DATA_LIMIT ||
+                e->name_off < start || e->name_off > len ||
+                len - e->name_off < e->name_len ||
+                e->data_off < start || e->data_off > len ||
+                len - e->data_off < e->data_len) {
+            ERR("Invalid save file entry %lu\n", i);
+            return false;
+        }
 
-#undef RESPONSE_XPATH
+        l = alloc_efi_variable_view(buf + e->name_off, e->name_len,
+                                    buf + e->data_off, e->data_len);
+        if (!l) {
+            ERR("Failed to allocate memory\n");
+            return false;
+        }
+        l->guid = e->guid;
+        l->timestamp = e->timestamp;
+        memcpy(l->cert, e->cert, sizeof(l->cert));
+        l->attributes = e->attributes;
 
-out:
-    xmlFree(content);
-    xmlXPathFreeObject(xpath_obj);
-    xmlXPathFreeContext(xpath_ctx);
-    xmlFreeDoc(doc);
-    return ret;
+        insert_variable(l);
+    }
+
+    return true;
 }
 
-static bool
-get_from_xapi(const char *uuid, char **out)
+/*
+ * Writes the save file to path.tmp and renames it into place. Unmodified
+ * variables may still point into a mapping of the old file from resuming,
+ * so it must never be truncated, and a crash must not lose the last image.
+ */
+bool
+xapidb_save_to_file(const char *path)
 {
-    int status;
+    FILE *f;
+    uint8_t *buf;
+    size_t len;
+    char *tmp;
     bool ret = false;
-    char *session_ref = NULL, *response = NULL;
 
-    status = xmlrpc_call(&response, LOGIN_CALL);
-    if (status != HTTP_STATUS_OK) {
-        ERR("Failed to communicate with XAPI\n");
-        goto out;
-    }
-    if (!xmlrpc_process(response, &session_ref)) {
-        ERR("Failed to communicate with XAPI\n");
-        goto out;
-    }
-    free(response);
-    response = NULL;
+    if (!xapidb_serialize_save(&buf, &len))
+        return false;
 
-    status = xmlrpc_call(&response, VM_GET_BY_UUID_CALL, session_ref, uuid);
-    if (status != HTTP_STATUS_OK) {
-        ERR("Failed to communicate with XAPI\n");
-        goto out;
-    }
-    if (!xmlrpc_process(response, &xapidb_vm_ref)) {
-        ERR("Failed to lookup VM\n");
-        goto out;
+    if (asprintf(&tmp, "%s.tmp", path) == -1) {
+        ERR("Out of memory!\n");
+        free(buf);
+        return false;
     }
-    free(response);
-    response = NULL;
 
-    status = xmlrpc_call(&response, VM_GET_NVRAM_CALL, session_ref, xapidb_vm_ref);
-    if (status != HTTP_STATUS_OK) {
-        ERR("Failed to get EFI variables\n");
+    f = fopen(tmp, "w");
+    if (!f) {
+        DBG("Failed to open '%s'\n", tmp);
         goto out;
     }
-    if (!parse_get_nvram_call(response, out)) {
-        ERR("Failed to get EFI variables\n");
+    if (fwrite(buf, 1, len, f) != len || fflush(f) ||
+            fdatasync(fileno(f)) == -1) {
+        DBG("Failed to write to '%s': %s\n", tmp, strerror(errno));
+        fclose(f);
+        unlink(tmp);
         goto out;
     }
-    free(response);
-    response = NULL;
-
-    status = xmlrpc_call(&response, LOGOUT_CALL, session_ref);
-    if (status != HTTP_STATUS_OK || !xmlrpc_process(response, NULL)) {
-        ERR("Failed to logout\n");
-        free(*out);
-        *out = NULL;
+    if (fclose(f) || rename(tmp, path) == -1) {
+        DBG("Failed to write '%s': %s\n", path, strerror(errno));
+        unlink(tmp);
         goto out;
     }
-    free(response);
-    response = NULL;
 
     ret = true;
-
 out:
-    free(session_ref);
-    free(response);
+    free(tmp);
+    free(buf);
     return ret;
 }
 
-enum backend_init_status
-xapidb_init(void)
+/* The save file mapped by xapidb_resume_from_file. */
+static struct {
+    void *addr;
+    size_t len;
+} resume_map;
+
+/*
+ * The save file is mapped rather than read. Variables loaded from it use
+ * their names and data in place, so the mapping is kept for the life of the
+ * process. Save files from before the mapped format are still accepted.
+ */
+bool
+xapidb_resume_from_file(const char *path)
 {
-    char *encoded;
+    struct stat st;
     uint8_t *buf, *ptr;
-    BIO *bio, *b64;
+    int fd;
     bool ret;
-    int max_len, n, total = 0;
 
-    ret = get_from_xapi(xapidb_arg_uuid, &encoded);
-    if (!ret)
-        return BACKEND_INIT_FAILURE;
-    if (!encoded)
-        return BACKEND_INIT_FIRSTBOOT;
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        DBG("Failed to open '%s'\n", path);
+        return false;
+    }
 
-    max_len = strlen(encoded) * 3 / 4;
+    if (fstat(fd, &st) == -1 || st.st_size < DB_HEADER_LEN ||
+            st.st_size > MAX_SAVE_SIZE) {
+        DBG("Save file size is invalid\n");
+        close(fd);
+        return false;
+    }
 
-    buf = malloc(max_len);
-    if (!buf) {
-        ERR("Failed to allocate memory\n");
-        free(encoded);
-        return BACKEND_INIT_FAILURE;
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        DBG("Failed to map '%s': %s\n", path, strerror(errno));
+        return false;
     }
 
-    bio = BIO_new_mem_buf(encoded, -1);
-    if (!bio) {
-        ERR("Failed to create BIO\n");
-        free(encoded);
-        free(buf);
-        return BACKEND_INIT_FAILURE;
+    if (!memcmp(buf, SAVE_MAGIC, strlen(SAVE_MAGIC))) {
+        xapidb_resume_unmap();
+        resume_map.addr = buf;
+        resume_map.len = st.st_size;
+        return xapidb_parse_save(buf, st.st_size);
     }
-    b64 = BIO_new(BIO_f_base64());
-    if (!b64) {
-        ERR("Failed to create BIO\n");
-        free(encoded);
-        free(buf);
-        BIO_free_all(bio);
-        return BACKEND_INIT_FAILURE;
+
+    if (st.st_size > MAX_FILE_SIZE) {
+        DBG("Save file size is invalid\n");
+        munmap(buf, st.st_size);
+        return false;
     }
-    BIO_push(b64, bio);
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+
+    ptr = buf;
+    ret = xapidb_parse_blob(&ptr, st.st_size);
+    munmap(buf, st.st_size);
+
+    return ret;
+}
+
+/*
+ * Unmaps the save file mapped by xapidb_resume_from_file. The variables
+ * loaded from it must have been freed first.
+ */
+void
+xapidb_resume_unmap(void)
+{
+    if (!resume_map.addr)
+        return;
+
+    munmap(resume_map.addr, resume_map.len);
+    resume_map.addr = NULL;
+    resume_map.len = 0;
+}
+
+/*
+ * Decodes the EFI-variables member of a VM.get_NVRAM response straight into
+ * a new buffer. *out is NULL if the VM has no variables yet.
+ */
+static bool
+parse_get_nvram_call(const char *response, uint8_t **out, size_t *out_len)
+{
+    struct xml_reader r;
+    const char *text;
+    size_t len;
+    bool success, found;
+    enum xml_token token;
+
+    *out = NULL;
+
+    if (!xmlrpc_open(response, &r, &success) || !success ||
+            !xml_expect(&r, XML_START, "struct"))
+        return false;
 
     for (;;) {
-        n = BIO_read(b64, buf + total, max_len - total);
-        if (n <= 0)
+        token = xml_next_tag(&r);
+        if (token == XML_END && xml_is(&r, "struct"))
+            return true;
+        if (token != XML_START || !xml_is(&r, "member") ||
+                !xml_expect(&r, XML_START, "name") ||
+                xml_next(&r) != XML_TEXT)
+            return false;
+        found = xml_is(&r, "EFI-variables");
+        if (!xml_expect(&r, XML_END, "name") ||
+                !xml_expect(&r, XML_START, "value"))
+            return false;
+
+        if (found)
             break;
-        total += n;
+        if (!xml_skip(&r) || !xml_expect(&r, XML_END, "member"))
+            return false;
+    }
+
+    if (!xmlrpc_scalar(&r, &text, &len))
+        return false;
+
+    *out = malloc(BASE64_DECODED_MAX(len) + 1);
+    if (!*out)
+        return false;
+    if (!base64_decode(text, len, *out, out_len)) {
+        free(*out);
+        *out = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+get_from_xapi(const char *uuid, uint8_t **out, size_t *out_len)
+{
+    int status;
+    bool ok;
+    const char *response = NULL;
+
+    if (!xapidb_vm_ref) {
+        status = session_call(&response, VM_GET_BY_UUID_CALL, uuid);
+        if (status != HTTP_STATUS_OK) {
+            ERR("Failed to communicate with XAPI\n");
+            return false;
+        }
+        if (!xmlrpc_process(response, &xapidb_vm_ref)) {
+            ERR("Failed to lookup VM\n");
+            return false;
+        }
+    }
+
+    status = session_call(&response, VM_GET_NVRAM_CALL, xapidb_vm_ref);
+    if (status != HTTP_STATUS_OK) {
+        ERR("Failed to get EFI variables\n");
+        return false;
+    }
+    ok = parse_get_nvram_call(response, out, out_len);
+    http_trim();
+    if (!ok) {
+        ERR("Failed to get EFI variables\n");
+        return false;
     }
-    BIO_free_all(b64);
-    free(encoded);
+
+    return true;
+}
+
+enum backend_init_status
+xapidb_init(void)
+{
+    uint8_t *buf, *ptr;
+    size_t len;
+    bool ret;
+
+    if (!get_from_xapi(xapidb_arg_uuid, &buf, &len))
+        return BACKEND_INIT_FAILURE;
+    if (!buf)
+        return BACKEND_INIT_FIRSTBOOT;
 
     ptr = buf;
-    ret = xapidb_parse_blob(&ptr, total);
+    ret = xapidb_parse_blob(&ptr, len);
     free(buf);
 
     return ret ? BACKEND_INIT_SUCCESS : BACKEND_INIT_FAILURE;
 }
 
+/*
+ * Like xapidb_init, but the calls are driven by the main loop through
+ * xapidb_poll_fd and xapidb_poll_event, which calls done with the result.
+ */
+bool
+xapidb_init_async(void (*done)(enum backend_init_status status))
+{
+    assert(async.step == ASYNC_IDLE);
+
+    async.loaded = done;
+    async.relogin = true;
+    if (!async_next_call()) {
+        async.loaded = NULL;
+        http_close();
+        return false;
+    }
+
+    return true;
+}
+
 bool
 xapidb_sb_notify(void)
 {
     int status;
     bool ret = false;
-    char *session_ref = NULL, *response = NULL;
-
-    status = xmlrpc_call(&response, LOGIN_CALL);
-    if (status != HTTP_STATUS_OK)
-        goto out;
-    if (!xmlrpc_process(response, &session_ref))
-        goto out;
-    free(response);
-    response = NULL;
-
-    status = xmlrpc_call(&response, VM_MESSAGE_CREATE_CALL,
-                         session_ref,
-                         "VM_SECURE_BOOT_FAILED",
-                         5, /* priority */
-                         "VM", /* class */
-                         xapidb_arg_uuid,
-                         "The VM failed to pass Secure Boot verification.");
-    if (status != HTTP_STATUS_OK)
-        goto out;
-    if (!xmlrpc_process(response, NULL))
-        goto out;
-    free(response);
-    response = NULL;
-
-    status = xmlrpc_call(&response, LOGOUT_CALL, session_ref);
+    const char *response = NULL;
+
+    status = session_call(&response, VM_MESSAGE_CREATE_CALL,
+                          "VM_SECURE_BOOT_FAILED",
+                          5, /* priority */
+                          "VM", /* class */
+                          xapidb_arg_uuid,
+                          "The VM failed to pass Secure Boot verification.");
     if (status != HTTP_STATUS_OK)
         goto out;
     if (!xmlrpc_process(response, NULL))
         goto out;
-    free(response);
-    response = NULL;
 
     ret = true;
 
 out:
-    free(session_ref);
-    free(response);
     return ret;
 }
+
+/* Ends the session and releases the connection and cached blob. */
+void
+xapidb_fini(void)
+{
+    logout();
+    xapidb_close();
+}
+
+/*
+ * Releases this guest's connection and cached blob. The session is left for
+ * the other guests.
+ */
+void
+xapidb_close(void)
+{
+    async_wait();
+    http_close();
+    free(http.request);
+    http.request = NULL;
+    free(http.buf);
+    http.buf = NULL;
+    free(blob.raw);
+    blob.raw = NULL;
+    blob.raw_len = 0;
+    free(blob.encoded);
+    blob.encoded = NULL;
+    blob.encoded_size = 0;
+    free(xapidb_vm_ref);
+    xapidb_vm_ref = NULL;
+}
+
+/* The state of each guest's XAPI connection, for multi-domain mode. */
+const struct context_region xapidb_lib_context[] = {
+    CONTEXT_REGION(xapidb_arg_init),
+    CONTEXT_REGION(xapidb_arg_uuid),
+    CONTEXT_REGION(xapidb_arg_socket),
+    CONTEXT_REGION(xapidb_vm_ref),
+    CONTEXT_REGION(last_time),
+    CONTEXT_REGION(send_credit),
+    CONTEXT_REGION(xapidb_arg_writeback),
+    CONTEXT_REGION(xapidb_arg_compress),
+    CONTEXT_REGION(writeback_dirty),
+    CONTEXT_REGION(writeback_pending),
+    CONTEXT_REGION(writeback_failed),
+    CONTEXT_REGION(writeback_deadline),
+    CONTEXT_REGION(txn_active),
+    CONTEXT_REGION(txn_dirty),
+    CONTEXT_REGION(http),
+    CONTEXT_REGION(async),
+    CONTEXT_REGION(blob),
+    CONTEXT_REGION(resume_map),
+    CONTEXT_END
+};
@@ -30,16 +30,16 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <errno.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <backend.h>
 #include <debug.h>
+#include <handler.h>
 #include <xapidb.h>
+#include <zlib.h>
 
 #include "option.h"
 
@@ -59,7 +59,20 @@ xapidb_parse_arg(const char *name, const char *val)
         xapidb_arg_uuid = strdup(val);
     else if (!strcmp(name, "socket"))
         xapidb_arg_socket = strdup(val);
-    else
+    else if (!strcmp(name, "writeback")) {
+        char *end;
+
+        xapidb_arg_writeback = strtoul(val, &end, 0);
+        if (*val == '\0' || *end != '\0')
+            return false;
+    } else if (!strcmp(name, "compress")) {
+        char *end;
+
+        xapidb_arg_compress = strtoul(val, &end, 0);
+        if (*val == '\0' || *end != '\0' ||
+                xapidb_arg_compress > Z_BEST_COMPRESSION)
+            return false;
+    } else
         return false;
 
     return true;
@@ -83,78 +96,26 @@ xapidb_check_args(void)
 static bool
 xapidb_save(void)
 {
-    FILE *f;
-    uint8_t *buf;
-    size_t len;
-
-    if (!arg_save)
-        return true;
-
-    if (!xapidb_serialize_variables(&buf, &len, false))
-        return false;
-
-    f = fopen(arg_save, "w");
-    if (!f) {
-        DBG("Failed to open '%s'\n", arg_save);
-        free(buf);
-        return false;
-    }
-    if (fwrite(buf, 1, len, f) != len) {
-        DBG("Failed to write to '%s': %s\n", arg_save, strerror(errno));
-        fclose(f);
-        free(buf);
-        return false;
-    }
-    free(buf);
-
-    fclose(f);
-    return true;
+    return arg_save ? xapidb_save_to_file(arg_save) : true;
 }
 
 static bool
 xapidb_resume(void)
 {
-    FILE *f;
-    struct stat st;
-    uint8_t *buf, *ptr;
-    bool ret;
-
-    if (!arg_resume)
-        return true;
-
-    f = fopen(arg_resume, "r");
-    if (!f) {
-        DBG("Failed to open '%s'\n", arg_resume);
-        return false;
-    }
-
-    if (fstat(fileno(f), &st) == -1 || st.st_size < DB_HEADER_LEN ||
-            st.st_size > MAX_FILE_SIZE) {
-        DBG("Save file size is invalid\n");
-        fclose(f);
-        return false;
-    }
-
-    buf = malloc(st.st_size);
-    if (!buf) {
-        DBG("Failed to allocate memory\n");
-        fclose(f);
-        return false;
-    }
-    if (fread(buf, 1, st.st_size, f) != st.st_size) {
-        DBG("Failed to read from '%s'\n", arg_resume);
-        free(buf);
-        fclose(f);
-        return false;
-    }
-    fclose(f);
+    return arg_resume ? xapidb_resume_from_file(arg_resume) : true;
+}
 
-    ptr = buf;
-    ret = xapidb_parse_blob(&ptr, st.st_size);
-    free(buf);
+static const struct context_region xapidb_args_context[] = {
+    CONTEXT_REGION(arg_resume),
+    CONTEXT_REGION(arg_save),
+    CONTEXT_END
+};
 
-    return ret;
-}
+static const struct context_region *const xapidb_context[] = {
+    xapidb_args_context,
+    xapidb_lib_context,
+    NULL
+};
 
 const struct backend xapidb = {
     .parse_arg = xapidb_parse_arg,
@@ -163,5 +124,16 @@ const struct backend xapidb = {
     .save = xapidb_save,
     .resume = xapidb_resume,
     .set_variable = xapidb_set_variable,
+    .set_variable_async = xapidb_set_variable_async,
     .sb_notify = xapidb_sb_notify,
+    .flush_timeout = xapidb_flush_timeout,
+    .flush = xapidb_flush,
+    .poll_fd = xapidb_poll_fd,
+    .poll_event = xapidb_poll_event,
+    /*
+     * The session is shared by every guest and is logged out once at exit,
+     * so only release this guest's connection.
+     */
+    .fini = xapidb_close,
+    .context = xapidb_context,
 };